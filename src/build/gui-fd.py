@@ -662,13 +662,27 @@ class ModernPopcornBuilder:
                     ('core/memory.c', 'obj/memory.o'),
                     ('core/vmm.c', 'obj/vmm.o'),
                     ('core/init.c', 'obj/init.o'),
-                    ('core/syscall.c', 'obj/syscall.o')
+                    ('core/syscall.c', 'obj/syscall.o'),
+                    ('core/vma.c', 'obj/vma.o'),
+                    ('core/kstack.c', 'obj/kstack.o'),
+                    ('core/blockdev.c', 'obj/blockdev.o'),
+                    ('core/ata.c', 'obj/ata.o'),
+                    ('core/swap.c', 'obj/swap.o'),
+                    ('core/rbtree.c', 'obj/rbtree.o'),
+                    ('core/slab.c', 'obj/slab.o'),
+                    ('core/wait.c', 'obj/wait.o'),
+                    ('core/sync.c', 'obj/sync.o'),
+                    ('core/fpu.c', 'obj/fpu.o'),
+                    ('core/smp.c', 'obj/smp.o'),
+                    ('core/acpi.c', 'obj/acpi.o'),
+                    ('core/workqueue.c', 'obj/workqueue.o'),
+                    ('core/fiber.c', 'obj/fiber.o')
                 ]
                 
                 for src, obj in c_files:
                     if not self.run_command(['gcc', '-m64', '-c', src, '-o', obj,
                                            '-Wall', '-Wextra', '-fno-stack-protector',
-                                           '-mcmodel=large', '-mno-red-zone'],
+                                           '-mcmodel=large', '-mno-red-zone', '-mno-mmx', '-mno-sse', '-mno-sse2'],
                                           verbose=True, log_file=error_log):
                         success = False
                         break
@@ -681,7 +695,7 @@ class ModernPopcornBuilder:
                            'obj/halt_pop.o', 'obj/filesystem_pop.o', 'obj/multiboot2.o', 
                            'obj/sysinfo_pop.o', 'obj/memory_pop.o', 'obj/cpu_pop.o', 
                            'obj/dolphin_pop.o', 'obj/timer.o', 'obj/scheduler.o', 
-                           'obj/memory.o', 'obj/vmm.o', 'obj/init.o', 'obj/syscall.o']
+                           'obj/memory.o', 'obj/vmm.o', 'obj/init.o', 'obj/syscall.o', 'obj/vma.o', 'obj/kstack.o', 'obj/blockdev.o', 'obj/ata.o', 'obj/swap.o', 'obj/rbtree.o', 'obj/slab.o', 'obj/wait.o', 'obj/sync.o', 'obj/fpu.o', 'obj/smp.o', 'obj/acpi.o', 'obj/workqueue.o', 'obj/fiber.o']
                 
                 success = self.run_command(['ld', '-m', 'elf_x86_64', '-T', 'link.ld',
                                           '-o', 'kernel'] + obj_files,
@@ -719,27 +733,41 @@ class ModernPopcornBuilder:
                 'nasm -f elf64 core/kernel.asm -o obj/kasm.o && ' +
                 'nasm -f elf64 core/idt.asm -o obj/idt.o && ' +
                 'nasm -f elf64 core/context_switch.asm -o obj/context_switch.o && ' +
-                'gcc -m64 -c core/kernel.c -o obj/kc.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c core/console.c -o obj/console.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c core/utils.c -o obj/utils.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c core/pop_module.c -o obj/pop_module.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c pops/shimjapii_pop.c -o obj/shimjapii_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c pops/spinner_pop.c -o obj/spinner_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c pops/uptime_pop.c -o obj/uptime_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c pops/halt_pop.c -o obj/halt_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c pops/filesystem_pop.c -o obj/filesystem_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c core/multiboot2.c -o obj/multiboot2.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c pops/sysinfo_pop.c -o obj/sysinfo_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c pops/memory_pop.c -o obj/memory_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c pops/cpu_pop.c -o obj/cpu_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c pops/dolphin_pop.c -o obj/dolphin_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c core/timer.c -o obj/timer.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c core/scheduler.c -o obj/scheduler.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c core/memory.c -o obj/memory.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c core/vmm.c -o obj/vmm.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c core/init.c -o obj/init.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c core/syscall.c -o obj/syscall.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'ld -m elf_x86_64 -T link.ld -o kernel obj/kasm.o obj/kc.o obj/console.o obj/utils.o obj/pop_module.o obj/shimjapii_pop.o obj/idt.o obj/context_switch.o obj/spinner_pop.o obj/uptime_pop.o obj/halt_pop.o obj/filesystem_pop.o obj/multiboot2.o obj/sysinfo_pop.o obj/memory_pop.o obj/cpu_pop.o obj/dolphin_pop.o obj/timer.o obj/scheduler.o obj/memory.o obj/vmm.o obj/init.o obj/syscall.o'
+                'gcc -m64 -c core/kernel.c -o obj/kc.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/console.c -o obj/console.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/utils.c -o obj/utils.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/pop_module.c -o obj/pop_module.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c pops/shimjapii_pop.c -o obj/shimjapii_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c pops/spinner_pop.c -o obj/spinner_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c pops/uptime_pop.c -o obj/uptime_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c pops/halt_pop.c -o obj/halt_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c pops/filesystem_pop.c -o obj/filesystem_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/multiboot2.c -o obj/multiboot2.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c pops/sysinfo_pop.c -o obj/sysinfo_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c pops/memory_pop.c -o obj/memory_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c pops/cpu_pop.c -o obj/cpu_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c pops/dolphin_pop.c -o obj/dolphin_pop.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/timer.c -o obj/timer.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/scheduler.c -o obj/scheduler.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/memory.c -o obj/memory.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/vmm.c -o obj/vmm.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/init.c -o obj/init.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/syscall.c -o obj/syscall.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/vma.c -o obj/vma.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/kstack.c -o obj/kstack.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/blockdev.c -o obj/blockdev.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/ata.c -o obj/ata.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/swap.c -o obj/swap.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/rbtree.c -o obj/rbtree.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/slab.c -o obj/slab.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/wait.c -o obj/wait.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/sync.c -o obj/sync.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/fpu.c -o obj/fpu.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/smp.c -o obj/smp.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/acpi.c -o obj/acpi.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/workqueue.c -o obj/workqueue.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c core/fiber.c -o obj/fiber.o -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'ld -m elf_x86_64 -T link.ld -o kernel obj/kasm.o obj/kc.o obj/console.o obj/utils.o obj/pop_module.o obj/shimjapii_pop.o obj/idt.o obj/context_switch.o obj/spinner_pop.o obj/uptime_pop.o obj/halt_pop.o obj/filesystem_pop.o obj/multiboot2.o obj/sysinfo_pop.o obj/memory_pop.o obj/cpu_pop.o obj/dolphin_pop.o obj/timer.o obj/scheduler.o obj/memory.o obj/vmm.o obj/init.o obj/syscall.o obj/vma.o obj/kstack.o obj/blockdev.o obj/ata.o obj/swap.o obj/rbtree.o obj/slab.o obj/wait.o obj/sync.o obj/fpu.o obj/smp.o obj/acpi.o obj/workqueue.o obj/fiber.o'
             ])
             
             if success:
@@ -797,9 +825,17 @@ class ModernPopcornBuilder:
             self.log("💡 Press Ctrl+C in terminal or click 'Stop QEMU' to exit")
             
             try:
+                # Swap disk on the primary IDE master (the kernel only uses it if signed)
+                if not Path('swap.img').exists():
+                    with open('swap.img', 'wb') as f:
+                        f.write(b'POPCORN-SWAP-V1')
+                        f.truncate(64 * 1024 * 1024)
+                    self.log("💾 Created swap.img (64 MiB)")
+
                 self.qemu_process = subprocess.Popen([
                     'qemu-system-x86_64',
                     '-cdrom', 'popcorn.iso',
+                    '-drive', 'file=swap.img,format=raw,index=0,media=disk',
                     '-cpu', 'qemu64',
                     '-m', '256',
                     '-smp', '1',
@@ -849,8 +885,8 @@ class ModernPopcornBuilder:
                 'nasm -f elf64 core/kernel.asm -o obj/kasm.o && ' +
                 'nasm -f elf64 core/idt.asm -o obj/idt.o && ' +
                 'nasm -f elf64 core/context_switch.asm -o obj/context_switch.o && ' +
-                'gcc -m64 -c core/*.c -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
-                'gcc -m64 -c pops/*.c -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone && ' +
+                'gcc -m64 -c core/*.c -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
+                'gcc -m64 -c pops/*.c -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 && ' +
                 'mv *.o obj/ 2>/dev/null; ' +
                 'ld -m elf_x86_64 -T link.ld -o kernel obj/*.o'
             ])
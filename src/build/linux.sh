@@ -17,7 +17,7 @@ BUILD_BASE="buildbase"
 BUILD_LOG="$BUILD_BASE/build.log"
 CONFIG_FILE="$BUILD_BASE/.build_config"
 QEMU_MEMORY="256"
-QEMU_CORES="1"
+QEMU_CORES="2"
 
 # Check for required tools
 check_dependencies() {
@@ -121,7 +121,7 @@ compile_file() {
             nasm -f elf64 "$file" -o "$output"
             ;;
         "c")
-            gcc -m64 -c "$file" -o "$output" -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone
+            gcc -m64 -c "$file" -o "$output" -Wall -Wextra -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2
             ;;
     esac
     
@@ -170,12 +170,26 @@ build_kernel() {
     compile_file "core/vmm.c" "$OBJ_DIR/vmm.o" "c"
     compile_file "core/init.c" "$OBJ_DIR/init.o" "c"
     compile_file "core/syscall.c" "$OBJ_DIR/syscall.o" "c"
+    compile_file "core/fiber.c" "$OBJ_DIR/fiber.o" "c"
+    compile_file "core/workqueue.c" "$OBJ_DIR/workqueue.o" "c"
+    compile_file "core/acpi.c" "$OBJ_DIR/acpi.o" "c"
+    compile_file "core/smp.c" "$OBJ_DIR/smp.o" "c"
+    compile_file "core/fpu.c" "$OBJ_DIR/fpu.o" "c"
+    compile_file "core/sync.c" "$OBJ_DIR/sync.o" "c"
+    compile_file "core/wait.c" "$OBJ_DIR/wait.o" "c"
+    compile_file "core/slab.c" "$OBJ_DIR/slab.o" "c"
+    compile_file "core/rbtree.c" "$OBJ_DIR/rbtree.o" "c"
+    compile_file "core/swap.c" "$OBJ_DIR/swap.o" "c"
+    compile_file "core/ata.c" "$OBJ_DIR/ata.o" "c"
+    compile_file "core/blockdev.c" "$OBJ_DIR/blockdev.o" "c"
+    compile_file "core/kstack.c" "$OBJ_DIR/kstack.o" "c"
+    compile_file "core/vma.c" "$OBJ_DIR/vma.o" "c"
     
     # Link files
     log "INFO" "Linking object files..."
     
     # Check if all object files exist
-    for obj in "$OBJ_DIR"/kasm.o "$OBJ_DIR"/kc.o "$OBJ_DIR"/console.o "$OBJ_DIR"/utils.o "$OBJ_DIR"/pop_module.o "$OBJ_DIR"/shimjapii_pop.o "$OBJ_DIR"/idt.o "$OBJ_DIR"/context_switch.o "$OBJ_DIR"/spinner_pop.o "$OBJ_DIR"/uptime_pop.o "$OBJ_DIR"/halt_pop.o "$OBJ_DIR"/filesystem_pop.o "$OBJ_DIR"/multiboot2.o "$OBJ_DIR"/sysinfo_pop.o "$OBJ_DIR"/memory_pop.o "$OBJ_DIR"/cpu_pop.o "$OBJ_DIR"/dolphin_pop.o "$OBJ_DIR"/timer.o "$OBJ_DIR"/scheduler.o "$OBJ_DIR"/memory.o "$OBJ_DIR"/vmm.o "$OBJ_DIR"/init.o "$OBJ_DIR"/syscall.o; do
+    for obj in "$OBJ_DIR"/kasm.o "$OBJ_DIR"/kc.o "$OBJ_DIR"/console.o "$OBJ_DIR"/utils.o "$OBJ_DIR"/pop_module.o "$OBJ_DIR"/shimjapii_pop.o "$OBJ_DIR"/idt.o "$OBJ_DIR"/context_switch.o "$OBJ_DIR"/spinner_pop.o "$OBJ_DIR"/uptime_pop.o "$OBJ_DIR"/halt_pop.o "$OBJ_DIR"/filesystem_pop.o "$OBJ_DIR"/multiboot2.o "$OBJ_DIR"/sysinfo_pop.o "$OBJ_DIR"/memory_pop.o "$OBJ_DIR"/cpu_pop.o "$OBJ_DIR"/dolphin_pop.o "$OBJ_DIR"/timer.o "$OBJ_DIR"/scheduler.o "$OBJ_DIR"/memory.o "$OBJ_DIR"/vmm.o "$OBJ_DIR"/init.o "$OBJ_DIR"/syscall.o "$OBJ_DIR"/vma.o "$OBJ_DIR"/kstack.o "$OBJ_DIR"/blockdev.o "$OBJ_DIR"/ata.o "$OBJ_DIR"/swap.o "$OBJ_DIR"/rbtree.o "$OBJ_DIR"/slab.o "$OBJ_DIR"/wait.o "$OBJ_DIR"/sync.o "$OBJ_DIR"/fpu.o "$OBJ_DIR"/smp.o "$OBJ_DIR"/acpi.o "$OBJ_DIR"/workqueue.o "$OBJ_DIR"/fiber.o; do
         if [ ! -f "$obj" ]; then
             log "ERROR" "Missing object file: $obj"
             exit 1
@@ -210,7 +224,21 @@ build_kernel() {
         "$OBJ_DIR/memory.o" \
         "$OBJ_DIR/vmm.o" \
         "$OBJ_DIR/init.o" \
-        "$OBJ_DIR/syscall.o"
+        "$OBJ_DIR/syscall.o" \
+        "$OBJ_DIR/vma.o" \
+        "$OBJ_DIR/kstack.o" \
+        "$OBJ_DIR/blockdev.o" \
+        "$OBJ_DIR/ata.o" \
+        "$OBJ_DIR/swap.o" \
+        "$OBJ_DIR/rbtree.o" \
+        "$OBJ_DIR/slab.o" \
+        "$OBJ_DIR/wait.o" \
+        "$OBJ_DIR/sync.o" \
+        "$OBJ_DIR/fpu.o" \
+        "$OBJ_DIR/smp.o" \
+        "$OBJ_DIR/acpi.o" \
+        "$OBJ_DIR/workqueue.o" \
+        "$OBJ_DIR/fiber.o"
     
     check_status "Linking object files"
 }
@@ -312,11 +340,18 @@ run_qemu() {
         fi
     fi
     
+    # Swap disk on the primary IDE master (the kernel only uses it if signed)
+    if [ ! -f "swap.img" ]; then
+        dd if=/dev/zero of=swap.img bs=1M count=64 status=none
+        printf 'POPCORN-SWAP-V1' | dd of=swap.img bs=1 conv=notrunc status=none
+    fi
+    
     log "INFO" "Starting QEMU (64-bit) with ${QEMU_MEMORY}MB RAM and ${QEMU_CORES} cores..."
     log "INFO" "Press Ctrl+A then X to exit QEMU, or use the monitor console"
     
     qemu-system-x86_64 \
     -cdrom popcorn.iso \
+    -drive file=swap.img,format=raw,index=0,media=disk \
     -cpu qemu64 \
     -m "$QEMU_MEMORY" \
     -smp "$QEMU_CORES" \
@@ -16,7 +16,7 @@ BUILD_LOG="${BUILD_LOG:-$BUILD_BASE/build.log}"
 CONFIG_FILE="${CONFIG_FILE:-$BUILD_BASE/.build_config}"
 
 QEMU_MEMORY="${QEMU_MEMORY:-256}"
-QEMU_CORES="${QEMU_CORES:-1}"
+QEMU_CORES="${QEMU_CORES:-2}"
 
 TARGET_TRIPLE="x86_64-unknown-elf"
 KERNEL_OUT="${KERNEL_OUT:-kernel}"
@@ -183,13 +183,13 @@ compile_c() {
   log INFO "Compiling $file"
 
   if [[ "${CC:-}" == "x86_64-elf-gcc" ]]; then
-    "$CC" -m64 -c "$file" -o "$output" -Wall -Wextra -ffreestanding -fno-stack-protector -mcmodel=large -mno-red-zone >>"$BUILD_LOG" 2>&1 \
+    "$CC" -m64 -c "$file" -o "$output" -Wall -Wextra -ffreestanding -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 >>"$BUILD_LOG" 2>&1 \
       || die "C compile failed for $file"
     return 0
   fi
 
   "$CC" -target "$TARGET_TRIPLE" -m64 -c "$file" -o "$output" \
-    -Wall -Wextra -ffreestanding -fno-stack-protector -mcmodel=large -mno-red-zone \
+    -Wall -Wextra -ffreestanding -fno-stack-protector -mcmodel=large -mno-red-zone -mno-mmx -mno-sse -mno-sse2 \
     >>"$BUILD_LOG" 2>&1 || die "C compile failed for $file"
 }
 
@@ -231,6 +231,20 @@ build_kernel() {
   compile_c "core/vmm.c" "$OBJ_DIR/vmm.o"
   compile_c "core/init.c" "$OBJ_DIR/init.o"
   compile_c "core/syscall.c" "$OBJ_DIR/syscall.o"
+  compile_c "core/vma.c" "$OBJ_DIR/vma.o"
+  compile_c "core/kstack.c" "$OBJ_DIR/kstack.o"
+  compile_c "core/blockdev.c" "$OBJ_DIR/blockdev.o"
+  compile_c "core/ata.c" "$OBJ_DIR/ata.o"
+  compile_c "core/swap.c" "$OBJ_DIR/swap.o"
+  compile_c "core/rbtree.c" "$OBJ_DIR/rbtree.o"
+  compile_c "core/slab.c" "$OBJ_DIR/slab.o"
+  compile_c "core/wait.c" "$OBJ_DIR/wait.o"
+  compile_c "core/sync.c" "$OBJ_DIR/sync.o"
+  compile_c "core/fpu.c" "$OBJ_DIR/fpu.o"
+  compile_c "core/smp.c" "$OBJ_DIR/smp.o"
+  compile_c "core/acpi.c" "$OBJ_DIR/acpi.o"
+  compile_c "core/workqueue.c" "$OBJ_DIR/workqueue.o"
+  compile_c "core/fiber.c" "$OBJ_DIR/fiber.o"
 
   local objs=(
     "$OBJ_DIR/kasm.o"
@@ -256,6 +270,20 @@ build_kernel() {
     "$OBJ_DIR/vmm.o"
     "$OBJ_DIR/init.o"
     "$OBJ_DIR/syscall.o"
+    "$OBJ_DIR/vma.o"
+    "$OBJ_DIR/kstack.o"
+    "$OBJ_DIR/blockdev.o"
+    "$OBJ_DIR/ata.o"
+    "$OBJ_DIR/swap.o"
+    "$OBJ_DIR/rbtree.o"
+    "$OBJ_DIR/slab.o"
+    "$OBJ_DIR/wait.o"
+    "$OBJ_DIR/sync.o"
+    "$OBJ_DIR/fpu.o"
+    "$OBJ_DIR/smp.o"
+    "$OBJ_DIR/acpi.o"
+    "$OBJ_DIR/workqueue.o"
+    "$OBJ_DIR/fiber.o"
   )
 
   for obj in "${objs[@]}"; do
@@ -329,8 +357,13 @@ EOF
 
 run_qemu() {
   [[ -f "$ISO_OUT" ]] || create_iso
+  # Swap disk on the primary IDE master (the kernel only uses it if signed)
+  if [[ ! -f swap.img ]]; then
+    dd if=/dev/zero of=swap.img bs=1m count=64 2>/dev/null
+    printf 'POPCORN-SWAP-V1' | dd of=swap.img bs=1 conv=notrunc 2>/dev/null
+  fi
   log INFO "Starting QEMU: RAM=${QEMU_MEMORY}MB cores=${QEMU_CORES}"
-  qemu-system-x86_64 -cdrom "$ISO_OUT" -cpu qemu64 -m "$QEMU_MEMORY" -smp "$QEMU_CORES" -serial stdio
+  qemu-system-x86_64 -cdrom "$ISO_OUT" -drive file=swap.img,format=raw,index=0,media=disk -cpu qemu64 -m "$QEMU_MEMORY" -smp "$QEMU_CORES" -serial stdio
   log SUCCESS "QEMU session ended"
 }
 
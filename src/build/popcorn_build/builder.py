@@ -78,6 +78,20 @@ class KernelBuilder:
             ("core/vmm.c", "vmm.o"),
             ("core/init.c", "init.o"),
             ("core/syscall.c", "syscall.o"),
+            ("core/vma.c", "vma.o"),
+            ("core/kstack.c", "kstack.o"),
+            ("core/blockdev.c", "blockdev.o"),
+            ("core/ata.c", "ata.o"),
+            ("core/swap.c", "swap.o"),
+            ("core/rbtree.c", "rbtree.o"),
+            ("core/slab.c", "slab.o"),
+            ("core/wait.c", "wait.o"),
+            ("core/sync.c", "sync.o"),
+            ("core/fpu.c", "fpu.o"),
+            ("core/smp.c", "smp.o"),
+            ("core/acpi.c", "acpi.o"),
+            ("core/workqueue.c", "workqueue.o"),
+            ("core/fiber.c", "fiber.o"),
         ]
 
         cc_base = [self.tc.cc]
@@ -94,6 +108,10 @@ class KernelBuilder:
             "-fno-stack-protector",
             "-mcmodel=large",
             "-mno-red-zone",
+            # Kernel code keeps off the FPU/SIMD registers: they hold task state, switched lazily
+            "-mno-mmx",
+            "-mno-sse",
+            "-mno-sse2",
         ]
 
         for src_rel, out_name in c_files:
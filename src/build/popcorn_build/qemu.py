@@ -7,6 +7,19 @@ from pathlib import Path
 
 from .log import LogBuffer
 
+# Same disk linux.sh and macos.sh attach: the kernel only swaps to a disk
+# whose first sector starts with this signature (src/includes/swap.h).
+SWAP_SIGNATURE = b"POPCORN-SWAP-V1"
+SWAP_IMAGE_MB = 64
+
+
+def ensure_swap_image(path: Path) -> Path:
+    if not path.exists():
+        with open(path, "wb") as f:
+            f.write(SWAP_SIGNATURE)
+            f.truncate(SWAP_IMAGE_MB * 1024 * 1024)
+    return path
+
 
 @dataclass
 class QemuConfig:
@@ -20,6 +33,8 @@ class QemuConfig:
     boot_from_cd: bool = True
     # Some Homebrew QEMU builds don't support HVF; default to no accel (TCG).
     accel: str | None = None
+    # Signed swap disk on the primary IDE master, created next to the ISO.
+    swap_image: bool = True
 
 
 class QemuRunner:
@@ -41,6 +56,7 @@ class QemuRunner:
             raise RuntimeError("QEMU already running")
         if not iso_path.exists():
             raise RuntimeError("ISO not found")
+        swap_path = ensure_swap_image(iso_path.parent / "swap.img") if cfg.swap_image else None
 
         def build_cmd(accel: str | None) -> list[str]:
             cmd = [qemu_bin]
@@ -49,6 +65,10 @@ class QemuRunner:
             cmd += [
                 "-cdrom",
                 str(iso_path),
+            ]
+            if swap_path:
+                cmd += ["-drive", f"file={swap_path},format=raw,index=0,media=disk"]
+            cmd += [
                 "-m",
                 str(cfg.memory_mb),
                 "-smp",
@@ -0,0 +1,190 @@
+// src/core/acpi.c — RSDP, RSDT/XSDT and MADT, read once at SMP bring-up
+#include "../includes/acpi.h"
+#include "../includes/multiboot2.h"
+#include "../includes/vmm.h"
+#include "../includes/memory.h"
+#include "../includes/utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    char signature[8];        // "RSD PTR "
+    uint8_t checksum;         // first 20 bytes
+    char oem_id[6];
+    uint8_t revision;         // 0: ACPI 1.0, RSDT only
+    uint32_t rsdt_address;
+    uint32_t length;          // revision >= 2 from here on
+    uint64_t xsdt_address;
+    uint8_t ext_checksum;     // whole structure
+    uint8_t reserved[3];
+} __attribute__((packed)) AcpiRsdp;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) AcpiSdtHeader;
+
+typedef struct {
+    AcpiSdtHeader header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    // variable-length entries: type, length, body
+} __attribute__((packed)) AcpiMadt;
+
+#define MADT_TYPE_LAPIC          0
+#define MADT_TYPE_LAPIC_OVERRIDE 5
+#define MADT_LAPIC_ENABLED        (1u << 0)
+#define MADT_LAPIC_ONLINE_CAPABLE (1u << 1)
+
+#define ACPI_RSDP_V1_LEN 20u
+#define ACPI_MAX_TABLE_LEN 0x10000u   // sanity bound for a mapped table
+
+/* The boot tables identity-map the first GiB; firmware tables above that are mapped on demand. */
+#define ACPI_IDENTITY_LIMIT 0x40000000ull
+
+static bool acpi_checksum_ok(const void* p, uint32_t len) {
+    const uint8_t* b = (const uint8_t*)p;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        sum = (uint8_t)(sum + b[i]);
+    }
+    return sum == 0;
+}
+
+static bool acpi_sig_eq(const char* a, const char* b, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Identity pointer to [phys, phys + len), read-only; NULL if it cannot be mapped. */
+static const void* acpi_map(uint64_t phys, uint64_t len) {
+    if (phys == 0) {
+        return NULL;
+    }
+    if (phys + len > ACPI_IDENTITY_LIMIT) {
+        for (uint64_t pg = phys & ~(uint64_t)(PAGE_SIZE - 1U); pg < phys + len; pg += PAGE_SIZE) {
+            if (pg < ACPI_IDENTITY_LIMIT) {
+                continue;
+            }
+            if (vmm_map_kernel_4k(pg, pg, VMM_PTE_P | VMM_PTE_NX) != 0) {
+                return NULL;
+            }
+        }
+    }
+    return (const void*)(uintptr_t)phys;
+}
+
+/* Header first to learn the length, then the whole table, checksummed. */
+static const AcpiSdtHeader* acpi_map_table(uint64_t phys) {
+    const AcpiSdtHeader* h = acpi_map(phys, sizeof(AcpiSdtHeader));
+    if (!h || h->length < sizeof(AcpiSdtHeader) || h->length > ACPI_MAX_TABLE_LEN) {
+        return NULL;
+    }
+    if (!acpi_map(phys, h->length) || !acpi_checksum_ok(h, h->length)) {
+        return NULL;
+    }
+    return h;
+}
+
+/* RSDP signature on a 16-byte boundary in [start, end). */
+static const AcpiRsdp* acpi_scan_rsdp(uint64_t start, uint64_t end) {
+    for (uint64_t p = start; p + ACPI_RSDP_V1_LEN <= end; p += 16) {
+        const AcpiRsdp* r = (const AcpiRsdp*)(uintptr_t)p;
+        if (acpi_sig_eq(r->signature, "RSD PTR ", 8) && acpi_checksum_ok(r, ACPI_RSDP_V1_LEN)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static const AcpiRsdp* acpi_find_rsdp(void) {
+    const SystemInfo* si = multiboot2_get_info();
+    if (si->acpi_rsdp_len >= ACPI_RSDP_V1_LEN) {
+        const AcpiRsdp* r = (const AcpiRsdp*)(const void*)si->acpi_rsdp;
+        if (acpi_checksum_ok(r, ACPI_RSDP_V1_LEN)) {
+            return r;
+        }
+    }
+    // BIOS: first KiB of the EBDA (segment at 0x40E), then the ROM area
+    uint64_t ebda = (uint64_t)(*(const volatile uint16_t*)(uintptr_t)0x40E) << 4;
+    const AcpiRsdp* r = NULL;
+    if (ebda >= 0x80000 && ebda < 0xA0000) {
+        r = acpi_scan_rsdp(ebda, ebda + 1024);
+    }
+    return r ? r : acpi_scan_rsdp(0xE0000, 0x100000);
+}
+
+/* The "APIC" table through the XSDT (64-bit entries) when there is one, else the RSDT. */
+static const AcpiMadt* acpi_find_madt(const AcpiRsdp* rsdp, int* err) {
+    bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_address != 0 &&
+                acpi_checksum_ok(rsdp, rsdp->length < sizeof(AcpiRsdp) ? sizeof(AcpiRsdp) : rsdp->length);
+    const AcpiSdtHeader* root = acpi_map_table(xsdt ? rsdp->xsdt_address : rsdp->rsdt_address);
+    if (!root) {
+        *err = -3;
+        return NULL;
+    }
+    uint32_t entry_size = xsdt ? 8u : 4u;
+    uint32_t n = (root->length - (uint32_t)sizeof(AcpiSdtHeader)) / entry_size;
+    const uint8_t* entries = (const uint8_t*)root + sizeof(AcpiSdtHeader);
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t phys = xsdt ? *(const uint64_t*)(const void*)(entries + i * 8u)
+                             : *(const uint32_t*)(const void*)(entries + i * 4u);
+        const AcpiSdtHeader* h = acpi_map(phys, sizeof(AcpiSdtHeader));
+        if (h && acpi_sig_eq(h->signature, "APIC", 4)) {
+            const AcpiSdtHeader* t = acpi_map_table(phys);
+            if (!t) {
+                *err = -3;
+                return NULL;
+            }
+            return (const AcpiMadt*)(const void*)t;
+        }
+    }
+    *err = -2;
+    return NULL;
+}
+
+int acpi_parse_madt(AcpiMadtInfo* out) {
+    memset(out, 0, sizeof *out);
+    const AcpiRsdp* rsdp = acpi_find_rsdp();
+    if (!rsdp) {
+        return -1;
+    }
+    int err = 0;
+    const AcpiMadt* madt = acpi_find_madt(rsdp, &err);
+    if (!madt) {
+        return err;
+    }
+
+    out->lapic_phys = madt->lapic_address;
+    const uint8_t* p = (const uint8_t*)madt + sizeof(AcpiMadt);
+    const uint8_t* end = (const uint8_t*)madt + madt->header.length;
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        if (p[0] == MADT_TYPE_LAPIC && p[1] >= 8) {
+            // processor UID, APIC ID, flags
+            uint8_t apic_id = p[3];
+            uint32_t flags = *(const uint32_t*)(const void*)(p + 4);
+            if (flags & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE)) {
+                if (out->cpu_count < SMP_MAX_CPUS) {
+                    out->apic_ids[out->cpu_count++] = apic_id;
+                } else {
+                    out->cpus_skipped++;
+                }
+            }
+        } else if (p[0] == MADT_TYPE_LAPIC_OVERRIDE && p[1] >= 12) {
+            out->lapic_phys = *(const uint64_t*)(const void*)(p + 4);
+        }
+        p += p[1];
+    }
+    return 0;
+}
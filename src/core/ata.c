@@ -0,0 +1,193 @@
+// src/core/ata.c — ATA PIO (LBA28, polled) on the primary channel
+#include "../includes/blockdev.h"
+#include <stddef.h>
+#include <stdint.h>
+
+extern unsigned char read_port(unsigned short port);
+extern void write_port(unsigned short port, unsigned char data);
+
+#define ATA_PRIMARY_IO   0x1F0
+#define ATA_PRIMARY_CTRL 0x3F6
+
+/* Register offsets from the I/O base */
+#define ATA_REG_DATA     0
+#define ATA_REG_ERROR    1
+#define ATA_REG_SECCOUNT 2
+#define ATA_REG_LBA0     3
+#define ATA_REG_LBA1     4
+#define ATA_REG_LBA2     5
+#define ATA_REG_DRIVE    6
+#define ATA_REG_STATUS   7
+#define ATA_REG_COMMAND  7
+
+#define ATA_SR_BSY  0x80
+#define ATA_SR_DF   0x20
+#define ATA_SR_DRQ  0x08
+#define ATA_SR_ERR  0x01
+
+#define ATA_CMD_READ_PIO  0x20
+#define ATA_CMD_WRITE_PIO 0x30
+#define ATA_CMD_FLUSH     0xE7
+#define ATA_CMD_IDENTIFY  0xEC
+
+#define ATA_POLL_LIMIT 1000000u
+#define ATA_LBA28_MAX  (1u << 28)
+
+typedef struct {
+    uint16_t io;
+    bool slave;
+} AtaDrive;
+
+static AtaDrive ata_drives[2];
+static BlockDevice ata_devs[2];
+
+static inline void ata_insw(uint16_t port, void* buf, uint32_t words) {
+    __asm__ volatile("rep insw" : "+D"(buf), "+c"(words) : "d"(port) : "memory");
+}
+
+static inline void ata_outsw(uint16_t port, const void* buf, uint32_t words) {
+    __asm__ volatile("rep outsw" : "+S"(buf), "+c"(words) : "d"(port) : "memory");
+}
+
+/* ~400 ns: four reads of the alternate status register. */
+static void ata_delay(void) {
+    for (int i = 0; i < 4; i++) {
+        (void)read_port(ATA_PRIMARY_CTRL);
+    }
+}
+
+/* Wait for BSY to clear and, if want_drq, for DRQ. 0, or -1 on error / timeout. */
+static int ata_poll(uint16_t io, bool want_drq) {
+    for (uint32_t n = 0; n < ATA_POLL_LIMIT; n++) {
+        uint8_t st = read_port(io + ATA_REG_STATUS);
+        if (st & ATA_SR_BSY) {
+            continue;
+        }
+        if (st & (ATA_SR_ERR | ATA_SR_DF)) {
+            return -1;
+        }
+        if (!want_drq || (st & ATA_SR_DRQ)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void ata_select(const AtaDrive* d, uint32_t lba) {
+    write_port(d->io + ATA_REG_DRIVE, (uint8_t)(0xE0 | (d->slave ? 0x10 : 0) | ((lba >> 24) & 0x0F)));
+    ata_delay();
+}
+
+static int ata_issue(const AtaDrive* d, uint32_t lba, uint8_t count, uint8_t cmd) {
+    ata_select(d, lba);
+    if (ata_poll(d->io, false) != 0) {
+        return -1;
+    }
+    write_port(d->io + ATA_REG_SECCOUNT, count);
+    write_port(d->io + ATA_REG_LBA0, (uint8_t)lba);
+    write_port(d->io + ATA_REG_LBA1, (uint8_t)(lba >> 8));
+    write_port(d->io + ATA_REG_LBA2, (uint8_t)(lba >> 16));
+    write_port(d->io + ATA_REG_COMMAND, cmd);
+    return 0;
+}
+
+static int ata_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    const AtaDrive* d = (const AtaDrive*)dev->priv;
+    if (lba + count > dev->sectors) {
+        return -2;
+    }
+    uint8_t* p = (uint8_t*)buf;
+    while (count > 0) {
+        uint32_t n = count > 255u ? 255u : count;
+        if (ata_issue(d, (uint32_t)lba, (uint8_t)n, ATA_CMD_READ_PIO) != 0) {
+            return -1;
+        }
+        for (uint32_t s = 0; s < n; s++) {
+            if (ata_poll(d->io, true) != 0) {
+                return -1;
+            }
+            ata_insw(d->io + ATA_REG_DATA, p, BLOCK_SECTOR_SIZE / 2u);
+            p += BLOCK_SECTOR_SIZE;
+        }
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static int ata_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    const AtaDrive* d = (const AtaDrive*)dev->priv;
+    if (lba + count > dev->sectors) {
+        return -2;
+    }
+    const uint8_t* p = (const uint8_t*)buf;
+    while (count > 0) {
+        uint32_t n = count > 255u ? 255u : count;
+        if (ata_issue(d, (uint32_t)lba, (uint8_t)n, ATA_CMD_WRITE_PIO) != 0) {
+            return -1;
+        }
+        for (uint32_t s = 0; s < n; s++) {
+            if (ata_poll(d->io, true) != 0) {
+                return -1;
+            }
+            ata_outsw(d->io + ATA_REG_DATA, p, BLOCK_SECTOR_SIZE / 2u);
+            p += BLOCK_SECTOR_SIZE;
+        }
+        lba += n;
+        count -= n;
+    }
+    write_port(d->io + ATA_REG_COMMAND, ATA_CMD_FLUSH);
+    return ata_poll(d->io, false);
+}
+
+/* IDENTIFY; returns the LBA28 sector count, or 0 if there is no ATA disk. */
+static uint32_t ata_identify(const AtaDrive* d) {
+    write_port(d->io + ATA_REG_DRIVE, d->slave ? 0xB0 : 0xA0);
+    ata_delay();
+    write_port(d->io + ATA_REG_SECCOUNT, 0);
+    write_port(d->io + ATA_REG_LBA0, 0);
+    write_port(d->io + ATA_REG_LBA1, 0);
+    write_port(d->io + ATA_REG_LBA2, 0);
+    write_port(d->io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    if (read_port(d->io + ATA_REG_STATUS) == 0) {
+        return 0; /* no device */
+    }
+    for (uint32_t n = 0; n < ATA_POLL_LIMIT; n++) {
+        if ((read_port(d->io + ATA_REG_STATUS) & ATA_SR_BSY) == 0) {
+            break;
+        }
+    }
+    /* ATAPI / SATA signatures leave LBA1/LBA2 non-zero: not a PIO disk. */
+    if (read_port(d->io + ATA_REG_LBA1) != 0 || read_port(d->io + ATA_REG_LBA2) != 0) {
+        return 0;
+    }
+    if (ata_poll(d->io, true) != 0) {
+        return 0;
+    }
+    uint16_t id[256];
+    ata_insw(d->io + ATA_REG_DATA, id, 256);
+    uint32_t sectors = (uint32_t)id[60] | ((uint32_t)id[61] << 16);
+    return sectors < ATA_LBA28_MAX ? sectors : ATA_LBA28_MAX - 1u;
+}
+
+void ata_init(void) {
+    static const char* names[2] = {"hda", "hdb"};
+    /* Floating bus (no controller) reads back 0xFF. */
+    if (read_port(ATA_PRIMARY_IO + ATA_REG_STATUS) == 0xFF) {
+        return;
+    }
+    for (uint32_t i = 0; i < 2; i++) {
+        ata_drives[i].io = ATA_PRIMARY_IO;
+        ata_drives[i].slave = i == 1;
+        uint32_t sectors = ata_identify(&ata_drives[i]);
+        if (sectors == 0) {
+            continue;
+        }
+        ata_devs[i].name = names[i];
+        ata_devs[i].sectors = sectors;
+        ata_devs[i].read = ata_read;
+        ata_devs[i].write = ata_write;
+        ata_devs[i].priv = &ata_drives[i];
+        blockdev_register(&ata_devs[i]);
+    }
+}
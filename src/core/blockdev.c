@@ -0,0 +1,39 @@
+// src/core/blockdev.c — block device registry
+#include "../includes/blockdev.h"
+#include <stddef.h>
+
+static BlockDevice* blockdev_table[BLOCKDEV_MAX];
+static uint32_t blockdev_nr;
+
+static bool blockdev_name_eq(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+int blockdev_register(BlockDevice* dev) {
+    if (!dev || blockdev_nr >= BLOCKDEV_MAX) {
+        return -1;
+    }
+    blockdev_table[blockdev_nr++] = dev;
+    return 0;
+}
+
+BlockDevice* blockdev_find(const char* name) {
+    for (uint32_t i = 0; i < blockdev_nr; i++) {
+        if (blockdev_name_eq(blockdev_table[i]->name, name)) {
+            return blockdev_table[i];
+        }
+    }
+    return NULL;
+}
+
+BlockDevice* blockdev_get(uint32_t index) {
+    return index < blockdev_nr ? blockdev_table[index] : NULL;
+}
+
+uint32_t blockdev_count(void) {
+    return blockdev_nr;
+}
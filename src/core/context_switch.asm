@@ -1,154 +1,83 @@
 ; src/core/context_switch.asm
 ; x86-64 context switching (Popcorn kernel)
 ;
-; RDI = CPUContext* (System V). context_save: save caller; context_restore: iretq
-; to a stack with {RIP,CS,RFLAGS} for ring-0. C stacks that only have a return
-; address are repaired by writing that frame 24 bytes below the saved RSP.
+; A switch is always a function call from the scheduler, so only what the
+; System V ABI says survives a call has to be kept: rbp, rbx, r12-r15 and RSP.
+; They are pushed on the outgoing task's kernel stack and RSP is parked in
+; TaskStruct.ksp. A task preempted from an interrupt already has its full
+; frame on the same stack, below these, and leaves through that handler's
+; iretq once switch_to returns into it.
 
-section .bss
-align 8
-context_save_ptr: resq 1
-context_save_r10_tmp: resq 1 ; popped r10 before reloading context ptr into r10
-context_restore_iret_rsp: resq 1
+TASK_KSP equ 88 ; offsetof(TaskStruct, ksp), checked in scheduler.c
 
 section .text
-global context_save
-global context_restore
-global context_switch_to_task
-extern scheduler_get_current_task
-
-; void context_save(CPUContext* c)
-context_save:
-    mov [rel context_save_ptr], rdi
-    mov r11, rdi
-    mov [r11 + 112], rax
-
-    cli
-    mov rbx, rsp
-    mov r11, [rel context_save_ptr]
-    mov [r11 + 128], rbx
-
+global switch_to
+global task_entry_trampoline
+global fiber_switch
+global fiber_entry_trampoline
+extern task_exit
+extern scheduler_schedule
+extern schedule_tail
+extern fiber_main
+
+; void switch_to(TaskStruct* prev, TaskStruct* next)
+; prev may be NULL when the current stack is abandoned (the boot stack).
+switch_to:
     push rbp
     push rbx
-    push rcx
-    push rdx
-    push rsi
-    push rdi
-    push r8
-    push r9
-    push r10
-    push r11
     push r12
     push r13
     push r14
     push r15
-
+    test rdi, rdi
+    jz .load
+    mov [rdi + TASK_KSP], rsp
+.load:
+    mov rsp, [rsi + TASK_KSP]
     pop r15
     pop r14
     pop r13
     pop r12
-    pop r11
-    pop r10
-    pop r9
-    pop r8
-    pop rdi
-    pop rsi
-    pop rdx
-    pop rcx
     pop rbx
     pop rbp
+    ret
 
-    ; r10 = restored callee r10. Next line would reload context* into r10 — that
-    ; destroyed the true r10 and [r10+40] was written with the pointer (bogus iretq RIP).
-    mov [rel context_save_r10_tmp], r10
-    mov r10, [rel context_save_ptr]
-    mov [r10 + 0], r15
-    mov [r10 + 8], r14
-    mov [r10 + 16], r13
-    mov [r10 + 24], r12
-    mov [r10 + 32], r11
-    mov r11, [rel context_save_r10_tmp]
-    mov [r10 + 40], r11
-    mov [r10 + 48], r9
-    mov [r10 + 56], r8
-    mov [r10 + 64], rdi
-    mov [r10 + 72], rsi
-    mov [r10 + 80], rbp
-    mov [r10 + 88], rdx
-    mov [r10 + 96], rcx
-    mov [r10 + 104], rbx
-
-    mov rbx, [rsp]
-    mov [r10 + 120], rbx
-
-    pushfq
+; First return of a new task (see setup_task_context): rbx = entry point,
+; r12 = its argument. The switch ran with interrupts off and this CPU's
+; runqueue lock held; schedule_tail drops it.
+task_entry_trampoline:
+    call schedule_tail
+    sti
+    mov rdi, r12
+    call rbx
+    call task_exit
+.dead:
+    call scheduler_schedule
+    jmp .dead
+
+; void fiber_switch(uint64_t* save_sp, uint64_t next_sp)
+; The switch_to frame between two stacks of one task (fiber.c): RSP is
+; parked in *save_sp and next_sp is a stack left by fiber_switch or
+; fiber_create.
+fiber_switch:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
     pop rbx
-    mov [r10 + 136], rbx
-
-    mov bx, cs
-    mov [r10 + 144], bx
-    mov bx, ss
-    mov [r10 + 152], bx
-    mov bx, ds
-    mov [r10 + 160], bx
-    mov bx, es
-    mov [r10 + 168], bx
-    mov bx, fs
-    mov [r10 + 176], bx
-    mov bx, gs
-    mov [r10 + 184], bx
-
-    mov qword [r10 + 192], 0x1
+    pop rbp
     ret
 
-; void context_restore(CPUContext* c)
-context_restore:
-    mov r13, rdi
-    cli
-
-    mov bx, [r13 + 160]
-    mov ds, bx
-    mov bx, [r13 + 168]
-    mov es, bx
-    mov bx, [r13 + 176]
-    mov fs, bx
-    mov bx, [r13 + 184]
-    mov gs, bx
-
-    ; Ring-0 iretq: 3 qwords at RSP = {RIP,CS,RFLAGS}. C stacks may lack CS/RFLAGS
-    ; at RSP+8/16, and [RSP+8]==0x8 can be a false positive. Always build the frame
-    ; at (saved RSP) - 24 from fields in the context struct.
-    mov r8, [r13 + 128]
-    sub r8, 24
-    mov r9, [r13 + 120]
-    mov [r8], r9
-    mov qword [r8 + 8], 0x8
-    mov r9, [r13 + 136]
-    mov [r8 + 16], r9
-    mov qword [rel context_restore_iret_rsp], r8
-
-.gpr:
-    mov r14, r13
-    mov r15, [r14 + 0]
-    mov r12, [r14 + 24]
-    mov r11, [r14 + 32]
-    mov r10, [r14 + 40]
-    mov r9, [r14 + 48]
-    mov r8, [r14 + 56]
-    mov rdi, [r14 + 64]
-    mov rsi, [r14 + 72]
-    mov rbp, [r14 + 80]
-    mov rdx, [r14 + 88]
-    mov rcx, [r14 + 96]
-    mov rbx, [r14 + 104]
-    mov rax, [r14 + 112]
-    mov r13, [r14 + 16]
-    mov r14, [r14 + 8]
-    mov rsp, [rel context_restore_iret_rsp]
-    iretq
-
-; void context_switch_to_task(TaskStruct* t)
-; TaskStruct.context offset must match src/includes/scheduler.h (see _Static_assert in scheduler.c).
-context_switch_to_task:
-    add rdi, 72
-    jmp context_restore
\ No newline at end of file
+; First return into a new fiber (see fiber_create): r12 = the Fiber.
+fiber_entry_trampoline:
+    mov rdi, r12
+    call fiber_main
+    ud2                 ; fiber_main leaves through fiber_switch for good
@@ -0,0 +1,390 @@
+// src/core/fiber.c — fibers: small stacks switched cooperatively inside a task
+#include "../includes/fiber.h"
+#include "../includes/scheduler.h"
+#include "../includes/wait.h"
+#include "../includes/slab.h"
+#include "../includes/spinlock.h"
+#include "../includes/timer.h"
+#include "../includes/console.h"
+#include "../includes/utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Everything here runs on the owning task, so the lists need no lock; only
+ * the wake function runs elsewhere, and it touches nothing but nr_woken,
+ * the fiber's woken flag and the task's wakeup. A switch runs with
+ * interrupts off from naming the next fiber to landing on its stack, so a
+ * preemption always finds fs->current matching the stack the task is on
+ * (the scheduler checks a saved RSP against it).
+ */
+#define FIBER_CANARY  0x5A17F1BE5A17F1BEull
+
+// One fiber per 4 KiB slab frame: interrupt frames land on the fiber's stack
+#define FIBER_OBJ_SIZE 4032u
+static KmemCache fiber_cache;
+static bool fiber_ready;
+
+#define FIBER_HEADER_SIZE ((sizeof(Fiber) + 15u) & ~(size_t)15u)
+
+static FiberStats fiber_stats;
+
+extern uint64_t rdtsc(void);
+
+// context_switch.asm
+void fiber_switch(uint64_t* save_sp, uint64_t next_sp);
+void fiber_entry_trampoline(void);
+// First thing a new fiber runs (from fiber_entry_trampoline)
+void fiber_main(Fiber* f);
+
+void fiber_init(void) {
+    if (kmem_cache_init(&fiber_cache, "fiber", FIBER_OBJ_SIZE) != 0) {
+        console_print_error("fiber: cache does not fit a slab");
+        return;
+    }
+    fiber_ready = true;
+}
+
+void fiber_sched_init(FiberSched* fs) {
+    memset(fs, 0, sizeof *fs);
+}
+
+static void ready_push(FiberSched* fs, Fiber* f) {
+    f->next = NULL;
+    if (fs->ready_tail) {
+        fs->ready_tail->next = f;
+    } else {
+        fs->ready_head = f;
+    }
+    fs->ready_tail = f;
+}
+
+static Fiber* ready_pop(FiberSched* fs) {
+    Fiber* f = fs->ready_head;
+    if (f) {
+        fs->ready_head = f->next;
+        if (!fs->ready_head) {
+            fs->ready_tail = NULL;
+        }
+        f->next = NULL;
+    }
+    return f;
+}
+
+static void fiber_free(Fiber* f) {
+    kmem_cache_free(&fiber_cache, f);
+    __atomic_sub_fetch(&fiber_stats.live, 1, __ATOMIC_RELAXED);
+}
+
+/* Free the fiber that finished on the stack we just left. */
+static void fiber_reap(FiberSched* fs) {
+    if (fs->dead) {
+        fiber_free(fs->dead);
+        fs->dead = NULL;
+    }
+}
+
+/* Waiting fibers whose wakeup has come go to the back of the ready list. */
+static void fiber_collect_woken(FiberSched* fs) {
+    if (__atomic_load_n(&fs->nr_woken, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+    Fiber** link = &fs->waiting;
+    while (*link) {
+        Fiber* f = *link;
+        if (__atomic_load_n(&f->woken, __ATOMIC_ACQUIRE)) {
+            *link = f->next;
+            f->wait_queue = NULL;
+            __atomic_sub_fetch(&fs->nr_woken, 1, __ATOMIC_RELAXED);
+            ready_push(fs, f);
+        } else {
+            link = &f->next;
+        }
+    }
+}
+
+Fiber* fiber_create(FiberSched* fs, FiberFunc func, void* arg, uint32_t stack_size) {
+    if (!fiber_ready || !fs || !func || stack_size == 0 || stack_size > FIBER_STACK_MAX) {
+        return NULL;
+    }
+    Fiber* f = kmem_cache_alloc(&fiber_cache);
+    if (!f) {
+        return NULL;
+    }
+    __atomic_add_fetch(&fiber_stats.live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&fiber_stats.created, 1, __ATOMIC_RELAXED);
+    f->sched = fs;
+    f->func = func;
+    f->arg = arg;
+
+    // Stack from past the header to the end of the object (16-byte aligned)
+    uint8_t* lo = (uint8_t*)f + FIBER_HEADER_SIZE;
+    uint8_t* hi = (uint8_t*)f + fiber_cache.obj_size;
+    f->stack_limit = (uint64_t*)(void*)lo;
+    *f->stack_limit = FIBER_CANARY;
+    f->stack_size = (uint32_t)(hi - lo);
+
+    // fiber_switch frame: r15..r12, rbx, rbp, return into the trampoline
+    // with RSP back at hi, so its call leaves fiber_main ABI-aligned
+    uint64_t* sp = (uint64_t*)(void*)hi;
+    *--sp = (uint64_t)fiber_entry_trampoline;
+    for (int i = 0; i < 6; i++) {
+        *--sp = 0;
+    }
+    sp[3] = (uint64_t)f;  // r12
+    f->sp = (uint64_t)sp;
+
+    ready_push(fs, f);
+    fs->nr_fibers++;
+    return f;
+}
+
+static FiberSched* fiber_sched_current(void) {
+    TaskStruct* t = scheduler_get_current_task();
+    return t ? t->fibers : NULL;
+}
+
+Fiber* fiber_current(void) {
+    FiberSched* fs = fiber_sched_current();
+    return fs ? fs->current : NULL;
+}
+
+bool fiber_stack_contains(const TaskStruct* task, uint64_t lo, uint64_t hi) {
+    const FiberSched* fs = task->fibers;
+    const Fiber* f = fs ? fs->current : NULL;
+    if (!f) {
+        return false;
+    }
+    uint64_t base = (uint64_t)f->stack_limit;
+    return lo >= base && hi <= base + f->stack_size;
+}
+
+/*
+ * Leave the running fiber f for the next ready one, or for fiber_sched_run
+ * when there is none. Returns when something switches back to f.
+ */
+static void fiber_switch_away(FiberSched* fs, Fiber* f) {
+    if (*f->stack_limit != FIBER_CANARY) {
+        // The overrun has already written over the slab neighbour below
+        console_print_error("FATAL: fiber stack overflow; halting");
+        for (;;) {
+            __asm__ volatile("cli; hlt");
+        }
+    }
+    fiber_collect_woken(fs);
+    Fiber* next = ready_pop(fs);
+    uint64_t irq = local_irq_save();
+    fs->current = next;
+    fs->irq_flags = irq;
+    fs->switches++;
+    __atomic_add_fetch(&fiber_stats.switches, 1, __ATOMIC_RELAXED);
+    fiber_switch(&f->sp, next ? next->sp : fs->sp);
+    local_irq_restore(irq);
+    fiber_reap(fs);
+}
+
+void fiber_main(Fiber* f) {
+    FiberSched* fs = f->sched;
+    local_irq_restore(fs->irq_flags);  // as the context that switched here had them
+    fiber_reap(fs);
+    f->func(f->arg);
+
+    // Its stack is freed by whichever context runs next
+    fs->nr_fibers--;
+    fs->dead = f;
+    fiber_switch_away(fs, f);
+}
+
+void fiber_yield(void) {
+    FiberSched* fs = fiber_sched_current();
+    if (!fs || !fs->current) {
+        scheduler_yield();
+        return;
+    }
+    fiber_collect_woken(fs);
+    if (!fs->ready_head) {
+        return;
+    }
+    Fiber* f = fs->current;
+    ready_push(fs, f);
+    fiber_switch_away(fs, f);
+}
+
+/* Wake function of a parked fiber's entry (wake_up, queue lock held). */
+static void fiber_wake(WaitEntry* entry) {
+    Fiber* f = (Fiber*)(void*)((char*)entry - offsetof(Fiber, wait));
+    FiberSched* fs = f->sched;
+    TaskStruct* task = fs->task;
+    __atomic_add_fetch(&fs->nr_woken, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&f->woken, true, __ATOMIC_RELEASE);  // the owner may free f from here on
+    scheduler_wake_task(task);
+}
+
+static void fiber_unqueue(Fiber* f) {
+    uint64_t irq = spin_lock_irqsave(&f->wait_queue->lock);
+    wait_queue_remove(f->wait_queue, &f->wait);  // no-op once the waker unlinked it
+    spin_unlock_irqrestore(&f->wait_queue->lock, irq);
+}
+
+void fiber_await(WaitQueue* wq, bool (*cond)(void* arg), void* arg) {
+    FiberSched* fs = fiber_sched_current();
+    if (!fs || !fs->current) {
+        wait_event(wq, cond, arg, false);
+        return;
+    }
+    Fiber* f = fs->current;
+    while (!cond(arg)) {
+        // Queued before the condition is read again, as in wait_event
+        f->woken = false;
+        f->wait.task = NULL;
+        f->wait.exclusive = false;
+        f->wait.wake = fiber_wake;
+        f->wait_queue = wq;
+        uint64_t irq = spin_lock_irqsave(&wq->lock);
+        wait_queue_add(wq, &f->wait);
+        spin_unlock_irqrestore(&wq->lock, irq);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (cond(arg)) {
+            fiber_unqueue(f);  // after this any waker is done with f
+            f->wait_queue = NULL;
+            if (f->woken) {
+                __atomic_sub_fetch(&fs->nr_woken, 1, __ATOMIC_RELAXED);
+            }
+            return;
+        }
+        f->next = fs->waiting;
+        fs->waiting = f;
+        fiber_switch_away(fs, f);
+    }
+}
+
+/*
+ * Nothing ready but fibers still waiting: block the task until a waker
+ * releases one. Without a task to block (the shell) halt between interrupts.
+ */
+static void fiber_sched_idle(FiberSched* fs) {
+    uint64_t irq = local_irq_save();
+    if (!scheduler_can_block()) {
+        if (__atomic_load_n(&fs->nr_woken, __ATOMIC_ACQUIRE) == 0) {
+            timer_idle_halt(UINT64_MAX);
+        }
+    } else if (!scheduler_prepare_block()) {
+        scheduler_schedule();  // killed: the switch away is final
+    } else if (__atomic_load_n(&fs->nr_woken, __ATOMIC_ACQUIRE) != 0) {
+        scheduler_cancel_block();
+    } else {
+        scheduler_block();
+    }
+    local_irq_restore(irq);
+}
+
+void fiber_sched_run(FiberSched* fs) {
+    TaskStruct* task = scheduler_get_current_task();
+    if (!task) {
+        return;
+    }
+    fs->task = task;
+    task->fibers = fs;
+    while (fs->nr_fibers) {
+        fiber_collect_woken(fs);
+        Fiber* next = ready_pop(fs);
+        if (!next) {
+            fiber_sched_idle(fs);
+            continue;
+        }
+        uint64_t irq = local_irq_save();
+        fs->current = next;
+        fs->irq_flags = irq;
+        fs->switches++;
+        __atomic_add_fetch(&fiber_stats.switches, 1, __ATOMIC_RELAXED);
+        fiber_switch(&fs->sp, next->sp);
+        local_irq_restore(irq);
+        fiber_reap(fs);
+    }
+    task->fibers = NULL;
+}
+
+void fiber_task_exit(TaskStruct* task) {
+    FiberSched* fs = task->fibers;
+    if (!fs) {
+        return;
+    }
+    task->fibers = NULL;
+    // Taking each queue lock also waits out a waker still inside fiber_wake
+    for (Fiber* f = fs->waiting; f;) {
+        Fiber* next = f->next;
+        if (f->wait_queue) {
+            fiber_unqueue(f);
+        }
+        fiber_free(f);
+        f = next;
+    }
+    for (Fiber* f = fs->ready_head; f;) {
+        Fiber* next = f->next;
+        fiber_free(f);
+        f = next;
+    }
+    if (fs->current) {
+        fiber_free(fs->current);
+    }
+    if (fs->dead) {
+        fiber_free(fs->dead);
+    }
+}
+
+/* bench fiber: two fibers yielding to each other; the first one keeps time. */
+static uint32_t bench_rounds;
+static uint64_t bench_best;
+static uint64_t bench_total;
+
+static void bench_ping(void* arg) {
+    (void)arg;
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < bench_rounds; i++) {
+        uint64_t t0 = rdtsc();
+        fiber_yield();
+        uint64_t dt = rdtsc() - t0;
+        if (dt < bench_best) {
+            bench_best = dt;
+        }
+    }
+    bench_total = rdtsc() - start;
+}
+
+static void bench_pong(void* arg) {
+    (void)arg;
+    for (uint32_t i = 0; i < bench_rounds; i++) {
+        fiber_yield();
+    }
+}
+
+int fiber_bench(uint32_t rounds, CtxswBench* out) {
+    if (!out || rounds == 0) {
+        return -1;
+    }
+    FiberSched fs;
+    fiber_sched_init(&fs);
+    bench_rounds = rounds;
+    bench_best = UINT64_MAX;
+    bench_total = 0;
+    if (!fiber_create(&fs, bench_ping, NULL, FIBER_STACK_MIN)) {
+        return -1;
+    }
+    if (!fiber_create(&fs, bench_pong, NULL, FIBER_STACK_MIN)) {
+        fiber_free(ready_pop(&fs));
+        return -1;
+    }
+    uint64_t irq = local_irq_save();
+    fiber_sched_run(&fs);
+    local_irq_restore(irq);
+
+    // Each round trip is two switches
+    out->switches = rounds * 2;
+    out->avg_cycles = bench_total / out->switches;
+    out->min_cycles = bench_best / 2;
+    return 0;
+}
+
+const FiberStats* fiber_get_stats(void) {
+    return &fiber_stats;
+}
@@ -0,0 +1,225 @@
+// src/core/fpu.c — lazy extended-state switching on CR0.TS / #NM
+#include "../includes/fpu.h"
+#include "../includes/scheduler.h"
+#include "../includes/slab.h"
+#include "../includes/console.h"
+#include "../includes/smp.h"
+#include "../includes/utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define CR0_TS       (1ull << 3)
+#define CR4_OSXSAVE  (1ull << 18)
+#define CPUID1_ECX_XSAVE (1u << 26)
+#define CPUID1_ECX_AVX   (1u << 28)
+
+#define FPU_FCW_DEFAULT   0x037Fu
+#define FPU_MXCSR_DEFAULT 0x1F80u
+#define FPU_MXCSR_OFFSET  24u
+
+static FpuInfo fpu;
+static KmemCache fpu_cache;
+static bool fpu_ready;
+static bool fpu_ts[SMP_MAX_CPUS];             // CR0.TS as last written
+static TaskStruct* fpu_owner[SMP_MAX_CPUS];   // whose state the registers hold
+
+static inline void fpu_cpuid(uint32_t leaf, uint32_t sub, uint32_t r[4]) {
+    __asm__ volatile("cpuid" : "=a"(r[0]), "=b"(r[1]), "=c"(r[2]), "=d"(r[3]) : "a"(leaf), "c"(sub));
+}
+
+static inline uint64_t fpu_read_cr0(void) {
+    uint64_t v;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline uint64_t fpu_read_cr4(void) {
+    uint64_t v;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void fpu_write_cr4(uint64_t v) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+static inline void fpu_xsetbv(uint32_t index, uint64_t value) {
+    __asm__ volatile("xsetbv" : : "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void fpu_set_ts(uint32_t cpu) {
+    if (!fpu_ts[cpu]) {
+        __asm__ volatile("mov %0, %%cr0" : : "r"(fpu_read_cr0() | CR0_TS) : "memory");
+        fpu_ts[cpu] = true;
+    }
+}
+
+static inline void fpu_clear_ts(uint32_t cpu) {
+    if (fpu_ts[cpu]) {
+        __asm__ volatile("clts" ::: "memory");
+        fpu_ts[cpu] = false;
+    }
+}
+
+static void fpu_save(uint8_t* area) {
+    if (fpu.xsaveopt) {
+        __asm__ volatile("xsaveopt64 (%0)" : : "r"(area), "a"(0xFFFFFFFFu), "d"(0xFFFFFFFFu) : "memory");
+    } else if (fpu.xsave) {
+        __asm__ volatile("xsave64 (%0)" : : "r"(area), "a"(0xFFFFFFFFu), "d"(0xFFFFFFFFu) : "memory");
+    } else {
+        __asm__ volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static void fpu_restore(const uint8_t* area) {
+    if (fpu.xsave) {
+        __asm__ volatile("xrstor64 (%0)" : : "r"(area), "a"(0xFFFFFFFFu), "d"(0xFFFFFFFFu) : "memory");
+    } else {
+        __asm__ volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+/*
+ * Initial state for a task's first FPU use. The area comes zeroed, so the
+ * XSAVE header says every component is in its init state; only the legacy
+ * control words need values, since XRSTOR/FXRSTOR load MXCSR (and FXRSTOR
+ * the FCW) from memory regardless.
+ */
+static void fpu_area_init(uint8_t* area) {
+    *(uint16_t*)(void*)area = FPU_FCW_DEFAULT;
+    *(uint32_t*)(void*)(area + FPU_MXCSR_OFFSET) = FPU_MXCSR_DEFAULT;
+}
+
+void fpu_init(void) {
+    uint32_t r[4];
+    memset(&fpu, 0, sizeof fpu);
+    fpu.xfeatures = XFEATURE_X87 | XFEATURE_SSE;
+    fpu.area_size = FPU_LEGACY_SIZE;
+
+    fpu_cpuid(1, 0, r);
+    uint32_t ecx1 = r[2];
+    if (ecx1 & CPUID1_ECX_XSAVE) {
+        fpu_write_cr4(fpu_read_cr4() | CR4_OSXSAVE);
+        fpu_cpuid(0xD, 0, r);
+        uint64_t supported = (uint64_t)r[0] | ((uint64_t)r[3] << 32);
+        uint64_t want = XFEATURE_X87 | XFEATURE_SSE;
+        if ((ecx1 & CPUID1_ECX_AVX) && (supported & XFEATURE_AVX)) {
+            want |= XFEATURE_AVX;
+        }
+        fpu.xfeatures = want & supported;
+        fpu_xsetbv(0, fpu.xfeatures);
+
+        fpu_cpuid(0xD, 0, r);  // EBX: area size for what XCR0 now enables
+        fpu.area_size = r[1];
+        fpu_cpuid(0xD, 1, r);
+        fpu.xsave = true;
+        fpu.xsaveopt = (r[0] & 1u) != 0;
+    }
+
+    if (kmem_cache_init_aligned(&fpu_cache, "fpu_state", fpu.area_size, FPU_AREA_ALIGN) != 0) {
+        console_println_color("FPU: state area too large, lazy switching off", CONSOLE_ERROR_COLOR);
+        return;
+    }
+    fpu_owner[0] = NULL;
+    fpu_ts[0] = false;
+    fpu_ready = true;
+    fpu_set_ts(0);  // first use by anyone traps
+}
+
+void fpu_cpu_init(void) {
+    uint32_t cpu = smp_cpu_id();
+    if (fpu.xsave) {
+        fpu_write_cr4(fpu_read_cr4() | CR4_OSXSAVE);
+        fpu_xsetbv(0, fpu.xfeatures);
+    }
+    fpu_owner[cpu] = NULL;
+    fpu_ts[cpu] = false;
+    if (fpu_ready) {
+        fpu_set_ts(cpu);
+    }
+}
+
+/* cpu's registers hold t's current state: t loaded them last and has not run elsewhere since. */
+static inline bool fpu_live_on(const TaskStruct* t, uint32_t cpu) {
+    return t && t == fpu_owner[cpu] && t->fpu_cpu == cpu;
+}
+
+void fpu_switch(TaskStruct* prev, TaskStruct* next) {
+    if (!fpu_ready) {
+        return;
+    }
+    uint32_t cpu = smp_cpu_id();
+    if (fpu_live_on(prev, cpu) && smp_cpus_online() > 1) {
+        // prev may next run on another CPU: write its state back, but keep
+        // the registers, so coming back here needs no trap or restore
+        fpu_clear_ts(cpu);
+        fpu_save(prev->fpu_area);
+        fpu.saves++;
+    }
+    if (fpu_live_on(next, cpu)) {
+        fpu_clear_ts(cpu);
+    } else {
+        if (next && next == fpu_owner[cpu]) {
+            fpu_owner[cpu] = NULL;  // it used the FPU elsewhere since: stale copy
+        }
+        fpu_set_ts(cpu);
+    }
+}
+
+void fpu_release(TaskStruct* task) {
+    if (!task) {
+        return;
+    }
+    for (uint32_t c = 0; c < SMP_MAX_CPUS; c++) {
+        if (fpu_owner[c] == task) {
+            fpu_owner[c] = NULL;  // its register contents are simply dropped
+        }
+    }
+    if (task->fpu_area) {
+        kmem_cache_free(&fpu_cache, task->fpu_area);
+        task->fpu_area = NULL;
+    }
+}
+
+void fpu_nm_handler(void) {
+    TaskStruct* curr = scheduler_get_current_task();
+    uint32_t cpu = smp_cpu_id();
+    fpu_clear_ts(cpu);
+    fpu.traps++;
+    if (!fpu_ready || (curr && curr == fpu_owner[cpu])) {
+        return;
+    }
+
+    // With APs up the owner was written back as it left (and the APs start
+    // before any task runs); its area may be in use on another CPU by now
+    TaskStruct* owner = fpu_owner[cpu];
+    if (owner && owner->fpu_area && smp_cpus_online() == 1) {
+        fpu_save(owner->fpu_area);
+        fpu.saves++;
+    }
+    fpu_owner[cpu] = NULL;
+    if (!curr) {
+        return;
+    }
+
+    if (!curr->fpu_area) {
+        curr->fpu_area = kmem_cache_alloc(&fpu_cache);
+        if (!curr->fpu_area) {
+            // No area: run on fresh registers, unowned, and retry at the next trap
+            console_println_color("FPU: out of memory for task state", CONSOLE_ERROR_COLOR);
+            uint32_t mxcsr = FPU_MXCSR_DEFAULT;
+            __asm__ volatile("fninit; ldmxcsr %0" : : "m"(mxcsr));
+            return;
+        }
+        fpu_area_init(curr->fpu_area);
+        fpu.areas++;
+    }
+    fpu_restore(curr->fpu_area);
+    fpu.restores++;
+    fpu_owner[cpu] = curr;
+    curr->fpu_cpu = cpu;
+}
+
+const FpuInfo* fpu_get_info(void) {
+    return &fpu;
+}
@@ -3,6 +3,7 @@
 #include "../includes/timer.h"
 #include "../includes/scheduler.h"
 #include "../includes/memory.h"
+#include "../includes/vma.h"
 #include "../includes/pop_module.h"
 #include "../includes/multiboot2.h"
 #include "../includes/sysinfo_pop.h"
@@ -12,6 +13,9 @@
 #include "../includes/spinner_pop.h"
 #include "../includes/syscall.h"
 #include "../includes/utils.h"
+#include "../includes/smp.h"
+#include "../includes/workqueue.h"
+#include "../includes/fiber.h"
 #include <stddef.h>
 
 extern void multiboot2_parse(void);
@@ -38,7 +42,10 @@ static const int total_init_steps = 9;
 void init_boot_screen(void) {
     multiboot2_parse();
 
-    /* IDT before any task runs with IF=1 (see setup_task_context rflags) or context_save's sti. */
+    /* GS base first: the IDT load already uses CPU 0's tables. */
+    smp_bsp_init();
+
+    /* IDT before any task runs with IF=1 (task_entry_trampoline's sti, see setup_task_context). */
     idt_init();
 
     console_init();
@@ -202,6 +209,7 @@ void init_show_scheduler_info(void) {
     init_draw_progress_bar(3, total_init_steps, "Initializing Scheduler");
 
     scheduler_init();
+    vma_start_reclaim_thread();
 
     console_set_cursor(0, 18);
     console_print_color("  ✓ Preemptive Multi-Task Scheduler", BOOT_SUCCESS_COLOR);
@@ -328,6 +336,12 @@ void init_transition_to_console(void) {
     timer_set_tick_handler(scheduler_tick);
     timer_enable();
 
+    /* APs last: the LAPIC timer is calibrated against the running PIT tick. */
+    smp_init();
+    workqueue_init();
+    vma_start_collapse();
+    fiber_init();
+
     console_draw_prompt_with_path(get_current_directory());
 
     console_print_status_bar();
@@ -153,10 +153,22 @@ global cpuid_get_features
 global cpuid_extended_brand
 global rdtsc
 global default_cpu_exception
+global page_fault_handler
+global device_not_available_handler
+global lapic_timer_handler
+global ipi_resched_handler
+global ipi_tlb_handler
+global lapic_spurious_handler
 
 extern keyboard_handler_main
 extern timer_interrupt_handler
 extern syscall_dispatch
+extern vma_page_fault
+extern scheduler_page_fault_kill
+extern fpu_nm_handler
+extern smp_timer_interrupt
+extern smp_resched_interrupt
+extern smp_tlb_interrupt
 
 ; CPU exception vectors 0x00–0x1F: halt if unhandled. Presents a valid gate
 ; so a fault (e.g. #PF) does not re-fault on an empty IDT entry.
@@ -166,6 +178,58 @@ default_cpu_exception:
   hlt
   jmp .hang
 
+; #PF (IST1): demand paging for mmap areas. CPU pushed an error code, so after
+; 15 GPRs RSP is 8 mod 16; pad once to call C on an aligned stack. A fault
+; vma_page_fault cannot resolve kills a user-mode task or halts on a kernel one.
+page_fault_handler:
+  push rax
+  push rbx
+  push rcx
+  push rdx
+  push rsi
+  push rdi
+  push rbp
+  push r8
+  push r9
+  push r10
+  push r11
+  push r12
+  push r13
+  push r14
+  push r15
+  mov rdi, [rsp + 120]
+  mov r12, cr2               ; kept: a fault taken meanwhile would replace CR2
+  mov rsi, r12
+  sub rsp, 8
+  call vma_page_fault
+  add rsp, 8
+  test rax, rax
+  jnz .kill
+  pop r15
+  pop r14
+  pop r13
+  pop r12
+  pop r11
+  pop r10
+  pop r9
+  pop r8
+  pop rbp
+  pop rdi
+  pop rsi
+  pop rdx
+  pop rcx
+  pop rbx
+  pop rax
+  add rsp, 8
+  iretq
+.kill:
+  ; Unresolved: error code, CR2 and the faulting RIP; does not return
+  mov rdi, [rsp + 120]
+  mov rsi, r12
+  mov rdx, [rsp + 128]
+  sub rsp, 8
+  call scheduler_page_fault_kill
+
 read_port:
   mov rdx, rdi
   xor rax, rax
@@ -251,6 +315,41 @@ timer_handler:
   pop rax
   iretq
 
+; #NM: first FPU/SIMD use since CR0.TS was set; load the task's state (fpu.c).
+device_not_available_handler:
+  push rax
+  push rbx
+  push rcx
+  push rdx
+  push rsi
+  push rdi
+  push rbp
+  push r8
+  push r9
+  push r10
+  push r11
+  push r12
+  push r13
+  push r14
+  push r15
+  call fpu_nm_handler
+  pop r15
+  pop r14
+  pop r13
+  pop r12
+  pop r11
+  pop r10
+  pop r9
+  pop r8
+  pop rbp
+  pop rdi
+  pop rsi
+  pop rdx
+  pop rcx
+  pop rbx
+  pop rax
+  iretq
+
 syscall_handler_asm:
   push rax
   push rbx
@@ -297,6 +396,51 @@ cpuid_get_vendor:
   pop rbx
   ret
 
+%macro LAPIC_STUB 2
+%1:
+  push rax
+  push rbx
+  push rcx
+  push rdx
+  push rsi
+  push rdi
+  push rbp
+  push r8
+  push r9
+  push r10
+  push r11
+  push r12
+  push r13
+  push r14
+  push r15
+  call %2
+  pop r15
+  pop r14
+  pop r13
+  pop r12
+  pop r11
+  pop r10
+  pop r9
+  pop r8
+  pop rbp
+  pop rdi
+  pop rsi
+  pop rdx
+  pop rcx
+  pop rbx
+  pop rax
+  iretq
+%endmacro
+
+; Local APIC vectors (smp.c sends the EOI)
+LAPIC_STUB lapic_timer_handler, smp_timer_interrupt
+LAPIC_STUB ipi_resched_handler, smp_resched_interrupt
+LAPIC_STUB ipi_tlb_handler, smp_tlb_interrupt
+
+; Spurious vector: no EOI
+lapic_spurious_handler:
+  iretq
+
 cpuid_get_features:
   push rbx
   mov eax, 1
@@ -326,4 +470,87 @@ rdtsc:
   or rax, rdx
   ret
 
+; --- AP startup code: smp.c copies [ap_trampoline_start, ap_trampoline_end) to
+; AP_TRAMPOLINE_BASE, fills ap_trampoline_data and sends INIT-SIPI-SIPI. The AP
+; starts in real mode at CS:IP = 0x0800:0000, borrows the BSP's page tables
+; and calls entry(cpu) on the given stack in long mode. ---
+AP_TRAMPOLINE_BASE equ 0x8000   ; smp.h
+%define AP_ADDR(x) (AP_TRAMPOLINE_BASE + (x) - ap_trampoline_start)
+
+section .rodata
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_trampoline_data
+align 16
+bits 16
+ap_trampoline_start:
+  cli
+  cld
+  xor ax, ax
+  mov ds, ax
+  o32 lgdt [AP_ADDR(ap_gdt_pointer)]
+
+  mov eax, cr4
+  or eax, 1 << 5                ; PAE
+  mov cr4, eax
+  mov eax, [AP_ADDR(ap_trampoline_data)]
+  mov cr3, eax                  ; kernel PML4 (below 4 GiB)
+
+  mov ecx, 0xC0000080           ; EFER
+  rdmsr
+  or eax, (1 << 8) | (1 << 11)  ; LME, NXE
+  wrmsr
+
+  mov eax, cr0
+  or eax, 0x80000001            ; PG, PE
+  mov cr0, eax
+  jmp dword 0x08:AP_ADDR(ap_long_mode)
+
+bits 64
+ap_long_mode:
+  mov ax, 0x10
+  mov ds, ax
+  mov es, ax
+  mov ss, ax
+  xor eax, eax
+  mov fs, ax
+  mov gs, ax
+
+  mov rax, cr0
+  and rax, ~0x4
+  or  rax, 0x2
+  mov cr0, rax
+  mov rax, cr4
+  or  rax, (1 << 9) | (1 << 10)
+  mov cr4, rax
+
+  mov rsp, [abs AP_ADDR(ap_trampoline_data) + 8]
+  mov rdi, [abs AP_ADDR(ap_trampoline_data) + 24]
+  mov rax, [abs AP_ADDR(ap_trampoline_data) + 16]
+  call rax
+
+  cli
+.hang:
+  hlt
+  jmp .hang
+
+align 8
+ap_gdt:
+  dq 0
+  dq 0x00209A0000000000
+  dq 0x0000920000000000
+ap_gdt_pointer:
+  dw $ - ap_gdt - 1
+  dd AP_ADDR(ap_gdt)
+
+align 8
+ap_trampoline_data:
+  dq 0                          ; cr3
+  dq 0                          ; stack
+  dq 0                          ; entry(Cpu*)
+  dq 0                          ; Cpu*
+ap_trampoline_end:
+
+section .text
+
 ; context_switch lives in context_switch.asm
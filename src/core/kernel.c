@@ -13,6 +13,14 @@
 #include "../includes/syscall.h"
 #include "../includes/utils.h"
 #include "../includes/keyboard_queue.h"
+#include "../includes/wait.h"
+#include "../includes/sync.h"
+#include "../includes/fpu.h"
+#include "../includes/smp.h"
+#include "../includes/workqueue.h"
+#include "../includes/fiber.h"
+#include "../includes/kstack.h"
+#include "../includes/vmm.h"
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -45,6 +53,12 @@ extern unsigned char keyboard_map[128];
 extern void keyboard_handler(void);
 extern void timer_handler(void);
 extern void default_cpu_exception(void);
+extern void page_fault_handler(void);
+extern void device_not_available_handler(void);
+extern void lapic_timer_handler(void);
+extern void ipi_resched_handler(void);
+extern void ipi_tlb_handler(void);
+extern void lapic_spurious_handler(void);
 extern char read_port(unsigned short port);
 extern void write_port(unsigned short port, unsigned char data);
 
@@ -106,6 +120,9 @@ static volatile unsigned char key_queue[KEY_QUEUE_CAP];
 static volatile uint32_t key_queue_head;
 static volatile uint32_t key_queue_tail;
 
+/* Readers with nothing to pop block here; IRQ1 wakes them all. */
+static WaitQueue key_wait = WAIT_QUEUE_INIT;
+
 static void key_queue_push(unsigned char scancode)
 {
     uint32_t tail = key_queue_tail;
@@ -116,6 +133,20 @@ static void key_queue_push(unsigned char scancode)
     }
     key_queue[tail] = scancode;
     key_queue_tail = next;
+    if (wait_queue_active(&key_wait)) {
+        wake_up_all(&key_wait);
+    }
+}
+
+static bool key_queue_ready(void* arg)
+{
+    (void)arg;
+    return key_queue_head != key_queue_tail;
+}
+
+void key_queue_wait(void)
+{
+    wait_event(&key_wait, key_queue_ready, NULL, false);
 }
 
 bool key_queue_pop(uint8_t* out)
@@ -151,23 +182,22 @@ struct GDT_ptr {
 } __attribute__((packed));
 
 /* 64-bit TSS, IST1 = #PF, IST2 = #DF. TSS is a 16-byte GDT entry; it must be 16-byte aligned
-   in the GDT (Intel SDM, IA-32e: misaligned 16B system descriptor + LTR = #GP → triple-fault/reset). */
+   in the GDT (Intel SDM, IA-32e: misaligned 16B system descriptor + LTR = #GP → triple-fault/reset).
+   Every CPU gets its own copy (smp.h CpuTables): LTR marks the descriptor busy. */
 #define GDT_TSS_SEL 0x20u /* GDT index 4 after null+code+data+pad — offset 0x20 from GDT base */
-static void tss_ist_lgdt_ltr(void) {
-    static uint8_t tss[104] __attribute__((aligned(16)));
-    static uint8_t ist_pf[4096] __attribute__((aligned(16)));
-    static uint8_t ist_df[4096] __attribute__((aligned(16)));
+void cpu_tables_load(CpuTables* t, uint64_t rsp0) {
+    uint8_t* tss = t->tss;
     /* 6*8: null, code, data, 8B pad, TSS (16B). Pad puts TSS at offset 0x20 (16B-aligned). */
-    static uint64_t gdt6[6] __attribute__((aligned(32)));
+    uint64_t* gdt6 = t->gdt;
 
-    for (size_t i = 0; i < sizeof tss; i++) {
+    for (size_t i = 0; i < sizeof t->tss; i++) {
         tss[i] = 0;
     }
     const uint32_t tss_size = 104U;
     /* x86-64 TSS: RSP0@4, IST1@0x24, IST2@0x2C; I/O map base@0x66 — must be > limit or no I/O map */
-    *(uint64_t*)(void*)(tss + 0x4) = (uint64_t)(uintptr_t)&stack_top;
-    *(uint64_t*)(void*)(tss + 0x24) = (uint64_t)(uintptr_t)(ist_pf + sizeof ist_pf);
-    *(uint64_t*)(void*)(tss + 0x2c) = (uint64_t)(uintptr_t)(ist_df + sizeof ist_df);
+    *(uint64_t*)(void*)(tss + 0x4) = rsp0;
+    *(uint64_t*)(void*)(tss + 0x24) = (uint64_t)(uintptr_t)(t->ist_pf + sizeof t->ist_pf);
+    *(uint64_t*)(void*)(tss + 0x2c) = (uint64_t)(uintptr_t)(t->ist_df + sizeof t->ist_df);
     *(uint16_t*)(void*)(tss + 0x66) = (uint16_t)tss_size; /* 0x68: no I/O perm bitmap (104 bytes) */
 
     const uint64_t tss_b = (uint64_t)(uintptr_t)tss;
@@ -202,17 +232,33 @@ static void tss_ist_lgdt_ltr(void) {
         : : "i"((int)GDT_TSS_SEL) : "ax", "memory");
 }
 
+/* 64-bit: lidt must see a contiguous 2+8 byte block; avoid RDI/ABI issues by using "m". */
+void idt_load(void)
+{
+    struct {
+        uint16_t limit;
+        uint64_t base;
+    } __attribute__((packed)) idt_desc = {
+        (uint16_t)(sizeof(struct IDT_entry) * IDT_SIZE - 1U),
+        (uint64_t)(uintptr_t)IDT,
+    };
+    __asm__ volatile("lidt %0" : : "m"(idt_desc) : "memory");
+}
+
 void idt_init(void)
 {
-    tss_ist_lgdt_ltr();
+    cpu_tables_load(&smp_cpu(0)->tables, (uint64_t)(uintptr_t)&stack_top);
 
     uint64_t def = (uint64_t)(uintptr_t)default_cpu_exception;
     for (uint8_t n = 0; n < 32U; n++) {
         idt_set_gate(n, def, INTERRUPT_GATE, 0U);
     }
-    /* #PF, #DF: use IST1 / IST2 so delivery works if current RSP is unusable. */
-    idt_set_gate(0x0e, def, INTERRUPT_GATE, 1U);
+    /* #PF, #DF: use IST1 / IST2 so delivery works if current RSP is unusable.
+       #PF resolves demand-paged mmap areas (vma.c) and halts on anything else. */
+    idt_set_gate(0x0e, (uint64_t)(uintptr_t)page_fault_handler, INTERRUPT_GATE, 1U);
     idt_set_gate(0x08, def, INTERRUPT_GATE, 2U);
+    /* #NM: lazy FPU/SIMD state switch (fpu.c). */
+    idt_set_gate(0x07, (uint64_t)(uintptr_t)device_not_available_handler, INTERRUPT_GATE, 0U);
 
     uint64_t keyboard_address = (uint64_t)(uintptr_t)keyboard_handler;
     idt_set_gate(0x21, keyboard_address, INTERRUPT_GATE, 0U);
@@ -224,6 +270,12 @@ void idt_init(void)
     uint64_t syscall_address = (uint64_t)(uintptr_t)syscall_handler_asm;
     idt_set_gate(0x80, syscall_address, 0xEEU, 0U);
 
+    /* Local APIC: per-CPU timer on the APs, reschedule and TLB shootdown IPIs, spurious (smp.c). */
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint64_t)(uintptr_t)lapic_timer_handler, INTERRUPT_GATE, 0U);
+    idt_set_gate(IPI_RESCHED_VECTOR, (uint64_t)(uintptr_t)ipi_resched_handler, INTERRUPT_GATE, 0U);
+    idt_set_gate(IPI_TLB_VECTOR, (uint64_t)(uintptr_t)ipi_tlb_handler, INTERRUPT_GATE, 0U);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uint64_t)(uintptr_t)lapic_spurious_handler, INTERRUPT_GATE, 0U);
+
     /*     Ports
     *    PIC1    PIC2
     *Command 0x20    0xA0
@@ -255,17 +307,7 @@ void idt_init(void)
     write_port(0x21 , 0xff);
     write_port(0xA1 , 0xff);
 
-    /* 64-bit: lidt must see a contiguous 2+8 byte block; avoid RDI/ABI issues by using "m". */
-    {
-        struct {
-            uint16_t limit;
-            uint64_t base;
-        } __attribute__((packed)) idt_desc = {
-            (uint16_t)(sizeof(struct IDT_entry) * IDT_SIZE - 1U),
-            (uint64_t)(uintptr_t)IDT,
-        };
-        __asm__ volatile("lidt %0" : : "m"(idt_desc) : "memory");
-    }
+    idt_load();
     __asm__ volatile("sti" ::: "memory");
 }
 
@@ -342,10 +384,10 @@ static const char* available_commands[] = {
     "help", "halp", "hang", "clear", "uptime", "halt", "stop",
     "write", "read", "delete", "rm", "mkdir", "go", "back",
     "ls", "search", "cp", "listsys", "sysinfo",
-    "mem", "mem -map", "mem -use", "mem -stats", "mem -info", "mem -debug",
+    "mem", "mem -map", "mem -use", "mem -stats", "mem -info", "mem -debug", "mem -kstack test", "mem -vmm test",
     "cpu", "cpu -hz", "cpu -info",
-    "tasks", "timer", "syscalls",
-    "mon", "mon -debug", "mon -list", "mon -kill", "mon -ultramon",
+    "tasks", "top", "timer", "syscalls", "bench ctxsw", "bench fiber",
+    "mon", "mon -debug", "mon -list", "mon -kill", "mon -ultramon", "mon -locks", "mon -pin", "mon -dl", "mon -dl test", "mon -wq", "mon -wq test", "mon -lat",
     "dol", "dol -new", "dol -open", "dol -save", "dol -close", "dol -help",
     NULL
 };
@@ -371,6 +413,35 @@ int parse_number(const char* str, uint32_t* result) {
     return 1;
 }
 
+/* CPU mask: 0x-prefixed hex, else decimal */
+static int parse_cpumask(const char* str, uint32_t* result) {
+    if (!str || !result) return 0;
+    if (str[0] != '0' || (str[1] != 'x' && str[1] != 'X')) {
+        return parse_number(str, result);
+    }
+    str += 2;
+    uint32_t mask = 0;
+    const char* start = str;
+    for (;; str++) {
+        uint32_t digit;
+        if (*str >= '0' && *str <= '9') {
+            digit = (uint32_t)(*str - '0');
+        } else if (*str >= 'a' && *str <= 'f') {
+            digit = (uint32_t)(*str - 'a' + 10);
+        } else if (*str >= 'A' && *str <= 'F') {
+            digit = (uint32_t)(*str - 'A' + 10);
+        } else {
+            break;
+        }
+        mask = (mask << 4) | digit;
+    }
+    if (str == start || *str != '\0') {
+        return 0;
+    }
+    *result = mask;
+    return 1;
+}
+
 /* Autocomplete command */
 void autocomplete_command(char *buffer, unsigned int *index) {
     if (*index == 0) return;
@@ -410,6 +481,7 @@ void autocomplete_command(char *buffer, unsigned int *index) {
 }
 
 void keyboard_handler_main(void) {
+    scheduler_account_irq_enter();
     unsigned char status = read_port(KEYBOARD_STATUS_PORT);
     if (status & 0x01) {
         unsigned char keycode = read_port(KEYBOARD_DATA_PORT);
@@ -417,6 +489,251 @@ void keyboard_handler_main(void) {
     }
     /* Master PIC: End of interrupt */
     write_port(0x20, 0x20);
+    scheduler_account_irq_exit();
+}
+
+/*
+ * top: where the cycles went over the last second, per CPU and per task,
+ * refreshed in place until a key is pressed. Each row is formatted in full
+ * and written only when it differs from what is already on screen.
+ */
+#define TOP_MAX_TASKS 64
+#define TOP_WIDTH (VGA_WIDTH - 1)   // the last column would wrap and scroll
+
+typedef struct {
+    char text[TOP_WIDTH + 1];
+    unsigned char color;
+} TopRow;
+
+static TopRow top_screen[VGA_HEIGHT];
+static TaskTimes top_prev[TOP_MAX_TASKS];
+static TaskTimes top_now[TOP_MAX_TASKS];
+static uint64_t top_delta[TOP_MAX_TASKS];
+static uint32_t top_order[TOP_MAX_TASKS];
+static CpuTime top_prev_cpu[SMP_MAX_CPUS];
+
+static void top_put(char* row, uint32_t* col, const char* s) {
+    while (*s && *col < TOP_WIDTH) {
+        row[(*col)++] = *s++;
+    }
+}
+
+// Right-aligned in width columns
+static void top_put_num(char* row, uint32_t* col, uint64_t v, uint32_t width) {
+    char buffer[24];
+    u64_to_str(v, buffer);
+    for (uint32_t len = (uint32_t)strlen_simple(buffer); len < width; len++) {
+        top_put(row, col, " ");
+    }
+    top_put(row, col, buffer);
+}
+
+// part / whole as a percentage with one decimal, 6 columns
+static void top_put_pct(char* row, uint32_t* col, uint64_t part, uint64_t whole) {
+    uint64_t permille = whole ? part * 1000u / whole : 0;
+    char digit[2] = {(char)('0' + permille % 10u), '\0'};
+    top_put_num(row, col, permille / 10u, 4);
+    top_put(row, col, ".");
+    top_put(row, col, digit);
+    top_put(row, col, "%");
+}
+
+static void top_draw(uint32_t y, const char* row, unsigned char color) {
+    TopRow* r = &top_screen[y];
+    bool same = r->color == color;
+    for (uint32_t i = 0; same && i < TOP_WIDTH; i++) {
+        same = r->text[i] == row[i];
+    }
+    if (same) {
+        return;
+    }
+    for (uint32_t i = 0; i < TOP_WIDTH; i++) {
+        r->text[i] = row[i];
+    }
+    r->text[TOP_WIDTH] = '\0';
+    r->color = color;
+    console_set_cursor(0, y);
+    console_print_color(r->text, color);
+}
+
+static void top_row_init(char* row, uint32_t* col) {
+    for (uint32_t i = 0; i < TOP_WIDTH; i++) {
+        row[i] = ' ';
+    }
+    row[TOP_WIDTH] = '\0';
+    *col = 0;
+}
+
+static const char* top_state_name(TaskState s) {
+    switch (s) {
+        case TASK_STATE_RUNNING:  return "Running";
+        case TASK_STATE_READY:    return "Ready";
+        case TASK_STATE_BLOCKED:  return "Blocked";
+        case TASK_STATE_SLEEPING: return "Sleeping";
+        case TASK_STATE_ZOMBIE:   return "Zombie";
+        default:                  return "Unknown";
+    }
+}
+
+static const char* top_class_name(const TaskTimes* t) {
+    if (t->deadline) {
+        return "Deadline";
+    }
+    switch (t->priority) {
+        case PRIORITY_IDLE:     return "Idle";
+        case PRIORITY_LOW:      return "Low";
+        case PRIORITY_NORMAL:   return "Normal";
+        case PRIORITY_HIGH:     return "High";
+        case PRIORITY_REALTIME: return "Realtime";
+        default:                return "Unknown";
+    }
+}
+
+static uint64_t top_busy(const CpuTime* t) {
+    return t->user + t->sys + t->irq;
+}
+
+static void top_refresh(uint32_t n_prev, uint32_t n_now, uint64_t wall) {
+    char row[TOP_WIDTH + 1];
+    char buffer[24];
+    uint32_t col;
+    uint32_t y = 0;
+
+    top_row_init(row, &col);
+    top_put(row, &col, "top - up ");
+    u64_to_str(timer_get_uptime_ms() / 1000u, buffer);
+    top_put(row, &col, buffer);
+    top_put(row, &col, " s, ");
+    u64_to_str(n_now, buffer);
+    top_put(row, &col, buffer);
+    top_put(row, &col, " tasks, ");
+    u64_to_str(smp_cpus_online(), buffer);
+    top_put(row, &col, buffer);
+    top_put(row, &col, " CPUs");
+    col = TOP_WIDTH - 18;
+    top_put(row, &col, "any key to return");
+    top_draw(y++, row, CONSOLE_HEADER_COLOR);
+
+    // Per CPU, as shares of the time it accounted this interval
+    for (uint32_t c = 0; c < SMP_MAX_CPUS && y < VGA_HEIGHT; c++) {
+        CpuTime now;
+        if (!scheduler_get_cpu_time(c, &now)) {
+            continue;
+        }
+        CpuTime d = {
+            now.user - top_prev_cpu[c].user, now.sys - top_prev_cpu[c].sys,
+            now.irq - top_prev_cpu[c].irq, now.idle - top_prev_cpu[c].idle,
+        };
+        uint64_t total = top_busy(&d) + d.idle;
+        top_prev_cpu[c] = now;
+        top_row_init(row, &col);
+        top_put(row, &col, "CPU");
+        top_put_num(row, &col, c, 2);
+        top_put(row, &col, "  user");
+        top_put_pct(row, &col, d.user, total);
+        top_put(row, &col, "  sys");
+        top_put_pct(row, &col, d.sys, total);
+        top_put(row, &col, "  irq");
+        top_put_pct(row, &col, d.irq, total);
+        top_put(row, &col, "  idle");
+        top_put_pct(row, &col, d.idle, total);
+        if (c == 0) {
+            top_put(row, &col, "  (shell)");
+        }
+        top_draw(y++, row, CONSOLE_INFO_COLOR);
+    }
+
+    // Tasks by CPU used this interval; a task new since the last sample counts all it has used
+    for (uint32_t i = 0; i < n_now; i++) {
+        uint64_t before = 0;
+        for (uint32_t j = 0; j < n_prev; j++) {
+            if (top_prev[j].pid == top_now[i].pid) {
+                before = top_busy(&top_prev[j].time);
+                break;
+            }
+        }
+        top_delta[i] = top_busy(&top_now[i].time) - before;
+        uint32_t at = i;
+        while (at > 0 && top_delta[top_order[at - 1]] < top_delta[i]) {
+            top_order[at] = top_order[at - 1];
+            at--;
+        }
+        top_order[at] = i;
+    }
+
+    if (y < VGA_HEIGHT) {
+        top_row_init(row, &col);
+        top_draw(y++, row, CONSOLE_FG_COLOR);
+    }
+    if (y < VGA_HEIGHT) {
+        top_row_init(row, &col);
+        top_put(row, &col, "  PID CPU State    Class     %CPU   User ms    Sys ms    IRQ ms");
+        top_draw(y++, row, CONSOLE_FG_COLOR);
+    }
+    for (uint32_t i = 0; i < n_now && y < VGA_HEIGHT; i++) {
+        const TaskTimes* t = &top_now[top_order[i]];
+        top_row_init(row, &col);
+        top_put_num(row, &col, t->pid, 5);
+        top_put_num(row, &col, t->cpu, 4);
+        col++;
+        top_put(row, &col, top_state_name(t->state));
+        col = 20;
+        top_put(row, &col, top_class_name(t));
+        col = 28;
+        top_put_pct(row, &col, top_delta[top_order[i]], wall);
+        top_put_num(row, &col, timer_cycles_to_us(t->time.user) / 1000u, 10);
+        top_put_num(row, &col, timer_cycles_to_us(t->time.sys) / 1000u, 10);
+        top_put_num(row, &col, timer_cycles_to_us(t->time.irq) / 1000u, 10);
+        top_draw(y++, row, top_delta[top_order[i]] ? CONSOLE_SUCCESS_COLOR : CONSOLE_FG_COLOR);
+    }
+    while (y < VGA_HEIGHT) {
+        top_row_init(row, &col);
+        top_draw(y++, row, CONSOLE_FG_COLOR);
+    }
+}
+
+static void run_top(void) {
+    console_clear();
+    for (uint32_t y = 0; y < VGA_HEIGHT; y++) {
+        top_screen[y].color = 0xFF;  // nothing matches: the first refresh draws every row
+    }
+    uint32_t n_prev = scheduler_get_task_times(top_prev, TOP_MAX_TASKS);
+    for (uint32_t c = 0; c < SMP_MAX_CPUS; c++) {
+        if (!scheduler_get_cpu_time(c, &top_prev_cpu[c])) {
+            memset(&top_prev_cpu[c], 0, sizeof top_prev_cpu[c]);
+        }
+    }
+    uint64_t prev_tsc = rdtsc();
+
+    while (1) {
+        // One second, or until a key goes down (releases and E0 prefixes don't count)
+        uint64_t deadline = timer_get_ticks() + TIMER_FREQUENCY;
+        while (timer_get_ticks() < deadline) {
+            uint8_t keycode;
+            if (key_queue_pop(&keycode)) {
+                if (!(keycode & 0x80) && keycode != KEYBOARD_EXT_PREFIX) {
+                    console_clear();
+                    console_draw_header("Popcorn Kernel v0.5");
+                    return;
+                }
+                continue;
+            }
+            __asm__ volatile("cli" ::: "memory");
+            if (timer_get_ticks() < deadline) {
+                timer_idle_halt(deadline);
+            }
+            __asm__ volatile("sti" ::: "memory");
+        }
+
+        uint32_t n_now = scheduler_get_task_times(top_now, TOP_MAX_TASKS);
+        uint64_t now_tsc = rdtsc();
+        top_refresh(n_prev, n_now, now_tsc - prev_tsc);
+        for (uint32_t i = 0; i < n_now; i++) {
+            top_prev[i] = top_now[i];
+        }
+        n_prev = n_now;
+        prev_tsc = now_tsc;
+    }
 }
 
 extern const PopModule spinner_module;
@@ -493,10 +810,12 @@ void execute_command(const char *command) {
         console_println(" - Displays detailed system information");
         
         console_print_color("  mem [option]", CONSOLE_PROMPT_COLOR);
-        console_println(" - Memory commands: -map, -use, -stats, -info, -debug");
+        console_println(" - Memory commands: -map, -use, -stats, -info, -debug, -kstack test, -vmm test");
         
         console_print_color("  tasks", CONSOLE_PROMPT_COLOR);
         console_println(" - Show current task information");
+        console_print_color("  top", CONSOLE_PROMPT_COLOR);
+        console_println(" - Live CPU use per CPU and task, any key returns");
         
         console_print_color("  timer", CONSOLE_PROMPT_COLOR);
         console_println(" - Show timer information");
@@ -514,6 +833,22 @@ void execute_command(const char *command) {
         console_println(" - Kill specific task by PID");
         console_print_color("  mon -ultramon", CONSOLE_PROMPT_COLOR);
         console_println(" - Kill all tasks except idle");
+        console_print_color("  mon -locks", CONSOLE_PROMPT_COLOR);
+        console_println(" - Show lock contention by class");
+        console_print_color("  mon -dl [pid] [runtime ms] [period ms]", CONSOLE_PROMPT_COLOR);
+        console_println(" - Deadline class (runtime 0 leaves it)");
+        console_print_color("  mon -dl test", CONSOLE_PROMPT_COLOR);
+        console_println(" - Run the deadline class self-test");
+        console_print_color("  mon -wq [test]", CONSOLE_PROMPT_COLOR);
+        console_println(" - Show workqueue pools and queues, or run their self-test");
+        console_print_color("  mon -lat [pid|reset]", CONSOLE_PROMPT_COLOR);
+        console_println(" - Scheduler latency histograms, all CPUs or one task");
+        console_print_color("  mon -pin [pid] [cpumask]", CONSOLE_PROMPT_COLOR);
+        console_println(" - Restrict a task to CPUs (e.g. 0x6 = CPUs 1 and 2)");
+        console_print_color("  bench ctxsw", CONSOLE_PROMPT_COLOR);
+        console_println(" - Measure context switch cost in cycles");
+        console_print_color("  bench fiber", CONSOLE_PROMPT_COLOR);
+        console_println(" - Measure fiber switch cost in cycles");
         
         console_print_color("  cpu [option]", CONSOLE_PROMPT_COLOR);
         console_println(" - CPU commands: -hz, -info");
@@ -858,7 +1193,7 @@ void execute_command(const char *command) {
     } else if (strcmp(command, "sysinfo") == 0) {
         sysinfo_print_full();
     } else if (strncmp(command, "mem ", 4) == 0) {
-        // Memory commands: mem -map, mem -use, mem -stats, mem -info, mem -debug
+        // Memory commands: mem -map, mem -use, mem -stats, mem -info, mem -debug, mem -kstack test, mem -vmm test
         if (strcmp(command + 4, "-map") == 0) {
             memory_print_map();
         } else if (strcmp(command + 4, "-use") == 0) {
@@ -869,12 +1204,30 @@ void execute_command(const char *command) {
             kernel_memory_print_stats();
         } else if (strcmp(command + 4, "-debug") == 0) {
             memory_debug_print();
+        } else if (strcmp(command + 4, "-kstack test") == 0) {
+            console_newline();
+            console_println_color("=== TASK STACK SELF-TEST ===", CONSOLE_HEADER_COLOR);
+            if (kstack_selftest() == 0) {
+                console_print_success("All task stack checks passed");
+            } else {
+                console_print_error("Task stack self-test failed");
+            }
+        } else if (strcmp(command + 4, "-vmm test") == 0) {
+            console_newline();
+            console_println_color("=== PAGE TABLE SELF-TEST ===", CONSOLE_HEADER_COLOR);
+            if (vmm_selftest() == 0) {
+                console_print_success("All page table checks passed");
+            } else {
+                console_print_error("Page table self-test failed");
+            }
         } else {
-            console_print_error("Unknown mem option. Use: -map, -use, -stats, -info, or -debug");
+            console_print_error("Unknown mem option. Use: -map, -use, -stats, -info, -debug, -kstack test or -vmm test");
         }
     } else if (strcmp(command, "mem") == 0) {
         // Default: show usage
         memory_print_usage();
+    } else if (strcmp(command, "top") == 0) {
+        run_top();
     } else if (strcmp(command, "tasks") == 0) {
         char buffer[64];
         console_newline();
@@ -913,14 +1266,141 @@ void execute_command(const char *command) {
             int_to_str(current->priority, buffer);
             console_println_color(buffer, CONSOLE_FG_COLOR);
             
-            console_print_color("Total Runtime: ", CONSOLE_INFO_COLOR);
-            int_to_str((int)current->total_runtime, buffer);
+            console_print_color("CPU Time: ", CONSOLE_INFO_COLOR);
+            u64_to_str(timer_cycles_to_us(current->time.user + current->time.sys + current->time.irq) / 1000u,
+                       buffer);
+            console_print_color(buffer, CONSOLE_FG_COLOR);
+            console_println_color(" ms", CONSOLE_FG_COLOR);
+
+            console_print_color("Address Space: ", CONSOLE_INFO_COLOR);
+            console_println_color(current->lazy_mm ? "Kernel thread (lazy TLB)" : "Own root", CONSOLE_FG_COLOR);
+
+            console_print_color("CPU: ", CONSOLE_INFO_COLOR);
+            int_to_str((int)current->cpu, buffer);
             console_println_color(buffer, CONSOLE_FG_COLOR);
         } else {
             console_println_color("No current task", CONSOLE_ERROR_COLOR);
         }
-        
+
+        uint64_t cr3_loads = 0;
+        uint64_t cr3_skips = 0;
+        scheduler_get_cr3_stats(&cr3_loads, &cr3_skips);
+        console_print_color("CR3 loads / skips: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)cr3_loads, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)cr3_skips, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+
+        const KmemCache* tc = scheduler_task_cache();
+        console_print_color("Task structs live / slabs: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)tc->active, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)tc->slabs, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+
+        const FpuInfo* fi = fpu_get_info();
+        console_print_color("FPU areas / #NM traps / saves: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)fi->areas, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)fi->traps, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)fi->saves, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(fi->xsaveopt ? " (XSAVEOPT, " : fi->xsave ? " (XSAVE, " : " (FXSAVE, ", CONSOLE_FG_COLOR);
+        int_to_str((int)fi->area_size, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_println_color(" bytes)", CONSOLE_FG_COLOR);
+
+        SleepStats sleep_stats;
+        const SleepStats* ss = &sleep_stats;
+        uint32_t sleeping = scheduler_get_sleep_stats(&sleep_stats);
+        console_print_color("Sleeping / sleeps / early wakes: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)sleeping, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)ss->sleeps, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)ss->early_wakes, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+
+        console_print_color("Wake lateness avg / max (us): ", CONSOLE_INFO_COLOR);
+        int_to_str(ss->timeouts ? (int)(ss->late_total_us / ss->timeouts) : 0, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)ss->late_max_us, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+
+        console_print_color("CPUs online: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)smp_cpus_online(), buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+        scheduler_print_cpus();
+
+        BalanceStats bal;
+        scheduler_get_balance_stats(&bal);
+        console_print_color("Migrations / steals ok / tried: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)bal.migrations, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)bal.steal_success, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)bal.steal_attempts, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color("Balance runs / cache-hot skips: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)bal.balance_runs, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)bal.hot_skips, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+
         console_draw_separator(console_state.cursor_y, CONSOLE_FG_COLOR);
+    } else if (strcmp(command, "bench ctxsw") == 0) {
+        char buffer[64];
+        CtxswBench bench;
+        console_newline();
+        if (scheduler_bench_ctxsw(10000, &bench) != 0) {
+            console_print_error("bench: no stack for the peer");
+            return;
+        }
+        console_print_color("Switches: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)bench.switches, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color("Cycles per switch avg / min: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)bench.avg_cycles, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)bench.min_cycles, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+    } else if (strcmp(command, "bench fiber") == 0) {
+        char buffer[64];
+        CtxswBench bench;
+        console_newline();
+        if (fiber_bench(10000, &bench) != 0) {
+            console_print_error("bench: no memory for the fibers");
+            return;
+        }
+        console_print_color("Switches: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)bench.switches, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color("Cycles per switch avg / min: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)bench.avg_cycles, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)bench.min_cycles, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+
+        const FiberStats* fst = fiber_get_stats();
+        console_print_color("Fibers live / created: ", CONSOLE_INFO_COLOR);
+        u64_to_str(fst->live, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        u64_to_str(fst->created, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
     } else if (strcmp(command, "timer") == 0) {
         char buffer[64];
         console_newline();
@@ -938,6 +1418,13 @@ void execute_command(const char *command) {
         console_print_color("Timer Frequency: ", CONSOLE_INFO_COLOR);
         int_to_str(TIMER_FREQUENCY, buffer);
         console_println_color(buffer, CONSOLE_FG_COLOR);
+
+        console_print_color("Tickless idle periods / ticks skipped: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)global_timer.idle_entries, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(" / ", CONSOLE_FG_COLOR);
+        int_to_str((int)global_timer.ticks_skipped, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
         
         console_draw_separator(console_state.cursor_y, CONSOLE_FG_COLOR);
     } else if (strcmp(command, "syscalls") == 0) {
@@ -1026,8 +1513,122 @@ void execute_command(const char *command) {
             console_newline();
             console_println_color("Remaining tasks:", CONSOLE_INFO_COLOR);
             scheduler_print_tasks();
+        } else if (strcmp(args, "-locks") == 0) {
+            console_newline();
+            console_println_color("=== LOCK CONTENTION ===", CONSOLE_HEADER_COLOR);
+            lock_class_print_stats();
+        } else if (strcmp(args, "-dl test") == 0) {
+            console_newline();
+            console_println_color("=== DEADLINE SELF-TEST ===", CONSOLE_HEADER_COLOR);
+            if (scheduler_dl_selftest() == 0) {
+                console_print_success("All deadline checks passed");
+            } else {
+                console_print_error("Deadline self-test failed");
+            }
+        } else if (strncmp(args, "-dl ", 4) == 0) {
+            // Deadline class: mon -dl <pid> <runtime_ms> [period_ms]
+            const char* p = args + 4;
+            uint32_t vals[3] = {0, 0, 0};
+            int n = 0;
+            while (*p && n < 3) {
+                if (!parse_number(p, &vals[n])) {
+                    n = -1;
+                    break;
+                }
+                n++;
+                while (*p && *p != ' ') p++;
+                while (*p == ' ') p++;
+            }
+            if (n < 2 || *p || vals[0] == 0 || (vals[1] != 0 && n < 3)) {
+                console_print_error("Usage: mon -dl [pid] [runtime ms] [period ms], or runtime 0");
+                return;
+            }
+
+            int r = scheduler_set_deadline(vals[0], (uint64_t)vals[1] * 1000u, 0, (uint64_t)vals[2] * 1000u);
+            if (r == -1) {
+                console_print_error("No such task");
+            } else if (r == -2) {
+                console_print_error("Need 1 ms <= runtime <= period <= 10 s");
+            } else if (r == -3) {
+                console_print_error("Admission failed: no CPU has the bandwidth left");
+            } else if (vals[1] == 0) {
+                console_print_success("Task left the deadline class");
+            } else {
+                console_print_success("Task admitted to the deadline class");
+            }
+        } else if (strcmp(args, "-wq") == 0) {
+            console_newline();
+            console_println_color("=== WORKQUEUES ===", CONSOLE_HEADER_COLOR);
+            workqueue_print_stats();
+        } else if (strcmp(args, "-wq test") == 0) {
+            console_newline();
+            console_println_color("=== WORKQUEUE SELF-TEST ===", CONSOLE_HEADER_COLOR);
+            if (workqueue_selftest() == 0) {
+                console_print_success("All workqueue checks passed");
+            } else {
+                console_print_error("Workqueue self-test failed");
+            }
+        } else if (strcmp(args, "-lat") == 0 || strcmp(args, "-lat reset") == 0) {
+            if (args[4] == ' ') {
+                scheduler_reset_latency();
+                console_print_success("Latency histograms cleared");
+                return;
+            }
+            console_newline();
+            console_println_color("=== SCHEDULER LATENCY (all CPUs) ===", CONSOLE_HEADER_COLOR);
+            scheduler_print_latency(0);
+        } else if (strncmp(args, "-lat ", 5) == 0) {
+            uint32_t pid;
+            if (!parse_number(args + 5, &pid) || pid == 0) {
+                console_print_error("Invalid PID. Must be a positive number.");
+                return;
+            }
+            console_newline();
+            console_println_color("=== SCHEDULER LATENCY ===", CONSOLE_HEADER_COLOR);
+            if (scheduler_print_latency(pid) != 0) {
+                console_print_error("No such task");
+            }
+        } else if (strncmp(args, "-pin ", 5) == 0) {
+            // Set a task's CPU affinity: mon -pin <pid> <cpumask>
+            const char* pid_str = args + 5;
+            const char* mask_str = pid_str;
+            while (*mask_str && *mask_str != ' ') mask_str++;
+            while (*mask_str == ' ') mask_str++;
+            uint32_t pid;
+            uint32_t mask;
+            if (!parse_number(pid_str, &pid) || pid == 0) {
+                console_print_error("Invalid PID. Must be a positive number.");
+                return;
+            }
+            if (!parse_cpumask(mask_str, &mask)) {
+                console_print_error("Invalid CPU mask. Use hex (0x3) or decimal.");
+                return;
+            }
+
+            int r = scheduler_set_affinity(pid, mask);
+            if (r == -1) {
+                console_print_error("No such task");
+            } else if (r == -2) {
+                console_print_error("Mask holds no CPU that runs tasks");
+            } else if (r == -3) {
+                console_print_error("Deadline tasks stay on their reserved CPU");
+            } else {
+                char buffer[16];
+                console_print_color("Task ", CONSOLE_INFO_COLOR);
+                int_to_str((int)pid, buffer);
+                console_print_color(buffer, CONSOLE_SUCCESS_COLOR);
+                console_print_color(" may run on CPUs", CONSOLE_INFO_COLOR);
+                for (uint32_t c = 0; c < SMP_MAX_CPUS; c++) {
+                    if (mask & (1u << c)) {
+                        int_to_str((int)c, buffer);
+                        console_print_color(" ", CONSOLE_INFO_COLOR);
+                        console_print_color(buffer, CONSOLE_SUCCESS_COLOR);
+                    }
+                }
+                console_newline();
+            }
         } else {
-            console_print_error("Unknown mon option. Use: -debug, -debug [pid], -list, -kill [pid], or -ultramon");
+            console_print_error("Unknown mon option. Use: -debug, -debug [pid], -list, -kill [pid], -pin [pid] [mask], -dl [pid] [runtime] [period], -dl test, -ultramon, -locks, -wq [test] or -lat [pid|reset]");
         }
     } else if (strncmp(command, "cpu ", 4) == 0) {
         // CPU commands: cpu -hz, cpu -info
@@ -1102,7 +1703,7 @@ void kmain(void) {
     while (1) {
         unsigned char keycode;
         if (!key_queue_pop(&keycode)) {
-            __asm__ volatile("sti; hlt" ::: "memory");
+            key_queue_wait();
             continue;
         }
 
@@ -0,0 +1,240 @@
+// src/core/kstack.c — guard-paged task stacks, grown on demand from a reserve, and recycled mapped
+#include "../includes/kstack.h"
+#include "../includes/vmm.h"
+#include "../includes/memory.h"
+#include "../includes/console.h"
+#include "../includes/utils.h"
+#include "../includes/spinlock.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define KSTACK_PAGES (KSTACK_SIZE / PAGE_SIZE)
+#define KSTACK_NONE  0xFFFFu
+#define KSTACK_PTE   (VMM_PTE_P | VMM_PTE_RW | VMM_PTE_NX)
+
+/* Freed slots, linked by index; slots past kstack_fresh were never used. */
+static uint16_t kstack_next[KSTACK_MAX_SLOTS];
+static bool kstack_busy[KSTACK_MAX_SLOTS];
+static uint16_t kstack_free_head;
+static uint32_t kstack_fresh;
+static KStackStats kstack_stats;
+/* Slot lists and bookkeeping. Pages are mapped outside it. */
+static Spinlock kstack_lock = SPINLOCK_INIT;
+
+/*
+ * Zeroed frames for stack growth. kstack_fault runs on whatever code was
+ * using the stack, which may hold pmm_lock, vmm_kernel_lock or kstack_lock,
+ * so it only takes from here: each entry is a frame or 0, claimed with one
+ * atomic exchange. kstack_alloc tops it up from the PMM.
+ */
+static uint64_t kstack_reserve[KSTACK_RESERVE_FRAMES];
+
+static inline uint64_t kstack_slot_base(uint32_t slot) {
+    return KSTACK_REGION_BASE + (uint64_t)slot * KSTACK_SLOT_SIZE;
+}
+
+/* First stack byte (just above the guard page). */
+static inline uint64_t kstack_slot_stack(uint32_t slot) {
+    return kstack_slot_base(slot) + KSTACK_GUARD_SIZE;
+}
+
+static uint64_t kstack_reserve_take(void) {
+    for (uint32_t i = 0; i < KSTACK_RESERVE_FRAMES; i++) {
+        if (__atomic_load_n(&kstack_reserve[i], __ATOMIC_RELAXED) != 0) {
+            uint64_t frame = __atomic_exchange_n(&kstack_reserve[i], 0, __ATOMIC_ACQ_REL);
+            if (frame != 0) {
+                return frame;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Fill the empty reserve entries (task context: allocates). */
+static void kstack_reserve_fill(void) {
+    for (uint32_t i = 0; i < KSTACK_RESERVE_FRAMES; i++) {
+        if (__atomic_load_n(&kstack_reserve[i], __ATOMIC_RELAXED) != 0) {
+            continue;
+        }
+        uint64_t frame = pmm_alloc_frame(MEM_ALLOC_ZERO);
+        if (frame == 0) {
+            return;
+        }
+        uint64_t empty = 0;
+        if (!__atomic_compare_exchange_n(&kstack_reserve[i], &empty, frame, false, __ATOMIC_RELEASE,
+                                         __ATOMIC_RELAXED)) {
+            pmm_frame_put(frame);  // refilled by a concurrent kstack_alloc
+        }
+    }
+}
+
+/*
+ * Make a slot usable: every leaf table it needs exists, so kstack_fault
+ * only stores a PTE, and the top page is backed for the first frames.
+ */
+static int kstack_prepare(uint64_t stack) {
+    uint64_t kroot = vmm_kernel_pml4();
+    uint64_t top = stack + KSTACK_SIZE - PAGE_SIZE;
+    if ((vmm_query(kroot, top) & VMM_PTE_P) != 0) {
+        return 0;  // recycled: tables and resident pages are still there
+    }
+    for (uint32_t i = 0; i < KSTACK_PAGES; i++) {
+        if (vmm_prepare_kernel_4k(stack + (uint64_t)i * PAGE_SIZE) != 0) {
+            return -1;
+        }
+    }
+    uint64_t frame = pmm_alloc_frame(MEM_ALLOC_ZERO);
+    if (frame == 0) {
+        return -1;
+    }
+    if (vmm_map_kernel_4k(top, frame, KSTACK_PTE) != 0) {
+        pmm_frame_put(frame);
+        return -1;
+    }
+    __atomic_add_fetch(&kstack_stats.resident_pages, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void kstack_init(void) {
+    memset(kstack_busy, 0, sizeof kstack_busy);
+    memset(&kstack_stats, 0, sizeof kstack_stats);
+    kstack_free_head = KSTACK_NONE;
+    kstack_fresh = 0;
+}
+
+bool kstack_contains(uint64_t addr) {
+    return addr >= KSTACK_REGION_BASE && addr < KSTACK_REGION_END;
+}
+
+void* kstack_alloc(uint64_t size) {
+    if (size > KSTACK_SIZE) {
+        return NULL;
+    }
+    kstack_reserve_fill();
+
+    uint32_t slot;
+    uint64_t irq = spin_lock_irqsave(&kstack_lock);
+    if (kstack_free_head != KSTACK_NONE) {
+        slot = kstack_free_head;
+        kstack_free_head = kstack_next[slot];
+    } else if (kstack_fresh < KSTACK_MAX_SLOTS) {
+        slot = kstack_fresh++;
+        kstack_stats.slots_touched++;
+    } else {
+        spin_unlock_irqrestore(&kstack_lock, irq);
+        return NULL;
+    }
+    spin_unlock_irqrestore(&kstack_lock, irq);
+
+    uint64_t stack = kstack_slot_stack(slot);
+    if (kstack_prepare(stack) != 0) {
+        irq = spin_lock_irqsave(&kstack_lock);
+        kstack_next[slot] = kstack_free_head;
+        kstack_free_head = (uint16_t)slot;
+        spin_unlock_irqrestore(&kstack_lock, irq);
+        return NULL;
+    }
+
+    irq = spin_lock_irqsave(&kstack_lock);
+    kstack_busy[slot] = true;
+    kstack_stats.live++;
+    if (kstack_stats.live > kstack_stats.peak) {
+        kstack_stats.peak = kstack_stats.live;
+    }
+    spin_unlock_irqrestore(&kstack_lock, irq);
+    return (void*)(uintptr_t)stack;
+}
+
+void kstack_free(void* base) {
+    uint64_t va = (uint64_t)(uintptr_t)base;
+    if (!kstack_contains(va)) {
+        return;
+    }
+    uint32_t slot = (uint32_t)((va - KSTACK_REGION_BASE) / KSTACK_SLOT_SIZE);
+    uint64_t irq = spin_lock_irqsave(&kstack_lock);
+    if (va != kstack_slot_stack(slot) || !kstack_busy[slot]) {
+        spin_unlock_irqrestore(&kstack_lock, irq);
+        return;
+    }
+    kstack_busy[slot] = false;
+    kstack_stats.live--;
+    // Pages stay mapped: the next task on this slot starts with them
+    kstack_next[slot] = kstack_free_head;
+    kstack_free_head = (uint16_t)slot;
+    spin_unlock_irqrestore(&kstack_lock, irq);
+}
+
+int kstack_fault(uint64_t error_code, uint64_t fault_addr) {
+    if (!kstack_contains(fault_addr)) {
+        return -1;
+    }
+    uint32_t slot = (uint32_t)((fault_addr - KSTACK_REGION_BASE) / KSTACK_SLOT_SIZE);
+    uint64_t off = (fault_addr - KSTACK_REGION_BASE) % KSTACK_SLOT_SIZE;
+    if (off < KSTACK_GUARD_SIZE) {
+        /* This slot's own stack grew down past its last page. */
+        kstack_stats.overflows++;
+        kstack_stats.last_overflow = fault_addr;
+        console_println_color("Kernel stack overflow (guard page hit)", CONSOLE_ERROR_COLOR);
+        return -1;
+    }
+    if ((error_code & 1u) != 0 || !__atomic_load_n(&kstack_busy[slot], __ATOMIC_ACQUIRE)) {
+        return -1;  /* protection fault, or a stale pointer into a free slot */
+    }
+
+    /* Grow into the page below: a not-present PTE is never cached, so no flush. */
+    uint64_t frame = kstack_reserve_take();
+    if (frame == 0) {
+        kstack_stats.reserve_empty++;
+        return -1;
+    }
+    uint64_t page = fault_addr & ~(uint64_t)(PAGE_SIZE - 1);
+    if (vmm_set_pte(vmm_kernel_pml4(), page, frame | KSTACK_PTE) != 0) {
+        pmm_frame_put(frame);  /* not reached: kstack_prepare built the table */
+        return -1;
+    }
+    __atomic_add_fetch(&kstack_stats.resident_pages, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&kstack_stats.grown_pages, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+const KStackStats* kstack_get_stats(void) {
+    return &kstack_stats;
+}
+
+static uint32_t kstack_test_report(const char* what, bool ok) {
+    console_print_color(ok ? "  ok    " : "  FAIL  ", ok ? CONSOLE_SUCCESS_COLOR : CONSOLE_ERROR_COLOR);
+    console_println_color(what, CONSOLE_FG_COLOR);
+    return ok ? 0u : 1u;
+}
+
+uint32_t kstack_selftest(void) {
+    uint32_t failed = 0;
+    uint64_t kroot = vmm_kernel_pml4();
+    volatile uint8_t* s = kstack_alloc(KSTACK_SIZE);
+    if (!s) {
+        return kstack_test_report("allocate a stack", false);
+    }
+
+    // The lowest page is backed on first touch, from the reserve
+    uint64_t bottom = (uint64_t)(uintptr_t)s;
+    uint64_t grown = kstack_stats.grown_pages;
+    bool was_mapped = (vmm_query(kroot, bottom) & VMM_PTE_P) != 0;
+    s[0] = 0x5A;
+    failed += kstack_test_report("touching the lowest page backs it",
+                                 (vmm_query(kroot, bottom) & VMM_PTE_P) != 0 && s[0] == 0x5A &&
+                                 kstack_stats.grown_pages == grown + (was_mapped ? 0u : 1u));
+
+    // A freed slot is reused first, still mapped: no fault, no new frame
+    kstack_free((void*)(uintptr_t)s);
+    volatile uint8_t* again = kstack_alloc(KSTACK_SIZE);
+    grown = kstack_stats.grown_pages;
+    if (again) {
+        again[0] = 0xA5;
+    }
+    failed += kstack_test_report("a recycled stack keeps its pages",
+                                 again == s && kstack_stats.grown_pages == grown);
+    if (again) {
+        kstack_free((void*)(uintptr_t)again);
+    }
+    return failed;
+}
@@ -1,9 +1,14 @@
 // src/core/memory.c — bitmap physical allocator, identity-mapped 4K pages
 #include "../includes/memory.h"
 #include "../includes/vmm.h"
+#include "../includes/vma.h"
+#include "../includes/kstack.h"
+#include "../includes/blockdev.h"
+#include "../includes/swap.h"
 #include "../includes/console.h"
 #include "../includes/multiboot2.h"
 #include "../includes/utils.h"
+#include "../includes/spinlock.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -24,6 +29,28 @@ extern void console_draw_separator(unsigned int y, unsigned char color);
 /* Bit 1 = used, 0 = free */
 static uint8_t pmm_bitmap[PMM_BITMAP_BYTES] __attribute__((aligned(4096)));
 static bool pmm_ready = false;
+/* Kept in step with the bitmap so stats and allocs do not rescan 2^18 bits. */
+static uint32_t pmm_free_count = 0;
+/* Next-fit start for pmm_alloc_frame (byte index into pmm_bitmap). */
+static uint32_t pmm_frame_hint = 0;
+/* Bitmap, refcounts, huge heads and the kmalloc block table; IRQ-safe, never held across reclaim. */
+static Spinlock pmm_lock = SPINLOCK_INIT;
+
+/*
+ * Per-frame reference counts for frames handed out by pmm_alloc_frame (page
+ * tables, mapped user pages). kmalloc/alloc_pages blocks stay at 0: they are
+ * owned by their block record, and teardown paths skip refcount-0 frames.
+ */
+static uint16_t pmm_refcnt[PMM_MAX_4K_FRAMES];
+
+/*
+ * 2 MiB frames (512 aligned 4 KiB frames) for transparent huge pages. The
+ * head frame carries the reference count; tails stay at 0 so get/put on them
+ * is a no-op. pmm_huge_head marks which 2 MiB groups are live huge frames.
+ */
+#define PMM_HUGE_FRAMES 512U
+#define PMM_HUGE_GROUPS (PMM_MAX_4K_FRAMES / PMM_HUGE_FRAMES)
+static bool pmm_huge_head[PMM_HUGE_GROUPS];
 
 typedef struct {
     void* base;
@@ -48,14 +75,22 @@ static void pmm_set_used(uint32_t f) {
     if (f >= PMM_MAX_4K_FRAMES) {
         return;
     }
-    pmm_bitmap[f >> 3U] |= (uint8_t)(1U << (f & 7U));
+    uint8_t bit = (uint8_t)(1U << (f & 7U));
+    if ((pmm_bitmap[f >> 3U] & bit) == 0) {
+        pmm_bitmap[f >> 3U] |= bit;
+        pmm_free_count--;
+    }
 }
 
 static void pmm_set_free(uint32_t f) {
     if (f >= PMM_MAX_4K_FRAMES) {
         return;
     }
-    pmm_bitmap[f >> 3U] &= (uint8_t)~(1U << (f & 7U));
+    uint8_t bit = (uint8_t)(1U << (f & 7U));
+    if ((pmm_bitmap[f >> 3U] & bit) != 0) {
+        pmm_bitmap[f >> 3U] &= (uint8_t)~bit;
+        pmm_free_count++;
+    }
 }
 
 static int pmm_frame_free(uint32_t f) {
@@ -66,13 +101,7 @@ static int pmm_frame_free(uint32_t f) {
 }
 
 static uint32_t pmm_count_free(void) {
-    uint32_t n = 0;
-    for (uint32_t f = 0; f < PMM_MAX_4K_FRAMES; f++) {
-        if (pmm_frame_free(f)) {
-            n++;
-        }
-    }
-    return n;
+    return pmm_free_count;
 }
 
 static void pmm_mark_range_used(uint64_t pstart, uint64_t pend) {
@@ -138,8 +167,175 @@ static void pmm_free_range_frames(uint32_t start_f, uint32_t n) {
     }
 }
 
+/* Called when free frames run low; only wakes the reclaimer (vma_reclaim_wake). */
+static void (*pmm_reclaim_hook)(void);
+
+void pmm_set_reclaim_hook(void (*hook)(void)) {
+    pmm_reclaim_hook = hook;
+}
+
+uint32_t pmm_frames_free(void) {
+    return pmm_free_count;
+}
+
+static uint64_t pmm_take_frame(uint32_t flags) {
+    if (pmm_free_count == 0) {
+        return 0;
+    }
+    for (uint32_t n = 0; n < PMM_BITMAP_BYTES; n++) {
+        uint32_t i = (pmm_frame_hint + n) % PMM_BITMAP_BYTES;
+        if (pmm_bitmap[i] == 0xFFu) {
+            continue;
+        }
+        for (uint32_t b = 0; b < 8U; b++) {
+            uint32_t f = (i << 3U) | b;
+            if (pmm_frame_free(f)) {
+                pmm_set_used(f);
+                pmm_refcnt[f] = 1;
+                pmm_frame_hint = i;
+                uint64_t phys = (uint64_t)f * PAGE_SIZE;
+                if (flags & MEM_ALLOC_ZERO) {
+                    memory_zero((void*)(uintptr_t)phys, PAGE_SIZE);
+                }
+                return phys;
+            }
+        }
+    }
+    return 0;
+}
+
+uint64_t pmm_alloc_frame(uint32_t flags) {
+    if (!pmm_ready) {
+        return 0;
+    }
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
+    uint64_t phys = pmm_take_frame(flags);
+    bool low = pmm_free_count < PMM_RECLAIM_LOW;
+    spin_unlock_irqrestore(&pmm_lock, irq);
+    if (low && pmm_reclaim_hook) {
+        /* Never evict here: the caller may hold spinlocks with interrupts off. */
+        pmm_reclaim_hook();
+    }
+    return phys;
+}
+
+uint64_t pmm_alloc_huge(uint32_t flags) {
+    if (!pmm_ready || pmm_free_count < PMM_HUGE_FRAMES) {
+        return 0;
+    }
+    /* One group is 512 bits = 8 bitmap words; free means all zero. */
+    const uint64_t* words = (const uint64_t*)(const void*)pmm_bitmap;
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
+    for (uint32_t g = 0; g < PMM_HUGE_GROUPS; g++) {
+        const uint64_t* w = &words[g * 8U];
+        if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0) {
+            continue;
+        }
+        uint32_t f0 = g * PMM_HUGE_FRAMES;
+        for (uint32_t i = 0; i < PMM_HUGE_FRAMES; i++) {
+            pmm_set_used(f0 + i);
+            pmm_refcnt[f0 + i] = 0;
+        }
+        pmm_refcnt[f0] = 1;
+        pmm_huge_head[g] = true;
+        spin_unlock_irqrestore(&pmm_lock, irq);
+        uint64_t phys = (uint64_t)f0 * PAGE_SIZE;
+        if (flags & MEM_ALLOC_ZERO) {
+            memory_zero((void*)(uintptr_t)phys, (size_t)PMM_HUGE_FRAMES * PAGE_SIZE);
+        }
+        return phys;
+    }
+    spin_unlock_irqrestore(&pmm_lock, irq);
+    return 0;
+}
+
+bool pmm_is_huge(uint64_t phys) {
+    uint32_t f = (uint32_t)(phys / PAGE_SIZE);
+    return f < PMM_MAX_4K_FRAMES && (f % PMM_HUGE_FRAMES) == 0 && pmm_huge_head[f / PMM_HUGE_FRAMES];
+}
+
+bool pmm_huge_put(uint64_t phys) {
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
+    uint32_t f0 = (uint32_t)(phys / PAGE_SIZE);
+    if (!pmm_is_huge(phys) || --pmm_refcnt[f0] != 0) {
+        spin_unlock_irqrestore(&pmm_lock, irq);
+        return false;
+    }
+    pmm_huge_head[f0 / PMM_HUGE_FRAMES] = false;
+    for (uint32_t i = 0; i < PMM_HUGE_FRAMES; i++) {
+        pmm_set_free(f0 + i);
+    }
+    spin_unlock_irqrestore(&pmm_lock, irq);
+    return true;
+}
+
+bool pmm_huge_demote(uint64_t phys) {
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
+    uint32_t f0 = (uint32_t)(phys / PAGE_SIZE);
+    if (!pmm_is_huge(phys) || pmm_refcnt[f0] != 1) {
+        spin_unlock_irqrestore(&pmm_lock, irq);
+        return false;
+    }
+    pmm_huge_head[f0 / PMM_HUGE_FRAMES] = false;
+    for (uint32_t i = 0; i < PMM_HUGE_FRAMES; i++) {
+        pmm_refcnt[f0 + i] = 1;
+    }
+    spin_unlock_irqrestore(&pmm_lock, irq);
+    return true;
+}
+
+void pmm_frame_get(uint64_t phys) {
+    uint32_t f = (uint32_t)(phys / PAGE_SIZE);
+    if (f >= PMM_MAX_4K_FRAMES) {
+        return;
+    }
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
+    if (pmm_refcnt[f] != 0 && pmm_refcnt[f] < PMM_REF_PINNED - 1U) {
+        pmm_refcnt[f]++;
+    }
+    spin_unlock_irqrestore(&pmm_lock, irq);
+}
+
+void pmm_frame_pin(uint64_t phys) {
+    uint32_t f = (uint32_t)(phys / PAGE_SIZE);
+    if (f >= PMM_MAX_4K_FRAMES) {
+        return;
+    }
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
+    if (pmm_refcnt[f] != 0) {
+        pmm_refcnt[f] = PMM_REF_PINNED;
+    }
+    spin_unlock_irqrestore(&pmm_lock, irq);
+}
+
+bool pmm_frame_put(uint64_t phys) {
+    uint32_t f = (uint32_t)(phys / PAGE_SIZE);
+    if (f >= PMM_MAX_4K_FRAMES) {
+        return false;
+    }
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
+    bool freed = pmm_refcnt[f] != 0 && pmm_refcnt[f] != PMM_REF_PINNED && --pmm_refcnt[f] == 0;
+    if (freed) {
+        pmm_set_free(f);
+    }
+    spin_unlock_irqrestore(&pmm_lock, irq);
+    return freed;
+}
+
+uint32_t pmm_frame_refcount(uint64_t phys) {
+    uint32_t f = (uint32_t)(phys / PAGE_SIZE);
+    if (f >= PMM_MAX_4K_FRAMES) {
+        return 0;
+    }
+    return pmm_refcnt[f];
+}
+
 void physmem_init(void) {
     memset(pmm_bitmap, 0xFF, sizeof(pmm_bitmap));
+    memset(pmm_refcnt, 0, sizeof(pmm_refcnt));
+    memset(pmm_huge_head, 0, sizeof(pmm_huge_head));
+    pmm_free_count = 0;
+    pmm_frame_hint = 0;
 
     struct mmap_free_ctx ctx = {0};
     multiboot2_foreach_mmap(mmap_unreserve_cb, &ctx);
@@ -208,6 +404,11 @@ void memory_init(void) {
     normal_pool = (memory_pool){0};
     physmem_init();
     vmm_init();
+    vma_init();
+    kstack_init();
+    ata_init();
+    swap_init();
+    pmm_set_reclaim_hook(vma_reclaim_wake);
     console_println_color("Physical memory: bitmap pmm, 1 GiB identity-mapped", CONSOLE_SUCCESS_COLOR);
     console_println_color("Virtual: 4K map (PML4 walk), invlpg + load_cr3; asm identity map unchanged", CONSOLE_INFO_COLOR);
 }
@@ -246,8 +447,10 @@ void kfree(void* ptr) {
     if (!ptr || !pmm_ready) {
         return;
     }
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
     mem_block* b = find_block(ptr);
     if (!b || b->is_free) {
+        spin_unlock_irqrestore(&pmm_lock, irq);
         return;
     }
     size_t npg = (b->size + PAGE_SIZE - 1) / PAGE_SIZE;
@@ -262,6 +465,7 @@ void kfree(void* ptr) {
     }
     mem_stats.free_pages = pmm_count_free();
     mem_stats.used_pages = PMM_MAX_4K_FRAMES - mem_stats.free_pages;
+    spin_unlock_irqrestore(&pmm_lock, irq);
 }
 
 bool is_valid_allocation(void* ptr) {
@@ -357,12 +561,15 @@ void* zone_alloc(MemoryZone zone, size_t size, uint32_t flags) {
     if (npg == 0) {
         return NULL;
     }
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
     int32_t st = pmm_alloc_contig(npg);
     if (st < 0) {
+        spin_unlock_irqrestore(&pmm_lock, irq);
         return NULL;
     }
     if (memory_block_index >= MAX_MEMORY_BLOCKS) {
         pmm_free_range_frames((uint32_t)st, npg);
+        spin_unlock_irqrestore(&pmm_lock, irq);
         return NULL;
     }
     void* base = (void*)(uintptr_t)((uint32_t)st * PAGE_SIZE);
@@ -374,6 +581,7 @@ void* zone_alloc(MemoryZone zone, size_t size, uint32_t flags) {
     mem_stats.free_bytes = mem_stats.total_bytes - mem_stats.used_bytes;
     mem_stats.free_pages = pmm_count_free();
     mem_stats.used_pages = PMM_MAX_4K_FRAMES - mem_stats.free_pages;
+    spin_unlock_irqrestore(&pmm_lock, irq);
     return base;
 }
 
@@ -418,6 +626,116 @@ void memory_debug_print(void) {
     int_to_str((int)pmm_count_free(), b);
     console_print_color("Free 4K frames: ", CONSOLE_INFO_COLOR);
     console_println_color(b, CONSOLE_FG_COLOR);
+
+    VmmStats* vs = vmm_get_stats();
+    console_print_color("Page tables alloc/freed: ", CONSOLE_INFO_COLOR);
+    int_to_str((int)vs->tables_allocated, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color("/", CONSOLE_FG_COLOR);
+    int_to_str((int)vs->tables_freed, b);
+    console_println_color(b, CONSOLE_FG_COLOR);
+    console_print_color("PT cache hits/misses: ", CONSOLE_INFO_COLOR);
+    int_to_str((int)vs->pt_cache_hits, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color("/", CONSOLE_FG_COLOR);
+    int_to_str((int)vs->pt_cache_misses, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color(" (cached ", CONSOLE_FG_COLOR);
+    int_to_str((int)vs->pt_cache_len, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_println_color(")", CONSOLE_FG_COLOR);
+
+    VmSpace* sp = vma_current_space();
+    if (sp) {
+        console_print_color("mmap faults/zero-page/COW/file: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)sp->faults, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color("/", CONSOLE_FG_COLOR);
+        int_to_str((int)sp->zero_page_maps, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color("/", CONSOLE_FG_COLOR);
+        int_to_str((int)sp->cow_copies, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color("/", CONSOLE_FG_COLOR);
+        int_to_str((int)sp->file_maps, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color(" (resident ", CONSOLE_FG_COLOR);
+        int_to_str((int)sp->resident_pages, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color(", swapped ", CONSOLE_FG_COLOR);
+        int_to_str((int)sp->swapped_pages, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_println_color(")", CONSOLE_FG_COLOR);
+
+        console_print_color("THP maps/fallbacks/splits/collapses: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)sp->thp_maps, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color("/", CONSOLE_FG_COLOR);
+        int_to_str((int)sp->thp_fallbacks, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color("/", CONSOLE_FG_COLOR);
+        int_to_str((int)sp->thp_splits, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color("/", CONSOLE_FG_COLOR);
+        int_to_str((int)sp->thp_collapses, b);
+        console_println_color(b, CONSOLE_FG_COLOR);
+    }
+
+    const KStackStats* ks = kstack_get_stats();
+    console_print_color("Task stacks live/peak: ", CONSOLE_INFO_COLOR);
+    int_to_str((int)ks->live, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color("/", CONSOLE_FG_COLOR);
+    int_to_str((int)ks->peak, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color(" (resident pages ", CONSOLE_FG_COLOR);
+    int_to_str((int)ks->resident_pages, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color(", grown ", CONSOLE_FG_COLOR);
+    int_to_str((int)ks->grown_pages, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color(", reserve empty ", CONSOLE_FG_COLOR);
+    int_to_str((int)ks->reserve_empty, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color(", overflows ", CONSOLE_FG_COLOR);
+    int_to_str((int)ks->overflows, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_println_color(")", CONSOLE_FG_COLOR);
+
+    const SwapStats* ss = swap_get_stats();
+    const VmaReclaimStats* rs = vma_reclaim_get_stats();
+    if (!swap_enabled()) {
+        console_println_color("Swap: off (no signed swap disk)", CONSOLE_INFO_COLOR);
+    } else {
+        console_print_color("Swap slots used/total: ", CONSOLE_INFO_COLOR);
+        int_to_str((int)ss->used_slots, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color("/", CONSOLE_FG_COLOR);
+        int_to_str((int)ss->total_slots, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color(" (out ", CONSOLE_FG_COLOR);
+        int_to_str((int)ss->pages_out, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color(", in ", CONSOLE_FG_COLOR);
+        int_to_str((int)ss->pages_in, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_print_color(", errors ", CONSOLE_FG_COLOR);
+        int_to_str((int)ss->io_errors, b);
+        console_print_color(b, CONSOLE_FG_COLOR);
+        console_println_color(")", CONSOLE_FG_COLOR);
+    }
+    console_print_color("Clock runs/scanned/referenced/evicted: ", CONSOLE_INFO_COLOR);
+    int_to_str((int)rs->runs, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color("/", CONSOLE_FG_COLOR);
+    int_to_str((int)rs->scanned, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color("/", CONSOLE_FG_COLOR);
+    int_to_str((int)rs->referenced, b);
+    console_print_color(b, CONSOLE_FG_COLOR);
+    console_print_color("/", CONSOLE_FG_COLOR);
+    int_to_str((int)rs->evicted, b);
+    console_println_color(b, CONSOLE_FG_COLOR);
 }
 
 bool memory_check_integrity(void) {
@@ -28,6 +28,7 @@ void multiboot2_parse(void) {
     sys_info.mem_upper = 0;
     sys_info.total_memory = 0;
     sys_info.available_memory_regions = 0;
+    sys_info.acpi_rsdp_len = 0;
 
     // Check if we have a valid multiboot info pointer
     if (multiboot2_info_ptr == 0) {
@@ -90,6 +91,23 @@ void multiboot2_parse(void) {
                 }
                 break;
             }
+
+            case MULTIBOOT_TAG_TYPE_ACPI_OLD:
+            case MULTIBOOT_TAG_TYPE_ACPI_NEW: {
+                // The RSDP itself follows the tag header; prefer the v2 copy
+                uint32_t len = tag->size - (uint32_t)sizeof(struct multiboot_tag);
+                if (len > sizeof(sys_info.acpi_rsdp)) {
+                    len = sizeof(sys_info.acpi_rsdp);
+                }
+                if (tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW || sys_info.acpi_rsdp_len == 0) {
+                    const uint8_t* rsdp = (const uint8_t*)tag + sizeof(struct multiboot_tag);
+                    for (uint32_t i = 0; i < len; i++) {
+                        sys_info.acpi_rsdp[i] = rsdp[i];
+                    }
+                    sys_info.acpi_rsdp_len = len;
+                }
+                break;
+            }
         }
         
         // Move to next tag (tags are 8-byte aligned)
@@ -0,0 +1,229 @@
+// src/core/rbtree.c — red-black tree insert/erase (CLRS, with parent pointers)
+#include "../includes/rbtree.h"
+
+static void rb_rotate_left(RbTree* t, RbNode* x) {
+    RbNode* y = x->right;
+    x->right = y->left;
+    if (y->left) {
+        y->left->parent = x;
+    }
+    y->parent = x->parent;
+    if (!x->parent) {
+        t->root = y;
+    } else if (x == x->parent->left) {
+        x->parent->left = y;
+    } else {
+        x->parent->right = y;
+    }
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(RbTree* t, RbNode* x) {
+    RbNode* y = x->left;
+    x->left = y->right;
+    if (y->right) {
+        y->right->parent = x;
+    }
+    y->parent = x->parent;
+    if (!x->parent) {
+        t->root = y;
+    } else if (x == x->parent->right) {
+        x->parent->right = y;
+    } else {
+        x->parent->left = y;
+    }
+    y->right = x;
+    x->parent = y;
+}
+
+void rb_insert(RbTree* t, RbNode* node, bool (*less)(const RbNode* a, const RbNode* b)) {
+    RbNode* parent = NULL;
+    RbNode** link = &t->root;
+    bool leftmost = true;
+    while (*link) {
+        parent = *link;
+        if (less(node, parent)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    *link = node;
+    if (leftmost) {
+        t->leftmost = node;
+    }
+
+    /* Fix up: a red node may not have a red parent. */
+    RbNode* z = node;
+    while (z->parent && z->parent->red) {
+        RbNode* p = z->parent;
+        RbNode* g = p->parent;
+        if (p == g->left) {
+            RbNode* u = g->right;
+            if (u && u->red) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == p->right) {
+                z = p;
+                rb_rotate_left(t, z);
+                p = z->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rb_rotate_right(t, g);
+        } else {
+            RbNode* u = g->left;
+            if (u && u->red) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == p->left) {
+                z = p;
+                rb_rotate_right(t, z);
+                p = z->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rb_rotate_left(t, g);
+        }
+    }
+    t->root->red = false;
+}
+
+RbNode* rb_next(const RbNode* n) {
+    if (n->right) {
+        n = n->right;
+        while (n->left) {
+            n = n->left;
+        }
+        return (RbNode*)n;
+    }
+    while (n->parent && n == n->parent->right) {
+        n = n->parent;
+    }
+    return n->parent;
+}
+
+/* Put v where u was (v may be NULL). */
+static void rb_transplant(RbTree* t, RbNode* u, RbNode* v) {
+    if (!u->parent) {
+        t->root = v;
+    } else if (u == u->parent->left) {
+        u->parent->left = v;
+    } else {
+        u->parent->right = v;
+    }
+    if (v) {
+        v->parent = u->parent;
+    }
+}
+
+void rb_erase(RbTree* t, RbNode* z) {
+    if (t->leftmost == z) {
+        t->leftmost = rb_next(z);
+    }
+
+    /* x replaces the removed position; xp is its parent (x may be NULL). */
+    RbNode* x;
+    RbNode* xp;
+    bool removed_red;
+    if (!z->left || !z->right) {
+        x = z->left ? z->left : z->right;
+        xp = z->parent;
+        removed_red = z->red;
+        rb_transplant(t, z, x);
+    } else {
+        RbNode* y = z->right;
+        while (y->left) {
+            y = y->left;
+        }
+        removed_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            xp = y;
+        } else {
+            xp = y->parent;
+            rb_transplant(t, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        rb_transplant(t, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+    if (removed_red) {
+        return;
+    }
+
+    /* Removed a black node: push the missing black up or rebalance. */
+    while (x != t->root && (!x || !x->red)) {
+        if (x == xp->left) {
+            RbNode* w = xp->right;
+            if (w->red) {
+                w->red = false;
+                xp->red = true;
+                rb_rotate_left(t, xp);
+                w = xp->right;
+            }
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+                w->red = true;
+                x = xp;
+                xp = x->parent;
+            } else {
+                if (!w->right || !w->right->red) {
+                    w->left->red = false;
+                    w->red = true;
+                    rb_rotate_right(t, w);
+                    w = xp->right;
+                }
+                w->red = xp->red;
+                xp->red = false;
+                w->right->red = false;
+                rb_rotate_left(t, xp);
+                x = t->root;
+            }
+        } else {
+            RbNode* w = xp->left;
+            if (w->red) {
+                w->red = false;
+                xp->red = true;
+                rb_rotate_right(t, xp);
+                w = xp->left;
+            }
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+                w->red = true;
+                x = xp;
+                xp = x->parent;
+            } else {
+                if (!w->left || !w->left->red) {
+                    w->right->red = false;
+                    w->red = true;
+                    rb_rotate_left(t, w);
+                    w = xp->left;
+                }
+                w->red = xp->red;
+                xp->red = false;
+                w->left->red = false;
+                rb_rotate_right(t, xp);
+                x = t->root;
+            }
+        }
+    }
+    if (x) {
+        x->red = false;
+    }
+}
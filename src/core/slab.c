@@ -0,0 +1,151 @@
+// src/core/slab.c — object caches: one frame per slab, freelist inside the free objects
+#include "../includes/slab.h"
+#include "../includes/memory.h"
+#include "../includes/utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+struct kmem_slab {
+    KmemCache* cache;
+    KmemSlab* next;     // partial list
+    KmemSlab* prev;
+    void* free;         // first free object; each free object stores the next
+    uint32_t inuse;
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(KmemSlab) + 15u) & ~15u)
+
+static inline KmemSlab* slab_of(void* obj) {
+    return (KmemSlab*)((uintptr_t)obj & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static void slab_partial_add(KmemCache* c, KmemSlab* s) {
+    s->prev = NULL;
+    s->next = c->partial;
+    if (c->partial) {
+        c->partial->prev = s;
+    }
+    c->partial = s;
+}
+
+static void slab_partial_remove(KmemCache* c, KmemSlab* s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        c->partial = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    s->next = NULL;
+    s->prev = NULL;
+}
+
+static KmemSlab* slab_new(KmemCache* c) {
+    uint64_t frame = pmm_alloc_frame(MEM_ALLOC_NORMAL);
+    if (frame == 0) {
+        return NULL;
+    }
+    KmemSlab* s = (KmemSlab*)(uintptr_t)frame;
+    s->cache = c;
+    s->next = NULL;
+    s->prev = NULL;
+    s->inuse = 0;
+    s->free = NULL;
+    uint8_t* base = (uint8_t*)s + c->offset;
+    for (uint32_t i = c->per_slab; i > 0; i--) {
+        void** obj = (void**)(base + (size_t)(i - 1) * c->obj_size);
+        *obj = s->free;
+        s->free = obj;
+    }
+    return s;
+}
+
+int kmem_cache_init(KmemCache* c, const char* name, uint32_t size) {
+    return kmem_cache_init_aligned(c, name, size, 16u);
+}
+
+int kmem_cache_init_aligned(KmemCache* c, const char* name, uint32_t size, uint32_t align) {
+    if (align < 16u || (align & (align - 1u)) != 0 || align > PAGE_SIZE / 2u) {
+        return -1;
+    }
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);  // a free object holds the freelist link
+    }
+    uint32_t obj = (size + align - 1u) & ~(align - 1u);
+    uint32_t offset = (uint32_t)((SLAB_HEADER_SIZE + align - 1u) & ~(align - 1u));
+    if (obj > PAGE_SIZE - offset) {
+        return -1;
+    }
+    memset(c, 0, sizeof *c);
+    c->name = name;
+    c->obj_size = obj;
+    c->offset = offset;
+    c->per_slab = (uint32_t)((PAGE_SIZE - offset) / obj);
+    return 0;
+}
+
+void* kmem_cache_alloc(KmemCache* c) {
+    uint64_t irq = spin_lock_irqsave(&c->lock);
+    KmemSlab* s = c->partial;
+    if (!s) {
+        if (c->spare) {
+            s = c->spare;
+            c->spare = NULL;
+        } else {
+            spin_unlock_irqrestore(&c->lock, irq);
+            s = slab_new(c);
+            if (!s) {
+                return NULL;
+            }
+            irq = spin_lock_irqsave(&c->lock);
+            c->slabs++;
+        }
+        slab_partial_add(c, s);
+    }
+    void** obj = (void**)s->free;
+    s->free = *obj;
+    s->inuse++;
+    if (s->inuse == c->per_slab) {
+        slab_partial_remove(c, s);  // full slabs are on no list
+    }
+    c->active++;
+    c->allocs++;
+    spin_unlock_irqrestore(&c->lock, irq);
+    memset(obj, 0, c->obj_size);
+    return obj;
+}
+
+void kmem_cache_free(KmemCache* c, void* obj) {
+    if (!obj) {
+        return;
+    }
+    KmemSlab* s = slab_of(obj);
+    if (s->cache != c) {
+        return;
+    }
+    KmemSlab* release = NULL;
+    uint64_t irq = spin_lock_irqsave(&c->lock);
+    if (s->inuse == c->per_slab) {
+        slab_partial_add(c, s);
+    }
+    *(void**)obj = s->free;
+    s->free = obj;
+    s->inuse--;
+    c->active--;
+    c->frees++;
+
+    if (s->inuse == 0) {
+        slab_partial_remove(c, s);
+        if (!c->spare) {
+            c->spare = s;
+        } else {
+            release = s;
+            c->slabs--;
+        }
+    }
+    spin_unlock_irqrestore(&c->lock, irq);
+    if (release) {
+        pmm_frame_put((uint64_t)(uintptr_t)release);
+    }
+}
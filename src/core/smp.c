@@ -0,0 +1,395 @@
+// src/core/smp.c — local APIC, AP start-up and the per-CPU timer/IPI entry points
+#include "../includes/smp.h"
+#include "../includes/acpi.h"
+#include "../includes/scheduler.h"
+#include "../includes/timer.h"
+#include "../includes/vmm.h"
+#include "../includes/memory.h"
+#include "../includes/fpu.h"
+#include "../includes/console.h"
+#include "../includes/spinlock.h"
+#include "../includes/utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+extern uint64_t rdtsc(void);
+extern void cpuid_get_features(uint32_t* output);
+
+// Trampoline image (kernel.asm); the data block is four qwords at its end
+extern const uint8_t ap_trampoline_start[];
+extern const uint8_t ap_trampoline_end[];
+extern const uint8_t ap_trampoline_data[];
+
+typedef struct {
+    uint64_t cr3;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t cpu;
+} ApTrampolineData;
+
+#define MSR_APIC_BASE 0x1Bu
+#define MSR_GS_BASE   0xC0000101u
+#define APIC_BASE_ENABLE (1u << 11)
+
+// xAPIC register offsets
+#define LAPIC_ID          0x020u
+#define LAPIC_TPR         0x080u
+#define LAPIC_EOI         0x0B0u
+#define LAPIC_SVR         0x0F0u
+#define LAPIC_ICR_LOW     0x300u
+#define LAPIC_ICR_HIGH    0x310u
+#define LAPIC_LVT_TIMER   0x320u
+#define LAPIC_LVT_LINT0   0x350u
+#define LAPIC_LVT_LINT1   0x360u
+#define LAPIC_LVT_ERROR   0x370u
+#define LAPIC_TIMER_INIT  0x380u
+#define LAPIC_TIMER_CUR   0x390u
+#define LAPIC_TIMER_DIV   0x3E0u
+
+#define LAPIC_SVR_ENABLE     (1u << 8)
+#define LAPIC_LVT_MASKED     (1u << 16)
+#define LAPIC_TIMER_PERIODIC (1u << 17)
+#define LAPIC_DELIVERY_EXTINT 0x700u
+#define LAPIC_DELIVERY_NMI    0x400u
+#define LAPIC_DIV_16          0x3u
+#define LAPIC_ICR_PENDING    (1u << 12)
+#define LAPIC_ICR_INIT        0x4500u  // INIT, level assert
+#define LAPIC_ICR_STARTUP     0x4600u  // SIPI; low byte = start page
+#define LAPIC_ICR_FIXED       0x4000u  // fixed delivery, assert
+
+#define SMP_CALIB_TICKS 10u
+#define SMP_AP_WAIT_US  100000u
+#define SMP_TLB_FULL_PAGES 32u  // a longer range reloads CR3 instead of invlpg per page
+
+static Cpu cpus[SMP_MAX_CPUS];
+static volatile uint32_t cpus_online;
+static uint32_t cpus_present = 1;
+static volatile uint32_t* lapic;
+static uint64_t lapic_per_tick;
+
+/* The shootdown in flight; tlb_pending has a bit per CPU that has not flushed yet. */
+static Spinlock tlb_lock = SPINLOCK_INIT;
+static volatile uint64_t tlb_root;
+static volatile uint64_t tlb_start;
+static volatile uint64_t tlb_pages;
+static volatile uint32_t tlb_pending;
+
+static inline uint64_t smp_rdmsr(uint32_t msr) {
+    uint32_t lo;
+    uint32_t hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void smp_wrmsr(uint32_t msr, uint64_t v) {
+    __asm__ volatile("wrmsr" : : "a"((uint32_t)v), "d"((uint32_t)(v >> 32)), "c"(msr) : "memory");
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4u];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t v) {
+    lapic[reg / 4u] = v;
+    (void)lapic[LAPIC_ID / 4u];  // posted write: read back to order it
+}
+
+/* Busy-wait on the TSC once it is calibrated, else on whole PIT ticks. */
+static void smp_udelay(uint32_t us) {
+    if (global_timer.tsc_per_tick == 0) {
+        uint64_t until = timer_get_ticks() + us / (1000000u / TIMER_FREQUENCY) + 1u;
+        while (timer_get_ticks() < until) {
+            __asm__ volatile("pause");
+        }
+        return;
+    }
+    uint64_t start = rdtsc();
+    while (timer_cycles_to_us(rdtsc() - start) < us) {
+        __asm__ volatile("pause");
+    }
+}
+
+static void lapic_wait_icr(void) {
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+}
+
+static void lapic_send_ipi(uint32_t apic_id, uint32_t low) {
+    lapic_wait_icr();
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, low);
+}
+
+/* Software-enable this CPU's LAPIC; only the BSP takes PIC interrupts (ExtINT on LINT0). */
+static void lapic_cpu_init(bool bsp) {
+    smp_wrmsr(MSR_APIC_BASE, smp_rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_LINT0, bsp ? LAPIC_DELIVERY_EXTINT : LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, bsp ? LAPIC_DELIVERY_NMI : LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TPR, 0);
+}
+
+/* LAPIC timer counts (divide by 16) per PIT tick, over SMP_CALIB_TICKS ticks. */
+static uint64_t lapic_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    uint64_t t = timer_get_ticks();
+    while (timer_get_ticks() == t) {
+        __asm__ volatile("pause");  // start on a tick edge
+    }
+    t = timer_get_ticks();
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFFu);
+    while (timer_get_ticks() < t + SMP_CALIB_TICKS) {
+        __asm__ volatile("pause");
+    }
+    uint32_t left = lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    return (0xFFFFFFFFull - left) / SMP_CALIB_TICKS;
+}
+
+void smp_bsp_init(void) {
+    Cpu* c = &cpus[0];
+    c->self = c;
+    c->id = 0;
+    c->online = true;
+    cpus_online = 1;
+    smp_wrmsr(MSR_GS_BASE, (uint64_t)(uintptr_t)c);
+}
+
+/* First C code on an AP: still on the trampoline's GDT, interrupts off. */
+static void smp_ap_entry(Cpu* cpu) {
+    smp_wrmsr(MSR_GS_BASE, (uint64_t)(uintptr_t)cpu);
+    cpu_tables_load(&cpu->tables, cpu->stack_top);
+    idt_load();
+    fpu_cpu_init();
+
+    lapic_cpu_init(false);
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_TIMER_INIT, (uint32_t)lapic_per_tick);
+
+    __atomic_add_fetch(&cpus_online, 1u, __ATOMIC_SEQ_CST);
+    cpu->online = true;
+    scheduler_cpu_online();
+    __asm__ volatile("sti" ::: "memory");
+    idle_task();  // this stack is the idle task's; never returns
+}
+
+/* INIT, 10 ms, then two SIPIs; 0 once the AP reports in. */
+static int smp_start_ap(uint32_t idx, uint32_t apic_id) {
+    TaskStruct* idle = scheduler_init_ap(idx);
+    if (!idle) {
+        return -1;
+    }
+    Cpu* c = &cpus[idx];
+    c->self = c;
+    c->id = idx;
+    c->apic_id = apic_id;
+    c->stack_top = (uint64_t)(uintptr_t)idle->stack_top;
+
+    ApTrampolineData* d = (ApTrampolineData*)(uintptr_t)(AP_TRAMPOLINE_BASE +
+        (uint64_t)(ap_trampoline_data - ap_trampoline_start));
+    d->cr3 = vmm_kernel_pml4();
+    d->stack = c->stack_top;
+    d->entry = (uint64_t)(uintptr_t)smp_ap_entry;
+    d->cpu = (uint64_t)(uintptr_t)c;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT);
+    smp_udelay(10000);
+    for (int i = 0; i < 2; i++) {
+        lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE_BASE >> 12));
+        smp_udelay(200);
+    }
+    lapic_wait_icr();
+
+    for (uint32_t waited = 0; waited < SMP_AP_WAIT_US && !c->online; waited += 100u) {
+        smp_udelay(100);
+    }
+    return c->online ? 0 : -2;
+}
+
+void smp_init(void) {
+    char buffer[16];
+    uint32_t features[4];
+    cpuid_get_features(features);
+    if ((features[3] & (1u << 9)) == 0) {
+        console_println_color("SMP: no local APIC, single CPU", CONSOLE_WARNING_COLOR);
+        return;
+    }
+
+    AcpiMadtInfo madt;
+    int rc = acpi_parse_madt(&madt);
+    if (rc != 0 || madt.lapic_phys == 0) {
+        console_print_color("SMP: no usable MADT (", CONSOLE_WARNING_COLOR);
+        int_to_str(rc, buffer);
+        console_print_color(buffer, CONSOLE_WARNING_COLOR);
+        console_println_color("), single CPU", CONSOLE_WARNING_COLOR);
+        return;
+    }
+    uint64_t page = madt.lapic_phys & ~(uint64_t)(PAGE_SIZE - 1U);
+    if (vmm_map_kernel_4k(page, page, VMM_PTE_P | VMM_PTE_RW | VMM_PTE_PCD | VMM_PTE_PWT | VMM_PTE_NX) != 0) {
+        console_println_color("SMP: cannot map the local APIC", CONSOLE_ERROR_COLOR);
+        return;
+    }
+    lapic = (volatile uint32_t*)(uintptr_t)madt.lapic_phys;
+    lapic_cpu_init(true);
+    cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+
+    lapic_per_tick = lapic_calibrate();
+    if (lapic_per_tick == 0 || lapic_per_tick > 0xFFFFFFFFull) {
+        console_println_color("SMP: LAPIC timer calibration failed, single CPU", CONSOLE_ERROR_COLOR);
+        return;
+    }
+
+    // Below 1 MiB is identity-mapped and never handed out by the PMM
+    uint8_t* tramp = (uint8_t*)(uintptr_t)AP_TRAMPOLINE_BASE;
+    for (const uint8_t* p = ap_trampoline_start; p < ap_trampoline_end; p++) {
+        *tramp++ = *p;
+    }
+
+    uint32_t idx = 1;
+    for (uint32_t i = 0; i < madt.cpu_count && idx < SMP_MAX_CPUS; i++) {
+        if (madt.apic_ids[i] == cpus[0].apic_id) {
+            continue;
+        }
+        cpus_present++;
+        if (smp_start_ap(idx, madt.apic_ids[i]) == 0) {
+            idx++;
+        } else {
+            console_print_color("SMP: APIC ID ", CONSOLE_WARNING_COLOR);
+            int_to_str((int)madt.apic_ids[i], buffer);
+            console_print_color(buffer, CONSOLE_WARNING_COLOR);
+            console_println_color(" did not start", CONSOLE_WARNING_COLOR);
+        }
+    }
+
+    console_print_color("SMP: ", CONSOLE_SUCCESS_COLOR);
+    int_to_str((int)cpus_online, buffer);
+    console_print_color(buffer, CONSOLE_SUCCESS_COLOR);
+    console_print_color(" of ", CONSOLE_SUCCESS_COLOR);
+    int_to_str((int)(cpus_present + madt.cpus_skipped), buffer);
+    console_print_color(buffer, CONSOLE_SUCCESS_COLOR);
+    console_println_color(" CPUs online", CONSOLE_SUCCESS_COLOR);
+}
+
+uint32_t smp_cpus_online(void) {
+    return cpus_online;
+}
+
+Cpu* smp_cpu(uint32_t id) {
+    return id < SMP_MAX_CPUS ? &cpus[id] : NULL;
+}
+
+uint64_t smp_lapic_ticks_per_tick(void) {
+    return lapic_per_tick;
+}
+
+bool smp_timer_oneshot(uint64_t ticks) {
+    if (ticks < 2 || lapic_per_tick == 0) {
+        return false;
+    }
+    // Keep the tick phase: what is left of this period, then ticks - 1 more
+    uint64_t left = lapic_read(LAPIC_TIMER_CUR);
+    if (left == 0 || left > lapic_per_tick) {
+        left = lapic_per_tick;
+    }
+    uint64_t max_ticks = (0xFFFFFFFFull - left) / lapic_per_tick + 1;
+    if (ticks > max_ticks) {
+        ticks = max_ticks;
+    }
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, (uint32_t)(left + (ticks - 1) * lapic_per_tick));
+    smp_this_cpu()->idle_oneshots++;
+    return true;
+}
+
+void smp_timer_periodic(void) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_TIMER_INIT, (uint32_t)lapic_per_tick);
+}
+
+void smp_send_resched(uint32_t cpu) {
+    if (!lapic || cpu >= SMP_MAX_CPUS || cpu == smp_cpu_id() || !cpus[cpu].online) {
+        return;
+    }
+    uint64_t irq = local_irq_save();  // ICR high/low pair must not be split
+    lapic_send_ipi(cpus[cpu].apic_id, LAPIC_ICR_FIXED | IPI_RESCHED_VECTOR);
+    local_irq_restore(irq);
+}
+
+void smp_tlb_poll(void) {
+    uint32_t pending = __atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE);
+    if (pending == 0) {
+        return;  // also the only path before the per-CPU block exists
+    }
+    uint32_t bit = 1u << smp_cpu_id();
+    if ((pending & bit) == 0) {
+        return;
+    }
+    uint64_t cr3 = vmm_get_cr3();
+    if (tlb_root == 0 || tlb_root == VMM_ENTRY_ADDR(cr3)) {
+        if (tlb_pages > SMP_TLB_FULL_PAGES) {
+            vmm_load_cr3(cr3);
+        } else {
+            for (uint64_t i = 0; i < tlb_pages; i++) {
+                vmm_invalidate_page((uintptr_t)(tlb_start + i * PAGE_SIZE));
+            }
+        }
+    }
+    smp_this_cpu()->tlb_ipis++;
+    __atomic_and_fetch(&tlb_pending, ~bit, __ATOMIC_RELEASE);
+}
+
+void smp_tlb_shootdown(uint64_t pml4_phys, uint64_t start, uint64_t pages) {
+    if (!lapic || cpus_online <= 1 || pages == 0) {
+        return;
+    }
+    uint64_t irq = spin_lock_irqsave(&tlb_lock);  // answers the current sender while waiting
+    uint32_t self = smp_cpu_id();
+    tlb_root = VMM_ENTRY_ADDR(pml4_phys);
+    tlb_start = start;
+    tlb_pages = pages;
+    uint32_t targets = 0;
+    for (uint32_t c = 0; c < SMP_MAX_CPUS; c++) {
+        if (c != self && cpus[c].online) {
+            targets |= 1u << c;
+        }
+    }
+    __atomic_store_n(&tlb_pending, targets, __ATOMIC_RELEASE);
+    for (uint32_t c = 0; c < SMP_MAX_CPUS; c++) {
+        if (targets & (1u << c)) {
+            lapic_send_ipi(cpus[c].apic_id, LAPIC_ICR_FIXED | IPI_TLB_VECTOR);
+        }
+    }
+    while (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE) != 0) {
+        __asm__ volatile("pause");
+    }
+    spin_unlock_irqrestore(&tlb_lock, irq);
+}
+
+void smp_timer_interrupt(void) {
+    scheduler_account_irq_enter();
+    lapic_write(LAPIC_EOI, 0);
+    smp_this_cpu()->lapic_ticks++;
+    scheduler_tick();
+    scheduler_account_irq_exit();
+}
+
+void smp_resched_interrupt(void) {
+    scheduler_account_irq_enter();
+    lapic_write(LAPIC_EOI, 0);
+    smp_this_cpu()->resched_ipis++;
+    scheduler_resched_ipi();
+    scheduler_account_irq_exit();
+}
+
+void smp_tlb_interrupt(void) {
+    scheduler_account_irq_enter();
+    lapic_write(LAPIC_EOI, 0);
+    smp_tlb_poll();  // nothing left to do if a spin loop already answered
+    scheduler_account_irq_exit();
+}
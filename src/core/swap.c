@@ -0,0 +1,135 @@
+// src/core/swap.c — slot allocator and page I/O for the swap device
+#include "../includes/swap.h"
+#include "../includes/blockdev.h"
+#include "../includes/memory.h"
+#include "../includes/spinlock.h"
+#include "../includes/utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+static BlockDevice* swap_dev;
+static uint8_t swap_used[SWAP_MAX_SLOTS / 8u];
+static uint32_t swap_hint;
+static SwapStats swap_stats;
+
+/*
+ * swap_lock covers the slot bitmap and the counters. swap_io_lock keeps one
+ * transfer on the device at a time: a swap-in fault holds it with
+ * interrupts off, the reclaim task with them on but not preemptible
+ * (scheduler_preempt_disable). No interrupt handler does swap I/O, so
+ * nobody spins on it while its holder waits behind them on the same CPU.
+ */
+static Spinlock swap_lock = SPINLOCK_INIT;
+static Spinlock swap_io_lock = SPINLOCK_INIT;
+
+static bool swap_slot_used(uint32_t s) {
+    return (swap_used[s >> 3] & (1u << (s & 7u))) != 0;
+}
+
+static bool swap_has_signature(BlockDevice* dev) {
+    static uint8_t sector[BLOCK_SECTOR_SIZE];
+    if (dev->read(dev, 0, 1, sector) != 0) {
+        return false;
+    }
+    const char* sig = SWAP_SIGNATURE;
+    for (uint32_t i = 0; sig[i]; i++) {
+        if (sector[i] != (uint8_t)sig[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void swap_init(void) {
+    swap_dev = NULL;
+    memset(swap_used, 0, sizeof swap_used);
+    memset(&swap_stats, 0, sizeof swap_stats);
+    swap_hint = 1;
+
+    for (uint32_t i = 0; i < blockdev_count(); i++) {
+        BlockDevice* dev = blockdev_get(i);
+        if (dev->sectors >= 2u * SWAP_SLOT_SECTORS && swap_has_signature(dev)) {
+            swap_dev = dev;
+            break;
+        }
+    }
+    if (!swap_dev) {
+        return;
+    }
+    uint64_t slots = swap_dev->sectors / SWAP_SLOT_SECTORS;
+    swap_stats.total_slots = (uint32_t)(slots > SWAP_MAX_SLOTS ? SWAP_MAX_SLOTS : slots);
+    swap_used[0] |= 1u; /* slot 0: signature */
+    swap_stats.used_slots = 1;
+}
+
+bool swap_enabled(void) {
+    return swap_dev != NULL;
+}
+
+uint32_t swap_alloc(void) {
+    if (!swap_dev) {
+        return 0;
+    }
+    uint64_t irq = spin_lock_irqsave(&swap_lock);
+    uint32_t slot = 0;
+    for (uint32_t n = 0; n < swap_stats.total_slots && swap_stats.used_slots < swap_stats.total_slots; n++) {
+        uint32_t s = swap_hint + n;
+        if (s >= swap_stats.total_slots) {
+            s -= swap_stats.total_slots;
+        }
+        if (!swap_slot_used(s)) {
+            swap_used[s >> 3] |= (uint8_t)(1u << (s & 7u));
+            swap_stats.used_slots++;
+            swap_hint = s + 1;
+            slot = s;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&swap_lock, irq);
+    return slot;
+}
+
+void swap_free(uint32_t slot) {
+    uint64_t irq = spin_lock_irqsave(&swap_lock);
+    if (slot != 0 && slot < swap_stats.total_slots && swap_slot_used(slot)) {
+        swap_used[slot >> 3] &= (uint8_t)~(1u << (slot & 7u));
+        swap_stats.used_slots--;
+    }
+    spin_unlock_irqrestore(&swap_lock, irq);
+}
+
+int swap_write_page(uint32_t slot, uint64_t frame_phys) {
+    if (!swap_dev || slot == 0) {
+        return -1;
+    }
+    spin_lock(&swap_io_lock);
+    int rc = swap_dev->write(swap_dev, (uint64_t)slot * SWAP_SLOT_SECTORS, SWAP_SLOT_SECTORS,
+                             (const void*)(uintptr_t)frame_phys);
+    if (rc != 0) {
+        swap_stats.io_errors++;
+    } else {
+        swap_stats.pages_out++;
+    }
+    spin_unlock(&swap_io_lock);
+    return rc != 0 ? -1 : 0;
+}
+
+int swap_read_page(uint32_t slot, uint64_t frame_phys) {
+    if (!swap_dev || slot == 0) {
+        return -1;
+    }
+    spin_lock(&swap_io_lock);
+    int rc = swap_dev->read(swap_dev, (uint64_t)slot * SWAP_SLOT_SECTORS, SWAP_SLOT_SECTORS,
+                            (void*)(uintptr_t)frame_phys);
+    if (rc != 0) {
+        swap_stats.io_errors++;
+    } else {
+        swap_stats.pages_in++;
+    }
+    spin_unlock(&swap_io_lock);
+    return rc != 0 ? -1 : 0;
+}
+
+const SwapStats* swap_get_stats(void) {
+    return &swap_stats;
+}
@@ -0,0 +1,222 @@
+// src/core/sync.c — mutexes, semaphores and condition variables on wait queues
+#include "../includes/sync.h"
+#include "../includes/timer.h"
+#include "../includes/console.h"
+#include "../includes/spinlock.h"
+#include "../includes/utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+extern uint64_t rdtsc(void);
+
+static LockClass lock_class_default = LOCK_CLASS_INIT("default");
+static LockClass* lock_classes;
+static LockClass* lock_classes_tail;
+static Spinlock lock_classes_lock = SPINLOCK_INIT;
+
+/* Class of a lock, registered on first use. */
+static LockClass* lock_class_get(LockClass* cls) {
+    if (!cls) {
+        cls = &lock_class_default;
+    }
+    uint64_t irq = spin_lock_irqsave(&lock_classes_lock);
+    if (!cls->registered) {
+        cls->registered = true;
+        cls->next = NULL;
+        if (lock_classes_tail) {
+            lock_classes_tail->next = cls;
+        } else {
+            lock_classes = cls;
+        }
+        lock_classes_tail = cls;
+    }
+    spin_unlock_irqrestore(&lock_classes_lock, irq);
+    return cls;
+}
+
+static void lock_class_account_wait(LockClass* cls, uint64_t start_tsc) {
+    uint64_t us = timer_cycles_to_us(rdtsc() - start_tsc);
+    __atomic_add_fetch(&cls->wait_us, us, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&cls->wait_max_us, __ATOMIC_RELAXED);
+    while (us > max &&
+           !__atomic_compare_exchange_n(&cls->wait_max_us, &max, us, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // max now holds the value another CPU stored; retry only if still larger
+    }
+}
+
+const LockClass* lock_class_first(void) {
+    return lock_classes;
+}
+
+// Mutex
+
+void mutex_init(Mutex* m, LockClass* cls) {
+    m->locked = 0;
+    m->owner = NULL;
+    wait_queue_init(&m->waiters);
+    m->cls = lock_class_get(cls);
+}
+
+static bool mutex_try_acquire(Mutex* m) {
+    if (__atomic_exchange_n(&m->locked, 1u, __ATOMIC_ACQUIRE) != 0) {
+        return false;
+    }
+    m->owner = scheduler_get_current_task();
+    return true;
+}
+
+static bool mutex_acquire_cond(void* arg) {
+    return mutex_try_acquire((Mutex*)arg);
+}
+
+/*
+ * Spinning only pays while the owner is making progress on another CPU. With
+ * a single CPU the owner is never running while we are, so contenders block
+ * straight away.
+ */
+static bool mutex_owner_on_cpu(const Mutex* m) {
+    const TaskStruct* owner = m->owner;
+    return owner && owner != scheduler_get_current_task() && owner->state == TASK_STATE_RUNNING;
+}
+
+bool mutex_trylock(Mutex* m) {
+    if (!mutex_try_acquire(m)) {
+        return false;
+    }
+    __atomic_add_fetch(&m->cls->acquisitions, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void mutex_lock(Mutex* m) {
+    LockClass* cls = m->cls;
+    __atomic_add_fetch(&cls->acquisitions, 1, __ATOMIC_RELAXED);
+    if (mutex_try_acquire(m)) {
+        return;
+    }
+    __atomic_add_fetch(&cls->contended, 1, __ATOMIC_RELAXED);
+
+    for (uint32_t n = 0; n < MUTEX_SPIN_LIMIT && mutex_owner_on_cpu(m); n++) {
+        __asm__ volatile("pause");
+        if (m->locked == 0 && mutex_try_acquire(m)) {
+            __atomic_add_fetch(&cls->spin_acquired, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    __atomic_add_fetch(&cls->sleeps, 1, __ATOMIC_RELAXED);
+    uint64_t start = rdtsc();
+    wait_event(&m->waiters, mutex_acquire_cond, m, true);
+    lock_class_account_wait(cls, start);
+}
+
+void mutex_unlock(Mutex* m) {
+    m->owner = NULL;
+    // Full barrier: the release must be visible before we look for waiters
+    __atomic_store_n(&m->locked, 0u, __ATOMIC_SEQ_CST);
+    if (wait_queue_active(&m->waiters)) {
+        wake_up_one(&m->waiters);
+    }
+}
+
+bool mutex_is_locked(const Mutex* m) {
+    return m->locked != 0;
+}
+
+// Semaphore
+
+void semaphore_init(Semaphore* s, int32_t count, LockClass* cls) {
+    s->count = count;
+    wait_queue_init(&s->waiters);
+    s->cls = lock_class_get(cls);
+}
+
+static bool semaphore_try_take(Semaphore* s) {
+    int32_t c = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+    while (c > 0) {
+        if (__atomic_compare_exchange_n(&s->count, &c, c - 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool semaphore_take_cond(void* arg) {
+    return semaphore_try_take((Semaphore*)arg);
+}
+
+bool semaphore_trydown(Semaphore* s) {
+    if (!semaphore_try_take(s)) {
+        return false;
+    }
+    __atomic_add_fetch(&s->cls->acquisitions, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void semaphore_down(Semaphore* s) {
+    LockClass* cls = s->cls;
+    __atomic_add_fetch(&cls->acquisitions, 1, __ATOMIC_RELAXED);
+    if (semaphore_try_take(s)) {
+        return;
+    }
+    __atomic_add_fetch(&cls->contended, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cls->sleeps, 1, __ATOMIC_RELAXED);
+    uint64_t start = rdtsc();
+    wait_event(&s->waiters, semaphore_take_cond, s, true);
+    lock_class_account_wait(cls, start);
+}
+
+void semaphore_up(Semaphore* s) {
+    __atomic_add_fetch(&s->count, 1, __ATOMIC_RELEASE);
+    if (wait_queue_active(&s->waiters)) {
+        wake_up_one(&s->waiters);
+    }
+}
+
+// Condition variable
+
+void cond_init(CondVar* cv) {
+    wait_queue_init(&cv->waiters);
+}
+
+static void cond_release_mutex(void* arg) {
+    mutex_unlock((Mutex*)arg);
+}
+
+void cond_wait(CondVar* cv, Mutex* m) {
+    wait_release_and_block(&cv->waiters, cond_release_mutex, m, true);
+    mutex_lock(m);
+}
+
+void cond_signal(CondVar* cv) {
+    wake_up_one(&cv->waiters);
+}
+
+void cond_broadcast(CondVar* cv) {
+    wake_up_all(&cv->waiters);
+}
+
+static void print_column(uint64_t value, const char* sep) {
+    char buffer[32];
+    int_to_str((int)value, buffer);
+    console_print_color(buffer, CONSOLE_FG_COLOR);
+    console_print_color(sep, CONSOLE_FG_COLOR);
+}
+
+void lock_class_print_stats(void) {
+    console_println_color("Class | Acquired | Contended | Spun | Slept | Wait avg/max us", CONSOLE_FG_COLOR);
+    if (!lock_classes) {
+        console_println_color("(no locks in use)", CONSOLE_FG_COLOR);
+        return;
+    }
+    for (const LockClass* c = lock_classes; c; c = c->next) {
+        console_print_color(c->name, CONSOLE_FG_COLOR);
+        console_print_color(" | ", CONSOLE_FG_COLOR);
+        print_column(c->acquisitions, " | ");
+        print_column(c->contended, " | ");
+        print_column(c->spin_acquired, " | ");
+        print_column(c->sleeps, " | ");
+        print_column(c->sleeps ? c->wait_us / c->sleeps : 0, "/");
+        print_column(c->wait_max_us, "");
+        console_newline();
+    }
+}
@@ -2,6 +2,9 @@
 #include "../includes/syscall.h"
 #include "../includes/console.h"
 #include "../includes/memory.h"
+#include "../includes/vma.h"
+#include "../includes/vmm.h"
+#include "../includes/filesystem_pop.h"
 #include "../includes/scheduler.h"
 #include "../includes/timer.h"
 #include "../includes/utils.h"
@@ -14,6 +17,22 @@ static uint32_t syscall_count = 0;
 // Current process context (simplified for now)
 static uint32_t current_pid = 1;
 
+// Open files (global for now, like current_pid). Slots 0..2 are the console.
+#define SYSCALL_MAX_FDS 32
+typedef struct {
+    bool in_use;
+    int file;         // filesystem slot (fs_lookup)
+    uint64_t offset;
+} syscall_fd_t;
+static syscall_fd_t fd_table[SYSCALL_MAX_FDS];
+
+static syscall_fd_t* fd_get(int fd) {
+    if (fd < 3 || fd >= SYSCALL_MAX_FDS || !fd_table[fd].in_use) {
+        return NULL;
+    }
+    return &fd_table[fd];
+}
+
 // Initialize system call interface
 void syscall_init(void) {
     // Clear system call table
@@ -47,6 +66,10 @@ void syscall_init(void) {
     syscall_register(SYS_CHDIR, sys_chdir, "chdir", SYSCALL_FLAG_NONE);
     syscall_register(SYS_STAT, sys_stat, "stat", SYSCALL_FLAG_NONE);
     syscall_register(SYS_IOCTL, sys_ioctl, "ioctl", SYSCALL_FLAG_PRIVILEGED);
+    syscall_register(SYS_MADVISE, sys_madvise, "madvise", SYSCALL_FLAG_NONE);
+    syscall_register(SYS_SCHED_SETAFFINITY, sys_sched_setaffinity, "sched_setaffinity", SYSCALL_FLAG_NONE);
+    syscall_register(SYS_SCHED_GETAFFINITY, sys_sched_getaffinity, "sched_getaffinity", SYSCALL_FLAG_NONE);
+    syscall_register(SYS_SCHED_SETDEADLINE, sys_sched_setdeadline, "sched_setdeadline", SYSCALL_FLAG_NONE);
 
     console_println_color("System call interface initialized", CONSOLE_SUCCESS_COLOR);
 }
@@ -77,11 +100,14 @@ int64_t syscall_dispatch(syscall_context_t* ctx) {
 
     uint32_t syscall_num = (uint32_t)ctx->rax;
     
-    // Find system call handler
+    // Find system call handler; its time is the caller's system time
     for (uint32_t i = 0; i < syscall_count; i++) {
         if (syscall_table[i].syscall_num == syscall_num) {
             if (syscall_table[i].handler) {
-                return syscall_table[i].handler(ctx);
+                scheduler_account_sys_enter();
+                int64_t ret = syscall_table[i].handler(ctx);
+                scheduler_account_sys_exit();
+                return ret;
             }
         }
     }
@@ -203,12 +229,26 @@ int64_t sys_open(syscall_context_t* ctx) {
     // Suppress unused variable warning for now
     (void)flags;
     
-    // Simplified file opening
+    if (!pathname) {
+        return SYSCALL_EINVAL;
+    }
+
     console_print_color("Opening file: ", CONSOLE_INFO_COLOR);
     console_println_color(pathname, CONSOLE_FG_COLOR);
-    
-    // Return a fake file descriptor
-    return 3; // Start from 3 (0,1,2 are stdin,stdout,stderr)
+
+    int file = fs_lookup(pathname);
+    if (file < 0) {
+        return SYSCALL_ENOENT;
+    }
+    for (int fd = 3; fd < SYSCALL_MAX_FDS; fd++) {  // 0,1,2 are stdin,stdout,stderr
+        if (!fd_table[fd].in_use) {
+            fd_table[fd].in_use = true;
+            fd_table[fd].file = file;
+            fd_table[fd].offset = 0;
+            return fd;
+        }
+    }
+    return SYSCALL_EBUSY;
 }
 
 int64_t sys_close(syscall_context_t* ctx) {
@@ -217,6 +257,13 @@ int64_t sys_close(syscall_context_t* ctx) {
     char buffer[16];
     int_to_str(fd, buffer);
     console_println_color(buffer, CONSOLE_INFO_COLOR);
+
+    // Mappings hold their own page-cache references; closing does not unmap.
+    syscall_fd_t* f = fd_get(fd);
+    if (!f) {
+        return SYSCALL_EINVAL;
+    }
+    f->in_use = false;
     return SYSCALL_SUCCESS;
 }
 
@@ -262,8 +309,8 @@ int64_t sys_fork(syscall_context_t* ctx) {
     // Set up parent-child relationship
     child_task->ppid = current_task->pid;
     
-    // Copy the parent's context to child
-    child_task->context = current_task->context;
+    // The child starts at the parent's entry point on its own fresh stack;
+    // the parent's saved stack pointer is meaningless there
     
     // Child gets PID 0 in return value, parent gets child's PID
     uint32_t child_pid = child_task->pid;
@@ -298,24 +345,19 @@ int64_t sys_wait(syscall_context_t* ctx) {
     }
     
     // Look for zombie children of current process
-    for (int priority = PRIORITY_REALTIME; priority >= PRIORITY_IDLE; priority--) {
-        TaskStruct* task = scheduler.ready_queue[priority];
-        while (task) {
-            if (task->ppid == current_task->pid && task->state == TASK_STATE_ZOMBIE) {
-                uint32_t child_pid = task->pid;
-                
-                // Clean up the zombie child
-                scheduler_destroy_task(child_pid);
-                
-                console_print_color("Wait: Reaped child process PID ", CONSOLE_INFO_COLOR);
-                char buffer[16];
-                int_to_str(child_pid, buffer);
-                console_println_color(buffer, CONSOLE_SUCCESS_COLOR);
-                
-                return child_pid;
-            }
-            task = task->next;
-        }
+    TaskStruct* task = scheduler_find_zombie_child(current_task->pid);
+    if (task) {
+        uint32_t child_pid = task->pid;
+
+        // Clean up the zombie child
+        scheduler_destroy_task(child_pid);
+
+        console_print_color("Wait: Reaped child process PID ", CONSOLE_INFO_COLOR);
+        char buffer[16];
+        int_to_str(child_pid, buffer);
+        console_println_color(buffer, CONSOLE_SUCCESS_COLOR);
+
+        return child_pid;
     }
     
     // No zombie children found
@@ -359,6 +401,33 @@ int64_t sys_free(syscall_context_t* ctx) {
     return SYSCALL_SUCCESS;
 }
 
+// Common tail of sys_mmap: MAP_FIXED placement, then MAP_LOCKED / MAP_POPULATE.
+// Populate is best effort; a locked mapping that cannot be backed is undone.
+static int64_t mmap_finish(VmSpace* space, uint64_t mapped, uint64_t hint, size_t length, int flags) {
+    if (mapped == 0) {
+        return SYSCALL_ENOMEM;
+    }
+    if ((flags & MAP_FIXED) && hint != 0 && mapped != hint) {
+        vma_unmap(space, mapped, length);
+        return SYSCALL_EINVAL;
+    }
+    if (flags & MAP_LOCKED) {
+        uint64_t irq = vma_space_lock(space);
+        VmArea* a = vma_find(space, mapped);
+        if (a) {
+            a->flags |= VMA_FLAG_LOCKED;
+        }
+        vma_space_unlock(space, irq);
+        if (vma_populate(space, mapped, length) != 0) {
+            vma_unmap(space, mapped, length);
+            return SYSCALL_ENOMEM;
+        }
+    } else if (flags & MAP_POPULATE) {
+        (void)vma_populate(space, mapped, length);
+    }
+    return (int64_t)mapped;
+}
+
 int64_t sys_mmap(syscall_context_t* ctx) {
     void* addr = (void*)ctx->rdi;
     size_t length = (size_t)ctx->rsi;
@@ -367,21 +436,6 @@ int64_t sys_mmap(syscall_context_t* ctx) {
     int fd = (int)ctx->r8;
     int64_t offset = (int64_t)ctx->r9;
     
-    // Suppress unused parameter warnings for now
-    (void)addr;
-    (void)prot;
-    (void)flags;
-    (void)fd;
-    (void)offset;
-    
-    // For now, implement a simplified mmap that just allocates memory
-    // In a real implementation, this would handle:
-    // - File mapping (fd != -1)
-    // - Anonymous mapping (fd == -1)
-    // - Protection flags (PROT_READ, PROT_WRITE, PROT_EXEC)
-    // - Mapping flags (MAP_PRIVATE, MAP_SHARED, MAP_ANONYMOUS)
-    // - Address hints and alignment
-    
     if (length == 0) {
         return SYSCALL_EINVAL;
     }
@@ -391,23 +445,43 @@ int64_t sys_mmap(syscall_context_t* ctx) {
         return SYSCALL_EINVAL;
     }
     
-    // Allocate memory using our memory manager
-    void* mapped_addr = kmalloc(length, MEM_ALLOC_NORMAL);
+    // Anonymous mappings are demand paged (vma.c): reserve the range now,
+    // reads map the shared zero page, the first write gets a private frame.
+    if ((flags & MAP_ANONYMOUS) || fd == -1) {
+        task_unlazy_mm(scheduler_get_current_task());
+        VmSpace* space = vma_current_space();
+        if (!space) {
+            return SYSCALL_ENOMEM;
+        }
+        uint64_t hint = (uint64_t)(uintptr_t)addr;
+        uint64_t mapped = vma_map_anon(space, hint, length, (uint32_t)prot & (PROT_READ | PROT_WRITE | PROT_EXEC));
+        return mmap_finish(space, mapped, hint, length, flags);
+    }
     
-    if (!mapped_addr) {
+    // File mappings map page-cache frames directly: MAP_PRIVATE copies on
+    // write, MAP_SHARED writes land in the file.
+    syscall_fd_t* f = fd_get(fd);
+    if (!f) {
+        return SYSCALL_EINVAL;
+    }
+    bool shared = (flags & MAP_SHARED) != 0;
+    if (shared == ((flags & MAP_PRIVATE) != 0)) {
+        return SYSCALL_EINVAL;  // exactly one of MAP_SHARED / MAP_PRIVATE
+    }
+    if (offset < 0 || (offset & (PAGE_SIZE - 1)) != 0 ||
+        (uint64_t)offset / PAGE_SIZE >= fs_file_max_pages()) {
+        return SYSCALL_EINVAL;
+    }
+
+    task_unlazy_mm(scheduler_get_current_task());
+    VmSpace* space = vma_current_space();
+    if (!space) {
         return SYSCALL_ENOMEM;
     }
-    
-    // Zero the allocated memory
-    memory_zero(mapped_addr, length);
-    
-    console_print_color("Mmap: Mapped ", CONSOLE_INFO_COLOR);
-    char buffer[16];
-    int_to_str((int)length, buffer);
-    console_print_color(buffer, CONSOLE_INFO_COLOR);
-    console_println_color(" bytes", CONSOLE_SUCCESS_COLOR);
-    
-    return (int64_t)mapped_addr;
+    uint64_t hint = (uint64_t)(uintptr_t)addr;
+    uint64_t mapped = vma_map_file(space, hint, length, (uint32_t)prot & (PROT_READ | PROT_WRITE | PROT_EXEC),
+                                   f->file, (uint64_t)offset / PAGE_SIZE, shared);
+    return mmap_finish(space, mapped, hint, length, flags);
 }
 
 int64_t sys_munmap(syscall_context_t* ctx) {
@@ -418,14 +492,17 @@ int64_t sys_munmap(syscall_context_t* ctx) {
         return SYSCALL_EINVAL;
     }
     
-    // For now, implement a simplified munmap that just frees memory
-    // In a real implementation, this would handle:
-    // - Partial unmapping (length < mapped length)
-    // - Page alignment requirements
-    // - File-backed vs anonymous mappings
-    // - Shared memory considerations
+    // Demand-paged areas live in the user half; drop their frames and trim the area.
+    uint64_t va = (uint64_t)(uintptr_t)addr;
+    if (va >= VMM_USER_BASE && va < VMM_USER_END) {
+        task_unlazy_mm(scheduler_get_current_task());
+        if (vma_unmap(vma_current_space(), va, length) != 0) {
+            return SYSCALL_EINVAL;
+        }
+        return SYSCALL_SUCCESS;
+    }
     
-    // Free the memory using our memory manager
+    // Legacy kmalloc-backed mapping
     kfree(addr);
     
     console_print_color("Munmap: Unmapped ", CONSOLE_INFO_COLOR);
@@ -437,6 +514,29 @@ int64_t sys_munmap(syscall_context_t* ctx) {
     return SYSCALL_SUCCESS;
 }
 
+int64_t sys_madvise(syscall_context_t* ctx) {
+    uint64_t va = ctx->rdi;
+    size_t length = (size_t)ctx->rsi;
+    int advice = (int)ctx->rdx;
+
+    if (length == 0 || (va & (PAGE_SIZE - 1)) != 0 || va < VMM_USER_BASE || va >= VMM_USER_END) {
+        return SYSCALL_EINVAL;
+    }
+    if (advice < MADV_NORMAL || advice > MADV_DONTNEED) {
+        return SYSCALL_EINVAL;
+    }
+
+    task_unlazy_mm(scheduler_get_current_task());
+    VmSpace* space = vma_current_space();
+    if (!space) {
+        return SYSCALL_ENOMEM;
+    }
+    if (vma_advise(space, va, length, advice) != 0) {
+        return advice == MADV_WILLNEED ? SYSCALL_ENOMEM : SYSCALL_EINVAL;
+    }
+    return SYSCALL_SUCCESS;
+}
+
 int64_t sys_gettime(syscall_context_t* ctx) {
     (void)ctx; // Suppress unused parameter warning
     return timer_get_uptime_ms();
@@ -444,11 +544,8 @@ int64_t sys_gettime(syscall_context_t* ctx) {
 
 int64_t sys_sleep(syscall_context_t* ctx) {
     uint32_t ms = (uint32_t)ctx->rdi;
-    console_print_color("Sleep for ", CONSOLE_INFO_COLOR);
-    char buffer[16];
-    int_to_str(ms, buffer);
-    console_print_color(buffer, CONSOLE_INFO_COLOR);
-    console_println_color(" ms", CONSOLE_INFO_COLOR);
+    // Blocks on the sleep queue from a task; halts in place from the shell
+    timer_delay_ms(ms);
     return SYSCALL_SUCCESS;
 }
 
@@ -604,3 +701,41 @@ int64_t sys_ioctl(syscall_context_t* ctx) {
     
     return SYSCALL_EINVAL;
 }
+
+// pid (0 = caller), CPU mask (bit n = CPU n); a running task moves when it next leaves its CPU
+int64_t sys_sched_setaffinity(syscall_context_t* ctx) {
+    uint32_t pid = (uint32_t)ctx->rdi;
+    uint32_t mask = (uint32_t)ctx->rsi;
+    int r = scheduler_set_affinity(pid, mask);
+    if (r == -1) {
+        return SYSCALL_ENOENT;
+    }
+    if (r == -3) {
+        return SYSCALL_EBUSY;  // deadline task
+    }
+    return r == 0 ? SYSCALL_SUCCESS : SYSCALL_EINVAL;
+}
+
+// Returns the mask of pid (0 = caller)
+int64_t sys_sched_getaffinity(syscall_context_t* ctx) {
+    uint32_t mask;
+    if (scheduler_get_affinity((uint32_t)ctx->rdi, &mask) != 0) {
+        return SYSCALL_ENOENT;
+    }
+    return (int64_t)mask;
+}
+
+// pid (0 = caller), runtime, deadline (0 = period) and period in microseconds; runtime 0 leaves the class
+int64_t sys_sched_setdeadline(syscall_context_t* ctx) {
+    int r = scheduler_set_deadline((uint32_t)ctx->rdi, ctx->rsi, ctx->rdx, ctx->rcx);
+    switch (r) {
+        case 0:
+            return SYSCALL_SUCCESS;
+        case -1:
+            return SYSCALL_ENOENT;
+        case -3:
+            return SYSCALL_EBUSY;  // admission: not enough bandwidth left
+        default:
+            return SYSCALL_EINVAL;
+    }
+}
@@ -1,46 +1,125 @@
 // src/core/timer.c
 #include "../includes/timer.h"
 #include "../includes/console.h"
+#include "../includes/scheduler.h"
+#include "../includes/smp.h"
+#include "../includes/spinlock.h"
+#include "../includes/workqueue.h"
 #include <stddef.h>
 
 // External port I/O functions
 extern void write_port(unsigned short port, unsigned char data);
 extern char read_port(unsigned short port);
+extern uint64_t rdtsc(void);
+
+/* Calibrate over at least this many ticks before trusting the rate. */
+#define TIMER_TSC_CALIB_TICKS 10
+
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND  0x43
+#define PIT_MODE_PERIODIC 0x34  // channel 0, lo/hi byte, mode 2 (rate generator)
+#define PIT_MODE_ONESHOT  0x30  // channel 0, lo/hi byte, mode 0 (terminal count)
+#define PIT_LATCH         0x00  // channel 0 counter latch
+#define PIT_MAX_COUNT     0xFF00u  // margin below 0xFFFF to spot a passed terminal count
 
 // Global timer state
 TimerState global_timer = {0};
 
+static void pit_program(uint8_t mode, uint16_t count) {
+    write_port(PIT_COMMAND, mode);
+    write_port(PIT_CHANNEL0, (unsigned char)(count & 0xFF));
+    write_port(PIT_CHANNEL0, (unsigned char)(count >> 8));
+}
+
+static uint16_t pit_read_count(void) {
+    write_port(PIT_COMMAND, PIT_LATCH);
+    uint16_t lo = (uint8_t)read_port(PIT_CHANNEL0);
+    uint16_t hi = (uint8_t)read_port(PIT_CHANNEL0);
+    return (uint16_t)(lo | (hi << 8));
+}
+
+/*
+ * Account ticks ticks and stamp the TSC at the new tick. clock_seq is odd
+ * while ticks, tick_tsc and tsc_per_tick are inconsistent so timer_clock_ns
+ * on another CPU retries instead of pairing a new count with an old stamp.
+ */
+static void timer_advance(uint64_t ticks) {
+    if (ticks == 0) {
+        return;  // keep the old stamp or the clock would step back
+    }
+    __atomic_add_fetch(&global_timer.clock_seq, 1, __ATOMIC_RELEASE);
+    global_timer.ticks += ticks;
+
+    // TSC rate: cycles since the first tick over ticks since then
+    uint64_t tsc = rdtsc();
+    global_timer.tick_tsc = tsc;
+    if (global_timer.calib_ticks == 0) {
+        global_timer.calib_tsc = tsc;
+        global_timer.calib_ticks = global_timer.ticks;
+    } else if (global_timer.ticks - global_timer.calib_ticks >= TIMER_TSC_CALIB_TICKS) {
+        global_timer.tsc_per_tick =
+            (tsc - global_timer.calib_tsc) / (global_timer.ticks - global_timer.calib_ticks);
+    }
+    __atomic_add_fetch(&global_timer.clock_seq, 1, __ATOMIC_RELEASE);
+}
+
+/* Back to the periodic tick after a one-shot period covering ticks ticks. */
+static void timer_leave_oneshot(uint64_t ticks) {
+    pit_program(PIT_MODE_PERIODIC, global_timer.divisor);
+    global_timer.oneshot = false;
+    timer_advance(ticks);
+}
+
 // Initialize PIT (Programmable Interval Timer)
 void timer_init(uint32_t frequency_hz) {
     // Calculate divisor for desired frequency
-    uint16_t divisor = PIT_FREQUENCY / frequency_hz;
-    
-    // Configure PIT channel 0 for mode 3 (square wave generator)
-    write_port(0x43, 0x36);  // Channel 0, mode 3, binary
-    write_port(0x40, divisor & 0xFF);        // Low byte
-    write_port(0x40, (divisor >> 8) & 0xFF); // High byte
+    global_timer.divisor = (uint16_t)(PIT_FREQUENCY / frequency_hz);
+
+    // Mode 2 rather than square wave: the counter then runs divisor..1 once
+    // per tick, so reading it gives the phase within the tick
+    pit_program(PIT_MODE_PERIODIC, global_timer.divisor);
     
     // Initialize timer state
     global_timer.ticks = 0;
     global_timer.frequency = frequency_hz;
     global_timer.is_active = false;
     global_timer.tick_handler = NULL;
+    global_timer.tick_tsc = 0;
+    global_timer.tsc_per_tick = 0;
+    global_timer.calib_tsc = 0;
+    global_timer.calib_ticks = 0;
+    global_timer.clock_seq = 0;
+    global_timer.oneshot = false;
+    global_timer.idle_entries = 0;
+    global_timer.ticks_skipped = 0;
     
     console_println_color("Timer initialized", CONSOLE_SUCCESS_COLOR);
 }
 
 // Timer interrupt handler (called from assembly)
 void timer_interrupt_handler(void) {
-    // Increment tick counter
-    global_timer.ticks++;
+    scheduler_account_irq_enter();
+
+    // Increment tick counter; a one-shot covers every tick of the idle period
+    if (global_timer.oneshot) {
+        global_timer.ticks_skipped += global_timer.oneshot_ticks - 1;
+        timer_leave_oneshot(global_timer.oneshot_ticks);
+    } else {
+        timer_advance(1);
+    }
     
+    // EOI before the tick handler: it may switch tasks, and this frame only
+    // unwinds when the preempted task is resumed. IF stays clear until iretq.
+    write_port(0x20, 0x20);
+
+    // Delayed work first: the tick handler may switch away from this frame
+    workqueue_timer_tick();
+
     // Call registered tick handler if present
     if (global_timer.tick_handler) {
         global_timer.tick_handler();
     }
-    
-    // Send EOI (End of Interrupt) to PIC
-    write_port(0x20, 0x20);
+    scheduler_account_irq_exit();
 }
 
 // Enable timer interrupts
@@ -65,6 +144,40 @@ uint64_t timer_get_ticks(void) {
     return global_timer.ticks;
 }
 
+/*
+ * Nanoseconds since boot: whole ticks plus the TSC time since the latest
+ * one, capped below a tick so the value never passes the next tick's. Falls
+ * back to tick resolution until the TSC rate is calibrated.
+ */
+uint64_t timer_clock_ns(void) {
+    if (global_timer.frequency == 0) {
+        return 0;
+    }
+    uint64_t ns_per_tick = 1000000000ull / global_timer.frequency;
+    uint32_t seq;
+    uint64_t ticks, stamp, per_tick;
+    do {
+        seq = __atomic_load_n(&global_timer.clock_seq, __ATOMIC_ACQUIRE);
+        ticks = global_timer.ticks;
+        stamp = global_timer.tick_tsc;
+        per_tick = global_timer.tsc_per_tick;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&global_timer.clock_seq, __ATOMIC_RELAXED));
+
+    uint64_t ns = ticks * ns_per_tick;
+    if (per_tick == 0) {
+        return ns;
+    }
+    int64_t cycles = (int64_t)(rdtsc() - stamp);  // negative with TSC skew between CPUs
+    if (cycles <= 0) {
+        return ns;
+    }
+    if ((uint64_t)cycles >= per_tick) {
+        cycles = (int64_t)per_tick - 1;  // tick overdue or the PIT is one-shot
+    }
+    return ns + (uint64_t)cycles * ns_per_tick / per_tick;
+}
+
 // Get uptime in milliseconds
 uint64_t timer_get_uptime_ms(void) {
     return (global_timer.ticks * 1000) / global_timer.frequency;
@@ -78,12 +191,139 @@ void timer_set_tick_handler(void (*handler)(void)) {
 
 // Delay for specified milliseconds
 void timer_delay_ms(uint32_t ms) {
+    // From a task: block on the sleep queue so other tasks get the CPU
+    if (scheduler_sleep_ms(ms) == 0) {
+        return;
+    }
+
+    // Boot / shell context has nothing to switch to: halt until the target tick
     uint64_t start_ticks = global_timer.ticks;
     uint64_t target_ticks = start_ticks + timer_ms_to_ticks(ms);
-    
+    uint64_t flags = local_irq_save();
+
     while (global_timer.ticks < target_ticks) {
-        // Busy wait - in a real system this would yield CPU
-        __asm__ volatile("pause");
+        if (global_timer.is_active) {
+            timer_idle_halt(target_ticks);
+        } else {
+            __asm__ volatile("pause");
+        }
+    }
+    local_irq_restore(flags);
+}
+
+/* Wait for an interrupt with interrupts off on entry; the time is the CPU's idle time. */
+static void timer_halt(void) {
+    scheduler_account_halt(true);
+    __asm__ volatile("sti; hlt; cli" ::: "memory");
+    scheduler_account_halt(false);
+}
+
+/*
+ * An AP stops its own LAPIC tick: one interrupt at its next event, then the
+ * periodic tick again. Its clock is still the BSP's PIT tick, which may
+ * itself be stopped; the BSP armed that one-shot for the earliest event of
+ * every CPU, so it only needs a kick when this CPU now wants the tick
+ * earlier, or is leaving idle with work to do.
+ */
+static void timer_idle_halt_ap(void) {
+    uint64_t now = global_timer.ticks;
+    uint64_t next = scheduler_next_event_tick();
+    uint64_t delta = next > now ? next - now : 0;
+    if (global_timer.oneshot && next < now + global_timer.oneshot_ticks) {
+        smp_send_resched(0);
+    }
+    if (!smp_timer_oneshot(delta)) {
+        timer_halt();
+        return;
+    }
+    timer_halt();
+    smp_timer_periodic();
+    if (global_timer.oneshot && scheduler_next_event_tick() <= global_timer.ticks + 1) {
+        smp_send_resched(0);
+    }
+}
+
+/*
+ * Tickless idle. With nothing to run, the periodic tick is stopped and the
+ * PIT armed once for the earliest deadline: the caller's, or the first
+ * sleeper's. The PIT counts at most ~55 ms, so a long idle period is a
+ * chain of one-shots; still 20 interrupts a second instead of 100.
+ *
+ * Time is caught up when the tick resumes: by the one-shot interrupt for
+ * the whole period, or, if another interrupt ended the halt early, from the
+ * PIT count, rounded to the nearest tick.
+ *
+ * The PIT tick is every CPU's clock (their sleepers wait on
+ * timer_get_ticks), so with APs up the BSP only stops it while all of them
+ * are idle, until the first event on any of them. APs stop their LAPIC
+ * tick on their own (timer_idle_halt_ap).
+ */
+void timer_idle_halt(uint64_t deadline_tick) {
+    if (smp_cpu_id() != 0) {
+        timer_idle_halt_ap();
+        return;
+    }
+    uint64_t now = global_timer.ticks;
+    uint64_t next = scheduler_next_event_tick();
+    for (uint32_t cpu = 1; cpu < SMP_MAX_CPUS && next > now + 1; cpu++) {
+        uint64_t t = scheduler_next_event_tick_cpu(cpu);
+        if (t < next) {
+            next = t;
+        }
+    }
+    uint64_t work_due = workqueue_next_expiry();
+    if (work_due < next) {
+        next = work_due;
+    }
+    if (deadline_tick < next) {
+        next = deadline_tick;
+    }
+    uint64_t max_ticks = PIT_MAX_COUNT / global_timer.divisor;
+    uint64_t delta = next > now ? next - now : 0;
+
+    if (!global_timer.is_active || global_timer.oneshot || delta < 2 || max_ticks < 2) {
+        timer_halt();
+        return;
+    }
+    if (delta > max_ticks) {
+        delta = max_ticks;
+    }
+
+    // Arm for the end of tick now + delta: what is left of this tick, then delta - 1 more
+    uint16_t left = pit_read_count();
+    if (left == 0 || left > global_timer.divisor) {
+        left = global_timer.divisor;
+    }
+    uint32_t phase = global_timer.divisor - left;
+    uint32_t count = (uint32_t)left + (uint32_t)(delta - 1) * global_timer.divisor;
+    pit_program(PIT_MODE_ONESHOT, (uint16_t)count);
+    global_timer.oneshot = true;
+    global_timer.oneshot_ticks = delta;
+    global_timer.idle_entries++;
+
+    timer_halt();
+    if (!global_timer.oneshot) {
+        return;  // the one-shot fired and its interrupt caught up
+    }
+
+    // Woken early by another interrupt. A count past the armed value means
+    // the terminal count went by; its interrupt is pending and will catch up.
+    uint16_t remaining = pit_read_count();
+    if (remaining == 0 || remaining > count) {
+        return;
+    }
+    uint64_t elapsed = phase + (count - remaining);
+    uint64_t ticks = elapsed / global_timer.divisor;
+    if ((elapsed % global_timer.divisor) * 2 >= global_timer.divisor) {
+        ticks++;
+    }
+    global_timer.ticks_skipped += ticks;
+    timer_leave_oneshot(ticks);
+    if (ticks > 0) {
+        workqueue_timer_tick();
+    }
+    if (ticks > 0 && global_timer.tick_handler) {
+        global_timer.tick_handler();
     }
 }
 
@@ -96,3 +336,10 @@ uint64_t timer_ticks_to_ms(uint64_t ticks) {
 uint64_t timer_ms_to_ticks(uint64_t ms) {
     return (ms * global_timer.frequency) / 1000;
 }
+
+uint64_t timer_cycles_to_us(uint64_t cycles) {
+    if (global_timer.tsc_per_tick == 0 || global_timer.frequency == 0) {
+        return 0;
+    }
+    return cycles * (1000000 / global_timer.frequency) / global_timer.tsc_per_tick;
+}
@@ -104,3 +104,19 @@ void int_to_str(int num, char *str) {
     }
 }
 
+
+// Convert unsigned 64-bit integer to string (up to 20 digits)
+void u64_to_str(uint64_t num, char *str) {
+    char digits[20];
+    int i = 0;
+    do {
+        digits[i++] = (char)('0' + num % 10);
+        num /= 10;
+    } while (num != 0);
+
+    int j = 0;
+    while (i > 0) {
+        str[j++] = digits[--i];
+    }
+    str[j] = '\0';
+}
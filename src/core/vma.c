@@ -0,0 +1,1426 @@
+// src/core/vma.c — mmap areas per root, #PF demand paging, shared zero page + COW,
+// file mappings on page-cache frames, transparent huge pages, clock reclaim + swap
+#include "../includes/vma.h"
+#include "../includes/vmm.h"
+#include "../includes/memory.h"
+#include "../includes/kstack.h"
+#include "../includes/filesystem_pop.h"
+#include "../includes/swap.h"
+#include "../includes/scheduler.h"
+#include "../includes/timer.h"
+#include "../includes/smp.h"
+#include "../includes/spinlock.h"
+#include "../includes/wait.h"
+#include "../includes/workqueue.h"
+#include "../includes/utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Static pools, same approach as the scheduler's task pool. */
+#define VMA_MAX_AREAS  256u
+#define VMA_MAX_SPACES 32u
+
+static VmArea vma_pool[VMA_MAX_AREAS];
+static VmArea* vma_free_list;
+static VmSpace vma_spaces[VMA_MAX_SPACES];
+
+/* One zeroed frame, pinned, mapped read-only wherever an anonymous page is only read. */
+static uint64_t vma_zero_phys;
+
+/*
+ * Locking. Each space's lock covers its area list, its page tables and its
+ * counters; the free area list, the space table, the collapse scan and the
+ * reclaim clock have a lock each. Order: vma_spaces_lock, then a space, then
+ * vma_area_lock. The collapse scan and the clock hands only trylock a
+ * space and pass a busy one over; the reclaim task writes pages out with no
+ * lock held. Remote TLBs are shot down with the space lock held.
+ */
+static Spinlock vma_area_lock = SPINLOCK_INIT;
+static Spinlock vma_spaces_lock = SPINLOCK_INIT;
+static Spinlock vma_collapse_lock = SPINLOCK_INIT;
+static Spinlock vma_clock_lock = SPINLOCK_INIT;
+
+static inline uint64_t vma_page_down(uint64_t a) { return a & ~(uint64_t)(PAGE_SIZE - 1); }
+static inline uint64_t vma_page_up(uint64_t a) { return (a + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1); }
+static inline uint64_t vma_huge_down(uint64_t a) { return a & ~(uint64_t)(PMM_HUGE_SIZE - 1); }
+static inline uint64_t vma_huge_up(uint64_t a) { return (a + PMM_HUGE_SIZE - 1) & ~(uint64_t)(PMM_HUGE_SIZE - 1); }
+
+/* Fault handlers' result when only a frame was missing; -1 is a real fault. */
+#define VMA_FAULT_NOMEM (-2)
+
+static int vma_split_huge(VmSpace* space, uint64_t hstart);
+static bool vma_reclaim_busy(void);
+
+static bool vma_trylock(Spinlock* l, uint64_t* irq) {
+    *irq = local_irq_save();
+    if (spin_trylock(l)) {
+        return true;
+    }
+    local_irq_restore(*irq);
+    return false;
+}
+
+uint64_t vma_space_lock(VmSpace* space) {
+    return spin_lock_irqsave(&space->lock);
+}
+
+void vma_space_unlock(VmSpace* space, uint64_t irq) {
+    spin_unlock_irqrestore(&space->lock, irq);
+}
+
+/* Drop translations of [start, start + pages * 4K) in space, here and on every other CPU. */
+static void vma_flush(const VmSpace* space, uint64_t start, uint64_t pages) {
+    uint64_t cr3 = vmm_get_cr3();
+    if (VMM_ENTRY_ADDR(cr3) == space->pml4_phys) {
+        if (pages > 32u) {
+            vmm_load_cr3(cr3);
+        } else {
+            for (uint64_t i = 0; i < pages; i++) {
+                vmm_invalidate_page((uintptr_t)(start + i * PAGE_SIZE));
+            }
+        }
+    }
+    smp_tlb_shootdown(space->pml4_phys, start, pages);
+}
+
+static VmArea* vma_area_alloc(void) {
+    uint64_t irq = spin_lock_irqsave(&vma_area_lock);
+    VmArea* a = vma_free_list;
+    if (a) {
+        vma_free_list = a->next;
+    }
+    spin_unlock_irqrestore(&vma_area_lock, irq);
+    if (a) {
+        memset(a, 0, sizeof *a);
+    }
+    return a;
+}
+
+static void vma_area_free(VmArea* a) {
+    uint64_t irq = spin_lock_irqsave(&vma_area_lock);
+    a->next = vma_free_list;
+    vma_free_list = a;
+    spin_unlock_irqrestore(&vma_area_lock, irq);
+}
+
+void vma_init(void) {
+    vma_free_list = NULL;
+    for (uint32_t i = VMA_MAX_AREAS; i > 0; i--) {
+        vma_area_free(&vma_pool[i - 1]);
+    }
+    memset(vma_spaces, 0, sizeof vma_spaces);
+
+    vma_zero_phys = pmm_alloc_frame(MEM_ALLOC_ZERO);
+    if (vma_zero_phys != 0) {
+        pmm_frame_pin(vma_zero_phys);
+    }
+    vma_space_create(vmm_kernel_pml4());
+}
+
+uint64_t vma_zero_page(void) { return vma_zero_phys; }
+
+static VmSpace* vma_space_lookup(uint64_t pml4_phys) {
+    for (uint32_t i = 0; i < VMA_MAX_SPACES; i++) {
+        if (vma_spaces[i].in_use && vma_spaces[i].pml4_phys == pml4_phys) {
+            return &vma_spaces[i];
+        }
+    }
+    return NULL;
+}
+
+VmSpace* vma_space_for(uint64_t pml4_phys) {
+    uint64_t irq = spin_lock_irqsave(&vma_spaces_lock);
+    VmSpace* s = vma_space_lookup(VMM_ENTRY_ADDR(pml4_phys));
+    spin_unlock_irqrestore(&vma_spaces_lock, irq);
+    return s;
+}
+
+VmSpace* vma_current_space(void) {
+    return vma_space_for(vmm_get_cr3());
+}
+
+VmSpace* vma_space_create(uint64_t pml4_phys) {
+    if (pml4_phys == 0) {
+        return NULL;
+    }
+    uint64_t irq = spin_lock_irqsave(&vma_spaces_lock);
+    VmSpace* s = vma_space_lookup(VMM_ENTRY_ADDR(pml4_phys));
+    for (uint32_t i = 0; !s && i < VMA_MAX_SPACES; i++) {
+        if (!vma_spaces[i].in_use) {
+            s = &vma_spaces[i];
+            uint64_t sirq = spin_lock_irqsave(&s->lock);
+            memset(s, 0, offsetof(VmSpace, lock));
+            s->pml4_phys = VMM_ENTRY_ADDR(pml4_phys);
+            s->in_use = true;
+            spin_unlock_irqrestore(&s->lock, sirq);
+        }
+    }
+    spin_unlock_irqrestore(&vma_spaces_lock, irq);
+    return s;
+}
+
+/*
+ * Pages cleared by vma_zap_range whose frames are not freed yet: another CPU
+ * may still reach them through its TLB until the range is shot down.
+ */
+#define VMA_ZAP_BATCH 32u
+
+typedef struct {
+    VmSpace* space;
+    bool flush;          /* false: the root is loaded on no CPU */
+    uint64_t lo;         /* cleared range not yet flushed */
+    uint64_t hi;
+    uint32_t nr;
+    uint64_t frames[VMA_ZAP_BATCH];
+} VmaZap;
+
+static void vma_zap_finish(VmaZap* z) {
+    if (z->flush && z->hi > z->lo) {
+        vma_flush(z->space, z->lo, (z->hi - z->lo) / PAGE_SIZE);
+    }
+    for (uint32_t i = 0; i < z->nr; i++) {
+        pmm_frame_put(z->frames[i]);
+    }
+    z->nr = 0;
+    z->lo = UINT64_MAX;
+    z->hi = 0;
+}
+
+static void vma_zap_page(VmaZap* z, uint64_t va, uint64_t phys) {
+    if (va < z->lo) {
+        z->lo = va;
+    }
+    if (va + PAGE_SIZE > z->hi) {
+        z->hi = va + PAGE_SIZE;
+    }
+    if (phys != 0) {
+        z->frames[z->nr++] = phys;
+        if (z->nr == VMA_ZAP_BATCH) {
+            vma_zap_finish(z);
+        }
+    }
+}
+
+/*
+ * Drop whatever is mapped in [start, end) of one area; the area list is
+ * untouched. A huge leaf the range only partly covers is split first; if
+ * that fails, -1 with the block still mapped (callers split with
+ * vma_split_edges up front to fail before unmapping anything). Teardown
+ * (flush false) drops such a block whole instead.
+ */
+static int vma_zap_range(VmSpace* space, const VmArea* a, uint64_t start, uint64_t end, bool flush) {
+    if ((a->flags & (VMA_FLAG_FILE | VMA_FLAG_SHARED)) == (VMA_FLAG_FILE | VMA_FLAG_SHARED)) {
+        fs_file_sync(a->file);  /* write back before the cache frames lose this mapper */
+    }
+    VmaZap z = {.space = space, .flush = flush, .lo = UINT64_MAX, .hi = 0, .nr = 0};
+    int rc = 0;
+    uint64_t va = start;
+    while (va < end) {
+        uint64_t pde = vmm_query_pde(space->pml4_phys, va);
+        uint64_t next_2m = vma_huge_down(va) + PMM_HUGE_SIZE;
+        if ((pde & VMM_PTE_P) == 0) {
+            va = next_2m < end ? next_2m : end; /* no leaf table: nothing mapped here */
+            continue;
+        }
+        if (pde & VMM_PTE_PS) {
+            uint64_t h = vma_huge_down(va);
+            bool whole = h >= start && h + PMM_HUGE_SIZE <= end;
+            if (!whole && vma_split_huge(space, h) == 0) {
+                continue; /* now 4 KiB entries: zap just the requested part */
+            }
+            if (!whole && flush) {
+                rc = -1;
+                break;
+            }
+            vmm_unmap_2m(space->pml4_phys, h);
+            if (flush) {
+                vma_flush(space, h, 1);  /* one invlpg drops the whole 2 MiB entry */
+            }
+            pmm_huge_put(VMM_ENTRY_ADDR(pde));
+            space->resident_pages -= space->resident_pages < 512u ? space->resident_pages : 512u;
+            va = next_2m;
+            continue;
+        }
+
+        uint64_t e = vmm_query(space->pml4_phys, va);
+        if (e & VMM_PTE_P) {
+            uint64_t phys = VMM_ENTRY_ADDR(e);
+            vmm_unmap_4k(space->pml4_phys, va);
+            if (phys != vma_zero_phys) {
+                if (space->resident_pages > 0) {
+                    space->resident_pages--;
+                }
+            } else {
+                phys = 0;
+            }
+            vma_zap_page(&z, va, phys);
+        } else if (swap_pte_is(e)) {
+            if (!swap_pte_busy(e)) {
+                swap_free(swap_pte_slot(e));  /* a busy slot is freed by its swap-in */
+            }
+            vmm_set_pte(space->pml4_phys, va, 0);
+            if (space->swapped_pages > 0) {
+                space->swapped_pages--;
+            }
+        }
+        va += PAGE_SIZE;
+    }
+    vma_zap_finish(&z);
+    return rc;
+}
+
+/*
+ * Split the huge leaves that [start, end), or an area edge inside it, cuts
+ * through, so zapping the range area by area never has to. -1, with
+ * nothing unmapped, if one of them cannot be split.
+ */
+static int vma_split_edges(VmSpace* space, uint64_t start, uint64_t end) {
+    for (const VmArea* a = space->areas; a && a->start < end; a = a->next) {
+        if (a->end <= start) {
+            continue;
+        }
+        uint64_t cut[2] = {a->start > start ? a->start : start, a->end < end ? a->end : end};
+        for (uint32_t i = 0; i < 2; i++) {
+            if ((cut[i] & (PMM_HUGE_SIZE - 1)) == 0) {
+                continue;
+            }
+            uint64_t h = vma_huge_down(cut[i]);
+            uint64_t pde = vmm_query_pde(space->pml4_phys, h);
+            if ((pde & VMM_PTE_P) && (pde & VMM_PTE_PS) && vma_split_huge(space, h) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * The caller (the scheduler, holding its own lock) has made sure no CPU has
+ * the root loaded, so there is nothing to shoot down.
+ */
+void vma_space_destroy(VmSpace* space) {
+    if (!space) {
+        return;
+    }
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    if (!space->in_use) {
+        spin_unlock_irqrestore(&space->lock, irq);
+        return;
+    }
+    VmArea* a = space->areas;
+    while (a) {
+        VmArea* next = a->next;
+        vma_zap_range(space, a, a->start, a->end, false);
+        vma_area_free(a);
+        a = next;
+    }
+    space->areas = NULL;
+    spin_unlock_irqrestore(&space->lock, irq);
+
+    irq = spin_lock_irqsave(&vma_spaces_lock);
+    uint64_t sirq = spin_lock_irqsave(&space->lock);
+    space->in_use = false;
+    spin_unlock_irqrestore(&space->lock, sirq);
+    spin_unlock_irqrestore(&vma_spaces_lock, irq);
+}
+
+VmArea* vma_find(VmSpace* space, uint64_t addr) {
+    if (!space) {
+        return NULL;
+    }
+    for (VmArea* a = space->areas; a; a = a->next) {
+        if (addr < a->start) {
+            return NULL; /* sorted: nothing further can contain addr */
+        }
+        if (addr < a->end) {
+            return a;
+        }
+    }
+    return NULL;
+}
+
+static bool vma_range_free(VmSpace* space, uint64_t start, uint64_t len) {
+    uint64_t end = start + len;
+    for (VmArea* a = space->areas; a; a = a->next) {
+        if (a->start >= end) {
+            break;
+        }
+        if (a->end > start) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* First fit above VMM_USER_BASE, start aligned to align (a power of two). */
+static uint64_t vma_find_gap(VmSpace* space, uint64_t len, uint64_t align) {
+    uint64_t cand = VMM_USER_BASE;
+    for (VmArea* a = space->areas; a; a = a->next) {
+        if (a->start >= cand + len) {
+            break;
+        }
+        if (a->end > cand) {
+            cand = (a->end + align - 1) & ~(align - 1);
+        }
+    }
+    if (cand + len > VMM_USER_END || cand + len < cand) {
+        return 0;
+    }
+    return cand;
+}
+
+static void vma_insert(VmSpace* space, VmArea* area) {
+    VmArea** pp = &space->areas;
+    while (*pp && (*pp)->start < area->start) {
+        pp = &(*pp)->next;
+    }
+    area->next = *pp;
+    *pp = area;
+}
+
+static VmArea* vma_map_area(VmSpace* space, uint64_t hint, uint64_t len, uint32_t prot, uint32_t flags) {
+    if (!space || len == 0) {
+        return NULL;
+    }
+    len = vma_page_up(len);
+    if (len == 0 || len > VMM_USER_END - VMM_USER_BASE) {
+        return NULL;
+    }
+
+    uint64_t start = 0;
+    if (hint != 0 && (hint & (PAGE_SIZE - 1)) == 0 && hint >= VMM_USER_BASE &&
+        hint + len <= VMM_USER_END && vma_range_free(space, hint, len)) {
+        start = hint;
+    } else {
+        /* Big anonymous areas start 2 MiB aligned so huge pages can back them. */
+        uint64_t align = ((flags & VMA_FLAG_ANON) && len >= PMM_HUGE_SIZE) ? PMM_HUGE_SIZE : PAGE_SIZE;
+        start = vma_find_gap(space, len, align);
+    }
+    if (start == 0) {
+        return NULL;
+    }
+
+    VmArea* a = vma_area_alloc();
+    if (!a) {
+        return NULL;
+    }
+    a->start = start;
+    a->end = start + len;
+    a->prot = prot;
+    a->flags = flags;
+    a->file = -1;
+    vma_insert(space, a);
+    return a;
+}
+
+uint64_t vma_map_anon(VmSpace* space, uint64_t hint, uint64_t len, uint32_t prot) {
+    if (!space) {
+        return 0;
+    }
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    VmArea* a = vma_map_area(space, hint, len, prot, VMA_FLAG_ANON);
+    uint64_t start = a ? a->start : 0;
+    spin_unlock_irqrestore(&space->lock, irq);
+    return start;
+}
+
+uint64_t vma_map_file(VmSpace* space, uint64_t hint, uint64_t len, uint32_t prot,
+                      int file, uint64_t pgoff, bool shared) {
+    if (file < 0 || !space) {
+        return 0;
+    }
+    uint32_t flags = VMA_FLAG_FILE | (shared ? VMA_FLAG_SHARED : 0);
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    VmArea* a = vma_map_area(space, hint, len, prot, flags);
+    uint64_t start = 0;
+    if (a) {
+        a->file = file;
+        a->file_pgoff = pgoff;
+        start = a->start;
+    }
+    spin_unlock_irqrestore(&space->lock, irq);
+    return start;
+}
+
+/* Split a at addr (page aligned, strictly inside): a keeps [start, addr). NULL if out of slots. */
+static VmArea* vma_split(VmArea* a, uint64_t addr) {
+    VmArea* tail = vma_area_alloc();
+    if (!tail) {
+        return NULL;
+    }
+    *tail = *a;
+    tail->start = addr;
+    tail->file_pgoff += (addr - a->start) / PAGE_SIZE;
+    a->end = addr;
+    a->next = tail;
+    return tail;
+}
+
+int vma_unmap(VmSpace* space, uint64_t addr, uint64_t len) {
+    if (!space || len == 0 || (addr & (PAGE_SIZE - 1)) != 0) {
+        return -1;
+    }
+    uint64_t end = addr + vma_page_up(len);
+    if (end < addr) {
+        return -1;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    if (vma_split_edges(space, addr, end) != 0) {
+        spin_unlock_irqrestore(&space->lock, irq);
+        return -1;
+    }
+    VmArea** pp = &space->areas;
+    while (*pp) {
+        VmArea* a = *pp;
+        if (a->start >= end) {
+            break;
+        }
+        if (a->end <= addr) {
+            pp = &a->next;
+            continue;
+        }
+        uint64_t zs = a->start > addr ? a->start : addr;
+        uint64_t ze = a->end < end ? a->end : end;
+        /* Hole in the middle (the only area in range): move the tail to a new area first. */
+        if (zs > a->start && ze < a->end && !vma_split(a, ze)) {
+            spin_unlock_irqrestore(&space->lock, irq);
+            return -1;
+        }
+        if (vma_zap_range(space, a, zs, ze, true) != 0) {
+            spin_unlock_irqrestore(&space->lock, irq);
+            return -1;
+        }
+
+        if (zs == a->start && ze == a->end) {
+            *pp = a->next;
+            vma_area_free(a);
+            continue;
+        }
+        if (zs == a->start) {
+            a->file_pgoff += (ze - a->start) / PAGE_SIZE;
+            a->start = ze;
+        } else {
+            a->end = zs;
+        }
+        pp = &a->next;
+    }
+    spin_unlock_irqrestore(&space->lock, irq);
+    return 0;
+}
+
+static uint64_t vma_leaf_flags(const VmArea* a, bool writable) {
+    uint64_t f = VMM_PTE_P | VMM_PTE_US;
+    if (writable) {
+        f |= VMM_PTE_RW;
+    }
+    if ((a->prot & VMA_PROT_EXEC) == 0) {
+        f |= VMM_PTE_NX;
+    }
+    return f;
+}
+
+/*
+ * Write to a present read-only page of a writable area: the zero page or a
+ * frame someone else still references gets a private copy; a frame this space
+ * owns alone is simply made writable.
+ */
+static int vma_cow(VmSpace* space, const VmArea* a, uint64_t page) {
+    uint64_t e = vmm_query(space->pml4_phys, page);
+    if ((e & VMM_PTE_P) == 0 || (e & VMM_PTE_PS)) {
+        return -1; /* huge leaves are always mapped writable in writable areas */
+    }
+    uint64_t old = VMM_ENTRY_ADDR(e);
+    uint64_t flags = vma_leaf_flags(a, true);
+
+    /* Shared file pages are written in place; the cache frame is the file. */
+    if ((a->flags & VMA_FLAG_SHARED) || (old != vma_zero_phys && pmm_frame_refcount(old) == 1)) {
+        return vmm_map_4k(space->pml4_phys, page, old, flags);
+    }
+
+    uint64_t frame;
+    if (old == vma_zero_phys) {
+        frame = pmm_alloc_frame(MEM_ALLOC_ZERO);
+    } else {
+        frame = pmm_alloc_frame(MEM_ALLOC_NORMAL);
+        if (frame != 0) {
+            memory_copy((void*)(uintptr_t)frame, (const void*)(uintptr_t)old, PAGE_SIZE);
+        }
+    }
+    if (frame == 0) {
+        return VMA_FAULT_NOMEM;
+    }
+    if (vmm_map_4k(space->pml4_phys, page, frame, flags) != 0) {
+        pmm_frame_put(frame);
+        return -1;
+    }
+    /* Other CPUs may still read the old frame through their TLB. */
+    vma_flush(space, page, 1);
+    if (old == vma_zero_phys) {
+        space->resident_pages++;
+    } else {
+        pmm_frame_put(old);
+    }
+    space->cow_copies++;
+    return 0;
+}
+
+/*
+ * Not-present fault in a file area: map the page-cache frame itself. Shared
+ * areas (and reads of private ones) use it directly; a write to a private area
+ * maps it read-only first and lets vma_cow make the private copy.
+ */
+static int vma_file_fault(VmSpace* space, const VmArea* a, uint64_t page, bool write) {
+    uint64_t pgoff = a->file_pgoff + (page - a->start) / PAGE_SIZE;
+    uint64_t frame = fs_page_get(a->file, pgoff);
+    if (frame == 0) {
+        return -1; /* past the end of the file */
+    }
+    const bool shared = (a->flags & VMA_FLAG_SHARED) != 0;
+    const bool rw = shared && (a->prot & VMA_PROT_WRITE) != 0;
+    if (vmm_map_4k(space->pml4_phys, page, frame, vma_leaf_flags(a, rw)) != 0) {
+        pmm_frame_put(frame);
+        return -1;
+    }
+    space->resident_pages++;
+    space->file_maps++;
+    if (write && !shared) {
+        return vma_cow(space, a, page);
+    }
+    return 0;
+}
+
+/*
+ * Transparent huge pages: a writable anonymous area gets a 2 MiB frame for
+ * each aligned 2 MiB block it fully contains, as long as no leaf table exists
+ * there yet. Otherwise (no aligned huge frame, or some 4 KiB pages already
+ * mapped) the block stays on 4 KiB pages and the collapse thread may merge it
+ * once every page is populated.
+ */
+static bool vma_thp_block(const VmArea* a, uint64_t addr, uint64_t* hstart) {
+    if ((a->flags & VMA_FLAG_ANON) == 0 || (a->prot & VMA_PROT_WRITE) == 0) {
+        return false;
+    }
+    uint64_t h = vma_huge_down(addr);
+    if (h < a->start || h + PMM_HUGE_SIZE > a->end) {
+        return false;
+    }
+    *hstart = h;
+    return true;
+}
+
+static int vma_thp_map(VmSpace* space, const VmArea* a, uint64_t hstart) {
+    if (vmm_query_pde(space->pml4_phys, hstart) != 0) {
+        return -1;
+    }
+    uint64_t huge = pmm_alloc_huge(MEM_ALLOC_ZERO);
+    if (huge == 0) {
+        space->thp_fallbacks++;
+        return -1;
+    }
+    if (vmm_map_2m(space->pml4_phys, hstart, huge, vma_leaf_flags(a, true)) != 0) {
+        pmm_huge_put(huge);
+        space->thp_fallbacks++;
+        return -1;
+    }
+    space->resident_pages += 512u;
+    space->thp_maps++;
+    return 0;
+}
+
+/* Break a huge leaf into 512 PTEs (partial unmap / DONTNEED). */
+static int vma_split_huge(VmSpace* space, uint64_t hstart) {
+    uint64_t phys = VMM_ENTRY_ADDR(vmm_query_pde(space->pml4_phys, hstart));
+    if (!pmm_is_huge(phys) || pmm_frame_refcount(phys) != 1) {
+        return -1;
+    }
+    if (vmm_split_2m(space->pml4_phys, hstart) != 0) {
+        return -1;
+    }
+    pmm_huge_demote(phys);
+    space->thp_splits++;
+    return 0;
+}
+
+/*
+ * Not-present fault in an anonymous area. Only a write takes a huge frame;
+ * a read maps the zero page like anywhere else, so scanning a big area does
+ * not fill it with zeroed 2 MiB frames.
+ */
+static int vma_anon_fault(VmSpace* space, const VmArea* a, uint64_t page, bool write) {
+    uint64_t hstart;
+    if (write && vma_thp_block(a, page, &hstart) && vma_thp_map(space, a, hstart) == 0) {
+        return 0;
+    }
+
+    if (!write && vma_zero_phys != 0) {
+        /* Read of an untouched page: share the zero frame, read-only. */
+        if (vmm_map_4k(space->pml4_phys, page, vma_zero_phys, vma_leaf_flags(a, false)) != 0) {
+            return -1;
+        }
+        space->zero_page_maps++;
+        return 0;
+    }
+
+    uint64_t frame = pmm_alloc_frame(MEM_ALLOC_ZERO);
+    if (frame == 0) {
+        return VMA_FAULT_NOMEM;
+    }
+    if (vmm_map_4k(space->pml4_phys, page, frame, vma_leaf_flags(a, true)) != 0) {
+        pmm_frame_put(frame);
+        return -1;
+    }
+    space->resident_pages++;
+    return 0;
+}
+
+#define VMA_POPULATE_BATCH 32u   /* frames[] lives on the 4 KiB #PF IST stack */
+#define VMA_RA_FILE_PAGES  4u   /* default fault-around for file areas */
+#define VMA_RA_SEQ_PAGES   16u  /* MADV_SEQUENTIAL window */
+
+/*
+ * Back every not-present page of [start, end) inside a. Frames are collected
+ * VMA_POPULATE_BATCH at a time and installed with one vmm_map_range call, so
+ * the table walk happens once per leaf table rather than once per page.
+ * Writable anonymous areas get private frames; read-only ones the zero page;
+ * file areas their page-cache frames (read-only unless shared and writable).
+ * Swap entries are left in place. Stops quietly at end of file. Returns 0, or -1 when out of memory.
+ */
+static int vma_populate_area(VmSpace* space, const VmArea* a, uint64_t start, uint64_t end) {
+    if ((a->prot & (VMA_PROT_READ | VMA_PROT_WRITE | VMA_PROT_EXEC)) == 0) {
+        return 0;
+    }
+    const bool file = (a->flags & VMA_FLAG_FILE) != 0;
+    const bool rw = (a->prot & VMA_PROT_WRITE) != 0 && (!file || (a->flags & VMA_FLAG_SHARED) != 0);
+    const uint64_t flags = vma_leaf_flags(a, rw);
+    uint64_t frames[VMA_POPULATE_BATCH];
+
+    for (uint64_t va = start; va < end;) {
+        uint64_t hstart;
+        if (!file && (va & (PMM_HUGE_SIZE - 1)) == 0 && va + PMM_HUGE_SIZE <= end &&
+            vma_thp_block(a, va, &hstart) && vma_thp_map(space, a, va) == 0) {
+            space->prefaulted_pages += 512u;
+            va += PMM_HUGE_SIZE;
+            continue;
+        }
+        uint64_t n = (end - va) / PAGE_SIZE;
+        if (n > (vma_huge_down(va) + PMM_HUGE_SIZE - va) / PAGE_SIZE) {
+            n = (vma_huge_down(va) + PMM_HUGE_SIZE - va) / PAGE_SIZE; /* one 2 MiB block per batch */
+        }
+        if (n > VMA_POPULATE_BATCH) {
+            n = VMA_POPULATE_BATCH;
+        }
+        bool eof = false;
+        bool oom = false;
+        for (uint64_t i = 0; i < n; i++) {
+            uint64_t page = va + i * PAGE_SIZE;
+            frames[i] = 0;
+            uint64_t e = vmm_query(space->pml4_phys, page);
+            if ((e & VMM_PTE_P) || swap_pte_is(e)) {
+                continue; /* swapped pages come back on their own fault */
+            }
+            if (file) {
+                frames[i] = fs_page_get(a->file, a->file_pgoff + (page - a->start) / PAGE_SIZE);
+                eof = frames[i] == 0;
+            } else if (rw || vma_zero_phys == 0) {
+                frames[i] = pmm_alloc_frame(MEM_ALLOC_ZERO);
+                oom = frames[i] == 0;
+            } else {
+                frames[i] = vma_zero_phys;
+            }
+            if (eof || oom) {
+                n = i;
+                break;
+            }
+        }
+
+        int64_t done = n ? vmm_map_range(space->pml4_phys, va, frames, n, flags) : 0;
+        if (done < 0) {
+            done = 0;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            if (frames[i] == 0 || frames[i] == vma_zero_phys) {
+                if (frames[i] != 0 && i < (uint64_t)done) {
+                    space->zero_page_maps++;
+                }
+                continue;
+            }
+            if (i >= (uint64_t)done) {
+                pmm_frame_put(frames[i]);
+                continue;
+            }
+            space->resident_pages++;
+            space->prefaulted_pages++;
+            if (file) {
+                space->file_maps++;
+            }
+        }
+        if (oom || (uint64_t)done < n) {
+            return -1;
+        }
+        if (eof) {
+            return 0;
+        }
+        va += n * PAGE_SIZE;
+    }
+    return 0;
+}
+
+/* Map ahead of a resolved fault according to the area's access hint. */
+static void vma_readahead(VmSpace* space, const VmArea* a, uint64_t page) {
+    uint64_t window = 0;
+    if (a->flags & VMA_FLAG_RANDOM) {
+        window = 0;
+    } else if (a->flags & VMA_FLAG_SEQ) {
+        window = VMA_RA_SEQ_PAGES;
+    } else if (a->flags & VMA_FLAG_FILE) {
+        window = VMA_RA_FILE_PAGES;
+    }
+    if (window == 0 || page + PAGE_SIZE >= a->end) {
+        return;
+    }
+    uint64_t end = page + PAGE_SIZE + window * PAGE_SIZE;
+    if (end > a->end || end < page) {
+        end = a->end;
+    }
+    (void)vma_populate_area(space, a, page + PAGE_SIZE, end);
+}
+
+static int vma_populate_locked(VmSpace* space, uint64_t addr, uint64_t len) {
+    uint64_t end = addr + vma_page_up(len);
+    if (end < addr) {
+        return -1;
+    }
+    for (VmArea* a = space->areas; a && a->start < end; a = a->next) {
+        if (a->end <= addr) {
+            continue;
+        }
+        uint64_t s = a->start > addr ? a->start : addr;
+        uint64_t e = a->end < end ? a->end : end;
+        if (vma_populate_area(space, a, s, e) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int vma_populate(VmSpace* space, uint64_t addr, uint64_t len) {
+    if (!space || len == 0 || (addr & (PAGE_SIZE - 1)) != 0) {
+        return -1;
+    }
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    int rc = vma_populate_locked(space, addr, len);
+    spin_unlock_irqrestore(&space->lock, irq);
+    return rc;
+}
+
+static int vma_advise_locked(VmSpace* space, uint64_t addr, uint64_t len, int advice) {
+    uint64_t end = addr + vma_page_up(len);
+    if (end < addr) {
+        return -1;
+    }
+
+    switch (advice) {
+    case VMA_ADVISE_WILLNEED:
+        return vma_populate_locked(space, addr, len);
+
+    case VMA_ADVISE_DONTNEED:
+        for (VmArea* a = space->areas; a && a->start < end; a = a->next) {
+            if (a->end > addr && (a->flags & VMA_FLAG_LOCKED)) {
+                return -1; /* locked pages stay resident */
+            }
+        }
+        if (vma_split_edges(space, addr, end) != 0) {
+            return -1;
+        }
+        for (VmArea* a = space->areas; a && a->start < end; a = a->next) {
+            if (a->end <= addr) {
+                continue;
+            }
+            uint64_t s = a->start > addr ? a->start : addr;
+            uint64_t e = a->end < end ? a->end : end;
+            if (vma_zap_range(space, a, s, e, true) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+
+    case VMA_ADVISE_NORMAL:
+    case VMA_ADVISE_RANDOM:
+    case VMA_ADVISE_SEQUENTIAL: {
+        uint32_t hint = advice == VMA_ADVISE_RANDOM ? VMA_FLAG_RANDOM
+                      : advice == VMA_ADVISE_SEQUENTIAL ? VMA_FLAG_SEQ : 0;
+        for (VmArea* a = space->areas; a && a->start < end; a = a->next) {
+            if (a->end <= addr) {
+                continue;
+            }
+            /* Hints are per area: split so only [addr, end) changes. */
+            if (a->start < addr) {
+                VmArea* tail = vma_split(a, addr);
+                if (!tail) {
+                    return -1;
+                }
+                continue; /* the loop moves on to tail */
+            }
+            if (a->end > end && !vma_split(a, end)) {
+                return -1;
+            }
+            a->flags = (a->flags & ~(VMA_FLAG_SEQ | VMA_FLAG_RANDOM)) | hint;
+        }
+        return 0;
+    }
+
+    default:
+        return -1;
+    }
+}
+
+int vma_advise(VmSpace* space, uint64_t addr, uint64_t len, int advice) {
+    if (!space || len == 0 || (addr & (PAGE_SIZE - 1)) != 0) {
+        return -1;
+    }
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    int rc = vma_advise_locked(space, addr, len, advice);
+    spin_unlock_irqrestore(&space->lock, irq);
+    return rc;
+}
+
+/*
+ * Swap-in runs in three steps, like vma_swap_out. Under the space lock the
+ * faulting page and the swapped neighbours of its aligned VMA_SWAP_CLUSTER
+ * block (likely wanted soon, while the disk is busy anyway) get a frame each
+ * and SWAP_PTE_BUSY on their entry: the slot now belongs to this fault, a
+ * second fault on the page retries, and a zap clears the entry but leaves
+ * the slot. The reads run with the lock dropped, preemption off, and for a
+ * user fault interrupts back on, so shootdowns and the tick get through;
+ * the task cannot switch away because this is the #PF stack. Back under the
+ * lock a page is mapped only if its entry is still the busy one.
+ */
+typedef struct {
+    uint64_t root;
+    uint32_t n;
+    uint64_t va[VMA_SWAP_CLUSTER];     /* [0] is the faulting page */
+    uint32_t slot[VMA_SWAP_CLUSTER];
+    uint64_t frame[VMA_SWAP_CLUSTER];
+} VmaSwapIn;
+
+static bool vma_swap_reserve_page(VmSpace* space, VmaSwapIn* sw, uint64_t va, uint64_t e) {
+    uint64_t frame = pmm_alloc_frame(MEM_ALLOC_NORMAL);
+    if (frame == 0) {
+        return false;
+    }
+    vmm_set_pte(space->pml4_phys, va, e | SWAP_PTE_BUSY);  /* not present: nothing cached */
+    sw->va[sw->n] = va;
+    sw->slot[sw->n] = swap_pte_slot(e);
+    sw->frame[sw->n] = frame;
+    sw->n++;
+    return true;
+}
+
+/* Step one, space lock held. 0 with sw->n == 0 when the page is already being read in. */
+static int vma_swap_reserve(VmSpace* space, const VmArea* a, uint64_t page, VmaSwapIn* sw) {
+    uint64_t e = vmm_query(space->pml4_phys, page);
+    sw->root = space->pml4_phys;
+    sw->n = 0;
+    if (swap_pte_busy(e)) {
+        return 0;  /* another CPU has it in flight: retry once it is mapped */
+    }
+    if (!vma_swap_reserve_page(space, sw, page, e)) {
+        return VMA_FAULT_NOMEM;
+    }
+    uint64_t base = page & ~((uint64_t)VMA_SWAP_CLUSTER * PAGE_SIZE - 1);
+    for (uint32_t i = 0; i < VMA_SWAP_CLUSTER; i++) {
+        uint64_t va = base + (uint64_t)i * PAGE_SIZE;
+        if (va == page || va < a->start || va >= a->end) {
+            continue;
+        }
+        e = vmm_query(space->pml4_phys, va);
+        if (swap_pte_is(e) && !swap_pte_busy(e) && !vma_swap_reserve_page(space, sw, va, e)) {
+            break; /* out of frames: the rest fault in later */
+        }
+    }
+    return 0;
+}
+
+/*
+ * Steps two and three, space lock not held. The faulting page is mapped
+ * with A already set so the clock cannot evict it again before the
+ * faulting instruction restarts; the neighbours are mapped cold. -1 if the
+ * faulting page could not be read; its entry is then left as it was.
+ */
+static int vma_swap_in_io(VmSpace* space, const VmaSwapIn* sw, bool user) {
+    bool ok[VMA_SWAP_CLUSTER];
+    scheduler_preempt_disable();
+    if (user) {
+        __asm__ volatile("sti" ::: "memory");  /* user mode always runs with IF set */
+    }
+    for (uint32_t i = 0; i < sw->n; i++) {
+        ok[i] = swap_read_page(sw->slot[i], sw->frame[i]) == 0;
+    }
+    __asm__ volatile("cli" ::: "memory");
+    scheduler_preempt_enable_no_resched();
+
+    int rc = 0;
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    bool same_space = space->in_use && space->pml4_phys == sw->root;
+    for (uint32_t i = 0; i < sw->n; i++) {
+        uint64_t va = sw->va[i];
+        uint32_t slot = sw->slot[i];
+        uint64_t busy = swap_pte_make(slot) | SWAP_PTE_BUSY;
+        bool held = same_space && vmm_query(sw->root, va) == busy;
+        const VmArea* a = held ? vma_find(space, va) : NULL;  /* prot may have changed */
+        if (a && ok[i] &&
+            vmm_map_4k(sw->root, va, sw->frame[i],
+                       vma_leaf_flags(a, (a->prot & VMA_PROT_WRITE) != 0) | (i == 0 ? VMM_PTE_A : 0)) == 0) {
+            swap_free(slot);
+            space->resident_pages++;
+            if (space->swapped_pages > 0) {
+                space->swapped_pages--;
+            }
+            space->swap_ins++;
+            continue;
+        }
+        if (held) {
+            vmm_set_pte(sw->root, va, swap_pte_make(slot));  /* still swapped; the slot goes back to the PTE */
+            if (i == 0) {
+                rc = -1;
+            }
+        } else {
+            swap_free(slot);  /* zapped meanwhile, which left the slot to us */
+        }
+        pmm_frame_put(sw->frame[i]);
+    }
+    spin_unlock_irqrestore(&space->lock, irq);
+    return rc;
+}
+
+static int vma_fault_locked(VmSpace* space, uint64_t error_code, uint64_t fault_addr, VmaSwapIn* sw) {
+    VmArea* a = vma_find(space, fault_addr);
+    if (!a) {
+        return -1;
+    }
+    space->faults++;
+
+    const bool write = (error_code & PF_ERR_WRITE) != 0;
+    if ((error_code & PF_ERR_FETCH) && (a->prot & VMA_PROT_EXEC) == 0) {
+        return -1;
+    }
+    if (write && (a->prot & VMA_PROT_WRITE) == 0) {
+        return -1;
+    }
+    if ((a->prot & (VMA_PROT_READ | VMA_PROT_WRITE | VMA_PROT_EXEC)) == 0) {
+        return -1;
+    }
+
+    uint64_t page = vma_page_down(fault_addr);
+    uint64_t cur = vmm_query(space->pml4_phys, page);
+    if ((cur & VMM_PTE_P) && (write ? (cur & VMM_PTE_RW) != 0 : (error_code & PF_ERR_PRESENT) == 0)) {
+        /* Another CPU resolved it (or collapsed the block) while we waited for the lock. */
+        vmm_invalidate_page((uintptr_t)page);
+        return 0;
+    }
+    if (error_code & PF_ERR_PRESENT) {
+        return write ? vma_cow(space, a, page) : -1;
+    }
+
+    if (swap_pte_is(vmm_query(space->pml4_phys, page))) {
+        return vma_swap_reserve(space, a, page, sw);
+    }
+    int rc = (a->flags & VMA_FLAG_FILE) ? vma_file_fault(space, a, page, write)
+                                        : vma_anon_fault(space, a, page, write);
+    if (rc == 0) {
+        vma_readahead(space, a, page);
+    }
+    return rc;
+}
+
+int vma_page_fault(uint64_t error_code, uint64_t fault_addr) {
+    if (kstack_contains(fault_addr)) {
+        return kstack_fault(error_code, fault_addr);
+    }
+    VmSpace* space = vma_current_space();
+    if (!space) {
+        return -1;
+    }
+    VmaSwapIn sw;
+    sw.n = 0;
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    int rc = vma_fault_locked(space, error_code, fault_addr, &sw);
+    spin_unlock_irqrestore(&space->lock, irq);
+    if (rc == 0 && sw.n > 0) {
+        rc = vma_swap_in_io(space, &sw, (error_code & PF_ERR_USER) != 0);
+    }
+    if (rc == VMA_FAULT_NOMEM && (error_code & PF_ERR_USER) && vma_reclaim_busy()) {
+        /* Reclaim is freeing frames: restart the instruction (the tick can
+         * preempt user mode, so the reclaim task gets to run) and fault again. */
+        return 0;
+    }
+    return rc;
+}
+
+/*
+ * Background collapse: a 2 MiB block of a huge-eligible area whose leaf table
+ * is fully populated with private frames (or the zero page) is copied into one
+ * huge frame and remapped with a single PDE.
+ */
+#define VMA_COLLAPSE_BLOCKS 8u   /* blocks examined per scan */
+#define VMA_COLLAPSE_MS     1000u /* pause between scans */
+
+/* Scan position and the frames being replaced; all under vma_collapse_lock. */
+static uint32_t vma_scan_space;
+static uint64_t vma_scan_addr;
+static uint64_t vma_collapse_old[512];
+
+static int vma_collapse_block(VmSpace* space, const VmArea* a, uint64_t h) {
+    uint64_t pde = vmm_query_pde(space->pml4_phys, h);
+    if ((pde & VMM_PTE_P) == 0 || (pde & VMM_PTE_PS)) {
+        return -1;
+    }
+    uint64_t* pt = (uint64_t*)(uintptr_t)VMM_ENTRY_ADDR(pde);
+    for (uint32_t i = 0; i < 512u; i++) {
+        uint64_t f = VMM_ENTRY_ADDR(pt[i]);
+        if ((pt[i] & VMM_PTE_P) == 0 || (f != vma_zero_phys && pmm_frame_refcount(f) != 1)) {
+            return -1;
+        }
+    }
+    uint64_t huge = pmm_alloc_huge(MEM_ALLOC_NORMAL);
+    if (huge == 0) {
+        return -1;
+    }
+
+    /*
+     * No write may land between the copy and the PDE swap. Write-protect the
+     * block and shoot it down first: a writer then faults and waits for the
+     * space lock, and finds the huge page once it gets it. Readers carry on.
+     * If the swap fails the pages stay read-only and vma_cow makes each
+     * writable again on its next write (they are all unshared).
+     */
+    for (uint32_t i = 0; i < 512u; i++) {
+        __atomic_fetch_and(&pt[i], ~VMM_PTE_RW, __ATOMIC_SEQ_CST);
+    }
+    vma_flush(space, h, 512u);
+
+    uint64_t* old = vma_collapse_old;
+    for (uint32_t i = 0; i < 512u; i++) {
+        old[i] = VMM_ENTRY_ADDR(pt[i]);
+        void* dst = (void*)(uintptr_t)(huge + (uint64_t)i * PAGE_SIZE);
+        if (old[i] == vma_zero_phys) {
+            memory_zero(dst, PAGE_SIZE);
+        } else {
+            memory_copy(dst, (const void*)(uintptr_t)old[i], PAGE_SIZE);
+        }
+    }
+    if (vmm_collapse_2m(space->pml4_phys, h, huge, vma_leaf_flags(a, true)) != 0) {
+        pmm_huge_put(huge);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < 512u; i++) {
+        if (old[i] != vma_zero_phys) {
+            pmm_frame_put(old[i]);
+            if (space->resident_pages > 0) {
+                space->resident_pages--;
+            }
+        }
+    }
+    space->resident_pages += 512u;
+    space->thp_collapses++;
+    return 0;
+}
+
+void vma_collapse_scan(uint32_t max_blocks) {
+    uint64_t cirq = spin_lock_irqsave(&vma_collapse_lock);
+    for (uint32_t n = 0; n < VMA_MAX_SPACES && max_blocks > 0; n++) {
+        VmSpace* sp = &vma_spaces[vma_scan_space];
+        uint64_t irq;
+        if (sp->in_use && vma_trylock(&sp->lock, &irq)) {
+            for (VmArea* a = sp->in_use ? sp->areas : NULL; a && max_blocks > 0; a = a->next) {
+                uint64_t h = vma_huge_up(a->start > vma_scan_addr ? a->start : vma_scan_addr);
+                uint64_t unused;
+                for (; h + PMM_HUGE_SIZE <= a->end && max_blocks > 0; h += PMM_HUGE_SIZE) {
+                    if (!vma_thp_block(a, h, &unused)) {
+                        break;
+                    }
+                    (void)vma_collapse_block(sp, a, h);
+                    vma_scan_addr = h + PMM_HUGE_SIZE;
+                    max_blocks--;
+                }
+            }
+            spin_unlock_irqrestore(&sp->lock, irq);
+            if (max_blocks == 0) {
+                break; /* resume at vma_scan_addr next time */
+            }
+        }
+        vma_scan_space = (vma_scan_space + 1) % VMA_MAX_SPACES;
+        vma_scan_addr = 0;
+    }
+    spin_unlock_irqrestore(&vma_collapse_lock, cirq);
+}
+
+/* One scan per period as delayed work on the unbound queue; the item requeues itself. */
+static DelayedWork vma_collapse_work;
+
+static void vma_collapse_work_fn(Work* work) {
+    (void)work;
+    vma_collapse_scan(VMA_COLLAPSE_BLOCKS);
+    queue_delayed_work(system_unbound_wq, &vma_collapse_work, VMA_COLLAPSE_MS);
+}
+
+void vma_start_collapse(void) {
+    delayed_work_init(&vma_collapse_work, vma_collapse_work_fn, NULL);
+    queue_delayed_work(system_unbound_wq, &vma_collapse_work, VMA_COLLAPSE_MS);
+}
+
+/*
+ * Two-handed clock. The front hand walks mapped 4 KiB pages of reclaimable
+ * areas (space by space, address order, skipping 2 MiB blocks with no leaf
+ * table) and clears their accessed bit; every page it passes goes into a ring
+ * of VMA_CLOCK_SPREAD entries. The back hand is the oldest ring entry: a page
+ * not touched in the time the front hand took to cover the spread is cold.
+ */
+#define VMA_CLOCK_SPREAD   128u  /* pages between the hands */
+#define VMA_CLOCK_MAX_STEP 4096u /* front-hand steps per vma_reclaim call */
+
+typedef struct {
+    uint32_t space;
+    uint64_t va;
+} VmaClockEntry;
+
+/* Both hands and the ring are under vma_clock_lock; the counters belong to the running vma_reclaim. */
+static VmaClockEntry vma_clock_ring[VMA_CLOCK_SPREAD];
+static uint32_t vma_clock_head;  /* oldest entry (the back hand) */
+static uint32_t vma_clock_len;
+static uint32_t vma_clock_space; /* front hand */
+static uint64_t vma_clock_addr;
+static VmaReclaimStats vma_reclaim_stats;
+
+static bool vma_reclaimable_area(const VmArea* a) {
+    return (a->flags & (VMA_FLAG_ANON | VMA_FLAG_LOCKED)) == VMA_FLAG_ANON &&
+           (a->prot & VMA_PROT_WRITE) != 0;
+}
+
+/* First reclaimable area of sp ending above addr. */
+static const VmArea* vma_clock_area(const VmSpace* sp, uint64_t addr) {
+    for (const VmArea* a = sp->areas; a; a = a->next) {
+        if (a->end > addr && vma_reclaimable_area(a)) {
+            return a;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Advance the front hand to the next present page and clear its accessed
+ * bit; false when the budget runs out. A space whose lock is busy is passed
+ * over for this round.
+ */
+static bool vma_clock_advance(uint32_t* budget, VmaClockEntry* out) {
+    while (*budget > 0) {
+        (*budget)--;
+        VmSpace* sp = &vma_spaces[vma_clock_space];
+        uint64_t irq;
+        if (!sp->in_use || !vma_trylock(&sp->lock, &irq)) {
+            vma_clock_space = (vma_clock_space + 1) % VMA_MAX_SPACES;
+            vma_clock_addr = 0;
+            continue;
+        }
+        const VmArea* a = sp->in_use ? vma_clock_area(sp, vma_clock_addr) : NULL;
+        if (!a) {
+            spin_unlock_irqrestore(&sp->lock, irq);
+            vma_clock_space = (vma_clock_space + 1) % VMA_MAX_SPACES;
+            vma_clock_addr = 0;
+            continue;
+        }
+        uint64_t va = a->start > vma_clock_addr ? a->start : vma_clock_addr;
+        uint64_t pde = vmm_query_pde(sp->pml4_phys, va);
+        if ((pde & VMM_PTE_P) == 0 || (pde & VMM_PTE_PS)) {
+            spin_unlock_irqrestore(&sp->lock, irq);
+            vma_clock_addr = vma_huge_down(va) + PMM_HUGE_SIZE;
+            continue;
+        }
+        vma_clock_addr = va + PAGE_SIZE;
+        bool present = (vmm_query(sp->pml4_phys, va) & VMM_PTE_P) != 0;
+        if (present) {
+            (void)vmm_test_and_clear_accessed(sp->pml4_phys, va);
+        }
+        spin_unlock_irqrestore(&sp->lock, irq);
+        if (present) {
+            out->space = vma_clock_space;
+            out->va = va;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Write a cold, unshared page to swap and leave a swap entry in its PTE.
+ * Under the space lock the page is write-protected and shot down, so no CPU
+ * can change it, and its frame gets an extra reference. The write runs with
+ * the lock dropped and interrupts on. Back under the lock the page goes only
+ * if its PTE is exactly as left: same frame, still read-only, accessed bit
+ * still clear (a write fault in the meantime copied it away; a read set A).
+ * Otherwise write access comes back and the slot is freed.
+ */
+static bool vma_swap_out(VmSpace* space, uint64_t va) {
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    const VmArea* a = space->in_use ? vma_find(space, va) : NULL;
+    uint64_t root = space->pml4_phys;
+    uint64_t e = a ? vmm_query(root, va) : 0;
+    uint64_t phys = VMM_ENTRY_ADDR(e);
+    if (!a || !vma_reclaimable_area(a) || (e & (VMM_PTE_P | VMM_PTE_PS)) != VMM_PTE_P ||
+        phys == vma_zero_phys || pmm_frame_refcount(phys) != 1) {
+        spin_unlock_irqrestore(&space->lock, irq);
+        return false;
+    }
+    if (e & VMM_PTE_A) {
+        vma_reclaim_stats.referenced++;
+        spin_unlock_irqrestore(&space->lock, irq);
+        return false;
+    }
+    uint32_t slot = swap_alloc();
+    if (slot == 0) {
+        spin_unlock_irqrestore(&space->lock, irq);
+        return false;
+    }
+    uint64_t ro = e & ~VMM_PTE_RW;
+    vmm_set_pte(root, va, ro);
+    vma_flush(space, va, 1);
+    pmm_frame_get(phys);  /* keeps the frame if the page is unmapped meanwhile */
+    spin_unlock_irqrestore(&space->lock, irq);
+
+    scheduler_preempt_disable();
+    bool written = swap_write_page(slot, phys) == 0;
+    scheduler_preempt_enable();
+
+    irq = spin_lock_irqsave(&space->lock);
+    bool same = space->in_use && space->pml4_phys == root;
+    uint64_t now = same ? vmm_query(root, va) : 0;
+    same = same && (now & (VMM_PTE_P | VMM_PTE_PS | VMM_PTE_RW)) == VMM_PTE_P &&
+           VMM_ENTRY_ADDR(now) == phys;
+    bool evict = written && same && (now & VMM_PTE_A) == 0 && pmm_frame_refcount(phys) == 2;
+    if (evict) {
+        vmm_set_pte(root, va, swap_pte_make(slot));
+        vma_flush(space, va, 1);
+        pmm_frame_put(phys);  /* the mapping's reference */
+        if (space->resident_pages > 0) {
+            space->resident_pages--;
+        }
+        space->swapped_pages++;
+        space->swap_outs++;
+    } else {
+        if (same) {
+            vmm_set_pte(root, va, now | (e & VMM_PTE_RW));
+        }
+        swap_free(slot);
+    }
+    spin_unlock_irqrestore(&space->lock, irq);
+    pmm_frame_put(phys);
+    return evict;
+}
+
+/*
+ * One clock run. The hands move under vma_clock_lock and collect the pages
+ * the back hand passes; they are written out after it is dropped. Runs one
+ * at a time, from the reclaim task.
+ */
+#define VMA_RECLAIM_BATCH 32u
+
+static volatile bool vma_reclaim_running;
+
+uint32_t vma_reclaim(uint32_t want) {
+    if (!swap_enabled() || want == 0) {
+        return 0;
+    }
+    if (__atomic_exchange_n(&vma_reclaim_running, true, __ATOMIC_ACQUIRE)) {
+        return 0;  /* another task is already running the clock */
+    }
+    vma_reclaim_stats.runs++;
+    uint32_t freed = 0;
+    uint32_t budget = VMA_CLOCK_MAX_STEP;
+    bool more = true;
+    while (freed < want && more) {
+        VmaClockEntry cand[VMA_RECLAIM_BATCH];
+        uint32_t n = 0;
+        uint32_t need = want - freed < VMA_RECLAIM_BATCH ? want - freed : VMA_RECLAIM_BATCH;
+
+        uint64_t irq = spin_lock_irqsave(&vma_clock_lock);
+        VmaClockEntry front;
+        while (n < need && (more = vma_clock_advance(&budget, &front))) {
+            vma_reclaim_stats.scanned++;
+            if (vma_clock_len < VMA_CLOCK_SPREAD) {
+                vma_clock_ring[(vma_clock_head + vma_clock_len++) % VMA_CLOCK_SPREAD] = front;
+                continue;
+            }
+            /* Ring full: the back hand takes the oldest slot, the front hand refills it. */
+            cand[n++] = vma_clock_ring[vma_clock_head];
+            vma_clock_ring[vma_clock_head] = front;
+            vma_clock_head = (vma_clock_head + 1) % VMA_CLOCK_SPREAD;
+        }
+        spin_unlock_irqrestore(&vma_clock_lock, irq);
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (vma_swap_out(&vma_spaces[cand[i].space], cand[i].va)) {
+                freed++;
+                vma_reclaim_stats.evicted++;
+            }
+        }
+    }
+    __atomic_store_n(&vma_reclaim_running, false, __ATOMIC_RELEASE);
+    return freed;
+}
+
+/*
+ * The reclaim task. vma_reclaim_wake only sets vma_kswapd_wanted and wakes
+ * the queue, so it is safe wherever pmm_alloc_frame is. The task evicts
+ * until PMM_RECLAIM_HIGH frames are free or a run frees nothing; in the
+ * latter case it waits VMA_KSWAPD_BACKOFF ticks, with further wakeups
+ * ignored, before it listens again.
+ */
+#define VMA_KSWAPD_BACKOFF 10u
+
+static WaitQueue vma_kswapd_wq = WAIT_QUEUE_INIT;
+static volatile bool vma_kswapd_wanted;
+static volatile bool vma_kswapd_stalled;  /* last run freed nothing */
+
+static bool vma_kswapd_cond(void* arg) {
+    (void)arg;
+    return vma_kswapd_wanted;
+}
+
+static void vma_kswapd(void) {
+    while (1) {
+        wait_event(&vma_kswapd_wq, vma_kswapd_cond, NULL, false);
+        uint32_t got;
+        do {
+            got = vma_reclaim(PMM_RECLAIM_BATCH);
+        } while (got > 0 && pmm_frames_free() < PMM_RECLAIM_HIGH);
+        vma_kswapd_stalled = got == 0 && pmm_frames_free() < PMM_RECLAIM_HIGH;
+        if (vma_kswapd_stalled) {
+            scheduler_sleep_ticks(VMA_KSWAPD_BACKOFF);
+        }
+        __atomic_store_n(&vma_kswapd_wanted, false, __ATOMIC_RELEASE);
+    }
+}
+
+void vma_reclaim_wake(void) {
+    if (!swap_enabled() || __atomic_exchange_n(&vma_kswapd_wanted, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    if (wait_queue_active(&vma_kswapd_wq)) {
+        wake_up_all(&vma_kswapd_wq);
+    }
+}
+
+void vma_start_reclaim_thread(void) {
+    (void)scheduler_create_task(vma_kswapd, NULL, PRIORITY_HIGH);
+}
+
+/* Reclaim is under way and not stuck: a fault out of frames may just be retried. */
+static bool vma_reclaim_busy(void) {
+    return vma_kswapd_wanted && !vma_kswapd_stalled;
+}
+
+const VmaReclaimStats* vma_reclaim_get_stats(void) {
+    return &vma_reclaim_stats;
+}
@@ -1,13 +1,12 @@
 // src/core/vmm.c — 4-level map; subtables from PMM (identity: phys == virt pointer)
 #include "../includes/vmm.h"
 #include "../includes/memory.h"
+#include "../includes/spinlock.h"
+#include "../includes/smp.h"
+#include "../includes/console.h"
 #include <stddef.h>
 #include <stdint.h>
 
-/* 2 MiB PDE: present + writable + page size (huge) */
-#define VMM_PDE_2M (VMM_PTE_P | VMM_PTE_RW | (1ull << 7))
-#define VMM_2M_COUNT 512u /* 512 × 2 MiB = 1 GiB */
-
 /*
  * PML4 indices for vmm_clone_kernel_space (legacy; prefer vmm_map_kernel_region).
  */
@@ -30,15 +29,67 @@ static inline uint64_t* vmm_phys_to_ptr(uint64_t phys) { return (uint64_t*)(uint
 /* Intermediate levels: P + RW, supervisor. */
 #define TABLE_ENT (VMM_PTE_P | VMM_PTE_RW)
 
+#define VMM_ADDR_MASK 0x000ffffffffff000ull
+#define VMM_2M_MASK   ((uint64_t)PMM_HUGE_SIZE - 1U)
+
+/*
+ * Zeroed page-table pages released by vmm_destroy_address_space. Table
+ * allocations pop from here before going to the PMM, so a create/destroy
+ * loop recycles the same frames and skips the 4 KiB clear on the hot path.
+ */
+#define VMM_PT_CACHE_MAX 64u
+static uint64_t vmm_pt_cache[VMM_PT_CACHE_MAX];
+static uint32_t vmm_pt_cache_len;
+static VmmStats vmm_stats;
+
+/* Table cache; and the shared kernel tables, which every CPU may extend (kstack, MMIO). */
+static Spinlock vmm_pt_cache_lock = SPINLOCK_INIT;
+static Spinlock vmm_kernel_lock = SPINLOCK_INIT;
+
+/* Boot root; its slot 0 and 256..511 entries are the kernel half of every root. */
+static uint64_t g_kernel_pml4_phys;
+
+static uint64_t vmm_table_alloc(void) {
+    uint64_t irq = spin_lock_irqsave(&vmm_pt_cache_lock);
+    if (vmm_pt_cache_len > 0) {
+        vmm_stats.pt_cache_hits++;
+        vmm_stats.tables_allocated++;
+        uint64_t phys = vmm_pt_cache[--vmm_pt_cache_len];
+        spin_unlock_irqrestore(&vmm_pt_cache_lock, irq);
+        return phys;
+    }
+    spin_unlock_irqrestore(&vmm_pt_cache_lock, irq);
+    uint64_t phys = pmm_alloc_frame(MEM_ALLOC_ZERO);
+    if (phys != 0) {
+        vmm_stats.pt_cache_misses++;
+        vmm_stats.tables_allocated++;
+    }
+    return phys;
+}
+
+static void vmm_table_free(uint64_t phys) {
+    vmm_stats.tables_freed++;
+    if (pmm_frame_refcount(phys) == 1) {
+        memory_zero(vmm_phys_to_ptr(phys), PAGE_SIZE);
+        uint64_t irq = spin_lock_irqsave(&vmm_pt_cache_lock);
+        if (vmm_pt_cache_len < VMM_PT_CACHE_MAX) {
+            vmm_pt_cache[vmm_pt_cache_len++] = phys;
+            spin_unlock_irqrestore(&vmm_pt_cache_lock, irq);
+            return;
+        }
+        spin_unlock_irqrestore(&vmm_pt_cache_lock, irq);
+    }
+    pmm_frame_put(phys);
+}
+
 static int vmm_ensure_subtable(uint64_t* table, uint32_t index) {
     if (table[index] & VMM_PTE_P) {
         return 0;
     }
-    void* p = alloc_pages(1, MEM_ALLOC_ZERO);
-    if (!p) {
+    uint64_t phys = vmm_table_alloc();
+    if (phys == 0) {
         return -1;
     }
-    uint64_t phys = (uint64_t)(uintptr_t)p;
     table[index] = phys | TABLE_ENT;
     return 0;
 }
@@ -51,58 +102,70 @@ void vmm_init(void) {
         lo |= EFER_NXE;
         __asm__ volatile("wrmsr" : : "a"(lo), "d"(hi), "c"((uint32_t)EFER_MSR) : "memory");
     }
+
+    /*
+     * The boot PML4 (kernel.asm) becomes the kernel reference root. Give every
+     * high-half slot its PDPT now, so each process root can copy the top-level
+     * entries once and later kernel mappings show up in all of them.
+     */
+    g_kernel_pml4_phys = vmm_get_cr3() & VMM_ADDR_MASK;
+    uint64_t* k = vmm_phys_to_ptr(g_kernel_pml4_phys);
+    for (uint32_t i = VMM_KERNEL_PML4_FIRST; i < 512u; i++) {
+        if ((k[i] & VMM_PTE_P) == 0) {
+            uint64_t phys = vmm_table_alloc();
+            if (phys == 0) {
+                break;
+            }
+            k[i] = phys | TABLE_ENT;
+        }
+    }
 }
 
 uint64_t vmm_alloc_pml4(void) {
-    void* p = alloc_pages(1, MEM_ALLOC_ZERO);
-    if (!p) {
-        return 0;
-    }
-    return (uint64_t)(uintptr_t)p;
+    return vmm_table_alloc();
 }
 
 int vmm_map_kernel_region(uint64_t pml4_phys) {
     if ((pml4_phys & (PAGE_SIZE - 1U)) != 0) {
         return -2;
     }
+    if (g_kernel_pml4_phys == 0) {
+        return -1;
+    }
     uint64_t* pml4 = vmm_phys_to_ptr(pml4_phys);
-    if (pml4[0] != 0) {
+    if (pml4[VMM_KERNEL_PML4_LOW] != 0 || pml4[VMM_KERNEL_PML4_FIRST] != 0) {
         return -3;
     }
-
-    void* p_pdpt = alloc_pages(1, MEM_ALLOC_ZERO);
-    void* p_pd = alloc_pages(1, MEM_ALLOC_ZERO);
-    if (!p_pdpt || !p_pd) {
-        return -1;
+    const uint64_t* k = vmm_phys_to_ptr(g_kernel_pml4_phys);
+    pml4[VMM_KERNEL_PML4_LOW] = k[VMM_KERNEL_PML4_LOW];
+    for (uint32_t i = VMM_KERNEL_PML4_FIRST; i < 512u; i++) {
+        pml4[i] = k[i];
     }
-    uint64_t pdpt_phys = (uint64_t)(uintptr_t)p_pdpt;
-    uint64_t pd_phys = (uint64_t)(uintptr_t)p_pd;
-
-    pml4[0] = pdpt_phys | TABLE_ENT;
+    return 0;
+}
 
-    uint64_t* pdpt = vmm_phys_to_ptr(pdpt_phys);
-    pdpt[0] = pd_phys | TABLE_ENT;
+uint64_t vmm_kernel_pml4(void) { return g_kernel_pml4_phys; }
 
-    uint64_t* pd = vmm_phys_to_ptr(pd_phys);
-    for (uint32_t i = 0; i < VMM_2M_COUNT; i++) {
-        /* Identity: 2 MiB each, same as kernel.asm p2_2m_loop (| 0x83). */
-        uint64_t base = (uint64_t)i * (2ull * 1024ull * 1024ull);
-        pd[i] = base | VMM_PDE_2M;
+int vmm_map_kernel_4k(uint64_t vaddr, uint64_t paddr, uint64_t flags) {
+    uint32_t i4 = pml4_i(vaddr);
+    if (g_kernel_pml4_phys == 0 || (i4 != VMM_KERNEL_PML4_LOW && i4 < VMM_KERNEL_PML4_FIRST)) {
+        return -2;
     }
+    uint64_t irq = spin_lock_irqsave(&vmm_kernel_lock);
+    int rc = vmm_map_4k(g_kernel_pml4_phys, vaddr, paddr, flags & ~VMM_PTE_US);
+    spin_unlock_irqrestore(&vmm_kernel_lock, irq);
+    return rc;
+}
 
-    /* PML4[256]: 0xFFFF800000000000..+1G -> same phys 0..1G (shared PD as boot). */
-    if (pml4[256] != 0) {
-        return -3;
-    }
-    void* p_l3h = alloc_pages(1, MEM_ALLOC_ZERO);
-    if (!p_l3h) {
-        return -1;
+int vmm_unmap_kernel_4k(uint64_t vaddr) {
+    uint32_t i4 = pml4_i(vaddr);
+    if (g_kernel_pml4_phys == 0 || (i4 != VMM_KERNEL_PML4_LOW && i4 < VMM_KERNEL_PML4_FIRST)) {
+        return -2;
     }
-    uint64_t l3h_phys = (uint64_t)(uintptr_t)p_l3h;
-    pml4[256] = l3h_phys | TABLE_ENT;
-    uint64_t* l3h = vmm_phys_to_ptr(l3h_phys);
-    l3h[0] = pd_phys | TABLE_ENT;
-    return 0;
+    uint64_t irq = spin_lock_irqsave(&vmm_kernel_lock);
+    int rc = vmm_unmap_4k(g_kernel_pml4_phys, vaddr);
+    spin_unlock_irqrestore(&vmm_kernel_lock, irq);
+    return rc;
 }
 
 int vmm_clone_kernel_space(uint64_t dst_pml4_phys, uint64_t src_pml4_phys) {
@@ -138,40 +201,126 @@ int vmm_init_process_address_space(uint64_t process_pml4_phys, uint64_t kernel_r
     return vmm_map_kernel_region(process_pml4_phys);
 }
 
-int vmm_map_4k(uint64_t pml4_phys, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
-    if ((pml4_phys & (PAGE_SIZE - 1U)) != 0 || (vaddr & (PAGE_SIZE - 1U)) != 0 ||
-        (paddr & (PAGE_SIZE - 1U)) != 0) {
-        return -2;
+/* Leaf table covering vaddr, allocating missing levels; NULL when out of frames. */
+static uint64_t* vmm_leaf_table(uint64_t pml4_phys, uint64_t vaddr) {
+    uint64_t* pml4 = vmm_phys_to_ptr(pml4_phys);
+    if (vmm_ensure_subtable(pml4, pml4_i(vaddr)) != 0) {
+        return NULL;
     }
-    if ((flags & VMM_PTE_P) == 0) {
+    uint64_t* pdpt = vmm_phys_to_ptr(pml4[pml4_i(vaddr)] & VMM_ADDR_MASK);
+    if (vmm_ensure_subtable(pdpt, pdpt_i(vaddr)) != 0) {
+        return NULL;
+    }
+    if (pdpt[pdpt_i(vaddr)] & VMM_PTE_PS) {
+        return NULL;
+    }
+    uint64_t* pd = vmm_phys_to_ptr(pdpt[pdpt_i(vaddr)] & VMM_ADDR_MASK);
+    if (vmm_ensure_subtable(pd, pd_i(vaddr)) != 0 || (pd[pd_i(vaddr)] & VMM_PTE_PS)) {
+        return NULL; /* out of frames, or vaddr is inside a huge leaf */
+    }
+    return vmm_phys_to_ptr(pd[pd_i(vaddr)] & VMM_ADDR_MASK);
+}
+
+int vmm_prepare_kernel_4k(uint64_t vaddr) {
+    uint32_t i4 = pml4_i(vaddr);
+    if (g_kernel_pml4_phys == 0 || (i4 != VMM_KERNEL_PML4_LOW && i4 < VMM_KERNEL_PML4_FIRST)) {
         return -2;
     }
+    uint64_t irq = spin_lock_irqsave(&vmm_kernel_lock);
+    uint64_t* pt = vmm_leaf_table(g_kernel_pml4_phys, vaddr);
+    spin_unlock_irqrestore(&vmm_kernel_lock, irq);
+    return pt ? 0 : -1;
+}
 
+/* PD slot for vaddr, allocating the PDPT level if needed; NULL on OOM / 1 GiB leaf. */
+static uint64_t* vmm_pd_slot(uint64_t pml4_phys, uint64_t vaddr) {
     uint64_t* pml4 = vmm_phys_to_ptr(pml4_phys);
     if (vmm_ensure_subtable(pml4, pml4_i(vaddr)) != 0) {
-        return -1;
+        return NULL;
+    }
+    uint64_t* pdpt = vmm_phys_to_ptr(pml4[pml4_i(vaddr)] & VMM_ADDR_MASK);
+    if (vmm_ensure_subtable(pdpt, pdpt_i(vaddr)) != 0 || (pdpt[pdpt_i(vaddr)] & VMM_PTE_PS)) {
+        return NULL;
     }
-    uint64_t pdpt_phys = pml4[pml4_i(vaddr)] & 0x000ffffffffff000ull;
-    uint64_t* pdpt = vmm_phys_to_ptr(pdpt_phys);
+    uint64_t* pd = vmm_phys_to_ptr(pdpt[pdpt_i(vaddr)] & VMM_ADDR_MASK);
+    return &pd[pd_i(vaddr)];
+}
 
-    if (vmm_ensure_subtable(pdpt, pdpt_i(vaddr)) != 0) {
-        return -1;
+static int vmm_check_leaf_flags(uint64_t vaddr, uint64_t flags) {
+    if ((flags & VMM_PTE_P) == 0) {
+        return -2;
     }
-    uint64_t pd_phys = pdpt[pdpt_i(vaddr)] & 0x000ffffffffff000ull;
-    uint64_t* pd = vmm_phys_to_ptr(pd_phys);
+    /* User pages in a kernel slot would land in the shared tables of every root. */
+    if ((flags & VMM_PTE_US) != 0 &&
+        (pml4_i(vaddr) < VMM_USER_PML4_FIRST || pml4_i(vaddr) > VMM_USER_PML4_LAST)) {
+        return -2;
+    }
+    return 0;
+}
 
-    if (vmm_ensure_subtable(pd, pd_i(vaddr)) != 0) {
-        return -1;
+int vmm_map_4k(uint64_t pml4_phys, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
+    if ((pml4_phys & (PAGE_SIZE - 1U)) != 0 || (vaddr & (PAGE_SIZE - 1U)) != 0 ||
+        (paddr & (PAGE_SIZE - 1U)) != 0) {
+        return -2;
+    }
+    if (vmm_check_leaf_flags(vaddr, flags) != 0) {
+        return -2;
     }
-    uint64_t pt_phys = pd[pd_i(vaddr)] & 0x000ffffffffff000ull;
-    uint64_t* pt = vmm_phys_to_ptr(pt_phys);
 
-    uint64_t leaf = (paddr & 0x000ffffffffff000ull) | (flags & 0xFFF) | (flags & VMM_PTE_NX);
+    uint64_t* pt = vmm_leaf_table(pml4_phys, vaddr);
+    if (!pt) {
+        return -1;
+    }
+    uint64_t leaf = (paddr & VMM_ADDR_MASK) | (flags & 0xFFF) | (flags & VMM_PTE_NX);
     pt[pt_i(vaddr)] = leaf;
     vmm_invalidate_page((uintptr_t)vaddr);
     return 0;
 }
 
+int64_t vmm_map_range(uint64_t pml4_phys, uint64_t vaddr, const uint64_t* frames, uint64_t count,
+                      uint64_t flags) {
+    if ((pml4_phys & (PAGE_SIZE - 1U)) != 0 || (vaddr & (PAGE_SIZE - 1U)) != 0 || !frames) {
+        return -2;
+    }
+    if (vmm_check_leaf_flags(vaddr, flags) != 0 ||
+        vmm_check_leaf_flags(vaddr + (count ? count - 1 : 0) * PAGE_SIZE, flags) != 0) {
+        return -2;
+    }
+
+    const uint64_t attr = (flags & 0xFFF) | (flags & VMM_PTE_NX);
+    uint64_t done = 0;
+    while (done < count) {
+        uint64_t va = vaddr + done * PAGE_SIZE;
+        if (vmm_query_pde(pml4_phys, va) & VMM_PTE_PS) {
+            /* Already covered by a huge leaf: only holes (frames[i] == 0) may fall here. */
+            uint64_t next = (va | VMM_2M_MASK) + 1U;
+            for (; done < count && va < next; done++, va += PAGE_SIZE) {
+                if (frames[done] != 0) {
+                    return (int64_t)done;
+                }
+            }
+            continue;
+        }
+        uint64_t* pt = vmm_leaf_table(pml4_phys, va);
+        if (!pt) {
+            break;
+        }
+        /* Fill the rest of this leaf table without walking again. */
+        for (uint32_t i = pt_i(va); i < 512u && done < count; i++, done++, va += PAGE_SIZE) {
+            if (frames[done] == 0) {
+                continue;
+            }
+            uint64_t old = pt[i];
+            pt[i] = (frames[done] & VMM_ADDR_MASK) | attr;
+            /* A not-present entry is never cached, so only replacements need invlpg. */
+            if (old & VMM_PTE_P) {
+                vmm_invalidate_page((uintptr_t)va);
+            }
+        }
+    }
+    return (int64_t)done;
+}
+
 int vmm_unmap_4k(uint64_t pml4_phys, uint64_t vaddr) {
     if ((pml4_phys & (PAGE_SIZE - 1U)) != 0 || (vaddr & (PAGE_SIZE - 1U)) != 0) {
         return -2;
@@ -186,17 +335,250 @@ int vmm_unmap_4k(uint64_t pml4_phys, uint64_t vaddr) {
     if ((pdpt[i3] & VMM_PTE_P) == 0) {
         return 0;
     }
+    if (pdpt[i3] & VMM_PTE_PS) {
+        return -1; /* inside a 1 GiB leaf: the PDPT entry is no table */
+    }
     uint64_t* pd = vmm_phys_to_ptr(pdpt[i3] & 0x000ffffffffff000ull);
     uint32_t i2 = pd_i(vaddr);
     if ((pd[i2] & VMM_PTE_P) == 0) {
         return 0;
     }
+    if (pd[i2] & VMM_PTE_PS) {
+        return -1; /* inside a 2 MiB leaf: split it first (vmm_split_2m) */
+    }
     uint64_t* pt = vmm_phys_to_ptr(pd[i2] & 0x000ffffffffff000ull);
     pt[pt_i(vaddr)] = 0;
     vmm_invalidate_page((uintptr_t)vaddr);
     return 0;
 }
 
+uint64_t vmm_query(uint64_t pml4_phys, uint64_t vaddr) {
+    const uint64_t* pml4 = vmm_phys_to_ptr(pml4_phys & VMM_ADDR_MASK);
+    uint64_t e = pml4[pml4_i(vaddr)];
+    if ((e & VMM_PTE_P) == 0) {
+        return 0;
+    }
+    const uint64_t* pdpt = vmm_phys_to_ptr(e & VMM_ADDR_MASK);
+    e = pdpt[pdpt_i(vaddr)];
+    if ((e & VMM_PTE_P) == 0 || (e & VMM_PTE_PS) != 0) {
+        return e;
+    }
+    const uint64_t* pd = vmm_phys_to_ptr(e & VMM_ADDR_MASK);
+    e = pd[pd_i(vaddr)];
+    if ((e & VMM_PTE_P) == 0 || (e & VMM_PTE_PS) != 0) {
+        return e;
+    }
+    const uint64_t* pt = vmm_phys_to_ptr(e & VMM_ADDR_MASK);
+    return pt[pt_i(vaddr)];
+}
+
+/* Existing 4 KiB leaf entry for vaddr, or NULL; never allocates. */
+static uint64_t* vmm_find_pte(uint64_t pml4_phys, uint64_t vaddr) {
+    uint64_t* t = vmm_phys_to_ptr(pml4_phys & VMM_ADDR_MASK);
+    uint64_t e = t[pml4_i(vaddr)];
+    if ((e & VMM_PTE_P) == 0) {
+        return NULL;
+    }
+    t = vmm_phys_to_ptr(e & VMM_ADDR_MASK);
+    e = t[pdpt_i(vaddr)];
+    if ((e & VMM_PTE_P) == 0 || (e & VMM_PTE_PS) != 0) {
+        return NULL;
+    }
+    t = vmm_phys_to_ptr(e & VMM_ADDR_MASK);
+    e = t[pd_i(vaddr)];
+    if ((e & VMM_PTE_P) == 0 || (e & VMM_PTE_PS) != 0) {
+        return NULL;
+    }
+    return &((uint64_t*)vmm_phys_to_ptr(e & VMM_ADDR_MASK))[pt_i(vaddr)];
+}
+
+bool vmm_test_and_clear_accessed(uint64_t pml4_phys, uint64_t vaddr) {
+    uint64_t* pte = vmm_find_pte(pml4_phys, vaddr);
+    if (!pte || (*pte & (VMM_PTE_P | VMM_PTE_A)) != (VMM_PTE_P | VMM_PTE_A)) {
+        return false;
+    }
+    __atomic_fetch_and(pte, ~VMM_PTE_A, __ATOMIC_SEQ_CST);
+    /* A cached translation would let the CPU skip setting A again. */
+    vmm_invalidate_page((uintptr_t)vaddr);
+    return true;
+}
+
+int vmm_set_pte(uint64_t pml4_phys, uint64_t vaddr, uint64_t entry) {
+    uint64_t* pte = vmm_find_pte(pml4_phys, vaddr);
+    if (!pte) {
+        return -1;
+    }
+    uint64_t old = *pte;
+    *pte = entry;
+    if (old & VMM_PTE_P) {
+        vmm_invalidate_page((uintptr_t)vaddr);
+    }
+    return 0;
+}
+
+uint64_t vmm_query_pde(uint64_t pml4_phys, uint64_t vaddr) {
+    const uint64_t* pml4 = vmm_phys_to_ptr(pml4_phys & VMM_ADDR_MASK);
+    uint64_t e = pml4[pml4_i(vaddr)];
+    if ((e & VMM_PTE_P) == 0) {
+        return 0;
+    }
+    const uint64_t* pdpt = vmm_phys_to_ptr(e & VMM_ADDR_MASK);
+    e = pdpt[pdpt_i(vaddr)];
+    if ((e & VMM_PTE_P) == 0 || (e & VMM_PTE_PS) != 0) {
+        return 0;
+    }
+    const uint64_t* pd = vmm_phys_to_ptr(e & VMM_ADDR_MASK);
+    return pd[pd_i(vaddr)];
+}
+
+int vmm_map_2m(uint64_t pml4_phys, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
+    if ((pml4_phys & (PAGE_SIZE - 1U)) != 0 || (vaddr & VMM_2M_MASK) != 0 || (paddr & VMM_2M_MASK) != 0) {
+        return -2;
+    }
+    if (vmm_check_leaf_flags(vaddr, flags) != 0) {
+        return -2;
+    }
+    uint64_t* pde = vmm_pd_slot(pml4_phys, vaddr);
+    if (!pde) {
+        return -1;
+    }
+    if ((*pde & VMM_PTE_P) && (*pde & VMM_PTE_PS) == 0) {
+        return -3; /* a leaf table is in the way; see vmm_collapse_2m */
+    }
+    *pde = (paddr & VMM_ADDR_MASK) | (flags & 0xFFF) | (flags & VMM_PTE_NX) | VMM_PTE_PS;
+    vmm_invalidate_page((uintptr_t)vaddr);
+    return 0;
+}
+
+int vmm_unmap_2m(uint64_t pml4_phys, uint64_t vaddr) {
+    if ((vaddr & VMM_2M_MASK) != 0) {
+        return -2;
+    }
+    uint64_t e = vmm_query_pde(pml4_phys, vaddr);
+    if ((e & VMM_PTE_P) == 0 || (e & VMM_PTE_PS) == 0) {
+        return 0;
+    }
+    uint64_t* pde = vmm_pd_slot(pml4_phys, vaddr);
+    *pde = 0;
+    vmm_invalidate_page((uintptr_t)vaddr);
+    return 0;
+}
+
+int vmm_split_2m(uint64_t pml4_phys, uint64_t vaddr) {
+    if ((vaddr & VMM_2M_MASK) != 0) {
+        return -2;
+    }
+    uint64_t e = vmm_query_pde(pml4_phys, vaddr);
+    if ((e & VMM_PTE_P) == 0 || (e & VMM_PTE_PS) == 0) {
+        return -2;
+    }
+    uint64_t pt_phys = vmm_table_alloc();
+    if (pt_phys == 0) {
+        return -1;
+    }
+    /* Same frames and attributes, one PTE per 4 KiB (bit 7 is PAT in a PTE). */
+    uint64_t* pt = vmm_phys_to_ptr(pt_phys);
+    uint64_t base = e & VMM_ADDR_MASK & ~VMM_2M_MASK;
+    uint64_t attr = (e & 0xFFF & ~VMM_PTE_PS) | (e & VMM_PTE_NX);
+    for (uint32_t i = 0; i < 512u; i++) {
+        pt[i] = (base + (uint64_t)i * PAGE_SIZE) | attr;
+    }
+    uint64_t* pde = vmm_pd_slot(pml4_phys, vaddr);
+    *pde = pt_phys | TABLE_ENT | (e & VMM_PTE_US);
+    vmm_invalidate_page((uintptr_t)vaddr);
+    vmm_stats.huge_splits++;
+    return 0;
+}
+
+int vmm_collapse_2m(uint64_t pml4_phys, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
+    if ((vaddr & VMM_2M_MASK) != 0 || (paddr & VMM_2M_MASK) != 0) {
+        return -2;
+    }
+    uint64_t e = vmm_query_pde(pml4_phys, vaddr);
+    if ((e & VMM_PTE_P) == 0 || (e & VMM_PTE_PS) != 0) {
+        return -2;
+    }
+    uint64_t* pde = vmm_pd_slot(pml4_phys, vaddr);
+    *pde = (paddr & VMM_ADDR_MASK) | (flags & 0xFFF) | (flags & VMM_PTE_NX) | VMM_PTE_PS;
+    /* 512 separate 4 KiB translations may be cached; one CR3 reload drops them all.
+       Other CPUs may also walk through the old table, so it is freed only after them. */
+    if ((vmm_get_cr3() & VMM_ADDR_MASK) == (pml4_phys & VMM_ADDR_MASK)) {
+        vmm_load_cr3(vmm_get_cr3());
+    }
+    smp_tlb_shootdown(pml4_phys, vaddr, 512u);
+    vmm_table_free(e & VMM_ADDR_MASK);
+    vmm_stats.huge_collapses++;
+    return 0;
+}
+
+/*
+ * Release one table and everything it exclusively owns. level: 3 = PDPT,
+ * 2 = PD, 1 = PT. Tables with more than one reference are shared with another
+ * root and only lose a reference; refcount-0 tables (boot .bss) are never
+ * touched. 4 KiB leaves go through pmm_frame_put, so only frames the VMM
+ * handed out are freed. Huge leaves go through pmm_huge_put, which ignores
+ * the boot identity map's 2 MiB pages (they are not PMM huge frames).
+ */
+static void vmm_release_table(uint64_t table_phys, int level) {
+    uint32_t refs = pmm_frame_refcount(table_phys);
+    if (refs == 0) {
+        return;
+    }
+    if (refs > 1) {
+        pmm_frame_put(table_phys);
+        return;
+    }
+    uint64_t* t = vmm_phys_to_ptr(table_phys);
+    for (uint32_t i = 0; i < 512u; i++) {
+        uint64_t e = t[i];
+        if ((e & VMM_PTE_P) == 0) {
+            continue;
+        }
+        uint64_t phys = e & VMM_ADDR_MASK;
+        if (level == 1) {
+            if (pmm_frame_put(phys)) {
+                vmm_stats.frames_released++;
+            }
+        } else if ((e & VMM_PTE_PS) == 0) {
+            vmm_release_table(phys, level - 1);
+        } else if (level == 2 && pmm_huge_put(phys)) {
+            vmm_stats.frames_released += 512u;
+        }
+    }
+    vmm_table_free(table_phys);
+}
+
+int vmm_destroy_address_space(uint64_t pml4_phys) {
+    if (pml4_phys == 0 || (pml4_phys & (PAGE_SIZE - 1U)) != 0) {
+        return -2;
+    }
+    if (pml4_phys == (vmm_get_cr3() & VMM_ADDR_MASK)) {
+        return -5;
+    }
+    if (pmm_frame_refcount(pml4_phys) != 1) {
+        return -4;
+    }
+    uint64_t* pml4 = vmm_phys_to_ptr(pml4_phys);
+    for (uint32_t i = VMM_USER_PML4_FIRST; i <= VMM_USER_PML4_LAST; i++) {
+        if (pml4[i] & VMM_PTE_P) {
+            vmm_release_table(pml4[i] & VMM_ADDR_MASK, 3);
+        }
+    }
+    /* Kernel slots point at the shared tables; just drop the copies. */
+    pml4[VMM_KERNEL_PML4_LOW] = 0;
+    for (uint32_t i = VMM_KERNEL_PML4_FIRST; i < 512u; i++) {
+        pml4[i] = 0;
+    }
+    vmm_table_free(pml4_phys);
+    vmm_stats.roots_destroyed++;
+    return 0;
+}
+
+VmmStats* vmm_get_stats(void) {
+    vmm_stats.pt_cache_len = vmm_pt_cache_len;
+    return &vmm_stats;
+}
+
 void vmm_invalidate_page(uintptr_t vaddr) {
     uintptr_t a = vaddr;
     __asm__ volatile("invlpg (%0)" : : "r"(a) : "memory", "cc");
@@ -211,3 +593,45 @@ uint64_t vmm_get_cr3(void) {
     __asm__ volatile("mov %%cr3, %0" : "=r"(c));
     return c;
 }
+
+static uint32_t vmm_test_report(const char* what, bool ok) {
+    console_print_color(ok ? "  ok    " : "  FAIL  ", ok ? CONSOLE_SUCCESS_COLOR : CONSOLE_ERROR_COLOR);
+    console_println_color(what, CONSOLE_FG_COLOR);
+    return ok ? 0u : 1u;
+}
+
+/*
+ * Runs on a scratch root that is never loaded, so the leaves can point at
+ * frames nobody owns; they are unmapped again before the root is destroyed.
+ */
+uint32_t vmm_selftest(void) {
+    uint32_t failed = 0;
+    uint64_t root = vmm_alloc_pml4();
+    if (root == 0) {
+        return vmm_test_report("allocate a scratch root", false);
+    }
+    const uint64_t huge_va = VMM_USER_BASE;
+    const uint64_t small_va = VMM_USER_BASE + 0x400000ull;
+    const uint64_t flags = VMM_PTE_P | VMM_PTE_RW | VMM_PTE_US;
+
+    if (vmm_map_2m(root, huge_va, 0x200000ull, flags) != 0) {
+        (void)vmm_destroy_address_space(root);
+        return vmm_test_report("map a 2 MiB leaf", false);
+    }
+    int rc = vmm_unmap_4k(root, huge_va + 5u * PAGE_SIZE);
+    uint64_t pde = vmm_query_pde(root, huge_va);
+    failed += vmm_test_report("vmm_unmap_4k inside a 2 MiB leaf fails and keeps it",
+                              rc == -1 && (pde & (VMM_PTE_P | VMM_PTE_PS)) == (VMM_PTE_P | VMM_PTE_PS) &&
+                              VMM_ENTRY_ADDR(pde) == 0x200000ull);
+
+    rc = vmm_map_4k(root, small_va, 0x300000ull, flags);
+    if (rc == 0) {
+        rc = vmm_unmap_4k(root, small_va);
+    }
+    failed += vmm_test_report("vmm_unmap_4k clears a 4 KiB leaf",
+                              rc == 0 && (vmm_query(root, small_va) & VMM_PTE_P) == 0);
+
+    (void)vmm_unmap_2m(root, huge_va);
+    (void)vmm_destroy_address_space(root);
+    return failed;
+}
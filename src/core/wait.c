@@ -0,0 +1,187 @@
+// src/core/wait.c — wait queues with exclusive and non-exclusive wakeups
+#include "../includes/wait.h"
+#include "../includes/scheduler.h"
+#include "../includes/timer.h"
+#include "../includes/spinlock.h"
+#include <stddef.h>
+#include <stdint.h>
+
+void wait_queue_init(WaitQueue* wq) {
+    spin_init(&wq->lock);
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+bool wait_queue_active(const WaitQueue* wq) {
+    return __atomic_load_n(&wq->head, __ATOMIC_RELAXED) != NULL;
+}
+
+void wait_queue_add(WaitQueue* wq, WaitEntry* entry) {
+    if (entry->exclusive) {
+        entry->next = NULL;
+        entry->prev = wq->tail;
+        if (wq->tail) {
+            wq->tail->next = entry;
+        } else {
+            wq->head = entry;
+        }
+        wq->tail = entry;
+    } else {
+        entry->prev = NULL;
+        entry->next = wq->head;
+        if (wq->head) {
+            wq->head->prev = entry;
+        } else {
+            wq->tail = entry;
+        }
+        wq->head = entry;
+    }
+    entry->queued = true;
+    if (entry->task) {
+        entry->task->wait_queue = wq;
+        entry->task->wait_entry = entry;
+    }
+}
+
+void wait_queue_remove(WaitQueue* wq, WaitEntry* entry) {
+    if (!entry->queued) {
+        return;
+    }
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        wq->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        wq->tail = entry->prev;
+    }
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->queued = false;
+    if (entry->task) {
+        entry->task->wait_queue = NULL;
+        entry->task->wait_entry = NULL;
+    }
+}
+
+void wait_queue_cancel(TaskStruct* task) {
+    uint64_t irq = local_irq_save();
+    WaitQueue* wq = task->wait_queue;
+    if (wq) {
+        spin_lock(&wq->lock);
+        if (task->wait_queue == wq) {
+            wait_queue_remove(wq, task->wait_entry);
+        }
+        spin_unlock(&wq->lock);
+    }
+    local_irq_restore(irq);
+}
+
+/* Boot / shell context: nothing to switch to, so halt until the next interrupt. */
+static void wait_halt(void) {
+    timer_idle_halt(UINT64_MAX);
+}
+
+/*
+ * Mark the current task BLOCKED and queue it, in that order under the
+ * queue lock, so that a waker finding the entry also finds the task ready
+ * to be woken. False if the task has been killed.
+ */
+static bool wait_enqueue_current(WaitQueue* wq, WaitEntry* entry) {
+    spin_lock(&wq->lock);
+    bool ok = scheduler_prepare_block();
+    if (ok) {
+        entry->task = scheduler_get_current_task();
+        wait_queue_add(wq, entry);
+    }
+    spin_unlock(&wq->lock);
+    return ok;
+}
+
+static void wait_dequeue(WaitQueue* wq, WaitEntry* entry) {
+    spin_lock(&wq->lock);
+    wait_queue_remove(wq, entry);  // no-op when the waker unlinked us
+    spin_unlock(&wq->lock);
+}
+
+void wait_event(WaitQueue* wq, bool (*cond)(void* arg), void* arg, bool exclusive) {
+    WaitEntry entry = {0};
+    entry.exclusive = exclusive;
+    for (;;) {
+        uint64_t irq = local_irq_save();
+        if (!scheduler_can_block()) {
+            bool done = cond(arg);
+            if (!done) {
+                wait_halt();
+            }
+            local_irq_restore(irq);
+            if (done) {
+                return;
+            }
+            continue;
+        }
+        if (!wait_enqueue_current(wq, &entry)) {
+            scheduler_schedule();  // killed: the switch away is final
+            local_irq_restore(irq);
+            continue;
+        }
+        // Our entry must be visible before the condition is read (the waker
+        // orders its update before its queue check the same way)
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (cond(arg)) {
+            wait_dequeue(wq, &entry);
+            scheduler_cancel_block();
+            local_irq_restore(irq);
+            return;
+        }
+        scheduler_block();
+        wait_dequeue(wq, &entry);
+        local_irq_restore(irq);
+    }
+}
+
+void wait_release_and_block(WaitQueue* wq, void (*release)(void* arg), void* arg, bool exclusive) {
+    uint64_t irq = local_irq_save();
+    WaitEntry entry = {0};
+    entry.exclusive = exclusive;
+    if (!scheduler_can_block() || !wait_enqueue_current(wq, &entry)) {
+        release(arg);
+        if (scheduler_can_block()) {
+            scheduler_schedule();  // killed
+        } else {
+            wait_halt();
+        }
+    } else {
+        release(arg);
+        scheduler_block();
+        wait_dequeue(wq, &entry);
+    }
+    local_irq_restore(irq);
+}
+
+uint32_t wake_up(WaitQueue* wq, uint32_t nr_exclusive) {
+    uint64_t irq = spin_lock_irqsave(&wq->lock);
+    uint32_t woken = 0;
+    WaitEntry* entry = wq->head;
+    while (entry) {
+        WaitEntry* next = entry->next;
+        bool exclusive = entry->exclusive;
+        TaskStruct* task = entry->task;
+        void (*wake)(WaitEntry*) = entry->wake;
+        wait_queue_remove(wq, entry);
+        if (wake) {
+            wake(entry);
+        } else {
+            scheduler_wake_task(task);
+        }
+        woken++;
+        if (exclusive && nr_exclusive != WAKE_ALL && --nr_exclusive == 0) {
+            break;
+        }
+        entry = next;
+    }
+    spin_unlock_irqrestore(&wq->lock, irq);
+    return woken;
+}
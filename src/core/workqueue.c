@@ -0,0 +1,672 @@
+// src/core/workqueue.c — worker pools, delayed work and flush/cancel
+#include "../includes/workqueue.h"
+#include "../includes/scheduler.h"
+#include "../includes/wait.h"
+#include "../includes/timer.h"
+#include "../includes/console.h"
+#include "../includes/spinlock.h"
+#include "../includes/smp.h"
+#include "../includes/utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lock order: wq_timer_lock -> pool->lock -> runqueue locks (waking a
+ * worker). The scheduler hooks run under a runqueue lock and so only touch
+ * atomics; the kick they ask for runs after the switch, with no lock held.
+ */
+#define WQ_UNBOUND_POOL SMP_MAX_CPUS
+
+static WorkerPool pools[SMP_MAX_CPUS + 1];
+static Workqueue queues[WQ_MAX_QUEUES];
+static Spinlock queues_lock = SPINLOCK_INIT;
+
+static Spinlock wq_timer_lock = SPINLOCK_INIT;
+static DelayedWork* wq_timers;   // by expires
+
+// Flushers and cancellers wait here; woken as items complete
+static WaitQueue work_done_wait = WAIT_QUEUE_INIT;
+
+Workqueue* system_wq;
+Workqueue* system_unbound_wq;
+
+static void worker_main(void);
+
+/* Append to the worklist and wake a worker if the pool may run more (pool->lock held). */
+static void pool_insert(WorkerPool* pool, Work* work) {
+    work->next = NULL;
+    if (pool->tail) {
+        pool->tail->next = work;
+    } else {
+        pool->head = work;
+    }
+    pool->tail = work;
+    work->pool = pool;
+    __atomic_add_fetch(&pool->nr_pending, 1u, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&work->wq->nr_inflight, 1u, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&work->wq->queued, 1u, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&pool->nr_running, __ATOMIC_SEQ_CST) < pool->max_active && pool->idle_list) {
+        // Claimed here: counted as running before it gets the CPU, so a
+        // second item does not wake a second worker on a bound pool
+        Worker* w = pool->idle_list;
+        pool->idle_list = w->next_idle;
+        w->next_idle = NULL;
+        w->listed = false;
+        w->idle = false;
+        pool->nr_idle--;
+        __atomic_add_fetch(&pool->nr_running, 1u, __ATOMIC_SEQ_CST);
+        scheduler_wake_task(w->task);
+    }
+}
+
+static Work* pool_pop(WorkerPool* pool) {
+    Work* work = pool->head;
+    if (work) {
+        pool->head = work->next;
+        if (!pool->head) {
+            pool->tail = NULL;
+        }
+        work->next = NULL;
+        __atomic_sub_fetch(&pool->nr_pending, 1u, __ATOMIC_SEQ_CST);
+    }
+    return work;
+}
+
+/* Unlink a pending item; false if it is not on the list (pool->lock held). */
+static bool pool_remove(WorkerPool* pool, Work* work) {
+    Work* prev = NULL;
+    for (Work* w = pool->head; w; prev = w, w = w->next) {
+        if (w != work) {
+            continue;
+        }
+        if (prev) {
+            prev->next = w->next;
+        } else {
+            pool->head = w->next;
+        }
+        if (pool->tail == w) {
+            pool->tail = prev;
+        }
+        w->next = NULL;
+        __atomic_sub_fetch(&pool->nr_pending, 1u, __ATOMIC_SEQ_CST);
+        return true;
+    }
+    return false;
+}
+
+static void idle_unlist(WorkerPool* pool, Worker* worker) {
+    for (Worker** pp = &pool->idle_list; *pp; pp = &(*pp)->next_idle) {
+        if (*pp == worker) {
+            *pp = worker->next_idle;
+            worker->next_idle = NULL;
+            worker->listed = false;
+            pool->nr_idle--;
+            return;
+        }
+    }
+}
+
+/* An item completed or was cancelled: wake anyone flushing. */
+static void work_done(Workqueue* wq) {
+    __atomic_sub_fetch(&wq->nr_inflight, 1u, __ATOMIC_SEQ_CST);
+    // Ordered before the queue check, as the waiter queues before testing
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (wait_queue_active(&work_done_wait)) {
+        wake_up_all(&work_done_wait);
+    }
+}
+
+/* Start one more worker; it begins idle. Called without pool->lock. */
+static bool create_worker(WorkerPool* pool) {
+    uint64_t irq = spin_lock_irqsave(&pool->lock);
+    Worker* worker = NULL;
+    for (uint32_t i = 0; i < WQ_MAX_WORKERS; i++) {
+        if (!pool->workers[i].used) {
+            worker = &pool->workers[i];
+            break;
+        }
+    }
+    if (!worker) {
+        spin_unlock_irqrestore(&pool->lock, irq);
+        return false;
+    }
+    worker->used = true;
+    worker->task = NULL;
+    worker->pool = pool;
+    worker->current = NULL;
+    worker->idle = true;
+    worker->listed = false;
+    worker->sleeping = false;
+    worker->next_idle = NULL;
+    pool->nr_workers++;
+    pool->nr_starting++;
+    spin_unlock_irqrestore(&pool->lock, irq);
+
+    uint32_t mask = pool->cpu == WQ_UNBOUND_POOL ? SCHED_CPUMASK_ALL : 1u << pool->cpu;
+    TaskStruct* task = scheduler_create_task_affine(worker_main, worker, PRIORITY_NORMAL, mask);
+
+    irq = spin_lock_irqsave(&pool->lock);
+    if (task) {
+        task->worker = worker;  // worker_main sets it too; here it is known sooner
+        pool->workers_created++;
+    } else {
+        worker->used = false;
+        pool->nr_workers--;
+        pool->nr_starting--;
+    }
+    spin_unlock_irqrestore(&pool->lock, irq);
+    return task != NULL;
+}
+
+/*
+ * Worker loop; pool->lock is held except around items. Going idle it queues
+ * itself on the idle list and blocks; whoever claims it takes it off the
+ * list first. Too many idle workers, or a kill, end the task.
+ */
+static void worker_main(void) {
+    TaskStruct* self = scheduler_get_current_task();
+    Worker* worker = (Worker*)self->task_data;
+    WorkerPool* pool = worker->pool;
+
+    uint64_t irq = spin_lock_irqsave(&pool->lock);
+    worker->task = self;
+    self->worker = worker;
+    pool->nr_starting--;
+
+    for (;;) {
+        Work* work = pool_pop(pool);
+        if (!work) {
+            if (!worker->idle) {
+                worker->idle = true;
+                __atomic_sub_fetch(&pool->nr_running, 1u, __ATOMIC_SEQ_CST);
+            }
+            if (pool->nr_idle >= WQ_MAX_IDLE) {
+                break;
+            }
+            worker->listed = true;
+            worker->next_idle = pool->idle_list;
+            pool->idle_list = worker;
+            pool->nr_idle++;
+            if (!scheduler_prepare_block()) {
+                idle_unlist(pool, worker);
+                break;  // killed
+            }
+            spin_unlock(&pool->lock);
+            scheduler_block();
+            spin_lock(&pool->lock);
+            if (worker->listed) {
+                idle_unlist(pool, worker);  // woken by something other than a claim
+            }
+            continue;
+        }
+
+        if (worker->idle) {
+            worker->idle = false;
+            __atomic_add_fetch(&pool->nr_running, 1u, __ATOMIC_SEQ_CST);
+        }
+        worker->current = work;
+        Workqueue* wq = work->wq;
+        // Cleared before the call so the function (or an IRQ) can requeue it
+        __atomic_store_n(&work->pending, 0u, __ATOMIC_RELEASE);
+
+        // Keep a spare: the next block in this pool then has someone to hand over to
+        bool spawn = pool->nr_idle + pool->nr_starting == 0 && pool->nr_workers < WQ_MAX_WORKERS;
+        spin_unlock_irqrestore(&pool->lock, irq);
+        if (spawn) {
+            create_worker(pool);
+        }
+
+        work->func(work);  // may free the item: not touched after this
+
+        irq = spin_lock_irqsave(&pool->lock);
+        worker->current = NULL;
+        pool->executed++;
+        spin_unlock(&pool->lock);
+        __atomic_add_fetch(&wq->executed, 1u, __ATOMIC_RELAXED);
+        work_done(wq);  // after current is cleared: a flusher rechecks both
+        spin_lock(&pool->lock);
+    }
+
+    worker->used = false;
+    worker->task = NULL;
+    pool->nr_workers--;
+    self->worker = NULL;
+    spin_unlock_irqrestore(&pool->lock, irq);
+}
+
+static void pool_init(WorkerPool* pool, uint32_t cpu, uint32_t max_active) {
+    spin_init(&pool->lock);
+    pool->cpu = cpu;
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->nr_pending = 0;
+    pool->nr_running = 0;
+    pool->max_active = max_active;
+    pool->nr_workers = 0;
+    pool->nr_idle = 0;
+    pool->nr_starting = 0;
+    pool->idle_list = NULL;
+    pool->online = create_worker(pool);
+}
+
+void workqueue_init(void) {
+    // Bound pools for the CPUs that will run tasks: every AP, and this
+    // CPU only if it is not the one the shell keeps
+    uint32_t self = smp_cpu_id();
+    for (uint32_t c = 0; c < SMP_MAX_CPUS; c++) {
+        Cpu* cpu = smp_cpu(c);
+        if (!cpu || !cpu->online || (c == self && !scheduler_cpu_runs_tasks(c))) {
+            continue;
+        }
+        pool_init(&pools[c], c, 1u);
+    }
+    pool_init(&pools[WQ_UNBOUND_POOL], WQ_UNBOUND_POOL, WQ_MAX_WORKERS);
+
+    system_wq = workqueue_create("events", 0);
+    system_unbound_wq = workqueue_create("events_unbound", WQ_UNBOUND);
+    if (!pools[WQ_UNBOUND_POOL].online) {
+        console_println_color("Workqueues: could not start workers", CONSOLE_ERROR_COLOR);
+        return;
+    }
+    console_println_color("Workqueues initialized", CONSOLE_SUCCESS_COLOR);
+}
+
+Workqueue* workqueue_create(const char* name, uint32_t flags) {
+    uint64_t irq = spin_lock_irqsave(&queues_lock);
+    Workqueue* wq = NULL;
+    for (uint32_t i = 0; i < WQ_MAX_QUEUES; i++) {
+        if (!queues[i].used) {
+            wq = &queues[i];
+            wq->used = true;
+            wq->name = name;
+            wq->flags = flags;
+            wq->nr_inflight = 0;
+            wq->queued = 0;
+            wq->executed = 0;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&queues_lock, irq);
+    return wq;
+}
+
+void work_init(Work* work, WorkFunc func, void* data) {
+    work->func = func;
+    work->data = data;
+    work->pending = 0;
+    work->next = NULL;
+    work->pool = NULL;
+    work->wq = NULL;
+}
+
+void delayed_work_init(DelayedWork* dwork, WorkFunc func, void* data) {
+    work_init(&dwork->work, func, data);
+    dwork->expires = 0;
+    dwork->cpu = 0;
+    dwork->timer_armed = false;
+    dwork->next = NULL;
+}
+
+static WorkerPool* pick_pool(uint32_t cpu, const Workqueue* wq) {
+    if (!(wq->flags & WQ_UNBOUND) && cpu < SMP_MAX_CPUS && pools[cpu].online) {
+        return &pools[cpu];
+    }
+    return &pools[WQ_UNBOUND_POOL];
+}
+
+bool queue_work_on(uint32_t cpu, Workqueue* wq, Work* work) {
+    if (!wq || !work || !work->func) {
+        return false;
+    }
+    WorkerPool* pool = pick_pool(cpu, wq);
+    uint64_t irq = spin_lock_irqsave(&pool->lock);
+    bool queued = __atomic_exchange_n(&work->pending, 1u, __ATOMIC_ACQ_REL) == 0;
+    if (queued) {
+        work->wq = wq;
+        pool_insert(pool, work);
+    }
+    spin_unlock_irqrestore(&pool->lock, irq);
+    return queued;
+}
+
+bool queue_work(Workqueue* wq, Work* work) {
+    uint64_t irq = local_irq_save();
+    uint32_t cpu = smp_cpu_id();
+    bool queued = queue_work_on(cpu, wq, work);
+    local_irq_restore(irq);
+    return queued;
+}
+
+bool queue_delayed_work(Workqueue* wq, DelayedWork* dwork, uint64_t delay_ms) {
+    if (!wq || !dwork || !dwork->work.func) {
+        return false;
+    }
+    if (delay_ms == 0) {
+        return queue_work(wq, &dwork->work);
+    }
+    // Rounded up to whole ticks; the current one is already partly gone
+    uint64_t ticks = (delay_ms * TIMER_FREQUENCY + 999) / 1000 + 1;
+
+    uint64_t irq = spin_lock_irqsave(&wq_timer_lock);
+    bool queued = __atomic_exchange_n(&dwork->work.pending, 1u, __ATOMIC_ACQ_REL) == 0;
+    if (queued) {
+        dwork->work.wq = wq;
+        dwork->cpu = smp_cpu_id();
+        dwork->expires = timer_get_ticks() + ticks;
+        dwork->timer_armed = true;
+        DelayedWork** pp = &wq_timers;
+        while (*pp && (*pp)->expires <= dwork->expires) {
+            pp = &(*pp)->next;
+        }
+        dwork->next = *pp;
+        *pp = dwork;
+    }
+    spin_unlock_irqrestore(&wq_timer_lock, irq);
+    return queued;
+}
+
+void workqueue_timer_tick(void) {
+    uint64_t now = timer_get_ticks();
+    DelayedWork* first = __atomic_load_n(&wq_timers, __ATOMIC_RELAXED);
+    if (!first || first->expires > now) {
+        return;
+    }
+    uint64_t irq = spin_lock_irqsave(&wq_timer_lock);
+    while (wq_timers && wq_timers->expires <= now) {
+        DelayedWork* dwork = wq_timers;
+        wq_timers = dwork->next;
+        dwork->next = NULL;
+        dwork->timer_armed = false;
+        // Still pending: straight onto the pool, under the timer lock so a
+        // cancel finds it either here or there
+        WorkerPool* pool = pick_pool(dwork->cpu, dwork->work.wq);
+        spin_lock(&pool->lock);
+        pool_insert(pool, &dwork->work);
+        spin_unlock(&pool->lock);
+    }
+    spin_unlock_irqrestore(&wq_timer_lock, irq);
+}
+
+uint64_t workqueue_next_expiry(void) {
+    DelayedWork* first = __atomic_load_n(&wq_timers, __ATOMIC_RELAXED);
+    return first ? first->expires : UINT64_MAX;
+}
+
+/* Some worker of the item's last pool is running it. */
+static bool work_running(Work* work) {
+    WorkerPool* pool = __atomic_load_n(&work->pool, __ATOMIC_ACQUIRE);
+    if (!pool) {
+        return false;
+    }
+    bool running = false;
+    uint64_t irq = spin_lock_irqsave(&pool->lock);
+    for (uint32_t i = 0; i < WQ_MAX_WORKERS; i++) {
+        if (pool->workers[i].used && pool->workers[i].current == work) {
+            running = true;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&pool->lock, irq);
+    return running;
+}
+
+static bool work_idle_cond(void* arg) {
+    Work* work = (Work*)arg;
+    return !work_pending(work) && !work_running(work);
+}
+
+static bool work_not_running_cond(void* arg) {
+    return !work_running((Work*)arg);
+}
+
+static bool workqueue_empty_cond(void* arg) {
+    return __atomic_load_n(&((Workqueue*)arg)->nr_inflight, __ATOMIC_SEQ_CST) == 0;
+}
+
+void flush_work(Work* work) {
+    wait_event(&work_done_wait, work_idle_cond, work, false);
+}
+
+void flush_workqueue(Workqueue* wq) {
+    wait_event(&work_done_wait, workqueue_empty_cond, wq, false);
+}
+
+bool cancel_work_sync(Work* work) {
+    bool was_pending = false;
+    WorkerPool* pool = __atomic_load_n(&work->pool, __ATOMIC_ACQUIRE);
+    if (pool) {
+        uint64_t irq = spin_lock_irqsave(&pool->lock);
+        if (work->pool == pool && work_pending(work) && pool_remove(pool, work)) {
+            __atomic_store_n(&work->pending, 0u, __ATOMIC_RELEASE);
+            was_pending = true;
+        }
+        spin_unlock_irqrestore(&pool->lock, irq);
+        if (was_pending) {
+            work_done(work->wq);
+        }
+    }
+    wait_event(&work_done_wait, work_not_running_cond, work, false);
+    return was_pending;
+}
+
+bool cancel_delayed_work_sync(DelayedWork* dwork) {
+    bool disarmed = false;
+    uint64_t irq = spin_lock_irqsave(&wq_timer_lock);
+    if (dwork->timer_armed) {
+        for (DelayedWork** pp = &wq_timers; *pp; pp = &(*pp)->next) {
+            if (*pp == dwork) {
+                *pp = dwork->next;
+                break;
+            }
+        }
+        dwork->next = NULL;
+        dwork->timer_armed = false;
+        __atomic_store_n(&dwork->work.pending, 0u, __ATOMIC_RELEASE);
+        disarmed = true;
+    }
+    spin_unlock_irqrestore(&wq_timer_lock, irq);
+    bool dequeued = cancel_work_sync(&dwork->work);
+    return disarmed || dequeued;
+}
+
+struct worker_pool* workqueue_worker_sleeping(TaskStruct* task) {
+    Worker* worker = task->worker;
+    if (worker->idle || worker->sleeping) {
+        return NULL;
+    }
+    worker->sleeping = true;
+    WorkerPool* pool = worker->pool;
+    if (__atomic_sub_fetch(&pool->nr_running, 1u, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&pool->nr_pending, __ATOMIC_SEQ_CST) > 0) {
+        return pool;
+    }
+    return NULL;
+}
+
+void workqueue_worker_running(TaskStruct* task) {
+    Worker* worker = task->worker;
+    if (worker->sleeping) {
+        worker->sleeping = false;
+        __atomic_add_fetch(&worker->pool->nr_running, 1u, __ATOMIC_SEQ_CST);
+    }
+}
+
+void workqueue_kick(struct worker_pool* pool) {
+    uint64_t irq = spin_lock_irqsave(&pool->lock);
+    if (pool->head && pool->idle_list &&
+        __atomic_load_n(&pool->nr_running, __ATOMIC_SEQ_CST) < pool->max_active) {
+        Worker* w = pool->idle_list;
+        pool->idle_list = w->next_idle;
+        w->next_idle = NULL;
+        w->listed = false;
+        w->idle = false;
+        pool->nr_idle--;
+        pool->block_kicks++;
+        __atomic_add_fetch(&pool->nr_running, 1u, __ATOMIC_SEQ_CST);
+        scheduler_wake_task(w->task);
+    }
+    spin_unlock_irqrestore(&pool->lock, irq);
+}
+
+static void print_pool(const WorkerPool* pool) {
+    char buffer[32];
+    if (pool->cpu == WQ_UNBOUND_POOL) {
+        console_print_color("unbound", CONSOLE_INFO_COLOR);
+    } else {
+        console_print_color("CPU ", CONSOLE_INFO_COLOR);
+        int_to_str((int)pool->cpu, buffer);
+        console_print_color(buffer, CONSOLE_INFO_COLOR);
+    }
+    console_print_color(": workers ", CONSOLE_INFO_COLOR);
+    int_to_str((int)pool->nr_workers, buffer);
+    console_print_color(buffer, CONSOLE_FG_COLOR);
+    console_print_color(" (idle ", CONSOLE_INFO_COLOR);
+    int_to_str((int)pool->nr_idle, buffer);
+    console_print_color(buffer, CONSOLE_FG_COLOR);
+    console_print_color(", running ", CONSOLE_INFO_COLOR);
+    int_to_str((int)pool->nr_running, buffer);
+    console_print_color(buffer, CONSOLE_FG_COLOR);
+    console_print_color("), pending ", CONSOLE_INFO_COLOR);
+    int_to_str((int)pool->nr_pending, buffer);
+    console_print_color(buffer, CONSOLE_FG_COLOR);
+    console_print_color(", done ", CONSOLE_INFO_COLOR);
+    int_to_str((int)pool->executed, buffer);
+    console_print_color(buffer, CONSOLE_FG_COLOR);
+    console_print_color(", woken on block ", CONSOLE_INFO_COLOR);
+    int_to_str((int)pool->block_kicks, buffer);
+    console_print_color(buffer, CONSOLE_FG_COLOR);
+    console_print_color(", started ", CONSOLE_INFO_COLOR);
+    int_to_str((int)pool->workers_created, buffer);
+    console_println_color(buffer, CONSOLE_FG_COLOR);
+}
+
+void workqueue_print_stats(void) {
+    char buffer[32];
+    for (uint32_t p = 0; p <= WQ_UNBOUND_POOL; p++) {
+        if (pools[p].online) {
+            print_pool(&pools[p]);
+        }
+    }
+    for (uint32_t i = 0; i < WQ_MAX_QUEUES; i++) {
+        const Workqueue* wq = &queues[i];
+        if (!wq->used) {
+            continue;
+        }
+        console_print_color("  ", CONSOLE_INFO_COLOR);
+        console_print_color(wq->name, CONSOLE_FG_COLOR);
+        console_print_color(wq->flags & WQ_UNBOUND ? " (unbound)" : "", CONSOLE_INFO_COLOR);
+        console_print_color(": queued ", CONSOLE_INFO_COLOR);
+        int_to_str((int)wq->queued, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(", done ", CONSOLE_INFO_COLOR);
+        int_to_str((int)wq->executed, buffer);
+        console_print_color(buffer, CONSOLE_FG_COLOR);
+        console_print_color(", in flight ", CONSOLE_INFO_COLOR);
+        int_to_str((int)wq->nr_inflight, buffer);
+        console_println_color(buffer, CONSOLE_FG_COLOR);
+    }
+}
+
+/*
+ * Self-test (mon -wq test), run from the shell. Items and counters are
+ * static: every item is flushed before the test returns.
+ */
+static DelayedWork wq_test_dwork;
+static Work wq_test_slow_work;
+static Work wq_test_block_work;
+static Work wq_test_release_work;
+static volatile uint32_t wq_test_runs;
+static volatile uint64_t wq_test_tick;     // when the last item ran
+static volatile bool wq_test_release;
+static volatile bool wq_test_released;     // the blocker saw the release in time
+
+static void wq_test_count(Work* work) {
+    (void)work;
+    wq_test_tick = timer_get_ticks();
+    __atomic_add_fetch(&wq_test_runs, 1u, __ATOMIC_SEQ_CST);
+}
+
+static void wq_test_slow(Work* work) {
+    scheduler_sleep_ms(20);
+    wq_test_count(work);
+}
+
+/* Sleeps until the next item of its pool runs, which needs the pool to hand over. */
+static void wq_test_blocker(Work* work) {
+    uint64_t give_up = timer_get_ticks() + timer_ms_to_ticks(1000);
+    while (!wq_test_release && timer_get_ticks() < give_up) {
+        scheduler_sleep_ms(5);
+    }
+    wq_test_released = wq_test_release;
+    wq_test_count(work);
+}
+
+static void wq_test_releaser(Work* work) {
+    wq_test_release = true;
+    wq_test_count(work);
+}
+
+static uint32_t wq_test_report(const char* what, bool ok) {
+    console_print_color(ok ? "  ok    " : "  FAIL  ", ok ? CONSOLE_SUCCESS_COLOR : CONSOLE_ERROR_COLOR);
+    console_println_color(what, CONSOLE_FG_COLOR);
+    return ok ? 0u : 1u;
+}
+
+uint32_t workqueue_selftest(void) {
+    uint32_t failed = 0;
+    if (!system_wq || !system_unbound_wq || !pools[WQ_UNBOUND_POOL].online) {
+        return wq_test_report("workqueues running", false);
+    }
+
+    // Delayed work runs once, no earlier than its delay; flush_work waits through the timer
+    wq_test_runs = 0;
+    delayed_work_init(&wq_test_dwork, wq_test_count, NULL);
+    uint64_t t0 = timer_get_ticks();
+    queue_delayed_work(system_unbound_wq, &wq_test_dwork, 50);
+    flush_work(&wq_test_dwork.work);
+    failed += wq_test_report("delayed work runs after its delay",
+                             wq_test_runs == 1 && wq_test_tick - t0 >= timer_ms_to_ticks(50));
+
+    // Cancelling an armed item disarms it before it runs
+    wq_test_runs = 0;
+    queue_delayed_work(system_unbound_wq, &wq_test_dwork, 5000);
+    bool was_pending = cancel_delayed_work_sync(&wq_test_dwork);
+    failed += wq_test_report("cancel_delayed_work_sync disarms the timer",
+                             was_pending && !work_pending(&wq_test_dwork.work) && wq_test_runs == 0);
+
+    // flush_work on an item that sleeps while it runs
+    wq_test_runs = 0;
+    work_init(&wq_test_slow_work, wq_test_slow, NULL);
+    queue_work(system_unbound_wq, &wq_test_slow_work);
+    flush_work(&wq_test_slow_work);
+    failed += wq_test_report("flush_work waits for a running item", wq_test_runs == 1);
+
+    // A bound pool runs one item at a time: the releaser only gets to run
+    // because the pool hands the CPU over when the blocker sleeps
+    uint32_t cpu = SMP_MAX_CPUS;
+    for (uint32_t c = 0; c < SMP_MAX_CPUS; c++) {
+        if (pools[c].online && c != smp_cpu_id()) {
+            cpu = c;
+            break;
+        }
+    }
+    if (cpu == SMP_MAX_CPUS) {
+        console_println_color("  skip  bound pool hand-over (no CPU with a bound pool)", CONSOLE_INFO_COLOR);
+        return failed;
+    }
+    WorkerPool* pool = &pools[cpu];
+    uint64_t kicks = pool->block_kicks;
+    wq_test_runs = 0;
+    wq_test_release = false;
+    wq_test_released = false;
+    work_init(&wq_test_block_work, wq_test_blocker, NULL);
+    work_init(&wq_test_release_work, wq_test_releaser, NULL);
+    queue_work_on(cpu, system_wq, &wq_test_block_work);
+    queue_work_on(cpu, system_wq, &wq_test_release_work);
+    flush_work(&wq_test_block_work);
+    flush_work(&wq_test_release_work);
+    failed += wq_test_report("bound pool wakes a worker when an item blocks",
+                             wq_test_runs == 2 && wq_test_released && pool->block_kicks > kicks);
+    return failed;
+}
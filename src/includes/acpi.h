@@ -0,0 +1,23 @@
+// src/includes/acpi.h — just enough ACPI to enumerate CPUs from the MADT
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "smp.h"
+
+typedef struct {
+    uint64_t lapic_phys;              // local APIC MMIO base (MADT, or its 64-bit override)
+    uint32_t cpu_count;               // enabled (or online-capable) processors
+    uint8_t apic_ids[SMP_MAX_CPUS];   // in MADT order; the BSP is among them
+    uint32_t cpus_skipped;            // beyond SMP_MAX_CPUS
+} AcpiMadtInfo;
+
+/*
+ * RSDP from the Multiboot2 ACPI tag, else the BIOS areas (EBDA, 0xE0000-0xFFFFF);
+ * then RSDT/XSDT to the "APIC" table.
+ * Returns 0, -1 no RSDP, -2 no MADT, -3 checksum mismatch.
+ */
+int acpi_parse_madt(AcpiMadtInfo* out);
+
+#endif // ACPI_H
@@ -0,0 +1,32 @@
+// src/includes/blockdev.h — minimal block device registry (sector I/O)
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BLOCK_SECTOR_SIZE 512u
+#define BLOCKDEV_MAX      4u
+
+/*
+ * A sector-addressed device. read/write move count 512-byte sectors between
+ * the device and a contiguous kernel buffer and return 0 or a negative error.
+ */
+typedef struct block_device {
+    const char* name;
+    uint64_t sectors;
+    int (*read)(struct block_device* dev, uint64_t lba, uint32_t count, void* buf);
+    int (*write)(struct block_device* dev, uint64_t lba, uint32_t count, const void* buf);
+    void* priv;
+} BlockDevice;
+
+/* Returns 0, or -1 when the table is full. dev must stay valid. */
+int blockdev_register(BlockDevice* dev);
+BlockDevice* blockdev_find(const char* name);
+BlockDevice* blockdev_get(uint32_t index);
+uint32_t blockdev_count(void);
+
+/* Probe the primary ATA channel (PIO) and register any disks as hda / hdb. */
+void ata_init(void);
+
+#endif // BLOCKDEV_H
@@ -0,0 +1,100 @@
+// src/includes/fiber.h — cooperative fibers on small stacks inside one task
+#ifndef FIBER_H
+#define FIBER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "scheduler.h"
+#include "wait.h"
+
+/*
+ * A fiber is a function with its own small stack, run inside a task, that
+ * gives up the CPU only where it says so: fiber_yield, fiber_await or by
+ * returning. A fiber switch saves the callee-saved registers and RSP and
+ * jumps to the other stack, about the cost of a function call, with no
+ * runqueue or interrupt frame involved. The task itself is still scheduled
+ * and preempted as usual.
+ *
+ * A task owns a FiberSched, creates fibers on it and runs them with
+ * fiber_sched_run, which returns once every fiber has finished. Ready
+ * fibers run in FIFO order. A fiber awaiting a condition parks on a wait
+ * queue; while no fiber is ready the task blocks until one of them is woken.
+ * All of this happens on the owning task only.
+ *
+ * The Fiber and its stack share one slab object with a 4 KiB footprint;
+ * the stack is whatever the header leaves, and stack_size only has to fit
+ * in that. Interrupts taken while a fiber runs push their frames onto its
+ * stack too, which is why there is no smaller class. A canary at the bottom
+ * of each stack is checked whenever the fiber switches away, and finding it
+ * overwritten halts the kernel.
+ */
+#define FIBER_STACK_MIN 4096u
+#define FIBER_STACK_MAX 4096u
+
+typedef void (*FiberFunc)(void* arg);
+
+typedef struct fiber {
+    uint64_t sp;                   // saved RSP while switched out
+    struct fiber_sched* sched;
+    FiberFunc func;
+    void* arg;
+    struct fiber* next;            // ready or waiting list
+    WaitEntry wait;                // on wait_queue while parked in fiber_await
+    WaitQueue* wait_queue;
+    volatile bool woken;           // set by the waker once it is done with the fiber
+    uint32_t stack_size;           // usable bytes
+    uint64_t* stack_limit;         // lowest stack word, holds the canary
+} Fiber;
+
+typedef struct fiber_sched {
+    TaskStruct* task;              // the task in fiber_sched_run
+    uint64_t sp;                   // the task's own stack while a fiber runs
+    Fiber* current;
+    Fiber* ready_head;
+    Fiber* ready_tail;
+    Fiber* waiting;                // parked in fiber_await
+    Fiber* dead;                   // finished; freed by the next context to run
+    uint32_t nr_fibers;            // created and not yet finished
+    volatile uint32_t nr_woken;    // waiting fibers a waker has released
+    uint64_t irq_flags;            // RFLAGS of the context switching to a new fiber
+    uint64_t switches;
+} FiberSched;
+
+typedef struct {
+    uint64_t live;                 // fibers allocated
+    uint64_t created;
+    uint64_t switches;
+} FiberStats;
+
+// Slab cache for fibers; call after the scheduler is up
+void fiber_init(void);
+void fiber_sched_init(FiberSched* fs);
+
+/* A ready fiber running func(arg) once fiber_sched_run gets to it; NULL for a bad size or no memory. */
+Fiber* fiber_create(FiberSched* fs, FiberFunc func, void* arg, uint32_t stack_size);
+
+// Run fs's fibers on the calling task until all of them have returned
+void fiber_sched_run(FiberSched* fs);
+
+/*
+ * From a fiber: let the next ready fiber run (returns at once if there is
+ * none). Outside a fiber these fall back to scheduler_yield and wait_event.
+ */
+void fiber_yield(void);
+void fiber_await(WaitQueue* wq, bool (*cond)(void* arg), void* arg);
+
+// The running fiber, or NULL outside one
+Fiber* fiber_current(void);
+
+/* [lo, hi) lies on the stack of the fiber a switched-out task is running (saved RSP check). */
+bool fiber_stack_contains(const TaskStruct* task, uint64_t lo, uint64_t hi);
+
+/* The task is being torn down: unqueue and free its fibers (scheduler, off the task's stack). */
+void fiber_task_exit(TaskStruct* task);
+
+// Fiber round trips on the calling task; cycles per switch as for scheduler_bench_ctxsw
+int fiber_bench(uint32_t rounds, CtxswBench* out);
+
+const FiberStats* fiber_get_stats(void);
+
+#endif // FIBER_H
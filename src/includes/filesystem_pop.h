@@ -0,0 +1,41 @@
+// src/includes/filesystem_pop.h
+#ifndef FILESYSTEM_POP_H
+#define FILESYSTEM_POP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+void init_filesystem(void);
+bool write_file(const char* name, const char* content);
+const char* read_file(const char* name);
+bool delete_file(const char* name);
+
+/*
+ * Page cache for mmap. A file is identified by its slot index (fs_lookup).
+ * Each file page has at most one cache frame; mappings share it by reference
+ * count, so mapping a file copies its content once, into the cache, and never
+ * per mapper. While a page is cached the frame is authoritative: read_file
+ * syncs from it and write_file refreshes it.
+ */
+
+/* Slot index of name in the current directory, or -1. */
+int fs_lookup(const char* name);
+
+/* Content length in bytes of a file slot (0 for a free slot). */
+size_t fs_file_size(int file);
+
+/* Pages a file can ever have (content is bounded by MAX_FILE_CONTENT_LENGTH). */
+uint64_t fs_file_max_pages(void);
+
+/*
+ * Cache frame for page pgoff of file, filled on first use. Returns the physical
+ * address with a reference held for the caller (drop with pmm_frame_put), or 0
+ * if the file is gone, pgoff is out of range or memory is short.
+ */
+uint64_t fs_page_get(int file, uint64_t pgoff);
+
+/* Copy cached pages back into the file content (shared mappings write back here). */
+void fs_file_sync(int file);
+
+#endif // FILESYSTEM_POP_H
@@ -0,0 +1,64 @@
+// src/includes/fpu.h — lazy x87/SSE/AVX state switching
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "scheduler.h"
+
+/*
+ * Extended state is switched lazily. The registers belong to fpu_owner;
+ * switching to any other task sets CR0.TS, and that task's first FPU/SIMD
+ * instruction raises #NM. The handler saves the owner's state (XSAVEOPT,
+ * which skips components unchanged since the last XRSTOR) and loads the
+ * new task's (XRSTOR), allocating its area on first use. Integer-only tasks
+ * never trap and never get an area.
+ *
+ * The area is sized from CPUID leaf 0xD for the components enabled in
+ * XCR0 (x87, SSE and, when present, AVX). Without XSAVE, FXSAVE/FXRSTOR and
+ * a 512-byte area are used. Kernel code is built without MMX/SSE, so the
+ * registers only ever hold task state.
+ *
+ * Each CPU has its own owner. Once more than one CPU is online a task's
+ * state is saved as it is switched out, since it may next run elsewhere,
+ * but the CPU keeps it loaded: a task that comes back to the CPU it last
+ * used the FPU on, with no other user in between, runs without a trap or
+ * a restore. Only the CPU a task last loaded its state on (fpu_cpu) may
+ * trust its registers.
+ */
+#define FPU_AREA_ALIGN 64u
+#define FPU_LEGACY_SIZE 512u
+
+#define XFEATURE_X87 (1ull << 0)
+#define XFEATURE_SSE (1ull << 1)
+#define XFEATURE_AVX (1ull << 2)
+
+typedef struct {
+    bool xsave;            // XSAVE/XRSTOR (else FXSAVE/FXRSTOR)
+    bool xsaveopt;
+    uint64_t xfeatures;    // XCR0
+    uint32_t area_size;    // bytes per task area
+    uint64_t traps;        // #NM taken
+    uint64_t saves;        // owner state written back
+    uint64_t restores;
+    uint64_t areas;        // tasks that ever used the FPU
+} FpuInfo;
+
+// CPUID / XCR0 / CR4 setup and the area cache; call once before any task runs
+void fpu_init(void);
+
+// XCR0 / CR4 and CR0.TS on an AP, after fpu_init ran on the BSP
+void fpu_cpu_init(void);
+
+// Context switch prev -> next: clear CR0.TS if next owns the registers, else set it
+void fpu_switch(TaskStruct* prev, TaskStruct* next);
+
+// Task is going away: drop ownership and free its area
+void fpu_release(TaskStruct* task);
+
+// #NM handler (device not available), from the asm stub
+void fpu_nm_handler(void);
+
+const FpuInfo* fpu_get_info(void);
+
+#endif // FPU_H
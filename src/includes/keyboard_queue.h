@@ -7,4 +7,7 @@
 /* IRQ handler pushes scancodes; consumers (kmain, halt, Dolphin) pop. */
 bool key_queue_pop(uint8_t* out);
 
+/* Block until a scancode is queued (halts in place outside a task). */
+void key_queue_wait(void);
+
 #endif
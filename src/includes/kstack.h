@@ -0,0 +1,70 @@
+// src/includes/kstack.h — task stacks in a guard-paged region
+#ifndef KSTACK_H
+#define KSTACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Stacks live in PML4 slot 384 of the shared kernel half, so they are mapped
+ * in every root. Each slot is one unmapped guard page followed by the stack:
+ *
+ *   base + i * KSTACK_SLOT_SIZE:  [ guard 4K ][ stack KSTACK_SIZE ]
+ *
+ * A new stack gets its top page; the rest is backed on first touch from a
+ * reserve of zeroed frames, since the #PF may come from code holding the
+ * PMM or page-table locks. Freed slots keep their pages and go back on the
+ * freelist, so reuse neither faults nor flushes TLBs; the region holds what
+ * the stacks ever touched, up to the peak number of live stacks. Running
+ * into the guard page is reported as an overflow instead of corrupting a
+ * neighbour.
+ */
+#define KSTACK_REGION_BASE 0xFFFFC00000000000ull
+#define KSTACK_SIZE        (16u * 1024u)
+#define KSTACK_GUARD_SIZE  4096u
+#define KSTACK_SLOT_SIZE   (KSTACK_SIZE + KSTACK_GUARD_SIZE)
+#define KSTACK_MAX_SLOTS   1024u
+#define KSTACK_REGION_END  (KSTACK_REGION_BASE + (uint64_t)KSTACK_MAX_SLOTS * KSTACK_SLOT_SIZE)
+#define KSTACK_RESERVE_FRAMES 32u  /* growth frames, refilled by kstack_alloc */
+
+typedef struct {
+    uint64_t live;            /* stacks handed out */
+    uint64_t peak;
+    uint64_t slots_touched;   /* slots ever used (freelist holds the rest of those) */
+    uint64_t resident_pages;  /* backed stack pages, free slots included */
+    uint64_t grown_pages;     /* backed by a fault from the reserve */
+    uint64_t reserve_empty;   /* growth faults that found the reserve empty */
+    uint64_t overflows;       /* guard-page hits */
+    uint64_t last_overflow;   /* faulting address of the last overflow */
+} KStackStats;
+
+/* Reset the region and freelist. Call after vmm_init. */
+void kstack_init(void);
+
+/*
+ * Lowest usable address of a stack of at most KSTACK_SIZE bytes (the usable
+ * range is [ret, ret + KSTACK_SIZE), the top page backed). Also refills the
+ * growth reserve. NULL when size is too large, the region is exhausted or
+ * there are no frames.
+ */
+void* kstack_alloc(uint64_t size);
+
+/* Put the slot back on the freelist with its pages still mapped. */
+void kstack_free(void* base);
+
+/* True if addr lies in the stack region (stack or guard page). */
+bool kstack_contains(uint64_t addr);
+
+/*
+ * #PF hook for the stack region: backs a missing page of a live stack from
+ * the reserve and returns 0. -1 for a guard-page hit (counted as an
+ * overflow), a free slot or an empty reserve. Takes no lock.
+ */
+int kstack_fault(uint64_t error_code, uint64_t fault_addr);
+
+const KStackStats* kstack_get_stats(void);
+
+// Growth and recycling checks (mem -kstack test); returns the number that failed
+uint32_t kstack_selftest(void);
+
+#endif // KSTACK_H
@@ -60,6 +60,45 @@ bool is_page_allocated(void* ptr);
 void* page_to_virt(uint64_t page);
 uint64_t virt_to_page(void* ptr);
 
+/*
+ * Single 4 KiB frames with reference counts (page tables, mapped pages).
+ * pmm_alloc_frame returns the physical address with refcount 1, or 0 on OOM;
+ * pmm_frame_put frees the frame when the count reaches zero and returns true.
+ * Frames from kmalloc/alloc_pages have refcount 0 and are ignored by get/put.
+ * A pinned frame (e.g. the shared zero page) ignores get/put for good.
+ */
+#define PMM_REF_PINNED 0xFFFFu
+uint64_t pmm_alloc_frame(uint32_t flags);
+void pmm_frame_get(uint64_t phys);
+void pmm_frame_pin(uint64_t phys);
+bool pmm_frame_put(uint64_t phys);
+uint32_t pmm_frame_refcount(uint64_t phys);
+
+/*
+ * Reclaim runs in the background. Whenever pmm_alloc_frame leaves fewer than
+ * PMM_RECLAIM_LOW frames free, or finds none, it calls the hook, which must
+ * not block or take locks an allocating caller may hold: it only wakes the
+ * reclaim task, which evicts PMM_RECLAIM_BATCH pages at a time until
+ * PMM_RECLAIM_HIGH are free. memory_init installs vma_reclaim_wake.
+ */
+#define PMM_RECLAIM_BATCH 32u
+#define PMM_RECLAIM_LOW   256u  /* 1 MiB */
+#define PMM_RECLAIM_HIGH  512u
+void pmm_set_reclaim_hook(void (*hook)(void));
+uint32_t pmm_frames_free(void);
+
+/*
+ * 2 MiB frames for transparent huge pages: 512 contiguous, 2 MiB aligned 4 KiB
+ * frames with one reference count on the head. pmm_huge_put frees all 512 at
+ * zero. pmm_huge_demote turns an unshared huge frame into 512 ordinary
+ * refcount-1 frames (used when a huge mapping is split into 4 KiB PTEs).
+ */
+#define PMM_HUGE_SIZE (2u * 1024u * 1024u)
+uint64_t pmm_alloc_huge(uint32_t flags);
+bool pmm_is_huge(uint64_t phys);
+bool pmm_huge_put(uint64_t phys);
+bool pmm_huge_demote(uint64_t phys);
+
 // Memory statistics
 KernelMemoryStats* memory_get_stats(void);
 void kernel_memory_print_stats(void);
@@ -85,6 +85,8 @@ typedef struct {
     uint32_t mem_upper;      // KB
     uint64_t total_memory;   // Bytes (calculated from memory map)
     uint32_t available_memory_regions;
+    uint8_t acpi_rsdp[36];   // copy of the RSDP from the ACPI tag (v1: first 20 bytes)
+    uint32_t acpi_rsdp_len;  // 0 when the loader passed none
 } SystemInfo;
 
 // External reference to multiboot info pointer (set in core/kernel.asm)
@@ -0,0 +1,40 @@
+// src/includes/rbtree.h — intrusive red-black tree with a cached leftmost node
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Embed an RbNode in the structure to be sorted and recover the container with
+ * rb_entry. The tree never allocates; ordering is supplied at insert time.
+ * rb_first is O(1) (the leftmost node is cached), insert and erase are
+ * O(log n).
+ */
+typedef struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    bool red;
+} RbNode;
+
+typedef struct {
+    RbNode* root;
+    RbNode* leftmost;
+} RbTree;
+
+#define RB_TREE_INIT {NULL, NULL}
+#define rb_entry(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+/*
+ * Insert node; less(a, b) is true when a sorts before b. Equal keys go after
+ * existing ones, so ties come out in insertion order.
+ */
+void rb_insert(RbTree* tree, RbNode* node, bool (*less)(const RbNode* a, const RbNode* b));
+void rb_erase(RbTree* tree, RbNode* node);
+
+static inline RbNode* rb_first(const RbTree* tree) { return tree->leftmost; }
+RbNode* rb_next(const RbNode* node);
+
+#endif // RBTREE_H
@@ -5,6 +5,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "vmm.h"
+#include "rbtree.h"
+#include "slab.h"
+#include "smp.h"
+#include "spinlock.h"
 
 // Task states
 typedef enum {
@@ -24,42 +28,40 @@ typedef enum {
     PRIORITY_REALTIME = 4
 } TaskPriority;
 
-// CPU context structure for x86-64
+/*
+ * Scheduler latency, from TSC stamps taken at wakeup, pick and switch-out.
+ * Histogram bucket b counts samples of [2^b, 2^(b+1)) microseconds (bucket 0
+ * also takes 0); the last bucket is open-ended. Kept per task and per CPU.
+ */
+#define SCHED_LAT_BUCKETS 24
+
 typedef struct {
-    // General purpose registers (x86-64 calling convention)
-    uint64_t r15;
-    uint64_t r14;
-    uint64_t r13;
-    uint64_t r12;
-    uint64_t r11;
-    uint64_t r10;
-    uint64_t r9;
-    uint64_t r8;
-    uint64_t rdi;  // 1st argument
-    uint64_t rsi;  // 2nd argument
-    uint64_t rbp;  // base pointer
-    uint64_t rdx;  // 3rd argument
-    uint64_t rcx;  // 4th argument
-    uint64_t rbx;  // callee-saved
-    uint64_t rax;  // return value
-    
-    // Control registers
-    uint64_t rip;  // instruction pointer
-    uint64_t rsp;  // stack pointer
-    uint64_t rflags; // flags register
-    
-    // Segment registers (simplified for long mode)
-    uint64_t cs;   // code segment
-    uint64_t ss;   // stack segment
-    uint64_t ds;   // data segment
-    uint64_t es;   // extra segment
-    uint64_t fs;   // extra segment
-    uint64_t gs;   // extra segment
-    
-    // FPU/SSE state (simplified - just mark as present)
-    uint64_t fpu_state[32]; // XMM0-XMM15 registers
-    uint64_t fpu_control;
-} CPUContext;
+    uint32_t buckets[SCHED_LAT_BUCKETS];
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+} LatHist;
+
+typedef struct {
+    LatHist wakeup;           // woken (or created) -> on the CPU
+    LatHist preempted;        // switched out while runnable -> on the CPU again
+    LatHist run;              // on the CPU, switch-in to switch-out
+    uint64_t preemptions;     // switched out while still runnable
+    uint64_t voluntary;       // switched out blocked, sleeping or exiting
+} SchedLatStats;
+
+/*
+ * CPU time in TSC cycles, charged at every switch and at interrupt entry and
+ * exit. Every task runs in ring 0, so user is a task's own code, sys its time
+ * inside system calls and irq the interrupt handlers that ran while it was
+ * current. Only CPUs count idle: the time they sat halted.
+ */
+typedef struct {
+    uint64_t user;
+    uint64_t sys;
+    uint64_t irq;
+    uint64_t idle;
+} CpuTime;
 
 // Task control block
 typedef struct task_struct {
@@ -67,20 +69,19 @@ typedef struct task_struct {
     uint32_t ppid;
     TaskState state;
     TaskPriority priority;
-    uint32_t nice;
+    int32_t nice;             // -20..19, fair class weight
     
     // Timing information
     uint64_t start_time;
-    uint64_t total_runtime;
-    uint64_t last_run_time;
+    CpuTime time;
     
     // Stack information
     void* stack_base;
     uint64_t stack_size;
     void* stack_top;  // Top of stack (for context switching)
     
-    // CPU context
-    CPUContext context;
+    // Saved kernel RSP while switched out; callee-saved registers sit above it
+    uint64_t ksp;
     
     // Scheduling
     uint64_t vruntime;
@@ -97,13 +98,196 @@ typedef struct task_struct {
 
     /* Per-task translation root; default is boot kernel PML4 (identity map). */
     AddressSpace address_space;
+
+    /*
+     * Lazy TLB: kernel threads never touch the user half, so they keep running
+     * on whatever root the previous task left in CR3 and record it here.
+     */
+    bool lazy_mm;
+    uint64_t active_pml4;
+
+    struct task_struct* pid_next;  // PID hash chain
+    struct task_struct* all_next;  // scheduler.task_list
+    struct task_struct* all_prev;
+    bool on_rq;                    // queued on its CPU's runqueue
+
+    // Fair class accounting (nanoseconds)
+    RbNode run_node;               // in its runqueue's fair_tree while queued
+    uint32_t weight;               // from nice and priority
+    uint64_t exec_start;           // clock when last charged
+    uint64_t sum_exec;             // CPU time consumed
+    uint64_t slice_start;          // sum_exec when the current slice began
+
+    // Timed sleep
+    RbNode sleep_node;             // in its runqueue's sleep_tree while sleeping
+    uint64_t wake_tick;            // deadline in timer ticks, 0 when not queued
+    uint64_t sleep_tsc;            // TSC when the sleep began
+    uint64_t sleep_request_us;     // requested duration
+
+    // Wait queue the task is BLOCKED on (entry lives on the task's stack)
+    struct wait_queue* wait_queue;
+    struct wait_entry* wait_entry;
+
+    // XSAVE area, allocated on first FPU/SIMD use (fpu.c)
+    uint8_t* fpu_area;
+    uint32_t fpu_cpu;              // CPU whose registers last loaded it
+
+    uint32_t cpu;                  // runqueue the task belongs to
+    uint64_t last_ran_tsc;         // TSC when it last left a CPU (cache-hot test)
+    uint64_t nr_migrations;        // moved by the load balancer or for its affinity
+    uint32_t cpus_allowed;         // affinity: bit n set = may run on CPU n
+    bool migrating;                // off every queue on its way to an allowed CPU
+    struct worker* worker;         // workqueue worker this task runs, else NULL
+    struct fiber_sched* fibers;    // in fiber_sched_run, else NULL
+
+    // Deadline class (ns); dl_bw == 0 for every other task
+    uint64_t dl_runtime;           // budget per period
+    uint64_t dl_deadline;          // relative to the period start
+    uint64_t dl_period;
+    uint64_t dl_bw;                // runtime / period, SCHED_DL_BW_SHIFT fixed point
+    uint32_t dl_cpu;               // CPU its bandwidth is reserved on (and pinned to)
+    uint32_t dl_cpus_saved;        // cpus_allowed to restore on leaving the class
+    uint64_t dl_abs_deadline;      // current job, sched clock
+    int64_t dl_budget;             // runtime left; negative after an overrun
+    bool dl_throttled;             // out of budget: off the queue until replenished
+    bool dl_yielded;               // gave up the rest of this period
+    uint64_t dl_replenish_at;      // next period start while throttled
+    RbNode dl_node;                // in its runqueue's dl_tree while queued
+    struct task_struct* dl_throttle_next;
+    uint64_t dl_overruns;          // throttled for using up the budget
+    uint64_t dl_misses;            // still running at its deadline
+
+    // Latency tracing (TSC); lat_ready_tsc is 0 while the task is not waiting to run
+    uint64_t lat_ready_tsc;
+    bool lat_ready_woken;          // waiting since a wakeup rather than a preemption
+    uint64_t lat_run_tsc;          // switched in
+    SchedLatStats lat;
+
+    // What the CPU time is charged as right now (see CpuTime)
+    uint32_t acct_irq_depth;       // interrupt handlers open on its stack
+    uint32_t acct_sys_depth;       // inside a system call
+    bool acct_halted;              // idle task (or the shell) halted for an interrupt
+
+    uint32_t preempt_off;          // scheduler_preempt_disable depth
 } TaskStruct;
 
+/*
+ * Fair class tunables: every runnable fair task should run once per
+ * SCHED_LATENCY_NS, in slices of at least SCHED_MIN_GRANULARITY_NS. With the
+ * 10 ms PIT tick these are whole ticks.
+ */
+#define SCHED_LATENCY_NS            40000000ull
+#define SCHED_MIN_GRANULARITY_NS    10000000ull
+#define SCHED_WAKEUP_GRANULARITY_NS 10000000ull
+#define SCHED_NICE_MIN (-20)
+#define SCHED_NICE_MAX 19
+
+#define SCHED_PRIORITIES    5
+
+/*
+ * Deadline class: admitted while the deadline bandwidth on a CPU stays
+ * within SCHED_DL_BW_LIMIT_PCT, leaving the rest to every other class.
+ * Budgets are charged from the TSC-refined scheduler clock, so runtime may be
+ * below a tick; a task that spins through its budget is stopped at the next
+ * tick and the overrun is taken from its next period.
+ */
+#define SCHED_DL_BW_SHIFT     20
+#define SCHED_DL_BW_LIMIT_PCT 95u
+#define SCHED_DL_PERIOD_MAX_US 10000000ull
+#define SCHED_DL_RUNTIME_MIN_US 1000ull
+#define SCHED_CPUMASK_ALL   ((1u << SMP_MAX_CPUS) - 1u)
+#define SCHED_PID_MAX       32768u  // PIDs 1..SCHED_PID_MAX-1, reused after release
+#define SCHED_PID_HASH_BITS 6
+#define SCHED_PID_HASH_SIZE (1u << SCHED_PID_HASH_BITS)
+
+// FIFO of READY tasks at one priority (linked through next/prev)
+typedef struct {
+    TaskStruct* head;
+    TaskStruct* tail;
+    uint32_t nr;
+} RunQueue;
+
+/*
+ * Sleep queue accounting. Lateness is how much longer than requested a
+ * sleeper actually stayed off the CPU, measured with the TSC; with a 10 ms
+ * tick expect an average of about half a tick.
+ */
+typedef struct {
+    uint64_t sleeps;
+    uint64_t timeouts;        // woken by their deadline
+    uint64_t early_wakes;     // woken explicitly before it
+    uint64_t late_total_us;   // summed over timeouts
+    uint64_t late_max_us;
+} SleepStats;
+
+/*
+ * Load balancer counters, per destination CPU. A steal is an idle CPU
+ * pulling from the busiest queue; a balance run is the periodic check
+ * finding an imbalance worth acting on.
+ */
+typedef struct {
+    uint64_t migrations;      // tasks pulled to this CPU
+    uint64_t steal_attempts;
+    uint64_t steal_success;
+    uint64_t balance_runs;
+    uint64_t hot_skips;       // candidates left where they were as cache-hot
+    uint32_t failed;          // consecutive attempts that moved nothing
+} BalanceStats;
+
+/*
+ * One runqueue per CPU, each under its own lock. A CPU only ever runs tasks
+ * from its own queue; the balancer moves READY tasks between queues with
+ * both locks held, taken in CPU order. Sleepers stay on the queue of the
+ * CPU they slept on.
+ * Lock order: scheduler.lock, then a wait queue's lock, then a runqueue lock.
+ * A runqueue lock held across switch_to is released by the task switched to.
+ */
+typedef struct {
+    Spinlock lock;
+    uint32_t cpu;
+    bool online;
+    bool idle_has_run;                 // idle task runs on its own stack (not the boot stack)
+    TaskStruct* curr;
+    TaskStruct* idle;                  // PID 0, runs when every queue is empty
+    RunQueue rq[SCHED_PRIORITIES];     // FIFO levels: REALTIME and IDLE
+    uint32_t prio_bitmap;              // bit p set <=> rq[p] non-empty
+    RbTree dl_tree;                    // READY deadline tasks by absolute deadline
+    uint32_t dl_nr;
+    uint64_t dl_bw_total;              // admitted deadline bandwidth (scheduler.lock)
+    TaskStruct* dl_throttled;          // out of budget, by dl_throttle_next
+    RbTree fair_tree;                  // READY fair tasks (LOW..HIGH) by vruntime
+    uint32_t fair_nr;
+    uint64_t fair_load;                // sum of queued fair weights
+    uint64_t min_vruntime;
+    uint32_t nr_queued;                // READY tasks in rq[], dl_tree and fair_tree
+    volatile bool need_resched;        // acted on at the next tick or resched IPI
+    RbTree sleep_tree;                 // SLEEPING tasks by wake_tick
+    uint32_t sleep_nr;
+    SleepStats sleep_stats;
+    uint64_t cr3_loads;   /* switches that wrote CR3 */
+    uint64_t cr3_skips;   /* switches that kept the loaded root */
+    struct worker_pool* wq_kick;       // pool whose worker blocked here, kicked after the switch
+    TaskStruct* push_list;             // parked off-affinity tasks (via next), queued elsewhere after the switch
+    uint64_t load_avg;                 // running tasks x SCHED_LOAD_SCALE, decayed per tick
+    uint32_t balance_ticks;            // ticks since the last periodic balance
+    BalanceStats balance;
+    SchedLatStats lat;                 // every task that ran here
+    uint64_t acct_tsc;                 // TSC up to which this CPU's time is charged
+    CpuTime time;                      // the idle task's (the shell's on CPU 0) included
+} CpuRunQueue;
+
 // Scheduler state
 typedef struct {
-    TaskStruct* current_task;
-    TaskStruct* ready_queue[5];  // One queue per priority level
-    uint32_t next_pid;
+    Spinlock lock;                     // PIDs, hash, task list, zombies, address-space users
+    CpuRunQueue rqs[SMP_MAX_CPUS];
+    uint64_t sched_latency_ns;
+    uint64_t sched_min_granularity_ns;
+    uint64_t sched_wakeup_granularity_ns;
+    TaskStruct* zombies;               // exited tasks awaiting the reaper / sys_wait
+    TaskStruct* pid_hash[SCHED_PID_HASH_SIZE];
+    TaskStruct* task_list;             // all tasks incl. zombies, creation order
+    TaskStruct* task_list_tail;
+    uint32_t next_pid;                 // PID allocator cursor
     bool scheduler_active;
     uint64_t total_tasks;
 } SchedulerState;
@@ -116,27 +300,152 @@ void scheduler_init(void);
 void scheduler_tick(void);
 void scheduler_yield(void);
 TaskStruct* scheduler_create_task(void (*function)(void), void* data, TaskPriority priority);
+// Same, restricted to the CPUs in cpus_allowed from the start
+TaskStruct* scheduler_create_task_affine(void (*function)(void), void* data, TaskPriority priority,
+                                         uint32_t cpus_allowed);
+// CPU cpu is online and its idle task has run (the shell's CPU never gets there)
+bool scheduler_cpu_runs_tasks(uint32_t cpu);
 void scheduler_destroy_task(uint32_t pid);
+TaskStruct* scheduler_find_task(uint32_t pid);
+TaskStruct* scheduler_find_zombie_child(uint32_t ppid);
 void scheduler_schedule(void);
 TaskStruct* scheduler_get_current_task(void);
+/*
+ * Keep the current task on its CPU with interrupts still on: the tick and
+ * resched IPIs leave need_resched set instead of switching, and the
+ * outermost enable switches then. For short sections holding a lock that
+ * code running with interrupts off also spins on (swap I/O); the task
+ * must not block inside.
+ */
+void scheduler_preempt_disable(void);
+void scheduler_preempt_enable(void);
+/* Same, but never switches: for exception stacks (#PF); the next tick does. */
+void scheduler_preempt_enable_no_resched(void);
 void scheduler_set_priority(uint32_t pid, TaskPriority priority);
+int scheduler_set_nice(uint32_t pid, int nice);
+/*
+ * Affinity: the CPUs (bit n = CPU n) a task may run on; pid 0 is the caller.
+ * A queued, sleeping or blocked task moves at once, a running one when it
+ * next leaves its CPU. set returns -1 for no such task, -2 when the mask
+ * holds no CPU that runs tasks, -3 for a deadline task (bound to the CPU
+ * its bandwidth is reserved on).
+ */
+int scheduler_set_affinity(uint32_t pid, uint32_t mask);
+int scheduler_get_affinity(uint32_t pid, uint32_t* mask);
+/*
+ * Deadline class: each period the task may run for runtime, and its job is
+ * due deadline after the period starts (0: the period). The earliest
+ * deadline runs first, ahead of every other class. A task that uses up its
+ * runtime is throttled until its next period; one that yields gives up
+ * what is left of it. Runtime 0 returns the task to its priority class.
+ * pid 0 is the caller. Returns 0, -1 no such task, -2 bad parameters,
+ * -3 no CPU it may run on has the bandwidth.
+ */
+int scheduler_set_deadline(uint32_t pid, uint64_t runtime_us, uint64_t deadline_us, uint64_t period_us);
+void scheduler_set_fair_tunables(uint64_t latency_ns, uint64_t min_granularity_ns);
+// Make a BLOCKED or SLEEPING task READY (fair sleepers are placed near min_vruntime)
+void scheduler_wake_task(TaskStruct* task);
+/*
+ * Block the current task for ticks timer ticks (or at least ms milliseconds).
+ * 0 once it has slept, -1 if there is no task to block (boot or shell
+ * context); callers fall back to waiting in place.
+ */
+int scheduler_sleep_ticks(uint64_t ticks);
+// Earliest tick the scheduler needs an interrupt for (UINT64_MAX: none)
+uint64_t scheduler_next_event_tick(void);
+// Same for another CPU's runqueue; a CPU running anything wants the next tick
+uint64_t scheduler_next_event_tick_cpu(uint32_t cpu);
+// True when the caller runs as a task that may block (not boot / shell context)
+bool scheduler_can_block(void);
+/*
+ * Blocking in two steps, so a wakeup cannot slip in between publishing the
+ * task on a wait queue and leaving the CPU: mark the current task BLOCKED
+ * (interrupts off), queue it, then scheduler_block switches it out unless
+ * the wakeup has already come. scheduler_cancel_block undoes the mark when
+ * the caller finds it need not sleep after all. prepare fails for a task
+ * that has been killed; it should schedule away instead of queueing.
+ */
+bool scheduler_prepare_block(void);
+void scheduler_block(void);
+void scheduler_cancel_block(void);
+int scheduler_sleep_ms(uint64_t ms);
 void scheduler_print_tasks(void);
+/*
+ * Accounting hooks, each on the current CPU: interrupt handlers bracket
+ * their work with irq_enter/exit, syscall_dispatch with sys_enter/exit, and
+ * a halt waiting for an interrupt with halt(true)/halt(false).
+ */
+void scheduler_account_irq_enter(void);
+void scheduler_account_irq_exit(void);
+void scheduler_account_sys_enter(void);
+void scheduler_account_sys_exit(void);
+void scheduler_account_halt(bool halted);
+
+// One task's CPU time, for top
+typedef struct {
+    uint32_t pid;
+    uint32_t cpu;
+    TaskState state;
+    TaskPriority priority;
+    bool deadline;
+    CpuTime time;
+} TaskTimes;
+
+// Every task but the idle ones, in creation order; returns how many (at most max)
+uint32_t scheduler_get_task_times(TaskTimes* out, uint32_t max);
+// False when the CPU is offline
+bool scheduler_get_cpu_time(uint32_t cpu, CpuTime* out);
+// Latency histograms of one task, or of all CPUs for pid 0; -1 if there is no such task
+int scheduler_print_latency(uint32_t pid);
+void scheduler_reset_latency(void);
+// What each online CPU is running and how many tasks it has queued
+void scheduler_print_cpus(void);
+// Summed over all CPUs; returns the number of sleeping tasks
+uint32_t scheduler_get_sleep_stats(SleepStats* out);
+void scheduler_get_cr3_stats(uint64_t* loads, uint64_t* skips);
+// Balancer counters summed over all CPUs (failed is the largest current streak)
+void scheduler_get_balance_stats(BalanceStats* out);
 void scheduler_kill_all_except_idle(void);
 uint32_t scheduler_get_task_count(void);
+const KmemCache* scheduler_task_cache(void);
 TaskStruct* scheduler_create_task_with_pid(void (*function)(void), void* data, TaskPriority priority, uint32_t custom_pid);
 
+/*
+ * SMP: the idle task for an AP's runqueue (its stack is what the AP boots
+ * on), then, on the AP itself, mark the runqueue ready for tasks.
+ */
+TaskStruct* scheduler_init_ap(uint32_t cpu);
+void scheduler_cpu_online(void);
+// Resched IPI: switch if this CPU's runqueue asked for it
+void scheduler_resched_ipi(void);
+// First thing a new task runs (task_entry_trampoline): drop the runqueue lock
+void schedule_tail(void);
+
 // Task management
 void task_init(TaskStruct* task, void (*function)(void), void* data, TaskPriority priority);
 void task_set_address_space(TaskStruct* task, uint64_t pml4_phys);
+void task_unlazy_mm(TaskStruct* task);
 uint64_t scheduler_kernel_pml4_phys(void);
 void task_switch(TaskStruct* from, TaskStruct* to);
 void task_exit(void);
+// Unresolvable #PF (kernel.asm): kills a user-mode faulter, halts on a kernel one
+void scheduler_page_fault_kill(uint64_t error_code, uint64_t fault_addr, uint64_t rip);
 void setup_task_context(TaskStruct* task);
 
-// Assembly functions for context switching
-void context_save(CPUContext* context);
-void context_restore(CPUContext* context);
-void context_switch_to_task(TaskStruct* task);
+// Assembly (context_switch.asm): save prev's callee-saved registers and RSP,
+// resume next. prev may be NULL when the current stack is being abandoned.
+void switch_to(TaskStruct* prev, TaskStruct* next);
+void task_entry_trampoline(void);
+
+// switch_to cost measured against a private peer stack (bench ctxsw)
+typedef struct {
+    uint32_t switches;
+    uint64_t avg_cycles;      // per switch, including the timing loop
+    uint64_t min_cycles;      // half the fastest round trip
+} CtxswBench;
+int scheduler_bench_ctxsw(uint32_t rounds, CtxswBench* out);
+// Deadline class checks (mon -dl test); returns the number that failed
+uint32_t scheduler_dl_selftest(void);
 
 // Stack management
 void* task_allocate_stack(uint64_t size);
@@ -0,0 +1,42 @@
+// src/includes/slab.h — fixed-size object caches on single PMM frames
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "spinlock.h"
+
+/*
+ * An object cache hands out objects of one size from 4 KiB slabs. Each slab
+ * is one PMM frame with a small header followed by the objects; the owning
+ * slab of an object is found by rounding its address down to the frame.
+ * Slabs with free objects sit on a partial list, so allocation is O(1); one
+ * fully free slab is kept for reuse and further ones go back to the PMM.
+ */
+typedef struct kmem_slab KmemSlab;
+
+typedef struct {
+    const char* name;
+    uint32_t obj_size;     // rounded up to the alignment (16 bytes by default)
+    uint32_t offset;       // first object, past the slab header
+    uint32_t per_slab;
+    KmemSlab* partial;     // slabs with at least one free object
+    KmemSlab* spare;       // one completely free slab
+    uint64_t slabs;        // frames held (including spare)
+    uint64_t active;       // objects handed out
+    uint64_t allocs;
+    uint64_t frees;
+    Spinlock lock;         // lists and counters; frames come and go outside it
+} KmemCache;
+
+/* Returns 0, or -1 if size does not fit a slab. */
+int kmem_cache_init(KmemCache* cache, const char* name, uint32_t size);
+/* Objects aligned to align bytes (a power of two, 16 or more). */
+int kmem_cache_init_aligned(KmemCache* cache, const char* name, uint32_t size, uint32_t align);
+
+/* Zeroed object, or NULL when out of frames. */
+void* kmem_cache_alloc(KmemCache* cache);
+void kmem_cache_free(KmemCache* cache, void* obj);
+
+#endif // SLAB_H
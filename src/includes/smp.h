@@ -0,0 +1,107 @@
+// src/includes/smp.h — application processor bring-up and per-CPU data
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * CPUs come from the ACPI MADT. The BSP keeps the PIT as the global clock
+ * (timer_get_ticks); each AP is started with INIT-SIPI-SIPI through a
+ * real-mode trampoline copied to AP_TRAMPOLINE_BASE and then gets its own
+ * GDT, TSS and IST stacks, a periodic LAPIC timer at TIMER_FREQUENCY and an
+ * idle task whose stack it boots on.
+ */
+#define SMP_MAX_CPUS 16u
+#define SMP_IST_SIZE 4096u
+
+#define AP_TRAMPOLINE_BASE 0x8000u  // one page below 1 MiB; SIPI vector 0x08
+
+// Vectors above the remapped PIC (0x20-0x2F)
+#define LAPIC_TIMER_VECTOR    0x30u
+#define IPI_RESCHED_VECTOR    0xF0u
+#define IPI_TLB_VECTOR        0xF1u
+#define LAPIC_SPURIOUS_VECTOR 0xFFu
+
+/* GDT (null, code, data, pad, 16-byte TSS descriptor), the TSS and its IST stacks. */
+typedef struct {
+    uint64_t gdt[6] __attribute__((aligned(32)));
+    uint8_t tss[104] __attribute__((aligned(16)));
+    uint8_t ist_pf[SMP_IST_SIZE] __attribute__((aligned(16)));
+    uint8_t ist_df[SMP_IST_SIZE] __attribute__((aligned(16)));
+} CpuTables;
+
+/*
+ * Per-CPU block, found through the GS base: %gs:0 holds the block's own
+ * address and %gs:8 the CPU index, so both are a single load.
+ */
+typedef struct cpu {
+    struct cpu* self;
+    uint32_t id;              // dense index, 0 = BSP
+    uint32_t apic_id;
+    volatile bool online;
+    uint64_t stack_top;       // stack the CPU booted on (TSS RSP0)
+    uint64_t lapic_ticks;
+    uint64_t resched_ipis;
+    uint64_t tlb_ipis;        // shootdown requests flushed here
+    uint64_t idle_oneshots;   // idle halts with the periodic tick stopped
+    CpuTables tables;
+} Cpu;
+
+static inline uint32_t smp_cpu_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:8, %0" : "=r"(id));
+    return id;
+}
+
+static inline Cpu* smp_this_cpu(void) {
+    Cpu* c;
+    __asm__ volatile("movq %%gs:0, %0" : "=r"(c));
+    return c;
+}
+
+// CPU 0's block and GS base; call before anything reads per-CPU data
+void smp_bsp_init(void);
+
+// Parse the MADT, calibrate the LAPIC timer and start every AP; needs the PIT tick
+void smp_init(void);
+
+uint32_t smp_cpus_online(void);
+Cpu* smp_cpu(uint32_t id);
+uint64_t smp_lapic_ticks_per_tick(void);
+
+/*
+ * AP tickless idle, interrupts off: smp_timer_oneshot replaces this CPU's
+ * periodic LAPIC tick by a single interrupt at the end of the tick ticks
+ * from now (false, tick left alone, for fewer than 2); smp_timer_periodic
+ * puts the tick back after the halt.
+ */
+bool smp_timer_oneshot(uint64_t ticks);
+void smp_timer_periodic(void);
+
+// Ask another CPU to look at its runqueue (no-op for the calling CPU)
+void smp_send_resched(uint32_t cpu);
+
+/*
+ * TLB shootdown: every other online CPU that has pml4_phys loaded drops its
+ * translations for [start, start + pages * 4 KiB); pml4_phys 0 is the shared
+ * kernel half, flushed everywhere. The caller has already changed the
+ * entries and flushed its own TLB; on return no CPU can still use the old
+ * ones, so the frames behind them may be freed. Many pages reload CR3
+ * instead. One request is in flight at a time.
+ *
+ * May be called with interrupts off and with spinlocks held: a target
+ * spinning on one of them answers from spin_lock (spinlock.h).
+ */
+void smp_tlb_shootdown(uint64_t pml4_phys, uint64_t start, uint64_t pages);
+
+// kernel.c: this CPU's GDT/TSS (RSP0 = rsp0) and the shared IDT
+void cpu_tables_load(CpuTables* t, uint64_t rsp0);
+void idt_load(void);
+
+// Interrupt entry points (kernel.asm)
+void smp_timer_interrupt(void);
+void smp_resched_interrupt(void);
+void smp_tlb_interrupt(void);
+
+#endif // SMP_H
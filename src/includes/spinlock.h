@@ -0,0 +1,75 @@
+// src/includes/spinlock.h — test-and-test-and-set spinlocks for SMP
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A spinlock is only ever held for a short, bounded section and never across
+ * a sleep. Anything an interrupt handler also takes must be locked with the
+ * _irqsave variants, or the handler can spin forever on its own CPU.
+ *
+ * A CPU spinning with interrupts off still answers TLB shootdowns
+ * (smp_tlb_poll): the holder may be waiting for it to flush.
+ */
+void smp_tlb_poll(void);
+
+typedef struct {
+    volatile uint32_t locked;
+} Spinlock;
+
+#define SPINLOCK_INIT {0}
+
+static inline void spin_init(Spinlock* l) {
+    l->locked = 0;
+}
+
+static inline bool spin_trylock(Spinlock* l) {
+    return __atomic_exchange_n(&l->locked, 1u, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spin_lock(Spinlock* l) {
+    while (!spin_trylock(l)) {
+        while (l->locked) {
+            smp_tlb_poll();
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+static inline void spin_unlock(Spinlock* l) {
+    __atomic_store_n(&l->locked, 0u, __ATOMIC_RELEASE);
+}
+
+static inline bool spin_is_locked(const Spinlock* l) {
+    return l->locked != 0;
+}
+
+/* Interrupts off on this CPU; returns RFLAGS for local_irq_restore. */
+static inline uint64_t local_irq_save(void) {
+    uint64_t f;
+    __asm__ volatile("pushfq; popq %0; cli" : "=r"(f) : : "memory");
+    return f;
+}
+
+/* Interrupts back on if they were on at the matching local_irq_save. */
+static inline void local_irq_restore(uint64_t f) {
+    if (f & (1ull << 9)) {
+        __asm__ volatile("sti" ::: "memory");
+    }
+}
+
+/* Interrupts off, then the lock; returns RFLAGS for spin_unlock_irqrestore. */
+static inline uint64_t spin_lock_irqsave(Spinlock* l) {
+    uint64_t f = local_irq_save();
+    spin_lock(l);
+    return f;
+}
+
+static inline void spin_unlock_irqrestore(Spinlock* l, uint64_t f) {
+    spin_unlock(l);
+    local_irq_restore(f);
+}
+
+#endif // SPINLOCK_H
@@ -0,0 +1,71 @@
+// src/includes/swap.h — swap area on a block device, swap entries in PTEs
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmm.h"
+
+/*
+ * The swap area is a whole block device whose first sector starts with
+ * SWAP_SIGNATURE (build/linux.sh writes it into swap.img); nothing else is
+ * ever written to, so an unrelated disk is left alone. Slot n is the 4 KiB at
+ * sector n * SWAP_SLOT_SECTORS; slot 0 holds the signature and is never used.
+ */
+#define SWAP_SIGNATURE     "POPCORN-SWAP-V1"
+#define SWAP_SLOT_SECTORS  8u
+#define SWAP_MAX_SLOTS     65536u /* 256 MiB */
+
+/*
+ * Swap entry in a non-present leaf PTE: P = 0, bit 9 (ignored by the CPU)
+ * marks it, the slot number sits where the frame address would.
+ */
+#define SWAP_PTE_MARK (1ull << 9)
+/*
+ * Set on a swap entry while a fault reads its slot with the space lock
+ * dropped; the slot then belongs to that fault (vma.c), not to the PTE.
+ */
+#define SWAP_PTE_BUSY (1ull << 10)
+
+static inline bool swap_pte_is(uint64_t pte) {
+    return (pte & VMM_PTE_P) == 0 && (pte & SWAP_PTE_MARK) != 0;
+}
+
+static inline bool swap_pte_busy(uint64_t pte) {
+    return swap_pte_is(pte) && (pte & SWAP_PTE_BUSY) != 0;
+}
+
+static inline uint64_t swap_pte_make(uint32_t slot) {
+    return ((uint64_t)slot << 12) | SWAP_PTE_MARK;
+}
+
+static inline uint32_t swap_pte_slot(uint64_t pte) {
+    return (uint32_t)(VMM_ENTRY_ADDR(pte) >> 12);
+}
+
+typedef struct {
+    uint32_t total_slots;
+    uint32_t used_slots;
+    uint64_t pages_out;
+    uint64_t pages_in;
+    uint64_t io_errors;
+} SwapStats;
+
+/* Look for a signed swap device (hda, hdb, ...) and enable it. */
+void swap_init(void);
+bool swap_enabled(void);
+
+/* Next free slot (next fit, so pages evicted together land together), 0 if full. */
+uint32_t swap_alloc(void);
+void swap_free(uint32_t slot);
+
+/*
+ * Move one page between a frame and a slot. 0, or -1 on I/O error. One
+ * transfer at a time; call with interrupts off or preemption disabled.
+ */
+int swap_write_page(uint32_t slot, uint64_t frame_phys);
+int swap_read_page(uint32_t slot, uint64_t frame_phys);
+
+const SwapStats* swap_get_stats(void);
+
+#endif // SWAP_H
@@ -0,0 +1,80 @@
+// src/includes/sync.h — sleeping locks: mutexes, semaphores, condition variables
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "scheduler.h"
+#include "wait.h"
+
+/*
+ * Every lock belongs to a class, usually one per kind of lock (e.g. all
+ * "vfs" mutexes), and contention is counted per class. A class registers
+ * itself on first use and is listed by mon -locks.
+ */
+typedef struct lock_class {
+    const char* name;
+    uint64_t acquisitions;
+    uint64_t contended;       // first attempt failed
+    uint64_t spin_acquired;   // contended, then won while spinning
+    uint64_t sleeps;          // contended and blocked
+    uint64_t wait_us;         // total time spent blocked
+    uint64_t wait_max_us;
+    bool registered;
+    struct lock_class* next;
+} LockClass;
+
+#define LOCK_CLASS_INIT(n) {(n), 0, 0, 0, 0, 0, 0, false, NULL}
+
+/*
+ * Mutex: one owner, released by the owner. A contender first spins while the
+ * owner is running on another CPU (it will likely release soon), bounded by
+ * MUTEX_SPIN_LIMIT; otherwise, or once the spin runs out, it blocks.
+ * Unlock wakes one waiter.
+ */
+#define MUTEX_SPIN_LIMIT 1000u
+
+typedef struct {
+    volatile uint32_t locked;
+    TaskStruct* owner;
+    WaitQueue waiters;
+    LockClass* cls;
+} Mutex;
+
+void mutex_init(Mutex* m, LockClass* cls);
+void mutex_lock(Mutex* m);
+bool mutex_trylock(Mutex* m);
+void mutex_unlock(Mutex* m);
+bool mutex_is_locked(const Mutex* m);
+
+// Counting semaphore
+typedef struct {
+    volatile int32_t count;
+    WaitQueue waiters;
+    LockClass* cls;
+} Semaphore;
+
+void semaphore_init(Semaphore* s, int32_t count, LockClass* cls);
+void semaphore_down(Semaphore* s);
+bool semaphore_trydown(Semaphore* s);
+void semaphore_up(Semaphore* s);
+
+/*
+ * Condition variable, used with a Mutex held. cond_wait releases the mutex
+ * and blocks atomically, and holds it again on return; callers recheck
+ * their predicate in a loop.
+ */
+typedef struct {
+    WaitQueue waiters;
+} CondVar;
+
+void cond_init(CondVar* cv);
+void cond_wait(CondVar* cv, Mutex* m);
+void cond_signal(CondVar* cv);
+void cond_broadcast(CondVar* cv);
+
+// Registered classes, in first-use order
+const LockClass* lock_class_first(void);
+void lock_class_print_stats(void);
+
+#endif // SYNC_H
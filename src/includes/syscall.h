@@ -28,6 +28,10 @@
 #define SYS_CHDIR       0x13
 #define SYS_STAT        0x14
 #define SYS_IOCTL       0x15
+#define SYS_MADVISE     0x16
+#define SYS_SCHED_SETAFFINITY 0x17
+#define SYS_SCHED_GETAFFINITY 0x18
+#define SYS_SCHED_SETDEADLINE 0x19
 
 // Maximum number of system calls
 #define MAX_SYSCALLS    32
@@ -75,6 +79,26 @@ typedef struct {
 #define SYSCALL_FLAG_BLOCKING   0x02
 #define SYSCALL_FLAG_SIGNAL     0x04
 
+// mmap protection and flags (Linux values)
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10
+#define MAP_ANONYMOUS   0x20
+#define MAP_LOCKED      0x2000  // populate now, exempt from MADV_DONTNEED
+#define MAP_POPULATE    0x8000  // prefault the whole range at mmap time
+
+// madvise advice
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+
 // File mode constants (for stat)
 #define S_IFMT   0170000  // File type mask
 #define S_IFREG  0100000  // Regular file
@@ -134,6 +158,7 @@ int64_t sys_malloc(syscall_context_t* ctx);
 int64_t sys_free(syscall_context_t* ctx);
 int64_t sys_mmap(syscall_context_t* ctx);
 int64_t sys_munmap(syscall_context_t* ctx);
+int64_t sys_madvise(syscall_context_t* ctx);
 int64_t sys_gettime(syscall_context_t* ctx);
 int64_t sys_sleep(syscall_context_t* ctx);
 int64_t sys_yield(syscall_context_t* ctx);
@@ -141,6 +166,9 @@ int64_t sys_getcwd(syscall_context_t* ctx);
 int64_t sys_chdir(syscall_context_t* ctx);
 int64_t sys_stat(syscall_context_t* ctx);
 int64_t sys_ioctl(syscall_context_t* ctx);
+int64_t sys_sched_setaffinity(syscall_context_t* ctx);
+int64_t sys_sched_getaffinity(syscall_context_t* ctx);
+int64_t sys_sched_setdeadline(syscall_context_t* ctx);
 
 // Helper functions
 bool syscall_is_valid(uint32_t syscall_num);
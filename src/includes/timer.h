@@ -14,7 +14,16 @@ typedef struct {
     uint64_t frequency;
     bool is_active;
     void (*tick_handler)(void);
-
+    uint64_t tick_tsc;        // TSC at the latest tick
+    uint64_t tsc_per_tick;    // calibrated against the PIT, 0 until known
+    uint64_t calib_tsc;
+    uint64_t calib_ticks;
+    uint32_t clock_seq;       // odd while the fields above are being updated
+    uint16_t divisor;         // PIT reload for one tick
+    bool oneshot;             // periodic tick stopped for tickless idle
+    uint64_t oneshot_ticks;   // ticks the armed one-shot covers
+    uint64_t idle_entries;    // halts with the tick stopped
+    uint64_t ticks_skipped;   // ticks accounted without their own interrupt
 } TimerState;
 extern TimerState global_timer;
 
@@ -25,11 +34,22 @@ void timer_enable(void);
 void timer_disable(void);
 uint64_t timer_get_ticks(void);
 uint64_t timer_get_uptime_ms(void);
+// Monotonic nanoseconds: tick count refined by the calibrated TSC
+uint64_t timer_clock_ns(void);
 void timer_set_tick_handler(void (*handler)(void));
 
 // Utility functions
 void timer_delay_ms(uint32_t ms);
 uint64_t timer_ticks_to_ms(uint64_t ticks);
 uint64_t timer_ms_to_ticks(uint64_t ms);
+/*
+ * Halt until the next interrupt with interrupts off on entry and exit. When
+ * no timer is due before the next tick the periodic tick is stopped and the
+ * PIT armed for min(deadline_tick, next scheduler event) instead.
+ */
+void timer_idle_halt(uint64_t deadline_tick);
+
+// TSC cycles to microseconds using the PIT-calibrated rate (0 while uncalibrated)
+uint64_t timer_cycles_to_us(uint64_t cycles);
 
 #endif // TIMER_H
\ No newline at end of file
@@ -0,0 +1,196 @@
+// src/includes/vma.h — virtual memory areas and demand paging for mmap
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "spinlock.h"
+
+/* Area protection (same values as PROT_* in syscall.h). */
+#define VMA_PROT_READ  0x1u
+#define VMA_PROT_WRITE 0x2u
+#define VMA_PROT_EXEC  0x4u
+
+/* Area kind / behaviour flags. */
+#define VMA_FLAG_ANON   0x01u /* anonymous, zero-filled on demand */
+#define VMA_FLAG_FILE   0x02u /* backed by page-cache frames of a file */
+#define VMA_FLAG_SHARED 0x04u /* writes go to the file (else private COW) */
+#define VMA_FLAG_LOCKED 0x08u /* populated at map time, never dropped by DONTNEED */
+#define VMA_FLAG_SEQ    0x10u /* sequential hint: wide readahead on fault */
+#define VMA_FLAG_RANDOM 0x20u /* random hint: no readahead */
+
+/* vma_advise values (same numbers as MADV_* in syscall.h). */
+#define VMA_ADVISE_NORMAL     0
+#define VMA_ADVISE_RANDOM     1
+#define VMA_ADVISE_SEQUENTIAL 2
+#define VMA_ADVISE_WILLNEED   3
+#define VMA_ADVISE_DONTNEED   4
+
+/* #PF error code bits (Intel SDM vol. 3, 4.7). */
+#define PF_ERR_PRESENT 0x01u
+#define PF_ERR_WRITE   0x02u
+#define PF_ERR_USER    0x04u
+#define PF_ERR_FETCH   0x10u
+
+/* One mapped range [start, end), page aligned, kept sorted per space. */
+typedef struct vm_area {
+    uint64_t start;
+    uint64_t end;
+    uint32_t prot;
+    uint32_t flags;
+    int32_t file;         /* VMA_FLAG_FILE: filesystem slot (fs_lookup) */
+    uint64_t file_pgoff;  /* file page mapped at start */
+    struct vm_area* next;
+} VmArea;
+
+/*
+ * The mmap view of one page-table root. Looked up by PML4 (the value in CR3),
+ * so every task running on that root shares its areas. The lock covers the
+ * area list, the user half of the page tables and the counters; the vma_*
+ * calls below take it themselves.
+ */
+typedef struct vm_space {
+    uint64_t pml4_phys;
+    VmArea* areas;
+    bool in_use;
+    uint32_t users;   /* tasks whose address_space is this root (task_set_address_space) */
+
+    /* Demand-paging counters */
+    uint64_t faults;
+    uint64_t zero_page_maps;
+    uint64_t cow_copies;
+    uint64_t resident_pages;
+    uint64_t file_maps;   /* page-cache frames mapped without a copy */
+    uint64_t prefaulted_pages; /* backed ahead of use (populate, WILLNEED, readahead) */
+
+    /* Transparent huge pages */
+    uint64_t thp_maps;       /* 2 MiB frames mapped at fault / populate */
+    uint64_t thp_fallbacks;  /* eligible blocks that had to use 4 KiB pages */
+    uint64_t thp_splits;
+    uint64_t thp_collapses;
+
+    /* Swap */
+    uint64_t swapped_pages;  /* PTEs currently holding a swap entry */
+    uint64_t swap_outs;
+    uint64_t swap_ins;
+
+    Spinlock lock;    /* last: vma_space_create clears everything before it */
+} VmSpace;
+
+/* Page-reclaim clock counters (all spaces). */
+typedef struct {
+    uint64_t runs;        /* vma_reclaim calls */
+    uint64_t scanned;     /* pages passed by the front hand */
+    uint64_t referenced;  /* pages the back hand found used again, kept */
+    uint64_t evicted;     /* pages written to swap and freed */
+} VmaReclaimStats;
+
+/* Allocate the shared zero frame and register the kernel root. Call after vmm_init. */
+void vma_init(void);
+
+/* Space for a root, or NULL. vma_current_space() uses CR3. */
+VmSpace* vma_space_for(uint64_t pml4_phys);
+VmSpace* vma_current_space(void);
+
+/* Register a process root (after vmm_init_process_address_space). NULL if the pool is full. */
+VmSpace* vma_space_create(uint64_t pml4_phys);
+
+/* Unmap every area and drop its frames; the root itself is left to vmm_destroy_address_space. */
+void vma_space_destroy(VmSpace* space);
+
+/*
+ * Reserve an anonymous area of len bytes (rounded up to pages). Nothing is
+ * backed yet: reads map the shared zero page read-only, the first write gets a
+ * private frame. hint is used when page aligned and free.
+ * Returns the start address, or 0 if no room / no area slots.
+ */
+uint64_t vma_map_anon(VmSpace* space, uint64_t hint, uint64_t len, uint32_t prot);
+
+/*
+ * Map len bytes of a file from page offset pgoff. Pages come straight from the
+ * filesystem page cache: a private mapping maps them read-only and copies on
+ * the first write, a shared one maps them writable and writes back to the file
+ * when unmapped. Returns the start address, or 0.
+ */
+uint64_t vma_map_file(VmSpace* space, uint64_t hint, uint64_t len, uint32_t prot,
+                      int file, uint64_t pgoff, bool shared);
+
+/*
+ * Unmap [addr, addr+len): drop frames, trim or split areas. Returns 0, or -1
+ * on bad args, no area slot for a split, or a huge page at an edge that
+ * cannot be split; nothing is unmapped then.
+ */
+int vma_unmap(VmSpace* space, uint64_t addr, uint64_t len);
+
+/*
+ * Back every page of [addr, addr+len) now instead of on first touch, in
+ * batches through vmm_map_range. Returns 0, or -1 on bad args / out of memory
+ * (pages mapped so far stay mapped).
+ */
+int vma_populate(VmSpace* space, uint64_t addr, uint64_t len);
+
+/*
+ * madvise: WILLNEED populates, DONTNEED drops the frames (the range refaults
+ * as fresh zero/file pages; -1 if it touches a locked area or cuts through a
+ * huge page that cannot be split), NORMAL /
+ * SEQUENTIAL / RANDOM set the readahead hint, splitting areas at the range
+ * edges. Returns 0 or -1.
+ */
+int vma_advise(VmSpace* space, uint64_t addr, uint64_t len, int advice);
+
+/* Area containing addr, or NULL. Call with the space locked. */
+VmArea* vma_find(VmSpace* space, uint64_t addr);
+
+/* Lock a space to use vma_find or change an area; returns the RFLAGS to restore. */
+uint64_t vma_space_lock(VmSpace* space);
+void vma_space_unlock(VmSpace* space, uint64_t irq);
+
+/*
+ * #PF entry from kernel.asm (page_fault_handler). Returns 0 when the fault was
+ * resolved and the instruction can be restarted, nonzero for a real fault.
+ * Faults in the task stack region are passed to kstack_fault.
+ */
+int vma_page_fault(uint64_t error_code, uint64_t fault_addr);
+
+/*
+ * Transparent huge pages. Anonymous writable areas of 2 MiB or more start 2 MiB
+ * aligned, and each fully covered aligned block is backed by one 2 MiB frame
+ * on its first write fault, or by vma_populate, when the PMM has one; a block
+ * read first starts on 4 KiB zero-page mappings. vma_collapse_scan looks at up to
+ * max_blocks such blocks still on 4 KiB pages and merges fully populated ones;
+ * vma_start_collapse runs it periodically as delayed work on
+ * system_unbound_wq (call after workqueue_init).
+ */
+void vma_collapse_scan(uint32_t max_blocks);
+void vma_start_collapse(void);
+
+/*
+ * Page reclaim. A two-handed clock runs over the 4 KiB pages of private
+ * anonymous, unlocked areas in every space: the front hand clears the PTE
+ * accessed bit, the back hand follows a fixed number of pages behind and
+ * writes pages whose bit is still clear out to swap, leaving a swap entry
+ * (swap.h) in the PTE. Huge pages, shared frames and file areas are left
+ * alone. Faulting on a swap entry reads the page back together with the
+ * swapped neighbours of its aligned VMA_SWAP_CLUSTER-page block.
+ *
+ * The clock runs in its own task (vma_start_reclaim_thread, after
+ * scheduler_init), never in the allocating context: vma_reclaim_wake is the
+ * PMM's reclaim hook and only wakes it. The page is written out with no
+ * lock held and interrupts on; a user fault reads it back the same way,
+ * with its swap entries marked busy meanwhile. A user fault that finds no
+ * frame while the task is making progress restarts instead of failing.
+ *
+ * vma_reclaim runs one clock pass from task context; it returns the number
+ * of frames freed (0 without a swap device, or while another pass runs).
+ */
+#define VMA_SWAP_CLUSTER 8u
+uint32_t vma_reclaim(uint32_t want);
+void vma_reclaim_wake(void);
+void vma_start_reclaim_thread(void);
+const VmaReclaimStats* vma_reclaim_get_stats(void);
+
+/* Physical address of the shared, pinned zero frame. */
+uint64_t vma_zero_page(void);
+
+#endif // VMA_H
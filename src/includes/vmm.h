@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 /*
  * Page-table entry flags (leaf PTE and intermediate tables use P+RW for kernel).
@@ -12,6 +13,11 @@
 #define VMM_PTE_P  (1ull << 0)  /* present */
 #define VMM_PTE_RW (1ull << 1)  /* read/write; clear = read-only */
 #define VMM_PTE_US (1ull << 2)  /* user/supervisor: set = user accessible */
+#define VMM_PTE_PWT (1ull << 3) /* write-through */
+#define VMM_PTE_PCD (1ull << 4) /* cache disable: MMIO */
+#define VMM_PTE_A  (1ull << 5)  /* accessed (set by the CPU) */
+#define VMM_PTE_D  (1ull << 6)  /* dirty (set by the CPU) */
+#define VMM_PTE_PS (1ull << 7)  /* PDPTE/PDE: maps a 1 GiB / 2 MiB leaf */
 #define VMM_PTE_NX (1ull << 63) /* execute disable (requires EFER.NXE) */
 
 /* One active translation root per execution context; stored on each task. */
@@ -20,32 +26,56 @@ typedef struct {
 } AddressSpace;
 
 /*
- * Policy: process roots get an explicit layout (vmm_map_kernel_region), not a
- * clone of boot tables. Long-term target remains high-half kernel + user low;
- * PMM/kmalloc currently assume the first 1 GiB identity (see memory.c).
+ * Policy: one kernel half shared by every root. The boot PML4 is the kernel
+ * reference; vmm_init gives each high-half slot (256..511) a PDPT up front, and
+ * process roots copy those top-level entries plus slot 0 (low 1 GiB identity,
+ * which PMM/kmalloc still assume, see memory.c). Kernel mappings made later
+ * through the shared tables are visible in all roots at once. User mappings
+ * live in the private half, PML4 slots 1..255.
  */
+#define VMM_KERNEL_PML4_LOW   0u   /* identity 0..1 GiB (kernel only) */
+#define VMM_KERNEL_PML4_FIRST 256u /* high half: slots 256..511 */
+#define VMM_USER_PML4_FIRST   1u
+#define VMM_USER_PML4_LAST    255u
+#define VMM_USER_BASE 0x0000008000000000ull /* first byte of PML4 slot 1 */
+#define VMM_USER_END  0x0000800000000000ull /* end of lower canonical half */
 
-/* Call once after physmem is up; enables EFER.NXE so VMM_PTE_NX is legal. */
+/*
+ * Call once after physmem is up; enables EFER.NXE so VMM_PTE_NX is legal,
+ * adopts the boot PML4 as the kernel reference and pre-populates its
+ * high-half PDPTs.
+ */
 void vmm_init(void);
 
+/* Physical address of the kernel reference root (boot PML4). */
+uint64_t vmm_kernel_pml4(void);
+
 /* New empty PML4 (one frame, zeroed). Returns 0 on failure. */
 uint64_t vmm_alloc_pml4(void);
 
 /*
- * Layout-driven kernel region: (1) identity-map the first 1 GiB at slot 0;
- * (2) map 0xFFFF800000000000..+1G to the same physical 0..1G at PML4 slot
- * 256 (shared PD page as boot). Same policy as kernel.asm.
- * Allocates fresh tables; does not copy the boot PML4.
- *
- * Requires PML4 slots 0 and 256 clear. Covers low identity + high-half kernel VAs.
- * (vmm_map_4k in 0..1GiB on such a root
- * would require splitting a 2 MiB PDE; not implemented—use user VAs above 1 GiB
- * or add a splitter when you need 4 KiB overlays in the low gigabyte.)
+ * Install the kernel half into a fresh root: copy PML4[0] and PML4[256..511]
+ * from the kernel reference root. No tables are allocated; the PDPTs, the
+ * 1 GiB identity PD and anything below them are shared.
  *
- * Returns: 0, -1 OOM, -2 bad pml4 alignment, -3 PML4[0] already used.
+ * Returns: 0, -1 vmm_init not run, -2 bad pml4 alignment, -3 slot 0/256 in use.
  */
 int vmm_map_kernel_region(uint64_t pml4_phys);
 
+/*
+ * Map/unmap a kernel page through the shared tables (slot 0 or 256..511), so it
+ * is visible in every root. US is stripped. Returns vmm_map_4k codes; -2 if
+ * vaddr is in the user half.
+ */
+int vmm_map_kernel_4k(uint64_t vaddr, uint64_t paddr, uint64_t flags);
+int vmm_unmap_kernel_4k(uint64_t vaddr);
+/*
+ * Allocate the shared leaf table covering kernel vaddr without mapping it,
+ * so a later vmm_set_pte there needs no frame and no lock. 0, -1 out of
+ * frames, -2 as for vmm_map_kernel_4k.
+ */
+int vmm_prepare_kernel_4k(uint64_t vaddr);
+
 /*
  * Legacy / migration: duplicate selected PML4 slots from an existing root
  * (shares PDPT/PD/PT physical pages). Prefer vmm_map_kernel_region for new
@@ -61,13 +91,86 @@ int vmm_clone_kernel_space(uint64_t dst_pml4_phys, uint64_t src_pml4_phys);
  */
 int vmm_init_process_address_space(uint64_t process_pml4_phys, uint64_t kernel_reference_pml4_phys);
 
+/*
+ * Tear down a root from vmm_alloc_pml4: walk the user half (slots 1..255), drop
+ * one reference on every 4 KiB leaf frame (freed at zero, see pmm_frame_put),
+ * and release page-table pages into a small zeroed cache that later table
+ * allocations use first. Shared kernel slots are cleared, never walked.
+ * Returns: 0, -2 bad pml4, -4 not a VMM-allocated root, -5 root is loaded in CR3.
+ */
+int vmm_destroy_address_space(uint64_t pml4_phys);
+
+/* Page-table allocation counters (cache hits come from destroyed roots). */
+typedef struct {
+    uint64_t tables_allocated;
+    uint64_t tables_freed;
+    uint64_t pt_cache_hits;
+    uint64_t pt_cache_misses;
+    uint64_t frames_released;
+    uint64_t roots_destroyed;
+    uint32_t pt_cache_len;
+    uint64_t huge_splits;     /* 2 MiB leaves broken into 512 PTEs */
+    uint64_t huge_collapses;  /* leaf tables replaced by a 2 MiB leaf */
+} VmmStats;
+
+VmmStats* vmm_get_stats(void);
+
 /* Map one 4 KiB page. pml4 is the physical address of the root. */
 int vmm_map_4k(uint64_t pml4_phys, uint64_t vaddr, uint64_t paddr, uint64_t flags);
 
+/*
+ * Map count consecutive pages from vaddr onto frames[i] with one walk per leaf
+ * table; frames[i] == 0 leaves that entry alone. No invlpg for entries that
+ * were not present. Returns the number of entries processed (< count when a
+ * table allocation failed) or -2 on bad arguments.
+ */
+int64_t vmm_map_range(uint64_t pml4_phys, uint64_t vaddr, const uint64_t* frames, uint64_t count,
+                      uint64_t flags);
+
+/* Clear a 4 KiB leaf (0 if none); -1 if vaddr lies inside a huge leaf. */
 int vmm_unmap_4k(uint64_t pml4_phys, uint64_t vaddr);
 
+/*
+ * 2 MiB leaves (PDE with PS) in the user half, for transparent huge pages.
+ * vmm_query_pde returns the raw PDE for vaddr (0 when an upper level is
+ * missing); a non-zero entry without VMM_PTE_PS means a leaf table exists.
+ *
+ * vmm_map_2m: -3 when a leaf table already covers the range.
+ * vmm_unmap_2m: clears a huge leaf; the frame is the caller's.
+ * vmm_split_2m: replace a huge leaf with a table of 512 PTEs onto the same
+ *   frames (-1 if no table frame).
+ * vmm_collapse_2m: replace the leaf table under vaddr with a huge leaf onto
+ *   paddr and free the table once every CPU's TLB has dropped it; the old
+ *   4 KiB frames are the caller's.
+ */
+uint64_t vmm_query_pde(uint64_t pml4_phys, uint64_t vaddr);
+int vmm_map_2m(uint64_t pml4_phys, uint64_t vaddr, uint64_t paddr, uint64_t flags);
+int vmm_unmap_2m(uint64_t pml4_phys, uint64_t vaddr);
+int vmm_split_2m(uint64_t pml4_phys, uint64_t vaddr);
+int vmm_collapse_2m(uint64_t pml4_phys, uint64_t vaddr, uint64_t paddr, uint64_t flags);
+
+/*
+ * Raw translation entry for vaddr: the 4 KiB PTE, or the PDE/PDPTE when that
+ * level is a huge leaf or not present. 0 when nothing is mapped.
+ */
+uint64_t vmm_query(uint64_t pml4_phys, uint64_t vaddr);
+#define VMM_ENTRY_ADDR(e) ((e) & 0x000ffffffffff000ull)
+
+/*
+ * Page reclaim helpers; both only touch an existing leaf table.
+ * vmm_test_and_clear_accessed: true if the 4 KiB PTE was present with A set
+ *   (A is cleared and the TLB entry dropped).
+ * vmm_set_pte: store a raw entry (e.g. a non-present swap entry); -1 when no
+ *   leaf table covers vaddr.
+ */
+bool vmm_test_and_clear_accessed(uint64_t pml4_phys, uint64_t vaddr);
+int vmm_set_pte(uint64_t pml4_phys, uint64_t vaddr, uint64_t entry);
+
 void vmm_invalidate_page(uintptr_t vaddr);
 void vmm_load_cr3(uint64_t pml4_phys);
 uint64_t vmm_get_cr3(void);
 
+// Page-table walk checks (mem -vmm test); returns the number that failed
+uint32_t vmm_selftest(void);
+
 #endif
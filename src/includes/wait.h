@@ -0,0 +1,75 @@
+// src/includes/wait.h — wait queues for tasks blocked on an event
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "scheduler.h"
+#include "spinlock.h"
+
+/*
+ * A waiter links a WaitEntry (on its own stack) into the queue and blocks
+ * (TASK_STATE_BLOCKED, off every runqueue). Non-exclusive waiters sit at the
+ * head and are all woken; exclusive waiters sit at the tail and wake_up
+ * stops after nr_exclusive of them, so a released resource wakes one
+ * contender instead of the whole herd. The waker unlinks what it wakes.
+ *
+ * Each queue has a spinlock, taken with interrupts off. A waiter marks
+ * itself BLOCKED and queues itself before testing its condition, so a
+ * waker that changes the condition and then finds the queue non-empty
+ * always reaches it, on whichever CPU it runs.
+ *
+ * An entry with a wake function belongs to no task (task is NULL): wake_up
+ * unlinks it and calls the function, with the queue lock held, instead of
+ * waking a task. Fibers wait this way (fiber.h).
+ */
+typedef struct wait_entry {
+    TaskStruct* task;
+    bool exclusive;
+    bool queued;
+    void (*wake)(struct wait_entry* entry);
+    struct wait_entry* next;
+    struct wait_entry* prev;
+} WaitEntry;
+
+typedef struct wait_queue {
+    Spinlock lock;
+    WaitEntry* head;
+    WaitEntry* tail;
+} WaitQueue;
+
+#define WAIT_QUEUE_INIT {SPINLOCK_INIT, NULL, NULL}
+#define WAKE_ALL 0u
+
+void wait_queue_init(WaitQueue* wq);
+bool wait_queue_active(const WaitQueue* wq);
+
+/* Link / unlink an entry; call with wq->lock held. */
+void wait_queue_add(WaitQueue* wq, WaitEntry* entry);
+void wait_queue_remove(WaitQueue* wq, WaitEntry* entry);
+
+/* Take a task that is being destroyed off whatever queue it waits on. */
+void wait_queue_cancel(TaskStruct* task);
+
+/*
+ * Block the current task until cond(arg) holds; cond is tested with
+ * interrupts off, after queueing and after each wakeup. A waker must make
+ * the condition true before it looks at the queue. Without a task
+ * to block (boot or shell context) it halts between interrupts instead.
+ */
+void wait_event(WaitQueue* wq, bool (*cond)(void* arg), void* arg, bool exclusive);
+
+/*
+ * Queue the current task, run release(arg) (e.g. dropping a mutex) and block
+ * until woken. No wakeup issued after release can be missed. Callers recheck
+ * their condition: wakeups may be spurious.
+ */
+void wait_release_and_block(WaitQueue* wq, void (*release)(void* arg), void* arg, bool exclusive);
+
+/* Wake every non-exclusive waiter and up to nr_exclusive exclusive ones (WAKE_ALL: all). */
+uint32_t wake_up(WaitQueue* wq, uint32_t nr_exclusive);
+
+static inline uint32_t wake_up_one(WaitQueue* wq) { return wake_up(wq, 1); }
+static inline uint32_t wake_up_all(WaitQueue* wq) { return wake_up(wq, WAKE_ALL); }
+
+#endif // WAIT_H
@@ -0,0 +1,146 @@
+// src/includes/workqueue.h — deferred work run by kernel worker tasks
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "scheduler.h"
+#include "spinlock.h"
+#include "smp.h"
+
+/*
+ * A work item is a function run later by a worker task, where it may block.
+ * Interrupt handlers and the shell queue items instead of doing slow work
+ * inline. Each CPU that runs tasks has a bound pool whose workers are
+ * pinned to it, and one unbound pool serves WQ_UNBOUND queues (and bound
+ * work queued from a CPU without a pool, such as the shell's).
+ *
+ * A bound pool runs one item at a time. When its running worker blocks
+ * inside an item while more work waits, an idle worker is woken to carry
+ * on; a worker that leaves idle with no idle one behind it starts another,
+ * so a pool grows as far as its items block (up to WQ_MAX_WORKERS) and
+ * shrinks back once more than WQ_MAX_IDLE workers sit idle. The unbound
+ * pool wakes an idle worker for every item queued.
+ *
+ * An item is queued at most once: queueing it while it is pending does
+ * nothing. Items must not be freed or reinitialised while pending or
+ * running; the function may requeue or free its own item.
+ */
+#define WQ_MAX_WORKERS 8u   // per pool
+#define WQ_MAX_IDLE    2u
+#define WQ_MAX_QUEUES  8u
+
+#define WQ_UNBOUND (1u << 0)
+
+typedef struct work Work;
+typedef void (*WorkFunc)(Work* work);
+
+struct work {
+    WorkFunc func;
+    void* data;
+    volatile uint32_t pending;     // on a pool's list or its timer armed
+    struct work* next;             // pool worklist
+    struct worker_pool* pool;      // pool it was last queued on
+    struct workqueue* wq;
+};
+
+typedef struct delayed_work {
+    Work work;
+    uint64_t expires;              // timer tick
+    uint32_t cpu;                  // queued from here at expiry
+    bool timer_armed;
+    struct delayed_work* next;     // timer list, by expires
+} DelayedWork;
+
+typedef struct workqueue {
+    const char* name;
+    uint32_t flags;
+    volatile uint32_t nr_inflight; // on a pool's list or running
+    uint64_t queued;
+    uint64_t executed;
+    bool used;
+} Workqueue;
+
+typedef struct worker {
+    TaskStruct* task;
+    struct worker_pool* pool;
+    Work* current;                 // item being run
+    bool used;
+    bool idle;                     // not counted in nr_running
+    bool listed;                   // on the pool's idle list
+    bool sleeping;                 // blocked inside an item (scheduler hook)
+    struct worker* next_idle;
+} Worker;
+
+typedef struct worker_pool {
+    Spinlock lock;
+    uint32_t cpu;                  // SMP_MAX_CPUS for the unbound pool
+    bool online;                   // has workers; otherwise work goes unbound
+    Work* head;
+    Work* tail;
+    volatile uint32_t nr_pending;
+    volatile uint32_t nr_running;  // workers running an item and not blocked
+    uint32_t max_active;
+    uint32_t nr_workers;
+    uint32_t nr_idle;
+    uint32_t nr_starting;          // created, not yet run
+    Worker* idle_list;
+    Worker workers[WQ_MAX_WORKERS];
+    uint64_t executed;
+    uint64_t block_kicks;          // idle workers woken because the running one blocked
+    uint64_t workers_created;
+} WorkerPool;
+
+// Queues every subsystem can share; valid after workqueue_init
+extern Workqueue* system_wq;
+extern Workqueue* system_unbound_wq;
+
+// Pools and their first workers, after SMP bring-up
+void workqueue_init(void);
+// NULL when all WQ_MAX_QUEUES are in use
+Workqueue* workqueue_create(const char* name, uint32_t flags);
+
+void work_init(Work* work, WorkFunc func, void* data);
+void delayed_work_init(DelayedWork* dwork, WorkFunc func, void* data);
+
+static inline bool work_pending(const Work* work) {
+    return __atomic_load_n(&work->pending, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* False if the item was already pending. Safe from interrupt handlers. */
+bool queue_work(Workqueue* wq, Work* work);
+bool queue_work_on(uint32_t cpu, Workqueue* wq, Work* work);
+bool queue_delayed_work(Workqueue* wq, DelayedWork* dwork, uint64_t delay_ms);
+
+/*
+ * Task context. flush_work waits until the item is neither pending nor
+ * running; flush_workqueue until nothing queued on wq is. The cancel calls
+ * take a pending item off its list or timer, wait for a running one to
+ * finish and return whether it was pending; the caller keeps others from
+ * requeueing it meanwhile.
+ */
+void flush_work(Work* work);
+void flush_workqueue(Workqueue* wq);
+bool cancel_work_sync(Work* work);
+bool cancel_delayed_work_sync(DelayedWork* dwork);
+
+// Timer interrupt: queue delayed work that is due
+void workqueue_timer_tick(void);
+// Earliest tick a delayed item expires (UINT64_MAX: none)
+uint64_t workqueue_next_expiry(void);
+
+// Scheduler hooks, called with the runqueue lock held (atomics only)
+struct worker_pool* workqueue_worker_sleeping(TaskStruct* task);
+void workqueue_worker_running(TaskStruct* task);
+// After the switch: wake an idle worker if the pool still has work and nobody running it
+void workqueue_kick(struct worker_pool* pool);
+
+void workqueue_print_stats(void);
+/*
+ * Shell self-test: delayed work, flush_work, cancel_delayed_work_sync and a
+ * bound pool handing over when an item blocks. Prints a line per check and
+ * returns the number that failed.
+ */
+uint32_t workqueue_selftest(void);
+
+#endif // WORKQUEUE_H
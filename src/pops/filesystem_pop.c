@@ -2,11 +2,14 @@
 #include "../includes/console.h"
 #include "../includes/error_codes.h"
 #include "../includes/utils.h"
+#include "../includes/filesystem_pop.h"
+#include "../includes/memory.h"
 #include <stdbool.h>
 #include <stddef.h> // Include for NULL
 
-// Forward declaration of strrcmp
+// Forward declarations
 int strrcmp(const char* str1, const char* str2);
+size_t strrlen(const char* str);
 
 // Global error tracking
 static ErrorCode last_filesystem_error = ERR_SUCCESS;
@@ -28,6 +31,13 @@ typedef struct {
 File file_system[MAX_FILES];
 char current_path[MAX_PATH_LENGTH] = "root";
 
+// Page cache: one optional frame per file page, shared by every mmap of it
+#define FS_FILE_PAGES ((MAX_FILE_CONTENT_LENGTH + PAGE_SIZE - 1) / PAGE_SIZE)
+static uint64_t fs_page_cache[MAX_FILES][FS_FILE_PAGES];
+
+static void fs_cache_refresh(int file);
+static void fs_cache_drop(int file);
+
 // Function to initialize the file system
 void init_filesystem() {
     for (int i = 0; i < MAX_FILES; ++i) {
@@ -208,6 +218,7 @@ bool write_file(const char* name, const char* content) {
                     k++;
                 }
                 file_system[i].content[j] = '\0';
+                fs_cache_refresh(i);
                 last_filesystem_error = ERR_SUCCESS;
                 return true;
             }
@@ -239,6 +250,7 @@ const char* read_file(const char* name) {
                 j++;
             }
             if (file_system[i].name[j] == '\0' && name[j] == '\0' && strrcmp(file_system[i].path, current_path) == 0) {
+                fs_file_sync(i);  // shared mappings may have written the cache
                 last_filesystem_error = ERR_SUCCESS;
                 return file_system[i].content;
             }
@@ -248,6 +260,99 @@ const char* read_file(const char* name) {
     return NULL; // File not found
 }
 
+int fs_lookup(const char* name) {
+    if (name == NULL || name[0] == '\0') {
+        return -1;
+    }
+    for (int i = 0; i < MAX_FILES; ++i) {
+        if (file_system[i].in_use && strrcmp(file_system[i].name, name) == 0 &&
+            strrcmp(file_system[i].path, current_path) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+size_t fs_file_size(int file) {
+    if (file < 0 || file >= MAX_FILES || !file_system[file].in_use) {
+        return 0;
+    }
+    fs_file_sync(file);
+    return strrlen(file_system[file].content);
+}
+
+uint64_t fs_file_max_pages(void) {
+    return FS_FILE_PAGES;
+}
+
+uint64_t fs_page_get(int file, uint64_t pgoff) {
+    if (file < 0 || file >= MAX_FILES || !file_system[file].in_use || pgoff >= FS_FILE_PAGES) {
+        return 0;
+    }
+    uint64_t frame = fs_page_cache[file][pgoff];
+    if (frame == 0) {
+        frame = pmm_alloc_frame(MEM_ALLOC_ZERO);
+        if (frame == 0) {
+            return 0;
+        }
+        fs_page_cache[file][pgoff] = frame;
+        fs_cache_refresh(file);
+    }
+    pmm_frame_get(frame);
+    return frame;
+}
+
+// Cached pages -> content. Content ends at the first NUL, as everywhere else here.
+void fs_file_sync(int file) {
+    if (file < 0 || file >= MAX_FILES) {
+        return;
+    }
+    for (uint64_t p = 0; p < FS_FILE_PAGES; p++) {
+        uint64_t frame = fs_page_cache[file][p];
+        if (frame == 0) {
+            continue;
+        }
+        uint64_t start = p * PAGE_SIZE;
+        if (start >= MAX_FILE_CONTENT_LENGTH - 1) {
+            break;
+        }
+        uint64_t n = MAX_FILE_CONTENT_LENGTH - 1 - start;
+        if (n > PAGE_SIZE) {
+            n = PAGE_SIZE;
+        }
+        memory_copy(file_system[file].content + start, (const void*)(uintptr_t)frame, n);
+    }
+    file_system[file].content[MAX_FILE_CONTENT_LENGTH - 1] = '\0';
+}
+
+// Content -> cached pages, zero past the end so mappings never see stale bytes.
+static void fs_cache_refresh(int file) {
+    size_t len = strrlen(file_system[file].content);
+    for (uint64_t p = 0; p < FS_FILE_PAGES; p++) {
+        uint64_t frame = fs_page_cache[file][p];
+        if (frame == 0) {
+            continue;
+        }
+        uint64_t start = p * PAGE_SIZE;
+        uint64_t n = len > start ? len - start : 0;
+        if (n > PAGE_SIZE) {
+            n = PAGE_SIZE;
+        }
+        char* dst = (char*)(uintptr_t)frame;
+        memory_copy(dst, file_system[file].content + start, n);
+        memory_zero(dst + n, PAGE_SIZE - n);
+    }
+}
+
+static void fs_cache_drop(int file) {
+    for (uint64_t p = 0; p < FS_FILE_PAGES; p++) {
+        if (fs_page_cache[file][p] != 0) {
+            pmm_frame_put(fs_page_cache[file][p]);
+            fs_page_cache[file][p] = 0;
+        }
+    }
+}
+
 // Function to calculate the length of a string
 size_t strrlen(const char* str) {
     size_t length = 0;
@@ -341,6 +446,7 @@ bool delete_file(const char* name) {
             }
             if (file_system[i].name[j] == '\0' && name[j] == '\0' && strrcmp(file_system[i].path, current_path) == 0) {
                 file_system[i].in_use = false;
+                fs_cache_drop(i);  // existing mappings keep their own references
                 // Clear the file data
                 file_system[i].name[0] = '\0';
                 file_system[i].content[0] = '\0';